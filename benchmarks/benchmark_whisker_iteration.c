@@ -200,6 +200,39 @@ static void system_9_(void *ctx, double dt)
 	});
 }
 
+// chunked variant of the system work, one call per slice of contiguous entities
+static void chunk_system_(void *ctx, double dt, int sys_id)
+{
+	struct w_ecs_world *world = ctx;
+	float mult = 0.1f * (sys_id + 1) * (float)dt;
+	w_query_for_each_chunk(world, "read position, read velocity, write transform", {
+		const BenchPosition *restrict pos = w_chunk_get(BenchPosition);
+		const BenchVelocity *restrict vel = w_chunk_get(BenchVelocity);
+		BenchTransform *restrict trans = w_chunk_get(BenchTransform);
+
+		float sum = 0;
+		for (size_t k = 0; k < chunk.length; k++)
+		{
+			trans[k].scale += (pos[k].x * vel[k].vx + pos[k].y * vel[k].vy) * mult;
+			trans[k].rotation += (pos[k].x - pos[k].y) * mult;
+			sum += trans[k].scale + trans[k].rotation;
+		}
+		g_accumulator += sum;
+	});
+}
+
+// typed variant of the system work, terms bound to locals without parsing
+static void typed_system_(void *ctx, double dt, int sys_id)
+{
+	struct w_ecs_world *world = ctx;
+	w_query_for_each_typed(world, W_QUERY(
+		(read, position, BenchPosition, pos),
+		(read, velocity, BenchVelocity, vel),
+		(write, transform, BenchTransform, trans)), {
+		do_system_work_(pos, vel, trans, dt, sys_id);
+	});
+}
+
 typedef void (*system_fn)(void *, double);
 static system_fn g_system_fns[10] = {
 	system_0_, system_1_, system_2_, system_3_, system_4_,
@@ -357,6 +390,46 @@ UBENCH_F(bench_iteration_10_systems_3_components, manual_system_invocation)
 }
 
 
+// ============================================================================
+// CASE 2b: chunked_system_invocation - 10 systems using w_query_for_each_chunk
+// ============================================================================
+
+UBENCH_F(bench_iteration_10_systems_3_components, chunked_system_invocation)
+{
+	struct w_ecs_world *world = &ubench_fixture->world;
+	double dt = ubench_fixture->delta_time;
+
+	for (int cycle = 0; cycle < BENCH_UPDATE_COUNT; cycle++)
+	{
+		for (int sys = 0; sys < 10; sys++)
+		{
+			chunk_system_(world, dt, sys);
+		}
+	}
+	UBENCH_DO_NOTHING(&g_accumulator);
+}
+
+
+// ============================================================================
+// CASE 2c: typed_system_invocation - 10 systems using w_query_for_each_typed
+// ============================================================================
+
+UBENCH_F(bench_iteration_10_systems_3_components, typed_system_invocation)
+{
+	struct w_ecs_world *world = &ubench_fixture->world;
+	double dt = ubench_fixture->delta_time;
+
+	for (int cycle = 0; cycle < BENCH_UPDATE_COUNT; cycle++)
+	{
+		for (int sys = 0; sys < 10; sys++)
+		{
+			typed_system_(world, dt, sys);
+		}
+	}
+	UBENCH_DO_NOTHING(&g_accumulator);
+}
+
+
 // ============================================================================
 // CASE 3: world_update - 10 systems via w_ecs_register_system + w_ecs_update
 // ============================================================================
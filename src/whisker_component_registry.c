@@ -17,8 +17,12 @@ void w_component_registry_init(struct w_component_registry *registry, struct w_a
 	w_array_init_t(registry->entries, W_COMPONENT_REGISTRY_ENTRY_REALLOC_BLOCK_SIZE);
 	registry->entries_length = 0;
 
+	// init page pool shared by the bitsets
+	w_sparse_bitset_page_pool_init(&registry->page_pool, arena);
+
 	// init entries bitset
 	w_sparse_bitset_init(&registry->entries_bitset, arena, W_COMPONENT_REGISTRY_ENTRY_BITSET_PAGE_SIZE);
+	registry->entries_bitset.pool = &registry->page_pool;
 }
 
 void w_component_registry_free(struct w_component_registry *registry)
@@ -39,6 +43,7 @@ void w_component_registry_free(struct w_component_registry *registry)
 	free_null(intersect_cache.bitsets);
 	w_sparse_bitset_free(&registry->entries_bitset);
 	w_sparse_bitset_intersect_free_cache(&intersect_cache);
+	w_sparse_bitset_page_pool_free(&registry->page_pool);
 	registry->entities = NULL;
 	registry->arena = NULL;
 	free_null(registry->entries);
@@ -55,6 +60,70 @@ struct w_component_entry *w_component_registry_get_entry(struct w_component_regi
 	return (w_component_registry_has_entry(registry, entity_type_id)) ? &registry->entries[entity_type_id] : NULL;
 }
 
+// count pages holding bits and derive their fill
+static void w_component_registry_entry_stats_(struct w_component_entry *entry, struct w_component_entry_stats *stats)
+{
+	struct w_sparse_bitset *bitset = &entry->data_bitset;
+
+	uint64_t pages_used = 0;
+	for (uint64_t li = 0; li < bitset->lookup_pages_length; li++)
+	{
+		pages_used += (uint64_t)__builtin_popcountll(bitset->lookup_pages[li]);
+	}
+
+	*stats = (struct w_component_entry_stats){
+		.page_size = bitset->page_size_,
+		.cardinality = bitset->cardinality,
+		.pages_used = pages_used,
+		.fill = pages_used ? (double)bitset->cardinality / (double)(pages_used * bitset->page_size_ * 64) : 0.0,
+		.migrations = entry->migrations,
+	};
+}
+
+// pick a page size for a fill, leaving a size needs the fill to move twice as
+// far past its threshold so bitsets near one don't flip back and forth
+static uint64_t w_component_registry_pick_page_size_(uint64_t page_size, double fill)
+{
+	double sparse = W_COMPONENT_REGISTRY_DATA_BITSET_FILL_SPARSE;
+	double dense = W_COMPONENT_REGISTRY_DATA_BITSET_FILL_DENSE;
+	if (page_size == W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE) sparse *= 2.0;
+	if (page_size == W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE) dense *= 0.5;
+
+	if (fill < sparse) return W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE;
+	if (fill > dense) return W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE;
+	return W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE;
+}
+
+void w_component_registry_tune(struct w_component_registry *registry)
+{
+	if (W_COMPONENT_REGISTRY_TUNE_INTERVAL == 0) return;
+
+	w_sparse_bitset_for_each(&registry->entries_bitset)
+	{
+		struct w_component_entry *entry = &registry->entries[i];
+		if (entry->data_bitset.generation - entry->tuned_generation < W_COMPONENT_REGISTRY_TUNE_INTERVAL) continue;
+
+		struct w_component_entry_stats stats;
+		w_component_registry_entry_stats_(entry, &stats);
+
+		uint64_t page_size = w_component_registry_pick_page_size_(stats.page_size, stats.fill);
+		if (stats.cardinality && page_size != stats.page_size)
+		{
+			w_sparse_bitset_rebuild(&entry->data_bitset, page_size);
+			entry->migrations++;
+		}
+		entry->tuned_generation = entry->data_bitset.generation;
+	}
+}
+
+bool w_component_registry_get_entry_stats(struct w_component_registry *registry, w_entity_id entity_type_id, struct w_component_entry_stats *stats)
+{
+	struct w_component_entry *entry = w_component_registry_get_entry(registry, entity_type_id);
+	if (!entry) return false;
+
+	w_component_registry_entry_stats_(entry, stats);
+	return true;
+}
 
 void *w_component_set_(struct w_component_registry *registry, uint type_id, w_entity_id type_entity_id, w_entity_id entity_id, void *data, size_t data_size)
 {
@@ -77,8 +146,11 @@ void *w_component_set_(struct w_component_registry *registry, uint type_id, w_en
 		struct w_component_entry *entry = &registry->entries[type_entity_id];
 		entry->type_id = type_id;
 		entry->type_size = data_size;
+		entry->tuned_generation = 0;
+		entry->migrations = 0;
 
-		w_sparse_bitset_init(&entry->data_bitset, registry->arena, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE);
+		w_sparse_bitset_init_ex(&entry->data_bitset, registry->arena, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE, W_COMPONENT_REGISTRY_DATA_BITSET_FLAGS);
+		entry->data_bitset.pool = &registry->page_pool;
 
 		w_array_init_t(entry->data, W_COMPONENT_REGISTRY_DATA_REALLOC_BLOCK_SIZE_BASE * data_size);
 		entry->data_length = 0;
@@ -28,6 +28,36 @@
 #define W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE 256
 #endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE */
 
+// page sizes picked for component data bitsets by w_component_registry_tune
+// from the fill of their non-empty pages, sparse below the sparse fill and
+// dense above the dense fill
+#ifndef W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE
+#define W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE 32
+#endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE */
+
+#ifndef W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE
+#define W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE 1024
+#endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE */
+
+#ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FILL_SPARSE
+#define W_COMPONENT_REGISTRY_DATA_BITSET_FILL_SPARSE 0.01
+#endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FILL_SPARSE */
+
+#ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FILL_DENSE
+#define W_COMPONENT_REGISTRY_DATA_BITSET_FILL_DENSE 0.5
+#endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FILL_DENSE */
+
+// changes to a component bitset between density samples, 0 disables tuning
+#ifndef W_COMPONENT_REGISTRY_TUNE_INTERVAL
+#define W_COMPONENT_REGISTRY_TUNE_INTERVAL 4096
+#endif /* ifndef W_COMPONENT_REGISTRY_TUNE_INTERVAL */
+
+// component data bitsets use adaptive page containers by default so rarely
+// used components only pay for the entities they hold
+#ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FLAGS
+#define W_COMPONENT_REGISTRY_DATA_BITSET_FLAGS W_SPARSE_BITSET_FLAG_ADAPTIVE
+#endif /* ifndef W_COMPONENT_REGISTRY_DATA_BITSET_FLAGS */
+
 #ifndef W_COMPONENT_REGISTRY_DATA_REALLOC_BLOCK_SIZE_BASE
 #define W_COMPONENT_REGISTRY_DATA_REALLOC_BLOCK_SIZE_BASE 64
 #endif /* ifndef W_COMPONENT_REGISTRY_DATA_REALLOC_BLOCK_SIZE_BASE */
@@ -217,6 +247,23 @@ struct w_component_entry
 
 	// type data size
 	uint64_t type_size;
+
+	// bitset generation at the last density sample, and page size moves made
+	uint64_t tuned_generation;
+	uint64_t migrations;
+};
+
+// density and page size of a component entry's data bitset
+struct w_component_entry_stats
+{
+	uint64_t page_size;
+	uint64_t cardinality;
+	uint64_t pages_used;
+
+	// share of bits set in the non-empty pages
+	double fill;
+
+	uint64_t migrations;
 };
 
 // main component registry struct
@@ -228,6 +275,9 @@ struct w_component_registry
 	// arena, passed to bitsets on init
 	struct w_arena *arena;
 
+	// recycles page words of all component bitsets
+	struct w_sparse_bitset_page_pool page_pool;
+
 	// component data storage entries + bitset of active components
 	w_array_declare(struct w_component_entry, entries);
 	struct w_sparse_bitset entries_bitset;
@@ -260,29 +310,18 @@ struct w_component_registry
 #define w_component_set_entry(ent, eid, src, type) (((type *)(ent)->data)[eid] = *(src))
 #define w_component_get_entry(ent, eid, type) ((type *)((ent)->data + ((eid) * (ent)->type_size)))
 #define w_component_has_entry(ent, eid)                                       \
-    ({                                                                        \
+    (((ent)->data_bitset.flags & W_SPARSE_BITSET_FLAG_SLAB)                   \
+    ? w_sparse_bitset_slab_get_(&(ent)->data_bitset, (eid))                   \
+    : ({                                                                      \
         uint64_t word_index = w_sparse_bitset_word_index((eid));              \
         uint64_t page_index = w_sparse_bitset_page_index(word_index, (ent)->data_bitset.page_size_); \
         struct w_sparse_bitset_page *page = &(ent)->data_bitset.pages[page_index]; \
         uint32_t local_word = w_sparse_bitset_local_word(word_index, (ent)->data_bitset.page_size_); \
-        (page->bits[local_word] & w_sparse_bitset_bit_mask((eid))); \
-    })
-#define w_component_remove_entry(ent, eid) do { \
-	uint64_t _word_index = w_sparse_bitset_word_index(eid); \
-	uint64_t _page_index = w_sparse_bitset_page_index(_word_index, (ent)->data_bitset.page_size_); \
-	struct w_sparse_bitset_page *_page = &((ent)->data_bitset.pages[_page_index]); \
-	uint32_t _local_word = w_sparse_bitset_local_word(_word_index, (ent)->data_bitset.page_size_); \
-	_page->bits[_local_word] &= w_sparse_bitset_bit_clear_mask(eid); \
-	bool _page_empty = true; \
-	for (uint32_t _i = _page->first_set; _i <= _page->last_set; _i++) \
-		if (_page->bits[_i]) { _page_empty = false; break; } \
-	if (_page_empty) { \
-		uint64_t _page_lookup_index = w_sparse_bitset_page_index(_page_index, W_SPARSE_BITSET_WORD_BITS); \
-		(ent)->data_bitset.lookup_pages[_page_lookup_index] &= w_sparse_bitset_bit_clear_mask(_page_index); \
-		_page->first_set = UINT32_MAX; \
-		_page->last_set = 0; \
-	} \
-} while(0)
+        (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) \
+            ? (page->bits && (page->bits[local_word] & w_sparse_bitset_bit_mask((eid)))) \
+            : w_sparse_bitset_get(&(ent)->data_bitset, (eid)); \
+    }))
+#define w_component_remove_entry(ent, eid) w_sparse_bitset_clear(&(ent)->data_bitset, (eid))
 
 // init a component registry
 void w_component_registry_init(struct w_component_registry *registry, struct w_arena *arena, struct w_entity_registry *entities);
@@ -290,6 +329,14 @@ void w_component_registry_init(struct w_component_registry *registry, struct w_a
 // free component data and bitsets
 void w_component_registry_free(struct w_component_registry *registry);
 
+// sample the density of component bitsets changed enough since their last
+// sample, moving them to the page size suiting their fill
+// (note: not thread-safe, bitsets must not be iterated while it runs)
+void w_component_registry_tune(struct w_component_registry *registry);
+
+// get the density stats of a component entry, false if it doesn't exist
+bool w_component_registry_get_entry_stats(struct w_component_registry *registry, w_entity_id entity_type_id, struct w_component_entry_stats *stats);
+
 // get component entry
 struct w_component_entry *w_component_registry_get_entry(struct w_component_registry *registry, w_entity_id entity_type_id);
 // check if registry has entry
@@ -93,6 +93,9 @@ enum W_WORLD_UPDATE_RESULT w_ecs_update(struct w_ecs_world *world)
 		world->scheduler.schedule.schedule_dirty = true;
 	}
 
+	// move component bitsets to page sizes suiting their density
+	w_component_registry_tune(&world->components);
+
 	// force enable buffering for safety
 	world->buffering_enabled = true;
 
@@ -307,6 +310,35 @@ void *w_ecs_get_component_(struct w_ecs_world *world, w_entity_id type_entity_id
 	return w_component_get_(&world->components, type_entity_id, entity_id);
 }
 
+size_t w_ecs_get_components_many(struct w_ecs_world *world, w_entity_id type_entity_id, const w_entity_id *entity_ids, size_t length, void **components)
+{
+	struct w_component_entry *entry = w_component_registry_get_entry(&world->components, type_entity_id);
+	if (!entry)
+	{
+		for (size_t k = 0; k < length; ++k) components[k] = NULL;
+		return 0;
+	}
+
+	// start the first rows, then keep the distance ahead while resolving
+	size_t distance = W_ECS_PREFETCH_DISTANCE;
+	for (size_t k = 0; k < distance && k < length; ++k)
+	{
+		__builtin_prefetch(entry->data + (size_t)entity_ids[k] * entry->type_size);
+	}
+
+	size_t found = 0;
+	for (size_t k = 0; k < length; ++k)
+	{
+		if (distance > 0 && k + distance < length) __builtin_prefetch(entry->data + (size_t)entity_ids[k + distance] * entry->type_size);
+
+		bool has = w_sparse_bitset_get(&entry->data_bitset, entity_ids[k]);
+		components[k] = has ? entry->data + (size_t)entity_ids[k] * entry->type_size : NULL;
+		found += has;
+	}
+
+	return found;
+}
+
 void w_ecs_remove_component_(struct w_ecs_world *world, w_entity_id type_entity_id, w_entity_id entity_id)
 {
 	struct w_component_entry *entry = w_component_registry_get_entry(&world->components, type_entity_id);
@@ -21,6 +21,12 @@
 #ifndef WHISKER_ECS_WORLD_H
 #define WHISKER_ECS_WORLD_H
 
+// batched component gets prefetch the row of the entity this many places
+// ahead of the one being resolved, 0 to disable prefetching
+#ifndef W_ECS_PREFETCH_DISTANCE
+#define W_ECS_PREFETCH_DISTANCE 8
+#endif /* ifndef W_ECS_PREFETCH_DISTANCE */
+
 enum W_COMPONENT_ACTION
 {
 	W_COMPONENT_ACTION_SET = 0,
@@ -155,6 +161,11 @@ void *w_ecs_set_component_(struct w_ecs_world *world, uint type_id, w_entity_id
 // get the component data on an entity, if it exists
 void *w_ecs_get_component_(struct w_ecs_world *world, w_entity_id type_entity_id, w_entity_id entity_id);
 
+// get the component data of each entity into components, NULL for entities
+// without it. Rows ahead are prefetched so random access (e.g. following
+// entity references) overlaps its cache misses, returns the number found
+size_t w_ecs_get_components_many(struct w_ecs_world *world, w_entity_id type_entity_id, const w_entity_id *entity_ids, size_t length, void **components);
+
 // remove a component from an entity
 void w_ecs_remove_component_(struct w_ecs_world *world, w_entity_id type_entity_id, w_entity_id entity_id);
 
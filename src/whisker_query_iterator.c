@@ -12,4 +12,29 @@ void w_query_iterator_begin(struct w_query_iterator *itor, struct w_query *query
 {
 	itor->get_cursor = 0;
 	itor->query = query;
+	itor->cache = w_query_cache_owner(query);
+	atomic_fetch_add_explicit(&query->iterations, 1, memory_order_relaxed);
+
+	// ordered queries don't walk slices, and stale presence falls back to
+	// looking up the optional components' bitsets
+	bool presence = query->presence_terms_length > 0 && query->order_term == W_QUERY_ORDER_NONE && w_query_presence_current(query);
+	itor->presence = presence ? query->presence : NULL;
+	itor->slice_presence = NULL;
+	itor->slice_start = 0;
+}
+
+void w_query_chunk_begin(struct w_query_chunk *chunk, struct w_query *query)
+{
+	chunk->get_cursor = 0;
+	chunk->query = query;
+	chunk->cache = w_query_cache_owner(query);
+	atomic_fetch_add_explicit(&query->iterations, 1, memory_order_relaxed);
+	chunk->start_id = W_ENTITY_INVALID;
+	chunk->length = 0;
+
+	// presence is only built for unordered queries, stale presence falls back
+	// to the optional components' bitsets
+	bool presence = query->presence_terms_length > 0 && query->order_term == W_QUERY_ORDER_NONE && w_query_presence_current(query);
+	chunk->presence = presence ? query->presence : NULL;
+	chunk->slice_presence = NULL;
 }
@@ -12,10 +12,28 @@
 #ifndef WHISKER_QUERY_ITERATOR_H
 #define WHISKER_QUERY_ITERATOR_H
 
-#define w_query_for_each_archetype_slice_loop_(block, stype, length) \
+// sparse slices are walked through their packed entity IDs in batches of
+// this many, the rows of upcoming batches are prefetched a batch at a time
+#ifndef W_QUERY_ITERATOR_BATCH_SIZE
+#define W_QUERY_ITERATOR_BATCH_SIZE 16
+#endif /* ifndef W_QUERY_ITERATOR_BATCH_SIZE */
+
+// number of entities ahead of the current one whose rows are prefetched by
+// sparse and ordered iteration, 0 to disable prefetching
+#ifndef W_QUERY_ITERATOR_PREFETCH_DISTANCE
+#define W_QUERY_ITERATOR_PREFETCH_DISTANCE 16
+#endif /* ifndef W_QUERY_ITERATOR_PREFETCH_DISTANCE */
+
+// first is the index of the first slice across dense then sparse slices,
+// the slice's optional term presence is looked up once per slice. Dense
+// rows stream in order, only the jump to the next slice is prefetched
+#define w_query_for_each_archetype_slice_loop_(block, stype, length, first) \
 	for (size_t i = 0; i < length; ++i) \
 	{ \
-		struct w_query_archetype_slice slice = itor.query->archetype_slices_##stype[i]; \
+		struct w_query_archetype_slice slice = itor.cache->archetype_slices_##stype[i]; \
+		if (W_QUERY_ITERATOR_PREFETCH_DISTANCE > 0 && i + 1 < length) w_query_iterator_prefetch(&itor, &itor.cache->archetype_slices_##stype[i + 1].start_id, 1); \
+		itor.slice_start = slice.start_id; \
+		itor.slice_presence = itor.presence ? &itor.presence[((first) + i) * itor.query->presence_terms_length] : NULL; \
 		for (size_t s = 0; s < slice.slice_length; ++s) \
 		{ \
 			itor.entity_id = slice.start_id + s; \
@@ -24,27 +42,76 @@
 		} \
 	} \
 
+// the packed IDs still step through the slices to keep the slice presence
+#define w_query_for_each_sparse_batch_loop_(block, first) \
+	{ \
+		const w_entity_id *_ids_ = itor.cache->sparse_ids; \
+		size_t _ids_length_ = itor.cache->sparse_ids_length; \
+		size_t _prefetched_ = 0; \
+		size_t _slice_ = 0; \
+		size_t _slice_left_ = 0; \
+		for (size_t _b_ = 0; _b_ < _ids_length_; _b_ += W_QUERY_ITERATOR_BATCH_SIZE) \
+		{ \
+			size_t _end_ = _b_ + W_QUERY_ITERATOR_BATCH_SIZE < _ids_length_ ? _b_ + W_QUERY_ITERATOR_BATCH_SIZE : _ids_length_; \
+			w_query_iterator_prefetch_sparse_(&itor, &_prefetched_, _end_); \
+			for (size_t _k_ = _b_; _k_ < _end_; ++_k_) \
+			{ \
+				if (_slice_left_ == 0) \
+				{ \
+					itor.slice_start = itor.cache->archetype_slices_sparse[_slice_].start_id; \
+					itor.slice_presence = itor.presence ? &itor.presence[((first) + _slice_) * itor.query->presence_terms_length] : NULL; \
+					_slice_left_ = itor.cache->archetype_slices_sparse[_slice_++].slice_length; \
+				} \
+				_slice_left_--; \
+				itor.entity_id = _ids_[_k_]; \
+				itor.get_cursor = 0; \
+				block; \
+			} \
+		} \
+	} \
+
+// ordered queries walk their sorted entities instead of the slices, which
+// jumps around the rows so the ones ahead are prefetched a batch at a time
+#define w_query_for_each_order_loop_(block) \
+	for (size_t i = 0; i < itor.query->order_length; ++i) \
+	{ \
+		if (i % W_QUERY_ITERATOR_BATCH_SIZE == 0) w_query_iterator_prefetch_order_(&itor, i + W_QUERY_ITERATOR_PREFETCH_DISTANCE); \
+		itor.entity_id = itor.query->order[i].entity_id; \
+		itor.get_cursor = 0; \
+		block; \
+	} \
+
+// each call site takes a slot the first time it runs, the slot indexes the
+// world's site queries so any number of worlds can share the call site
+#define w_query_site_() \
+	static uint32_t _site_ = 0; \
+	if (!_site_) _site_ = w_query_registry_next_site(); \
+
 #define w_query_for_each(w, q, block) {\
-	static struct w_query *_q_ = NULL; \
+	w_query_site_(); \
 	struct w_query_iterator itor; \
-	if (!_q_) _q_ = w_query_registry_get_query(&(w)->queries, q); \
-	w_query_iterator_begin(&itor, _q_); \
-	size_t dense_length = itor.query->archetype_slices_dense_length; \
-	size_t sparse_length = itor.query->archetype_slices_sparse_length; \
-	w_query_for_each_archetype_slice_loop_(block, dense, dense_length); \
-	w_query_for_each_archetype_slice_loop_(block, sparse, sparse_length); \
+	w_query_iterator_begin(&itor, w_query_registry_get_site_query(&(w)->queries, _site_, q)); \
+	if (itor.query->order_term != W_QUERY_ORDER_NONE) \
+	{ \
+		w_query_for_each_order_loop_(block); \
+	} \
+	else \
+	{ \
+		size_t dense_length = itor.cache->archetype_slices_dense_length; \
+		w_query_for_each_archetype_slice_loop_(block, dense, dense_length, 0); \
+		w_query_for_each_sparse_batch_loop_(block, dense_length); \
+	} \
 }; \
 
+// has/not terms carry no data, the cursor steps through data terms only
+// any() alternatives are optional, NULL when the entity doesn't have them
 #define w_itor_get_optional_impl_(T) ( \
     { \
-        while (itor.get_cursor < itor.query->terms_length && itor.query->terms[itor.get_cursor].access_type == W_QUERY_ACCESS_NONE) { \
-            itor.get_cursor++; \
-        } \
-        struct w_query_term *term = &itor.query->terms[itor.get_cursor]; \
-        struct w_sparse_bitset *bitset = itor.query->bitset_cache.bitsets[itor.get_cursor]; \
-        void *result = (term->access_type == W_QUERY_ACCESS_OPTIONAL && (!bitset || !w_sparse_bitset_get(bitset, itor.entity_id))) \
-            ? NULL \
-            : w_component_get_entry(term->component_entry, itor.entity_id, T); \
+        struct w_query_term *term = &itor.query->terms[itor.query->data_terms[itor.get_cursor]]; \
+        bool present = term->presence_term == W_QUERY_PRESENCE_TERM_NONE || (term->component_entry && (itor.slice_presence \
+            ? w_query_presence_test(itor.query, itor.slice_presence[term->presence_term], itor.entity_id - itor.slice_start) \
+            : w_sparse_bitset_get(&term->component_entry->data_bitset, itor.entity_id))); \
+        void *result = present ? w_component_get_entry(term->component_entry, itor.entity_id, T) : NULL; \
         itor.get_cursor++; \
         result; \
     } \
@@ -55,19 +122,266 @@
 
 #define w_itor_get(T) \
 	({ \
-		struct w_component_entry *_ent_ = itor.query->terms[itor.get_cursor++].component_entry; \
+		struct w_component_entry *_ent_ = itor.query->terms[itor.query->data_terms[itor.get_cursor++]].component_entry; \
 		(T *)((_ent_)->data + (itor.entity_id * (_ent_)->type_size)); \
 	})
 
+// mask of the alternatives of an any() group the current entity matched,
+// read from the slice presence when it's current
+#define w_itor_any_mask(any_group) \
+	(itor.slice_presence \
+		? w_query_any_mask_presence(itor.query, (any_group), itor.slice_presence, itor.entity_id - itor.slice_start) \
+		: w_query_any_mask(itor.query, (any_group), itor.entity_id))
+
 struct w_query_iterator 
 {
 	struct w_query *query;
+	// query owning the slices, the query itself unless it's an alias
+	struct w_query *cache;
 	size_t get_cursor;
 	w_entity_id entity_id;
+
+	// the query's slice presence, NULL when it isn't current, and the
+	// current slice's presence per optional term and first entity
+	const uint64_t *presence;
+	const uint64_t *slice_presence;
+	w_entity_id slice_start;
+};
+
+// prefetch the data term rows of the given entities
+// (note: optional rows of entities without the component are never read,
+// prefetching them is harmless)
+static inline void w_query_iterator_prefetch(const struct w_query_iterator *itor, const w_entity_id *entity_ids, size_t length)
+{
+	for (size_t t = 0; t < itor->query->data_terms_length; ++t)
+	{
+		struct w_component_entry *entry = itor->query->terms[itor->query->data_terms[t]].component_entry;
+		if (!entry) continue;
+
+		for (size_t k = 0; k < length; ++k)
+		{
+			__builtin_prefetch(entry->data + (size_t)entity_ids[k] * entry->type_size);
+		}
+	}
+}
+
+// prefetch the owner's packed sparse IDs, a batch at a time from *prefetched
+// on, until the prefetch distance past through is covered
+static inline void w_query_iterator_prefetch_sparse_(const struct w_query_iterator *itor, size_t *prefetched, size_t through)
+{
+	if (W_QUERY_ITERATOR_PREFETCH_DISTANCE == 0) return;
+
+	size_t ids_length = itor->cache->sparse_ids_length;
+	size_t until = through + W_QUERY_ITERATOR_PREFETCH_DISTANCE < ids_length ? through + W_QUERY_ITERATOR_PREFETCH_DISTANCE : ids_length;
+	while (*prefetched < until)
+	{
+		size_t length = ids_length - *prefetched < W_QUERY_ITERATOR_BATCH_SIZE ? ids_length - *prefetched : W_QUERY_ITERATOR_BATCH_SIZE;
+		w_query_iterator_prefetch(itor, &itor->cache->sparse_ids[*prefetched], length);
+		*prefetched += length;
+	}
+}
+
+// prefetch the rows of a batch of the order's entities from at on
+static inline void w_query_iterator_prefetch_order_(const struct w_query_iterator *itor, size_t at)
+{
+	if (W_QUERY_ITERATOR_PREFETCH_DISTANCE == 0) return;
+
+	size_t end = at + W_QUERY_ITERATOR_BATCH_SIZE < itor->query->order_length ? at + W_QUERY_ITERATOR_BATCH_SIZE : itor->query->order_length;
+	for (size_t t = 0; t < itor->query->data_terms_length; ++t)
+	{
+		struct w_component_entry *entry = itor->query->terms[itor->query->data_terms[t]].component_entry;
+		if (!entry) continue;
+
+		for (size_t k = at; k < end; ++k)
+		{
+			__builtin_prefetch(entry->data + (size_t)itor->query->order[k].entity_id * entry->type_size);
+		}
+	}
+}
+
+// chunked iteration, the block runs once per slice of contiguous entities
+// (note: chunks follow entity ID order, order_by is ignored)
+#define w_query_for_each_chunk_slice_loop_(block, stype, slices_length, first) \
+	for (size_t i = 0; i < slices_length; ++i) \
+	{ \
+		struct w_query_archetype_slice slice = chunk.cache->archetype_slices_##stype[i]; \
+		chunk.start_id = slice.start_id; \
+		chunk.length = slice.slice_length; \
+		chunk.slice_presence = chunk.presence ? &chunk.presence[((first) + i) * chunk.query->presence_terms_length] : NULL; \
+		chunk.get_cursor = 0; \
+		block; \
+	} \
+
+#define w_query_for_each_chunk(w, q, block) {\
+	w_query_site_(); \
+	struct w_query_chunk chunk; \
+	w_query_chunk_begin(&chunk, w_query_registry_get_site_query(&(w)->queries, _site_, q)); \
+	size_t dense_length = chunk.cache->archetype_slices_dense_length; \
+	size_t sparse_length = chunk.cache->archetype_slices_sparse_length; \
+	w_query_for_each_chunk_slice_loop_(block, dense, dense_length, 0); \
+	w_query_for_each_chunk_slice_loop_(block, sparse, sparse_length, dense_length); \
+}; \
+
+// column of the next data term, offset to the chunk's first entity so
+// element k belongs to entity start_id + k
+// (note: optional and any() terms need w_chunk_get_optional)
+#define w_chunk_get(T) \
+	({ \
+		struct w_component_entry *_ent_ = chunk.query->terms[chunk.query->data_terms[chunk.get_cursor++]].component_entry; \
+		(T *)((_ent_)->data + ((size_t)chunk.start_id * (_ent_)->type_size)); \
+	})
+
+// column of the next optional or any() data term, NULL when its component
+// doesn't exist yet or no entity in the chunk has it. Elements of entities
+// without the component hold no data, w_chunk_has tells them apart
+#define w_chunk_get_optional(T) \
+	({ \
+		struct w_query_term *_term_ = &chunk.query->terms[chunk.query->data_terms[chunk.get_cursor++]]; \
+		struct w_component_entry *_ent_ = _term_->component_entry; \
+		bool _none_ = !_ent_ || (chunk.slice_presence && _term_->presence_term != W_QUERY_PRESENCE_TERM_NONE && chunk.slice_presence[_term_->presence_term] == W_QUERY_PRESENCE_NONE); \
+		(T *)(_none_ ? NULL : (_ent_)->data + ((size_t)chunk.start_id * (_ent_)->type_size)); \
+	})
+
+// whether element k of the chunk has the component of data term n (the
+// n'th w_chunk_get call), always true for required terms
+#define w_chunk_has(n, k) \
+	w_query_chunk_has(&chunk, (n), (k))
+
+struct w_query_chunk
+{
+	struct w_query *query;
+	struct w_query *cache;
+	size_t get_cursor;
+	w_entity_id start_id;
+	size_t length;
+
+	// the query's slice presence, NULL when it isn't current, and the
+	// current slice's presence per optional term: W_QUERY_PRESENCE_ALL,
+	// W_QUERY_PRESENCE_NONE or an offset into the query's presence masks
+	const uint64_t *presence;
+	const uint64_t *slice_presence;
 };
 
+static inline bool w_query_chunk_has(const struct w_query_chunk *chunk, size_t n, size_t k)
+{
+	const struct w_query_term *term = &chunk->query->terms[chunk->query->data_terms[n]];
+	if (term->presence_term == W_QUERY_PRESENCE_TERM_NONE) return true;
+	if (!term->component_entry) return false;
+	if (chunk->slice_presence) return w_query_presence_test(chunk->query, chunk->slice_presence[term->presence_term], k);
+	return w_sparse_bitset_get(&term->component_entry->data_bitset, chunk->start_id + k);
+}
+
+// typed queries, terms are (access, component name, type, variable) tuples
+// resolved to component IDs once and bound to fixed locals per entity:
+//   w_query_for_each_typed(world, W_QUERY((write, position, Position, pos), (read, velocity, Velocity, vel)), {
+//       pos->x += vel->vx;
+//   });
+// access is read, write, optional, has, not or without, filter terms
+// declare no variable. The loop rebuilds the query cache before iterating
+#define W_QUERY(...) (__VA_ARGS__)
+
+// map a macro over up to 8 term tuples
+#define W_QUERY_NARGS_(...) W_QUERY_NARGS_N_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define W_QUERY_NARGS_N_(_1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define W_QUERY_CAT_(a, b) W_QUERY_CAT_I_(a, b)
+#define W_QUERY_CAT_I_(a, b) a##b
+#define W_QUERY_UNPACK_(...) __VA_ARGS__
+#define W_QUERY_MAP_TERMS_(m, terms) W_QUERY_MAP_I_(m, W_QUERY_UNPACK_ terms)
+#define W_QUERY_MAP_I_(m, ...) W_QUERY_CAT_(W_QUERY_MAP_, W_QUERY_NARGS_(__VA_ARGS__))(m, __VA_ARGS__)
+#define W_QUERY_MAP_1(m, a) m a
+#define W_QUERY_MAP_2(m, a, ...) m a W_QUERY_MAP_1(m, __VA_ARGS__)
+#define W_QUERY_MAP_3(m, a, ...) m a W_QUERY_MAP_2(m, __VA_ARGS__)
+#define W_QUERY_MAP_4(m, a, ...) m a W_QUERY_MAP_3(m, __VA_ARGS__)
+#define W_QUERY_MAP_5(m, a, ...) m a W_QUERY_MAP_4(m, __VA_ARGS__)
+#define W_QUERY_MAP_6(m, a, ...) m a W_QUERY_MAP_5(m, __VA_ARGS__)
+#define W_QUERY_MAP_7(m, a, ...) m a W_QUERY_MAP_6(m, __VA_ARGS__)
+#define W_QUERY_MAP_8(m, a, ...) m a W_QUERY_MAP_7(m, __VA_ARGS__)
+
+#define W_QUERY_TYPED_ACCESS_read W_QUERY_ACCESS_READ
+#define W_QUERY_TYPED_ACCESS_write W_QUERY_ACCESS_WRITE
+#define W_QUERY_TYPED_ACCESS_optional W_QUERY_ACCESS_OPTIONAL
+#define W_QUERY_TYPED_ACCESS_has W_QUERY_ACCESS_HAS
+#define W_QUERY_TYPED_ACCESS_not W_QUERY_ACCESS_NOT
+#define W_QUERY_TYPED_ACCESS_without W_QUERY_ACCESS_NOT
+
+#define W_QUERY_TYPED_ID_(access, name, T, var) w_ecs_get_component_by_name(_tw_, #name),
+#define W_QUERY_TYPED_ACCESS_(access, name, T, var) W_QUERY_TYPED_ACCESS_##access,
+
+// per loop: the term's entry, per slice: its column base, per entity: the
+// variable itself
+#define W_QUERY_TYPED_ENTRY_(access, name, T, var) W_QUERY_TYPED_ENTRY_##access(T, var)
+#define W_QUERY_TYPED_ENTRY_read(T, var) struct w_component_entry *var##_entry_ = itor.query->terms[_tk_++].component_entry;
+#define W_QUERY_TYPED_ENTRY_write W_QUERY_TYPED_ENTRY_read
+#define W_QUERY_TYPED_ENTRY_optional(T, var) size_t var##_pk_ = itor.query->terms[_tk_].presence_term; W_QUERY_TYPED_ENTRY_read(T, var)
+#define W_QUERY_TYPED_ENTRY_has(T, var) _tk_++;
+#define W_QUERY_TYPED_ENTRY_not W_QUERY_TYPED_ENTRY_has
+#define W_QUERY_TYPED_ENTRY_without W_QUERY_TYPED_ENTRY_has
+
+#define W_QUERY_TYPED_BASE_(access, name, T, var) W_QUERY_TYPED_BASE_##access(T, var)
+#define W_QUERY_TYPED_BASE_read(T, var) T *var##_base_ = (T *)(var##_entry_->data + (size_t)_slice_.start_id * var##_entry_->type_size);
+#define W_QUERY_TYPED_BASE_write W_QUERY_TYPED_BASE_read
+#define W_QUERY_TYPED_BASE_optional(T, var) T *var##_base_ = var##_entry_ ? (T *)(var##_entry_->data + (size_t)_slice_.start_id * var##_entry_->type_size) : NULL; \
+	uint64_t var##_presence_ = itor.slice_presence ? itor.slice_presence[var##_pk_] : W_QUERY_PRESENCE_NONE;
+#define W_QUERY_TYPED_BASE_has(T, var)
+#define W_QUERY_TYPED_BASE_not W_QUERY_TYPED_BASE_has
+#define W_QUERY_TYPED_BASE_without W_QUERY_TYPED_BASE_has
+
+#define W_QUERY_TYPED_GET_(access, name, T, var) W_QUERY_TYPED_GET_##access(T, var)
+#define W_QUERY_TYPED_GET_read(T, var) T *var = var##_base_ + _s_; (void)var;
+#define W_QUERY_TYPED_GET_write W_QUERY_TYPED_GET_read
+#define W_QUERY_TYPED_GET_optional(T, var) T *var = (var##_base_ && (itor.slice_presence ? w_query_presence_test(itor.query, var##_presence_, _s_) : w_component_has_entry(var##_entry_, itor.entity_id))) ? var##_base_ + _s_ : NULL; (void)var;
+#define W_QUERY_TYPED_GET_has(T, var)
+#define W_QUERY_TYPED_GET_not W_QUERY_TYPED_GET_has
+#define W_QUERY_TYPED_GET_without W_QUERY_TYPED_GET_has
+
+// sparse slices keep the packed IDs' rows prefetched past the slice's end,
+// _tn_ counts the sparse entities before the slice
+#define w_query_for_each_typed_slice_loop_(terms, block, stype, first, sparse) \
+	for (size_t i = 0; i < itor.cache->archetype_slices_##stype##_length; ++i) \
+	{ \
+		struct w_query_archetype_slice _slice_ = itor.cache->archetype_slices_##stype[i]; \
+		if (sparse) \
+		{ \
+			_tn_ += _slice_.slice_length; \
+			w_query_iterator_prefetch_sparse_(&itor, &_tp_, _tn_); \
+		} \
+		itor.slice_presence = itor.presence ? &itor.presence[((first) + i) * itor.query->presence_terms_length] : NULL; \
+		W_QUERY_MAP_TERMS_(W_QUERY_TYPED_BASE_, terms) \
+		for (size_t _s_ = 0; _s_ < _slice_.slice_length; ++_s_) \
+		{ \
+			itor.entity_id = _slice_.start_id + _s_; \
+			W_QUERY_MAP_TERMS_(W_QUERY_TYPED_GET_, terms) \
+			block; \
+		} \
+	} \
+
+#define w_query_for_each_typed(w, terms, block) {\
+	w_query_site_(); \
+	struct w_ecs_world *_tw_ = (w); \
+	uint64_t _tq_id_ = w_query_registry_site_query_id(&_tw_->queries, _site_); \
+	if (_tq_id_ == W_QUERY_ID_NONE) \
+	{ \
+		w_entity_id _ids_[] = { W_QUERY_MAP_TERMS_(W_QUERY_TYPED_ID_, terms) }; \
+		enum W_QUERY_ACCESS _access_[] = { W_QUERY_MAP_TERMS_(W_QUERY_TYPED_ACCESS_, terms) }; \
+		_tq_id_ = w_query_registry_add_query(&_tw_->queries, _ids_, _access_, sizeof(_ids_) / sizeof(*_ids_)); \
+		w_query_registry_set_site_query_id(&_tw_->queries, _site_, _tq_id_); \
+	} \
+	w_query_rebuild_cache(&_tw_->queries, _tw_->queries.queries[_tq_id_]); \
+	struct w_query_iterator itor; \
+	w_query_iterator_begin(&itor, _tw_->queries.queries[_tq_id_]); \
+	size_t _tk_ = 0; \
+	W_QUERY_MAP_TERMS_(W_QUERY_TYPED_ENTRY_, terms) \
+	(void)_tk_; \
+	size_t _tn_ = 0; \
+	size_t _tp_ = 0; \
+	w_query_for_each_typed_slice_loop_(terms, block, dense, 0, 0); \
+	w_query_for_each_typed_slice_loop_(terms, block, sparse, itor.cache->archetype_slices_dense_length, 1); \
+}; \
+
 // init a fresh iterator for the provided query
 void w_query_iterator_begin(struct w_query_iterator *itor, struct w_query *query);
+// init a fresh chunk iterator for the provided query
+void w_query_chunk_begin(struct w_query_chunk *chunk, struct w_query *query);
 
 /* void test_system(struct w_ecs_world *world, double delta_time) */
 /* { */
@@ -83,6 +397,19 @@ void w_query_iterator_begin(struct w_query_iterator *itor, struct w_query *query
 /* 	}); */
 /* } */
 
+/* void test_chunk_system(struct w_ecs_world *world, double delta_time) */
+/* { */
+/* 	w_query_for_each_chunk(world, "read comp1, write comp2", { */
+/* 		float *restrict comp1 = w_chunk_get(float);  */
+/* 		float *restrict comp2 = w_chunk_get(float);  */
+/*  */
+/* 		for (size_t k = 0; k < chunk.length; k++) */
+/* 		{ */
+/* 			comp2[k] += comp1[k] * delta_time; */
+/* 		} */
+/* 	}); */
+/* } */
+
 
 #endif /* WHISKER_QUERY_ITERATOR_H */
 
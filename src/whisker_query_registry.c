@@ -8,6 +8,7 @@
 #include "whisker_hash_xxhash64.h"
 
 #include "whisker_query_registry.h"
+#include "whisker_time.h"
 
 void w_query_registry_init(struct w_query_registry *registry, struct w_string_table *string_table, struct w_component_registry *component_registry, struct w_arena *arena)
 {
@@ -15,34 +16,114 @@ void w_query_registry_init(struct w_query_registry *registry, struct w_string_ta
 	registry->component_registry = component_registry;
 
 	w_array_init_t(registry->queries, W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE);
+	w_array_init_t(registry->query_blocks, 1);
+	w_array_init_t(registry->site_queries, W_QUERY_REGISTRY_SITE_QUERIES_REALLOC_BLOCK_SIZE);
+	registry->queries_length = 0;
+	registry->query_blocks_length = 0;
+	registry->site_queries_length = 0;
+	registry->intersect_threads = W_QUERY_REGISTRY_INTERSECT_THREADS;
 
 	w_hashmap_t_init(&registry->query_map, arena, 64, w_hashmap_hash_str, w_hashmap_eq_str);
+	w_hashmap_t_init(&registry->signature_map, arena, 64, w_hashmap_hash_str, w_hashmap_eq_str);
+
+	memset(&registry->slice_pool, 0, sizeof(registry->slice_pool));
+	registry->slice_pool.arena = arena;
 }
 void w_query_registry_free(struct w_query_registry *registry)
 {
 	// free all queries terms
 	for (size_t i = 0; i < registry->queries_length; ++i)
 	{
-		struct w_query *q = &registry->queries[i];
-
-		if (q->terms_length > 0)
-		{
-			free_null(q->terms);
-		}
-
-		free_null(q->archetype_slices_dense);
-		free_null(q->archetype_slices_sparse);
+		struct w_query *q = registry->queries[i];
+
+		free_null(q->terms);
+		free_null(q->data_terms);
+		free_null(q->plan_units);
+		free_null(q->plan_ops);
+		free_null(q->order);
+		free_null(q->order_members);
+		free_null(q->order_changed);
+		free_null(q->presence_terms);
+		free_null(q->presence);
+		free_null(q->presence_masks);
+		free_null(q->presence_generations);
+		free_null(q->sparse_ids);
+
+		// slice buffers belong to the pool's arena
+		q->archetype_slices_dense = NULL;
+		q->archetype_slices_sparse = NULL;
 		w_sparse_bitset_intersect_free_cache(&q->bitset_cache);
 	}
 
+	for (size_t i = 0; i < registry->query_blocks_length; ++i)
+	{
+		free_null(registry->query_blocks[i]);
+	}
 	free_null(registry->queries);
+	free_null(registry->query_blocks);
+	free_null(registry->site_queries);
 
 	registry->queries_length = 0;
+	registry->query_blocks_length = 0;
+	registry->site_queries_length = 0;
 
 	// free hashmap
 	w_hashmap_t_free(&registry->query_map);
+	w_hashmap_t_free(&registry->signature_map);
+}
+
+
+static inline void w_query_registry_push_term_(struct w_query *query, struct w_string_table *string_table, uint *term_id, char *term_string, size_t term_string_len, uint32_t any_group, uint32_t any_alternative)
+{
+	w_array_ensure_alloc_block_size(
+		query->terms,
+		*term_id + 1,
+		W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE
+	);
+
+	struct w_query_term *term = &query->terms[*term_id];
+	term->raw_term = w_string_table_intern_strn(string_table, term_string, term_string_len);
+	term->component_id = W_ENTITY_INVALID;
+	term->component_name = W_STRING_TABLE_INVALID_ID;
+	term->access_type = W_QUERY_ACCESS_NONE;
+	term->any_group = any_group;
+	term->any_alternative = any_alternative;
+	(*term_id)++;
 }
 
+// split "any(term | term ...)" into one term per alternative, false when
+// the group has more alternatives than fit its mask
+static inline bool w_query_registry_parse_any_group_(struct w_query *query, struct w_string_table *string_table, uint *term_id, char *group_string, size_t group_string_len)
+{
+	char *alt = group_string + 4;
+	char *end = group_string + group_string_len - 1;
+	uint32_t alternative = 0;
+
+	while (alt < end)
+	{
+		char *bar = memchr(alt, '|', end - alt);
+		char *alt_end = bar ? bar : end;
+
+		// trim whitespace around the alternative
+		while (alt < alt_end && *alt == ' ') alt++;
+		while (alt_end > alt && *(alt_end - 1) == ' ') alt_end--;
+
+		if (alt_end > alt)
+		{
+			if (alternative == W_QUERY_ANY_MAX_ALTERNATIVES) return false;
+			w_query_registry_push_term_(query, string_table, term_id, alt, alt_end - alt, query->any_groups_length, alternative++);
+		}
+
+		if (!bar) break;
+		alt = bar + 1;
+	}
+
+	if (alternative > 0)
+	{
+		query->any_groups_length++;
+	}
+	return true;
+}
 
 static inline void w_query_registry_parse_query_string(struct w_query *query, struct w_string_table *string_table)
 {
@@ -56,6 +137,7 @@ static inline void w_query_registry_parse_query_string(struct w_query *query, st
 
 	// loop over the raw query string splitting on commas
 	uint term_id = 0;
+	query->any_groups_length = 0;
 	while (raw_query && *raw_query)
 	{
 		char *query_term_comma = strchr(raw_query, ',');
@@ -83,18 +165,16 @@ static inline void w_query_registry_parse_query_string(struct w_query *query, st
 			break;
 		}
 
-		// alloc and intern term string
-		w_array_ensure_alloc_block_size(
-			query->terms,
-			term_id + 1,
-			W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE
-		);
-
-		query->terms[term_id].raw_term = w_string_table_intern_strn(string_table, raw_query, term_string_len);
-		query->terms[term_id].component_id = W_ENTITY_INVALID;
-		query->terms[term_id].component_name = W_STRING_TABLE_INVALID_ID;
-		query->terms[term_id].access_type = W_QUERY_ACCESS_NONE;
-		term_id++;
+		// alloc and intern term string, any() groups add a term per alternative
+		if (term_string_len > 5 && strncmp(raw_query, "any(", 4) == 0 && raw_query[term_string_len - 1] == ')')
+		{
+			// a group too wide to mask fails the whole query
+			if (!w_query_registry_parse_any_group_(query, string_table, &term_id, raw_query, term_string_len)) return;
+		}
+		else
+		{
+			w_query_registry_push_term_(query, string_table, &term_id, raw_query, term_string_len, W_QUERY_ANY_GROUP_NONE, 0);
+		}
 
 		// advance past the term
 		if (query_term_comma)
@@ -121,6 +201,32 @@ static inline void w_query_registry_parse_query_string(struct w_query *query, st
 		query->query_parse_state = W_QUERY_PARSE_STATE_QUERY_PARSED;
 	}
 }
+// record the terms the iterator gets data from, the terms that may be absent
+// (optional terms and any() alternatives), and the first order_by term
+static void w_query_collect_data_terms_(struct w_query *query)
+{
+	query->data_terms_length = 0;
+	query->presence_terms_length = 0;
+	query->order_term = W_QUERY_ORDER_NONE;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		struct w_query_term *term = &query->terms[i];
+		enum W_QUERY_ACCESS access = term->access_type;
+		term->presence_term = W_QUERY_PRESENCE_TERM_NONE;
+		if (access == W_QUERY_ACCESS_ORDER_BY && term->any_group == W_QUERY_ANY_GROUP_NONE && query->order_term == W_QUERY_ORDER_NONE) query->order_term = i;
+		if (access == W_QUERY_ACCESS_READ || access == W_QUERY_ACCESS_WRITE || access == W_QUERY_ACCESS_OPTIONAL)
+		{
+			w_array_ensure_alloc_block_size(query->data_terms, query->data_terms_length + 1, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
+			query->data_terms[query->data_terms_length++] = i;
+		}
+
+		if (access != W_QUERY_ACCESS_OPTIONAL && term->any_group == W_QUERY_ANY_GROUP_NONE) continue;
+		w_array_ensure_alloc_block_size(query->presence_terms, query->presence_terms_length + 1, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
+		term->presence_term = (uint32_t)query->presence_terms_length;
+		query->presence_terms[query->presence_terms_length++] = i;
+	}
+}
+
 static inline void w_query_registry_parse_query_term_strings(struct w_query *query, struct w_string_table *string_table)
 {
 	int parsed_count = 0;
@@ -158,6 +264,12 @@ static inline void w_query_registry_parse_query_term_strings(struct w_query *que
     			term->access_type = W_QUERY_ACCESS_WRITE;
     		else if (strncmp(raw_term, "optional", type_len) == 0)
     			term->access_type = W_QUERY_ACCESS_OPTIONAL;
+    		else if (strncmp(raw_term, "has", type_len) == 0)
+    			term->access_type = W_QUERY_ACCESS_HAS;
+    		else if (strncmp(raw_term, "not", type_len) == 0 || strncmp(raw_term, "without", type_len) == 0)
+    			term->access_type = W_QUERY_ACCESS_NOT;
+    		else if (strncmp(raw_term, "order_by", type_len) == 0)
+    			term->access_type = W_QUERY_ACCESS_ORDER_BY;
     		else
     			term->access_type = W_QUERY_ACCESS_NONE;
 
@@ -170,9 +282,17 @@ static inline void w_query_registry_parse_query_term_strings(struct w_query *que
 
 	if (parsed_count == (int)query->terms_length)
 	{
+		w_query_collect_data_terms_(query);
 		query->query_parse_state = W_QUERY_PARSE_STATE_TERMS_PARSED;
 	}
 }
+// order_by keys on a built-in type's leading scalar, other types have no
+// known layout to key on
+static inline bool w_query_order_type_(uint type_id)
+{
+	return W_COMPONENT_TYPE_NAME(type_id) != NULL;
+}
+
 static inline void w_query_registry_parse_query_term_components(struct w_query *query, struct w_string_table *string_table, struct w_component_registry *component_registry)
 {
 	int parsed_count = 0;
@@ -195,8 +315,11 @@ static inline void w_query_registry_parse_query_term_components(struct w_query *
 
 			if (component_id != W_ENTITY_INVALID)
 			{
+				struct w_component_entry *entry = w_component_registry_get_entry(component_registry, component_id);
+				if (term->access_type == W_QUERY_ACCESS_ORDER_BY && entry && !w_query_order_type_(entry->type_id)) continue;
+
 				term->component_id = component_id;
-				term->component_entry = w_component_registry_get_entry(component_registry, component_id);
+				term->component_entry = entry;
 				parsed_count++;
 			}
 		}
@@ -208,6 +331,162 @@ static inline void w_query_registry_parse_query_term_components(struct w_query *
 	}
 }
 
+// reset a query slot, its terms and slices are allocated once there's
+// something to hold
+static void w_query_init_(struct w_query *query)
+{
+	memset(query, 0, sizeof(*query));
+	query->raw_query = W_STRING_TABLE_INVALID_ID;
+	query->signature = W_STRING_TABLE_INVALID_ID;
+	query->order_term = W_QUERY_ORDER_NONE;
+	query->query_parse_state = W_QUERY_PARSE_STATE_UNPARSED;
+}
+
+static inline bool w_query_term_required_(struct w_query_term *term)
+{
+	return term->any_group == W_QUERY_ANY_GROUP_NONE && (term->access_type == W_QUERY_ACCESS_READ || term->access_type == W_QUERY_ACCESS_WRITE || term->access_type == W_QUERY_ACCESS_HAS || term->access_type == W_QUERY_ACCESS_ORDER_BY);
+}
+
+static inline bool w_query_term_excluded_(struct w_query_term *term)
+{
+	return term->any_group == W_QUERY_ANY_GROUP_NONE && term->access_type == W_QUERY_ACCESS_NOT;
+}
+
+static int w_query_signature_cmp_id_(const void *a, const void *b)
+{
+	w_entity_id x = *(const w_entity_id *)a;
+	w_entity_id y = *(const w_entity_id *)b;
+	return (x > y) - (x < y);
+}
+
+static int w_query_signature_cmp_str_(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// write one signature section: the prefix followed by the sorted unique
+// component IDs of the required terms ('r'), excluded terms ('n') or the
+// alternatives of an any() group ('a')
+static size_t w_query_signature_section_(struct w_query *query, char prefix, uint32_t any_group, w_entity_id *ids, char *out)
+{
+	size_t ids_length = 0;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		struct w_query_term *term = &query->terms[i];
+		bool in_section = (prefix == 'r') ? w_query_term_required_(term) : (prefix == 'n') ? w_query_term_excluded_(term) : term->any_group == any_group;
+		if (in_section) ids[ids_length++] = term->component_id;
+	}
+	qsort(ids, ids_length, sizeof(*ids), w_query_signature_cmp_id_);
+
+	size_t written = sprintf(out, "%c", prefix);
+	for (size_t i = 0; i < ids_length; ++i)
+	{
+		if (i > 0 && ids[i] == ids[i - 1]) continue;
+		written += sprintf(out + written, "%u,", ids[i]);
+	}
+	return written;
+}
+
+// canonicalise a parsed query's filtering terms and point it at the cache of
+// the first query with the same signature, term order, access and optional
+// terms don't change which entities match so they're left out
+static void w_query_registry_alias_(struct w_query_registry *registry, uint64_t query_id)
+{
+	struct w_query *query = registry->queries[query_id];
+
+	// up to 10 digits and a comma per ID, plus the section prefixes
+	size_t section_size = query->terms_length * 11 + 2;
+	w_entity_id *ids = w_mem_xcalloc_t(query->terms_length + 1, w_entity_id);
+	char *signature = w_mem_xcalloc(section_size * (query->any_groups_length + 2), 1);
+	char **groups = w_mem_xcalloc_t(query->any_groups_length + 1, char *);
+
+	size_t length = w_query_signature_section_(query, 'r', W_QUERY_ANY_GROUP_NONE, ids, signature);
+	length += w_query_signature_section_(query, 'n', W_QUERY_ANY_GROUP_NONE, ids, signature + length);
+
+	// any() groups are ORed sets, written order doesn't matter either
+	for (uint32_t g = 0; g < query->any_groups_length; ++g)
+	{
+		groups[g] = w_mem_xcalloc(section_size, 1);
+		w_query_signature_section_(query, 'a', g, ids, groups[g]);
+	}
+	qsort(groups, query->any_groups_length, sizeof(*groups), w_query_signature_cmp_str_);
+	for (uint32_t g = 0; g < query->any_groups_length; ++g)
+	{
+		length += sprintf(signature + length, "%s", groups[g]);
+		free_null(groups[g]);
+	}
+
+	query->signature = w_string_table_intern_str(registry->string_table, signature);
+	char *interned_str = w_string_table_lookup(registry->string_table, query->signature);
+
+	uint64_t *owner_id;
+	w_hashmap_t_get(&registry->signature_map, interned_str, owner_id);
+	if (owner_id)
+	{
+		query->cache_owner = registry->queries[*owner_id];
+	}
+	else
+	{
+		w_hashmap_t_set(&registry->signature_map, interned_str, query_id);
+	}
+
+	free_null(groups);
+	free_null(signature);
+	free_null(ids);
+}
+
+// take the next query slot, starting a new block when the last one is full
+static struct w_query *w_query_registry_new_query_(struct w_query_registry *registry)
+{
+	uint64_t new_id = registry->queries_length;
+	if (new_id % W_QUERY_REGISTRY_QUERY_BLOCK_SIZE == 0)
+	{
+		w_array_ensure_alloc(registry->query_blocks, registry->query_blocks_length + 1);
+		registry->query_blocks[registry->query_blocks_length++] = w_mem_xcalloc_t(W_QUERY_REGISTRY_QUERY_BLOCK_SIZE, struct w_query);
+	}
+
+	w_array_ensure_alloc_block_size(
+		registry->queries,
+		new_id + 1,
+		W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE
+	);
+
+	struct w_query *query = &registry->query_blocks[new_id / W_QUERY_REGISTRY_QUERY_BLOCK_SIZE][new_id % W_QUERY_REGISTRY_QUERY_BLOCK_SIZE];
+	registry->queries[new_id] = query;
+	registry->queries_length++;
+
+	w_query_init_(query);
+	query->id = new_id;
+	return query;
+}
+
+uint64_t w_query_registry_add_query(struct w_query_registry *registry, const w_entity_id *component_ids, const enum W_QUERY_ACCESS *access_types, size_t terms_length)
+{
+	struct w_query *query = w_query_registry_new_query_(registry);
+	uint64_t new_id = query->id;
+
+	// terms arrive resolved, only the entries are left to look up
+	w_array_ensure_alloc_block_size(query->terms, terms_length, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
+	for (size_t i = 0; i < terms_length; ++i)
+	{
+		query->terms[i] = (struct w_query_term){
+			.raw_term = W_STRING_TABLE_INVALID_ID,
+			.component_id = component_ids[i],
+			.component_name = W_STRING_TABLE_INVALID_ID,
+			.component_entry = w_component_registry_get_entry(registry->component_registry, component_ids[i]),
+			.access_type = access_types[i],
+			.any_group = W_QUERY_ANY_GROUP_NONE,
+		};
+	}
+	query->terms_length = terms_length;
+
+	w_query_collect_data_terms_(query);
+	query->query_parse_state = W_QUERY_PARSE_STATE_COMPONENTS_PARSED;
+	w_query_registry_alias_(registry, new_id);
+
+	return new_id;
+}
+
 struct w_query *w_query_registry_get_query(struct w_query_registry *registry, char *query_string)
 {
 	struct w_query *query = NULL;
@@ -218,29 +497,13 @@ struct w_query *w_query_registry_get_query(struct w_query_registry *registry, ch
 
 	// assign existing query to struct
 	if (query_id)
-		query = &registry->queries[*query_id];
+		query = registry->queries[*query_id];
 	// bump and get new query struct
 	else
 	{
-		w_array_ensure_alloc_block_size(
-			registry->queries,
-			registry->queries_length + 1,
-			W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE
-		);
-
-		uint64_t new_id = registry->queries_length++;
-		query = &registry->queries[new_id];
-
-		// init new query struct
+		query = w_query_registry_new_query_(registry);
+		uint64_t new_id = query->id;
 		query->raw_query = w_string_table_intern_str(registry->string_table, query_string);
-		query->query_parse_state = W_QUERY_PARSE_STATE_UNPARSED;
-
-		w_array_init_t(query->terms, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
-		w_array_init_t(query->archetype_slices_dense, W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE);
-		w_array_init_t(query->archetype_slices_sparse, W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE);
-		query->archetype_slices_dense_length = 0;
-		query->archetype_slices_sparse_length = 0;
-		query->bitset_cache_generation = 0;
 
 		// add to hashmap for caching - use interned string as key
 		char *interned_str = w_string_table_lookup(registry->string_table, query->raw_query);
@@ -269,165 +532,886 @@ struct w_query *w_query_registry_get_query(struct w_query_registry *registry, ch
 	if (query->query_parse_state == W_QUERY_PARSE_STATE_TERMS_PARSED)
 	{
 		w_query_registry_parse_query_term_components(query, registry->string_table, registry->component_registry);
+
+		// stage 4: share the cache of an equivalent query
+		if (query->query_parse_state == W_QUERY_PARSE_STATE_COMPONENTS_PARSED)
+		{
+			w_query_registry_alias_(registry, query->id);
+		}
 	}
 
 	return query;
 }
 
-bool w_query_rebuild_cache(struct w_query_registry *registry, struct w_query *query)
+// slot 0 is never handed out so call sites can use it as unassigned
+static _Atomic uint32_t w_query_registry_sites_ = 1;
+
+uint32_t w_query_registry_next_site(void)
 {
-	// instant fail if query isn't fully parsed
-	if (query->query_parse_state != W_QUERY_PARSE_STATE_COMPONENTS_PARSED)
+	return atomic_fetch_add(&w_query_registry_sites_, 1);
+}
+
+void w_query_registry_set_site_query_id(struct w_query_registry *registry, uint32_t site, uint64_t query_id)
+{
+	w_array_ensure_alloc_block_size(
+		registry->site_queries,
+		site + 1,
+		W_QUERY_REGISTRY_SITE_QUERIES_REALLOC_BLOCK_SIZE
+	);
+	if (registry->site_queries_length < site + 1) registry->site_queries_length = site + 1;
+
+	registry->site_queries[site] = query_id + 1;
+}
+
+struct w_query *w_query_registry_get_site_query(struct w_query_registry *registry, uint32_t site, char *query_string)
+{
+	uint64_t query_id = w_query_registry_site_query_id(registry, site);
+	if (query_id != W_QUERY_ID_NONE && registry->queries[query_id]->query_parse_state == W_QUERY_PARSE_STATE_COMPONENTS_PARSED)
 	{
-		return false;
+		return registry->queries[query_id];
+	}
+
+	// first run in this registry, or the query is still waiting on
+	// components to be registered
+	struct w_query *query = w_query_registry_get_query(registry, query_string);
+	w_query_registry_set_site_query_id(registry, site, query->id);
+
+	return query;
+}
+
+// size estimate of a plan unit, any() unions are at most the sum of their
+// present alternatives
+static uint64_t w_query_plan_unit_estimate_(struct w_query *query, size_t unit)
+{
+	if (unit < query->terms_length)
+	{
+		return query->terms[unit].component_entry->data_bitset.cardinality;
+	}
+
+	uint64_t estimate = 0;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		struct w_query_term *term = &query->terms[i];
+		if (term->any_group != unit - query->terms_length || !term->component_entry) continue;
+		estimate += term->component_entry->data_bitset.cardinality;
+	}
+	return estimate;
+}
+
+// tie break keeping equal estimates in a canonical order, whatever order the
+// terms were written in
+static uint64_t w_query_plan_unit_key_(struct w_query *query, size_t unit)
+{
+	if (unit < query->terms_length)
+	{
+		return query->terms[unit].component_id;
+	}
+
+	uint64_t key = UINT64_MAX;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		if (query->terms[i].any_group == unit - query->terms_length && query->terms[i].component_id < key) key = query->terms[i].component_id;
+	}
+	return key;
+}
+
+// order the plan units by ascending estimate, insertion sort as queries only
+// have a handful of units
+static void w_query_plan_sort_units_(struct w_query *query)
+{
+	for (size_t i = 1; i < query->plan_units_length; ++i)
+	{
+		size_t unit = query->plan_units[i];
+		uint64_t estimate = w_query_plan_unit_estimate_(query, unit);
+		uint64_t key = w_query_plan_unit_key_(query, unit);
+
+		size_t k = i;
+		while (k > 0)
+		{
+			size_t prev = query->plan_units[k - 1];
+			uint64_t prev_estimate = w_query_plan_unit_estimate_(query, prev);
+			if (prev_estimate < estimate || (prev_estimate == estimate && w_query_plan_unit_key_(query, prev) <= key)) break;
+
+			query->plan_units[k] = prev;
+			k--;
+		}
+		query->plan_units[k] = unit;
 	}
+}
 
-	// init bitset cache if needed
-	if (!query->bitset_cache.bitsets)
+// refresh term entries (the registry's entries array moves as it grows) and
+// lay out the bitset cache: required terms and any() groups are ANDed
+// smallest first, each any() group ORing its present alternatives, then the
+// excluded bitsets are ORed and subtracted. Returns false while a required
+// component or a whole any() group has no data yet
+// (note: a changed layout drops the cached results so they rebuild in full)
+static bool w_query_plan_(struct w_query_registry *registry, struct w_query *query)
+{
+	size_t required_count = 0;
+	size_t alternative_count = 0;
+	size_t excluded_count = 0;
+	for (size_t i = 0; i < query->terms_length; ++i)
 	{
-		w_array_init_t(query->bitset_cache.bitsets, query->terms_length);
+		struct w_query_term *term = &query->terms[i];
+		term->component_entry = w_component_registry_get_entry(registry->component_registry, term->component_id);
 
-		// assign bitset pointers from component registry
-		// count required terms (read/write) for intersection
-		// IMPORTANT: required terms must come before optional/has terms in query string
-		size_t required_count = 0;
+		if (w_query_term_required_(term))
+		{
+			if (!term->component_entry) return false;
+			required_count++;
+		}
+		else if (term->component_entry && term->any_group != W_QUERY_ANY_GROUP_NONE)
+		{
+			alternative_count++;
+		}
+		else if (term->component_entry && w_query_term_excluded_(term))
+		{
+			excluded_count++;
+		}
+	}
+
+	// units in written order the first time, then kept until re-planned
+	size_t units_length = required_count + query->any_groups_length;
+	bool resort = query->plan_units_length != units_length;
+	if (resort)
+	{
+		w_array_ensure_alloc_block_size(query->plan_units, units_length, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
+		query->plan_units_length = 0;
 		for (size_t i = 0; i < query->terms_length; ++i)
 		{
-			// optional/has terms may have NULL entry if component has no data
-			struct w_component_entry *entry = query->terms[i].component_entry;
+			if (w_query_term_required_(&query->terms[i])) query->plan_units[query->plan_units_length++] = i;
+		}
+		for (uint32_t g = 0; g < query->any_groups_length; ++g)
+		{
+			query->plan_units[query->plan_units_length++] = query->terms_length + g;
+		}
+	}
 
-			// required components (read/write) must have valid entry to proceed
-			if ((query->terms[i].access_type == W_QUERY_ACCESS_READ ||
-			     query->terms[i].access_type == W_QUERY_ACCESS_WRITE) && !entry)
+	// an any() group without any data matches nothing
+	uint64_t min_estimate = UINT64_MAX;
+	for (size_t u = 0; u < units_length; ++u)
+	{
+		uint64_t estimate = w_query_plan_unit_estimate_(query, query->plan_units[u]);
+		if (query->plan_units[u] >= query->terms_length && estimate == 0)
+		{
+			bool present = false;
+			for (size_t i = 0; i < query->terms_length && !present; ++i)
 			{
-				return false;
+				present = query->terms[i].any_group == query->plan_units[u] - query->terms_length && query->terms[i].component_entry;
 			}
+			if (!present) return false;
+		}
+		if (estimate < min_estimate) min_estimate = estimate;
+	}
 
-			query->bitset_cache.bitsets[i] = entry ? &entry->data_bitset : NULL;
-			// only read/write terms participate in intersection (not optional/has)
-			if (query->terms[i].access_type == W_QUERY_ACCESS_READ ||
-			    query->terms[i].access_type == W_QUERY_ACCESS_WRITE)
-			{
-				required_count++;
-			}
+	// re-plan once the leading unit drifts too far from the smallest
+	if (units_length > 0 && w_query_plan_unit_estimate_(query, query->plan_units[0]) > min_estimate * W_QUERY_PLANNER_REORDER_RATIO)
+	{
+		resort = true;
+	}
+	if (resort)
+	{
+		w_query_plan_sort_units_(query);
+	}
+
+	// absent components are only excluded when something is required
+	if (units_length == 0) excluded_count = 0;
+
+	struct w_sparse_bitset_intersect_cache *cache = &query->bitset_cache;
+	if (!cache->bitsets)
+	{
+		w_array_init_t(cache->bitsets, query->terms_length);
+		w_array_init_t(query->plan_ops, query->terms_length);
+	}
+
+	size_t length = required_count + alternative_count + excluded_count;
+	bool use_expr = alternative_count > 0 || excluded_count > 0;
+	bool changed = cache->bitsets_length != length || (cache->expr != NULL) != use_expr;
+
+	// each unit is its own group, consecutive operands in a group are ORed
+	size_t b = 0;
+	uint32_t group = 0;
+	for (size_t u = 0; u < units_length; ++u, ++group)
+	{
+		size_t unit = query->plan_units[u];
+		for (size_t i = (unit < query->terms_length) ? unit : 0; i < query->terms_length; ++i)
+		{
+			struct w_query_term *term = &query->terms[i];
+			if (unit >= query->terms_length && (term->any_group != unit - query->terms_length || !term->component_entry)) continue;
+
+			if (cache->bitsets[b] != &term->component_entry->data_bitset) changed = true;
+			cache->bitsets[b] = &term->component_entry->data_bitset;
+			query->plan_ops[b++] = (struct w_sparse_bitset_expr_op){ .op = W_SPARSE_BITSET_OP_AND, .group = group };
+
+			if (unit < query->terms_length) break;
 		}
-		// intersection only uses first N bitsets where N = required_count
-		query->bitset_cache.bitsets_length = required_count;
 	}
+	for (size_t i = 0; i < query->terms_length && excluded_count > 0; ++i)
+	{
+		struct w_query_term *term = &query->terms[i];
+		if (!w_query_term_excluded_(term) || !term->component_entry) continue;
 
-	// check if intersection cache is stale
-	if (w_sparse_bitset_intersect_cache_stale(&query->bitset_cache))
+		if (cache->bitsets[b] != &term->component_entry->data_bitset) changed = true;
+		cache->bitsets[b] = &term->component_entry->data_bitset;
+		query->plan_ops[b++] = (struct w_sparse_bitset_expr_op){ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = group };
+	}
+
+	if (!changed && use_expr && memcmp(cache->expr, query->plan_ops, b * sizeof(*query->plan_ops)) != 0)
 	{
-		// rebuild bitset indexes cache
-		w_sparse_bitset_intersect(&query->bitset_cache);
+		changed = true;
+	}
 
-		// build archetype slices caches
-		w_entity_id start_id = W_ENTITY_INVALID;
-		size_t slice_length = 0;
-		uint64_t *ids = query->bitset_cache.indexes;
+	// probe when the leading unit is tiny next to every other one
+	uint64_t rest_estimate = UINT64_MAX;
+	for (size_t u = 1; u < units_length; ++u)
+	{
+		uint64_t estimate = w_query_plan_unit_estimate_(query, query->plan_units[u]);
+		if (estimate < rest_estimate) rest_estimate = estimate;
+	}
+	uint64_t first_estimate = units_length > 0 ? w_query_plan_unit_estimate_(query, query->plan_units[0]) : 0;
+	cache->probe = units_length > 1 && rest_estimate / W_QUERY_PLANNER_PROBE_RATIO > first_estimate;
 
-		query->archetype_slices_dense_length = 0;
-		query->archetype_slices_sparse_length = 0;
+	if (units_length == 0) query->plan_kernel = W_QUERY_PLAN_KERNEL_NONE;
+	else if (cache->probe) query->plan_kernel = W_QUERY_PLAN_KERNEL_PROBE;
+	else if (use_expr) query->plan_kernel = W_QUERY_PLAN_KERNEL_EXPR;
+	else if (b == 1) query->plan_kernel = W_QUERY_PLAN_KERNEL_SCAN;
+	else if (b == 2) query->plan_kernel = W_QUERY_PLAN_KERNEL_PAIR;
+	else query->plan_kernel = W_QUERY_PLAN_KERNEL_NWAY;
 
-		for (size_t i = 0; i < query->bitset_cache.indexes_length; ++i)
+	if (!changed) return true;
+
+	cache->bitsets_length = b;
+	cache->cache_generation = 0;
+
+	free_null(cache->expr);
+	if (use_expr)
+	{
+		w_array_init_t(cache->expr, b);
+		memcpy(cache->expr, query->plan_ops, b * sizeof(*query->plan_ops));
+	}
+
+	return true;
+}
+
+// slice sorted ids into contiguous runs of at most MAX_SLICE, runs of at
+// least MIN_SLICE are dense, only counts when dense/sparse are NULL
+static void w_query_slice_ids_(const uint64_t *ids, size_t length, struct w_query_archetype_slice *dense, size_t *dense_count, struct w_query_archetype_slice *sparse, size_t *sparse_count)
+{
+	size_t i = 0;
+	while (i < length)
+	{
+		size_t run = 1;
+		while (i + run < length && run < W_QUERY_REGISTRY_ARCHETYPE_SLICES_MAX_SLICE && ids[i + run] == ids[i + run - 1] + 1)
 		{
-			if (start_id == W_ENTITY_INVALID)
-			{
-				start_id = ids[i];
-				slice_length = 1;
-				continue;
-			}
+			run++;
+		}
 
-			bool contiguous = (ids[i] == ids[i-1] + 1);
-			bool hit_max = false;
+		struct w_query_archetype_slice slice = { .start_id = (w_entity_id)ids[i], .slice_length = run };
+		if (run >= W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE)
+		{
+			if (dense) dense[*dense_count] = slice;
+			(*dense_count)++;
+		}
+		else
+		{
+			if (sparse) sparse[*sparse_count] = slice;
+			(*sparse_count)++;
+		}
+		i += run;
+	}
+}
 
-			if (contiguous)
-			{
-				slice_length++;
-
-				// keep building slice until it hits max length
-				if (slice_length < W_QUERY_REGISTRY_ARCHETYPE_SLICES_MAX_SLICE)
-				{
-					continue;
-				}
-				hit_max = true;
-			}
+struct w_query_archetype_slice *w_query_slice_pool_acquire(struct w_query_slice_pool *pool, size_t *capacity)
+{
+	size_t class = 0;
+	size_t class_capacity = W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY;
+	while (class_capacity < *capacity && class < W_QUERY_REGISTRY_SLICE_POOL_CLASSES - 1)
+	{
+		class_capacity <<= 1;
+		class++;
+	}
+	*capacity = class_capacity;
 
-			bool dense = (slice_length >= W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE);
+	struct w_query_slice_pool_list *list = &pool->lists[class];
+	if (!list->head) return w_arena_malloc(pool->arena, class_capacity * sizeof(struct w_query_archetype_slice));
 
-			// assign slice to correct array type
-			struct w_query_archetype_slice *slice;
-			if (dense)
-			{
-				w_array_ensure_alloc_block_size(
-					query->archetype_slices_dense,
-					query->archetype_slices_dense_length + 1,
-					W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE
-				);
+	struct w_query_archetype_slice *slices = list->head;
+	list->head = *(struct w_query_archetype_slice **)slices;
+	list->length--;
+	return slices;
+}
 
-				slice = &query->archetype_slices_dense[query->archetype_slices_dense_length++];
-			}
-			else
-			{
-				w_array_ensure_alloc_block_size(
-					query->archetype_slices_sparse,
-					query->archetype_slices_sparse_length + 1,
-					W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE
-				);
+void w_query_slice_pool_release(struct w_query_slice_pool *pool, struct w_query_archetype_slice *slices, size_t capacity)
+{
+	size_t class = 0;
+	while ((size_t)W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY << class < capacity) class++;
+
+	struct w_query_slice_pool_list *list = &pool->lists[class];
+	*(struct w_query_archetype_slice **)slices = list->head;
+	list->head = slices;
+	list->length++;
+}
+
+// move a slice array to a pooled buffer of at least capacity slices, keeping
+// its first length slices
+static void w_query_slices_move_(struct w_query_slice_pool *pool, struct w_query_archetype_slice **slices, _Atomic size_t *size, size_t length, size_t capacity)
+{
+	struct w_query_archetype_slice *moved = w_query_slice_pool_acquire(pool, &capacity);
+	if (*slices)
+	{
+		memcpy(moved, *slices, length * sizeof(*moved));
+		w_query_slice_pool_release(pool, *slices, *size / sizeof(*moved));
+	}
+	*slices = moved;
+	*size = capacity * sizeof(*moved);
+}
+
+// replace `remove` slices at `at` with room for `insert` new ones, handing
+// capacity back to the pool once under a quarter of it is used
+#define w_query_slices_splice_(pool, arr, at, remove, insert) \
+	do { \
+		size_t spliced_length = arr##_length + (insert) - (remove); \
+		if (spliced_length > arr##_size / sizeof(*arr)) \
+		{ \
+			w_query_slices_move_(pool, &arr, &arr##_size, arr##_length, spliced_length); \
+		} \
+		if (arr) memmove(&arr[(at) + (insert)], &arr[(at) + (remove)], (arr##_length - (at) - (remove)) * sizeof(*arr)); \
+		arr##_length = spliced_length; \
+		if (arr##_size / sizeof(*arr) > W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY && spliced_length * 4 < arr##_size / sizeof(*arr)) \
+		{ \
+			w_query_slices_move_(pool, &arr, &arr##_size, spliced_length, spliced_length * 2); \
+		} \
+	} while (0)
+
+// replace the dense/sparse slices in the given ranges with the slices of ids
+static void w_query_insert_slices_(struct w_query_slice_pool *pool, struct w_query *query, size_t dense_at, size_t dense_remove, size_t sparse_at, size_t sparse_remove, const uint64_t *ids, size_t length)
+{
+	size_t dense_count = 0;
+	size_t sparse_count = 0;
+	w_query_slice_ids_(ids, length, NULL, &dense_count, NULL, &sparse_count);
+	if (sparse_remove || sparse_count) query->sparse_ids_stale = true;
+
+	w_query_slices_splice_(pool, query->archetype_slices_dense, dense_at, dense_remove, dense_count);
+	w_query_slices_splice_(pool, query->archetype_slices_sparse, sparse_at, sparse_remove, sparse_count);
+
+	// a side without slices may not have a buffer yet
+	struct w_query_archetype_slice *dense = query->archetype_slices_dense ? &query->archetype_slices_dense[dense_at] : NULL;
+	struct w_query_archetype_slice *sparse = query->archetype_slices_sparse ? &query->archetype_slices_sparse[sparse_at] : NULL;
+	dense_count = 0;
+	sparse_count = 0;
+	w_query_slice_ids_(ids, length, dense, &dense_count, sparse, &sparse_count);
+}
+
+// first slice of a sorted slice array ending at or after id
+static size_t w_query_slices_lower_bound_(const struct w_query_archetype_slice *slices, size_t length, uint64_t id)
+{
+	size_t lo = 0;
+	size_t hi = length;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) >> 1;
+		if ((uint64_t)slices[mid].start_id + slices[mid].slice_length <= id) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// slice holding id in either slice array, NULL if none does
+static struct w_query_archetype_slice *w_query_find_slice_(struct w_query *query, uint64_t id)
+{
+	size_t d = w_query_slices_lower_bound_(query->archetype_slices_dense, query->archetype_slices_dense_length, id);
+	if (d < query->archetype_slices_dense_length && query->archetype_slices_dense[d].start_id <= id) return &query->archetype_slices_dense[d];
+
+	size_t s = w_query_slices_lower_bound_(query->archetype_slices_sparse, query->archetype_slices_sparse_length, id);
+	if (s < query->archetype_slices_sparse_length && query->archetype_slices_sparse[s].start_id <= id) return &query->archetype_slices_sparse[s];
+
+	return NULL;
+}
+
+// first position in the sorted indexes holding a value >= value
+static size_t w_query_indexes_lower_bound_(const uint64_t *indexes, size_t length, uint64_t value)
+{
+	size_t lo = 0;
+	size_t hi = length;
+	while (lo < hi)
+	{
+		size_t mid = (lo + hi) >> 1;
+		if (indexes[mid] < value) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// re-slice the ids between lo and hi after their page changed, widened over
+// slices running into the range so runs crossing its edges are extended or
+// split the same as a full rebuild would
+static void w_query_patch_slices_(struct w_query_slice_pool *pool, struct w_query *query, uint64_t lo, uint64_t hi)
+{
+	struct w_query_archetype_slice *slice;
+	if (lo > 0 && (slice = w_query_find_slice_(query, lo - 1))) lo = slice->start_id;
+	if ((slice = w_query_find_slice_(query, hi + 1))) hi = (uint64_t)slice->start_id + slice->slice_length - 1;
+
+	// no slice crosses lo or hi now, so the slices to drop are the ones
+	// ending between them
+	size_t dense_at = w_query_slices_lower_bound_(query->archetype_slices_dense, query->archetype_slices_dense_length, lo);
+	size_t dense_end = w_query_slices_lower_bound_(query->archetype_slices_dense, query->archetype_slices_dense_length, hi + 1);
+	size_t sparse_at = w_query_slices_lower_bound_(query->archetype_slices_sparse, query->archetype_slices_sparse_length, lo);
+	size_t sparse_end = w_query_slices_lower_bound_(query->archetype_slices_sparse, query->archetype_slices_sparse_length, hi + 1);
+
+	uint64_t *ids = query->bitset_cache.indexes;
+	size_t start = w_query_indexes_lower_bound_(ids, query->bitset_cache.indexes_length, lo);
+	size_t end = w_query_indexes_lower_bound_(ids, query->bitset_cache.indexes_length, hi + 1);
+
+	w_query_insert_slices_(pool, query, dense_at, dense_end - dense_at, sparse_at, sparse_end - sparse_at, &ids[start], end - start);
+}
+
+// pack the sparse slices' entity IDs for batched iteration
+static void w_query_sparse_ids_sync_(struct w_query *query)
+{
+	size_t length = 0;
+	for (size_t i = 0; i < query->archetype_slices_sparse_length; ++i)
+	{
+		length += query->archetype_slices_sparse[i].slice_length;
+	}
+	w_array_ensure_alloc_block_size(query->sparse_ids, length, W_QUERY_REGISTRY_SPARSE_IDS_REALLOC_BLOCK_SIZE);
+
+	size_t k = 0;
+	for (size_t i = 0; i < query->archetype_slices_sparse_length; ++i)
+	{
+		struct w_query_archetype_slice slice = query->archetype_slices_sparse[i];
+		for (size_t s = 0; s < slice.slice_length; ++s) query->sparse_ids[k++] = slice.start_id + (w_entity_id)s;
+	}
+	query->sparse_ids_length = length;
+	query->sparse_ids_stale = false;
+}
+
+// leading scalar of a component value, compound types key on their first
+// element and pack unions on their packed value
+static double w_query_order_key_(struct w_component_entry *entry, w_entity_id entity_id)
+{
+	unsigned char *value = entry->data + ((size_t)entity_id * entry->type_size);
+	switch (entry->type_id)
+	{
+		case W_COMPONENT_TYPE_int8_t: return *(int8_t *)value;
+		case W_COMPONENT_TYPE_int16_t: return *(int16_t *)value;
+		case W_COMPONENT_TYPE_int32_t: return *(int32_t *)value;
+		case W_COMPONENT_TYPE_int64_t: return (double)*(int64_t *)value;
+		case W_COMPONENT_TYPE_uint8_t: return *(uint8_t *)value;
+		case W_COMPONENT_TYPE_uint16_t: return *(uint16_t *)value;
+		case W_COMPONENT_TYPE_uint32_t: return *(uint32_t *)value;
+		case W_COMPONENT_TYPE_uint64_t: return (double)*(uint64_t *)value;
+		case W_COMPONENT_TYPE_float:
+		case W_COMPONENT_TYPE_w_vec2:
+		case W_COMPONENT_TYPE_w_vec3:
+		case W_COMPONENT_TYPE_w_vec4:
+		case W_COMPONENT_TYPE_w_mat2:
+		case W_COMPONENT_TYPE_w_mat3:
+		case W_COMPONENT_TYPE_w_mat4:
+		case W_COMPONENT_TYPE_w_color:
+		case W_COMPONENT_TYPE_w_rect:
+		case W_COMPONENT_TYPE_w_aabb2:
+		case W_COMPONENT_TYPE_w_aabb3:
+		case W_COMPONENT_TYPE_w_ray2:
+		case W_COMPONENT_TYPE_w_ray3: return *(float *)value;
+		case W_COMPONENT_TYPE_double: return *(double *)value;
+		case W_COMPONENT_TYPE_bool: return *(bool *)value;
+		case W_COMPONENT_TYPE_char: return *(char *)value;
+		case W_COMPONENT_TYPE_w_vec2i:
+		case W_COMPONENT_TYPE_w_vec3i:
+		case W_COMPONENT_TYPE_w_vec4i: return *(int *)value;
+		case W_COMPONENT_TYPE_w_vec2u:
+		case W_COMPONENT_TYPE_w_vec3u:
+		case W_COMPONENT_TYPE_w_vec4u:
+		case W_COMPONENT_TYPE_w_recti:
+		case W_COMPONENT_TYPE_w_entity_id:
+		case W_COMPONENT_TYPE_w_pack16x2:
+		case W_COMPONENT_TYPE_w_pack8x4: return *(uint32_t *)value;
+		case W_COMPONENT_TYPE_w_color8: return *(uint8_t *)value;
+		case W_COMPONENT_TYPE_w_pack16x4:
+		case W_COMPONENT_TYPE_w_pack8x8:
+		case W_COMPONENT_TYPE_w_pack32x2: return (double)*(uint64_t *)value;
+		default: return NAN;
+	}
+}
+
+// total order on keys: NaN keys sort after every other key, ties and NaNs
+// among themselves by entity ID
+static inline bool w_query_order_before_(struct w_query_order_entry a, struct w_query_order_entry b)
+{
+	bool a_nan = isnan(a.key);
+	bool b_nan = isnan(b.key);
+	if (a_nan != b_nan) return b_nan;
+	if (!a_nan && a.key != b.key) return a.key < b.key;
+	return a.entity_id < b.entity_id;
+}
 
-				slice = &query->archetype_slices_sparse[query->archetype_slices_sparse_length++];
+static int w_query_order_cmp_(const void *a, const void *b)
+{
+	struct w_query_order_entry x = *(const struct w_query_order_entry *)a;
+	struct w_query_order_entry y = *(const struct w_query_order_entry *)b;
+	return w_query_order_before_(y, x) - w_query_order_before_(x, y);
+}
+
+// bring the order up to date with the owner's matches and the current keys:
+// entries that left are dropped, entries that joined or whose key changed
+// are pulled out, sorted on their own and merged back into the rest, which
+// is still sorted. Returns true when the order changed
+static bool w_query_order_sync_(struct w_query *query)
+{
+	struct w_query *owner = w_query_cache_owner(query);
+	struct w_component_entry *entry = query->terms[query->order_term].component_entry;
+
+	// a key component registered after parsing with no known layout leaves
+	// the order empty
+	if (!entry || !w_query_order_type_(entry->type_id)) return false;
+
+	const uint64_t *indexes = owner->bitset_cache.indexes;
+	size_t indexes_length = owner->bitset_cache.indexes_length;
+	size_t length = query->order_length;
+	size_t moved = 0;
+	bool changed = false;
+	uint64_t started = 0;
+
+	// re-sync members when the matches were rebuilt
+	if (query->order_generation != owner->rebuilds)
+	{
+		started = w_time_precise();
+		query->order_generation = owner->rebuilds;
+
+		size_t kept = 0;
+		for (size_t i = 0; i < length; ++i)
+		{
+			w_entity_id entity_id = query->order[i].entity_id;
+			size_t at = w_query_indexes_lower_bound_(indexes, indexes_length, entity_id);
+			if (at < indexes_length && indexes[at] == entity_id) query->order[kept++] = query->order[i];
+			else query->order_members[entity_id / 64] &= ~(1ull << (entity_id % 64));
+		}
+		changed = kept != length;
+		length = kept;
+
+		if (indexes_length > 0)
+		{
+			w_array_ensure_alloc_block_size(query->order_members, indexes[indexes_length - 1] / 64 + 1, W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE);
+		}
+		w_array_ensure_alloc_block_size(query->order, indexes_length, W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE);
+		w_array_ensure_alloc_block_size(query->order_changed, indexes_length, W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE);
+		for (size_t i = 0; i < indexes_length; ++i)
+		{
+			uint64_t *word = &query->order_members[indexes[i] / 64];
+			uint64_t bit = 1ull << (indexes[i] % 64);
+			if (*word & bit) continue;
+
+			// joined entries go straight to the ones to merge back
+			*word |= bit;
+			w_entity_id entity_id = (w_entity_id)indexes[i];
+			query->order_changed[moved++] = (struct w_query_order_entry){ .key = w_query_order_key_(entry, entity_id), .entity_id = entity_id };
+		}
+	}
+
+	// pull out entries whose key moved, the rest stay sorted in place. Keys
+	// compare bitwise so a NaN key that stays NaN counts as unchanged
+	w_array_ensure_alloc_block_size(query->order_changed, length + moved, W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE);
+	size_t kept = 0;
+	for (size_t i = 0; i < length; ++i)
+	{
+		struct w_query_order_entry order_entry = query->order[i];
+		double key = w_query_order_key_(entry, order_entry.entity_id);
+		if (memcmp(&key, &order_entry.key, sizeof(key)) == 0)
+		{
+			query->order[kept++] = order_entry;
+			continue;
+		}
+		order_entry.key = key;
+		query->order_changed[moved++] = order_entry;
+	}
+	length = kept + moved;
+	query->order_length = length;
+	if (moved == 0)
+	{
+		if (started) query->rebuild_time += w_time_precise() - started;
+		return changed;
+	}
+
+	// merge from the back so the kept entries shift into their final place
+	if (!started) started = w_time_precise();
+	qsort(query->order_changed, moved, sizeof(*query->order_changed), w_query_order_cmp_);
+	size_t k = kept;
+	size_t m = moved;
+	for (size_t out = length; m > 0; --out)
+	{
+		if (k > 0 && w_query_order_before_(query->order_changed[m - 1], query->order[k - 1])) query->order[out - 1] = query->order[--k];
+		else query->order[out - 1] = query->order_changed[--m];
+	}
+	query->rebuild_time += w_time_precise() - started;
+
+	return true;
+}
+
+// word of a bitset regardless of its pages' containers, 0 past its pages
+static inline uint64_t w_query_bitset_word_(const struct w_sparse_bitset *bitset, uint64_t word_index)
+{
+	uint64_t page_index = word_index / bitset->page_size_;
+	if (page_index >= bitset->pages_length) return 0;
+	return w_sparse_bitset_page_word_(&bitset->pages[page_index], (uint32_t)(word_index % bitset->page_size_));
+}
+
+// 64 bits of a bitset starting at index
+static inline uint64_t w_query_bitset_bits_(const struct w_sparse_bitset *bitset, uint64_t index)
+{
+	uint64_t shift = index & 63;
+	uint64_t bits = w_query_bitset_word_(bitset, index >> 6) >> shift;
+	if (shift) bits |= w_query_bitset_word_(bitset, (index >> 6) + 1) << (64 - shift);
+	return bits;
+}
+
+bool w_query_presence_current(struct w_query *query)
+{
+	if (query->presence_rebuilds != w_query_cache_owner(query)->rebuilds + 1) return false;
+
+	for (size_t k = 0; k < query->presence_terms_length; ++k)
+	{
+		struct w_component_entry *entry = query->terms[query->presence_terms[k]].component_entry;
+		if (query->presence_generations[k] != (entry ? entry->data_bitset.generation : 0)) return false;
+	}
+	return true;
+}
+
+// record per owner slice whether all, none or some of its entities have each
+// presence term's component, copying the bits of the mixed slices so the
+// iterator tests a mask instead of looking up the bitset per entity
+static void w_query_presence_sync_(struct w_query *query)
+{
+	struct w_query *owner = w_query_cache_owner(query);
+	size_t terms_length = query->presence_terms_length;
+	size_t dense_length = owner->archetype_slices_dense_length;
+	size_t slices_length = dense_length + owner->archetype_slices_sparse_length;
+
+	w_array_ensure_alloc_block_size(query->presence, slices_length * terms_length, W_QUERY_REGISTRY_PRESENCE_REALLOC_BLOCK_SIZE);
+	w_array_ensure_alloc_block_size(query->presence_generations, terms_length, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE);
+	query->presence_length = slices_length * terms_length;
+	query->presence_generations_length = terms_length;
+	query->presence_masks_length = 0;
+
+	for (size_t k = 0; k < terms_length; ++k)
+	{
+		struct w_component_entry *entry = query->terms[query->presence_terms[k]].component_entry;
+		query->presence_generations[k] = entry ? entry->data_bitset.generation : 0;
+
+		for (size_t i = 0; i < slices_length; ++i)
+		{
+			uint64_t *presence = &query->presence[i * terms_length + k];
+			if (!entry)
+			{
+				*presence = W_QUERY_PRESENCE_NONE;
+				continue;
 			}
 
-			slice->start_id = start_id;
-			slice->slice_length = slice_length;
+			struct w_query_archetype_slice slice = i < dense_length ? owner->archetype_slices_dense[i] : owner->archetype_slices_sparse[i - dense_length];
+			size_t words = (slice.slice_length + 63) / 64;
+			w_array_ensure_alloc_block_size(query->presence_masks, query->presence_masks_length + words, W_QUERY_REGISTRY_PRESENCE_REALLOC_BLOCK_SIZE);
 
-			// if hit max, current element is in emitted slice - next iteration starts fresh
-			// if not contiguous, start new slice from current element
-			if (hit_max)
+			uint64_t *mask = &query->presence_masks[query->presence_masks_length];
+			size_t present = 0;
+			for (size_t w = 0; w < words; ++w)
 			{
-				start_id = W_ENTITY_INVALID;
-				slice_length = 0;
+				uint64_t bits = w_query_bitset_bits_(&entry->data_bitset, (uint64_t)slice.start_id + w * 64);
+				size_t remaining = slice.slice_length - w * 64;
+				if (remaining < 64) bits &= (1ull << remaining) - 1;
+				mask[w] = bits;
+				present += (size_t)__builtin_popcountll(bits);
 			}
+
+			// only mixed slices keep their bits
+			if (present == slice.slice_length) *presence = W_QUERY_PRESENCE_ALL;
+			else if (present == 0) *presence = W_QUERY_PRESENCE_NONE;
 			else
 			{
-				start_id = ids[i];
-				slice_length = 1;
+				*presence = query->presence_masks_length;
+				query->presence_masks_length += words;
 			}
 		}
+	}
 
-		// emit final pending slice if one was being built
-		if (start_id != W_ENTITY_INVALID)
-		{
-			bool dense = (slice_length >= W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE);
+	query->presence_rebuilds = owner->rebuilds + 1;
+}
 
-			struct w_query_archetype_slice *slice;
-			if (dense)
-			{
-				w_array_ensure_alloc_block_size(
-					query->archetype_slices_dense,
-					query->archetype_slices_dense_length + 1,
-					W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE
-				);
+// rebuild an owner query's bitset cache and slices
+static bool w_query_rebuild_slices_(struct w_query_registry *registry, struct w_query *query)
+{
+	// lay out the bitsets to intersect and subtract
+	if (!w_query_plan_(registry, query))
+	{
+		return false;
+	}
 
-				slice = &query->archetype_slices_dense[query->archetype_slices_dense_length++];
-			}
-			else
+	// check if intersection cache is stale
+	if (w_sparse_bitset_intersect_cache_stale(&query->bitset_cache))
+	{
+		// rebuild bitset indexes cache
+		uint64_t started = w_time_precise();
+		struct w_sparse_bitset_intersect_cache *cache = &query->bitset_cache;
+		uint64_t built_generation = cache->cache_generation;
+		if (registry->intersect_threads > 1) w_sparse_bitset_intersect_parallel(cache, registry->intersect_threads);
+		else w_sparse_bitset_intersect(cache);
+
+		// patch the slices over the changed pages when the slices reflect the
+		// previous indexes, otherwise build them from scratch
+		if (cache->incremental && query->bitset_cache_generation == built_generation && cache->dirty_pages_length <= W_QUERY_REGISTRY_SLICE_PATCH_MAX_PAGES)
+		{
+			uint64_t page_bits = cache->dirty_page_size * 64;
+			for (uint64_t d = 0; d < cache->dirty_pages_length; ++d)
 			{
-				w_array_ensure_alloc_block_size(
-					query->archetype_slices_sparse,
-					query->archetype_slices_sparse_length + 1,
-					W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE
-				);
-
-				slice = &query->archetype_slices_sparse[query->archetype_slices_sparse_length++];
+				uint64_t lo = cache->dirty_pages[d] * page_bits;
+				w_query_patch_slices_(&registry->slice_pool, query, lo, lo + page_bits - 1);
 			}
-
-			slice->start_id = start_id;
-			slice->slice_length = slice_length;
 		}
+		else
+		{
+			query->archetype_slices_dense_length = 0;
+			query->archetype_slices_sparse_length = 0;
+			w_query_insert_slices_(&registry->slice_pool, query, 0, 0, 0, 0, cache->indexes, cache->indexes_length);
+		}
+		if (query->sparse_ids_stale) w_query_sparse_ids_sync_(query);
+		query->bitset_cache_generation = cache->cache_generation;
+		query->rebuilds++;
+		query->rebuild_time += w_time_precise() - started;
 
 		return true;
 	}
 
 	return false;
 }
+
+bool w_query_rebuild_cache(struct w_query_registry *registry, struct w_query *query)
+{
+	// instant fail if query isn't fully parsed
+	if (query->query_parse_state != W_QUERY_PARSE_STATE_COMPONENTS_PARSED)
+	{
+		return false;
+	}
+
+	// aliases only keep their own term entries current for the iterator
+	bool built;
+	if (query->cache_owner)
+	{
+		for (size_t i = 0; i < query->terms_length; ++i)
+		{
+			query->terms[i].component_entry = w_component_registry_get_entry(registry->component_registry, query->terms[i].component_id);
+		}
+		built = w_query_rebuild_cache(registry, w_query_cache_owner(query));
+	}
+	else
+	{
+		built = w_query_rebuild_slices_(registry, query);
+	}
+
+	// ordered queries iterate their order, the rest their owner's slices
+	if (query->order_term != W_QUERY_ORDER_NONE)
+	{
+		if (w_query_order_sync_(query)) built = true;
+	}
+	else if (query->presence_terms_length > 0 && !w_query_presence_current(query))
+	{
+		uint64_t started = w_time_precise();
+		w_query_presence_sync_(query);
+		query->rebuild_time += w_time_precise() - started;
+	}
+
+	return built;
+}
+
+// count up to limit matches of a query through its owner's planned bitsets
+static uint64_t w_query_count_(struct w_query_registry *registry, struct w_query *query, uint64_t limit)
+{
+	if (query->query_parse_state != W_QUERY_PARSE_STATE_COMPONENTS_PARSED) return 0;
+
+	struct w_query *owner = w_query_cache_owner(query);
+	if (!w_query_plan_(registry, owner)) return 0;
+
+	return w_sparse_bitset_intersect_count(&owner->bitset_cache, limit);
+}
+
+uint64_t w_query_count(struct w_query_registry *registry, struct w_query *query)
+{
+	return w_query_count_(registry, query, 0);
+}
+
+bool w_query_any(struct w_query_registry *registry, struct w_query *query)
+{
+	return w_query_count_(registry, query, 1) > 0;
+}
+
+bool w_query_registry_get_query_stats(struct w_query_registry *registry, uint64_t query_id, struct w_query_stats *stats)
+{
+	if (query_id >= registry->queries_length) return false;
+
+	struct w_query *query = registry->queries[query_id];
+	struct w_query *owner = w_query_cache_owner(query);
+	memset(stats, 0, sizeof(*stats));
+
+	stats->cache_owner = owner->id;
+	stats->rebuilds = owner->rebuilds;
+	stats->rebuild_time = query->rebuild_time;
+	stats->iterations = atomic_load_explicit(&query->iterations, memory_order_relaxed);
+
+	stats->matches = owner->bitset_cache.indexes_length;
+	stats->dense_slices = owner->archetype_slices_dense_length;
+	stats->sparse_slices = owner->archetype_slices_sparse_length;
+	stats->sparse_entities = owner->sparse_ids_length;
+	stats->dense_entities = stats->matches - stats->sparse_entities;
+
+	// sizes are tracked in bytes
+	stats->bytes = query->terms_size + query->data_terms_size + query->plan_units_size + query->plan_ops_size
+		+ query->archetype_slices_dense_size + query->archetype_slices_sparse_size + query->sparse_ids_size
+		+ query->order_size + query->order_members_size + query->order_changed_size
+		+ query->presence_terms_size + query->presence_size + query->presence_masks_size + query->presence_generations_size
+		+ query->bitset_cache.bitsets_size + query->bitset_cache.indexes_size + query->bitset_cache.generations_size
+		+ query->bitset_cache.dirty_pages_size + query->bitset_cache.expr_size;
+
+	return true;
+}
+
+void w_query_registry_dump_stats(struct w_query_registry *registry, FILE *out)
+{
+	for (uint64_t i = 0; i < registry->queries_length; ++i)
+	{
+		struct w_query_stats stats;
+		w_query_registry_get_query_stats(registry, i, &stats);
+
+		fprintf(out, "query=%" PRIu64 " owner=%" PRIu64 " rebuilds=%" PRIu64 " rebuild_ns=%" PRIu64 " iterations=%" PRIu64
+			" matches=%" PRIu64 " dense_slices=%" PRIu64 " sparse_slices=%" PRIu64 " dense_entities=%" PRIu64 " sparse_entities=%" PRIu64
+			" bytes=%" PRIu64 " ",
+			i, stats.cache_owner, stats.rebuilds, stats.rebuild_time, stats.iterations,
+			stats.matches, stats.dense_slices, stats.sparse_slices, stats.dense_entities, stats.sparse_entities,
+			stats.bytes);
+
+		struct w_query *query = registry->queries[i];
+		char *raw_query = query->raw_query != W_STRING_TABLE_INVALID_ID ? w_string_table_lookup(registry->string_table, query->raw_query) : NULL;
+		if (raw_query)
+		{
+			fprintf(out, "\"%s\"\n", raw_query);
+			continue;
+		}
+
+		static const char *access_names[] = {"none", "read", "write", "optional", "has", "not", "order_by"};
+		fputs("\"", out);
+		for (size_t t = 0; t < query->terms_length; ++t)
+		{
+			fprintf(out, "%s%s %u", t ? ", " : "", access_names[query->terms[t].access_type], (unsigned)query->terms[t].component_id);
+		}
+		fputs("\"\n", out);
+	}
+}
+
+uint64_t w_query_any_mask(struct w_query *query, uint32_t any_group, w_entity_id entity_id)
+{
+	uint64_t mask = 0;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		struct w_query_term *term = &query->terms[i];
+		if (term->any_group != any_group || !term->component_entry) continue;
+
+		mask |= (uint64_t)w_sparse_bitset_get(&term->component_entry->data_bitset, entity_id) << term->any_alternative;
+	}
+	return mask;
+}
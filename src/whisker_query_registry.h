@@ -19,13 +19,28 @@
 #define W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE 1024
 #endif /* ifndef W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE */
 
+// queries are allocated this many at a time in blocks that never move
+#ifndef W_QUERY_REGISTRY_QUERY_BLOCK_SIZE
+#define W_QUERY_REGISTRY_QUERY_BLOCK_SIZE 64
+#endif /* ifndef W_QUERY_REGISTRY_QUERY_BLOCK_SIZE */
+
+#ifndef W_QUERY_REGISTRY_SITE_QUERIES_REALLOC_BLOCK_SIZE
+#define W_QUERY_REGISTRY_SITE_QUERIES_REALLOC_BLOCK_SIZE 64
+#endif /* ifndef W_QUERY_REGISTRY_SITE_QUERIES_REALLOC_BLOCK_SIZE */
+
+// query term arrays are allocated on the first term and grow by this much
 #ifndef W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE
-#define W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE 1024
+#define W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE 8
 #endif /* ifndef W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE */
 
-#ifndef W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE
-#define W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE 8196
-#endif /* ifndef W_QUERY_REGISTRY_QUERY_SLICES_REALLOC_BLOCK_SIZE */
+// slice arrays are pooled buffers with power of two capacities starting at
+// this many slices, allocated on the first match
+#ifndef W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY
+#define W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY 16
+#endif /* ifndef W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY */
+
+// number of slice pool capacity classes
+#define W_QUERY_REGISTRY_SLICE_POOL_CLASSES 40
 
 #ifndef W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE
 #define W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE 16
@@ -35,6 +50,69 @@
 #define W_QUERY_REGISTRY_ARCHETYPE_SLICES_MAX_SLICE 1024
 #endif /* ifndef W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE */
 
+// packed sparse slice entity IDs grow by this many entries
+#ifndef W_QUERY_REGISTRY_SPARSE_IDS_REALLOC_BLOCK_SIZE
+#define W_QUERY_REGISTRY_SPARSE_IDS_REALLOC_BLOCK_SIZE 256
+#endif /* ifndef W_QUERY_REGISTRY_SPARSE_IDS_REALLOC_BLOCK_SIZE */
+
+// incremental rebuilds patch the slices of up to this many changed pages in
+// place, past it the slices are rebuilt in full
+#ifndef W_QUERY_REGISTRY_SLICE_PATCH_MAX_PAGES
+#define W_QUERY_REGISTRY_SLICE_PATCH_MAX_PAGES 32
+#endif /* ifndef W_QUERY_REGISTRY_SLICE_PATCH_MAX_PAGES */
+
+// default threads a full rebuild of a query's matches is intersected on, 1
+// keeps rebuilds on the calling thread
+#ifndef W_QUERY_REGISTRY_INTERSECT_THREADS
+#define W_QUERY_REGISTRY_INTERSECT_THREADS 1
+#endif /* ifndef W_QUERY_REGISTRY_INTERSECT_THREADS */
+
+// a single any() group with more alternatives than this fails to parse, the
+// matched alternatives are reported as a 64 bit mask
+#ifndef W_QUERY_ANY_MAX_ALTERNATIVES
+#define W_QUERY_ANY_MAX_ALTERNATIVES 64
+#endif /* ifndef W_QUERY_ANY_MAX_ALTERNATIVES */
+
+// the planner keeps its operand order until the leading operand grows past
+// this many times the smallest one
+#ifndef W_QUERY_PLANNER_REORDER_RATIO
+#define W_QUERY_PLANNER_REORDER_RATIO 2
+#endif /* ifndef W_QUERY_PLANNER_REORDER_RATIO */
+
+// the planner probes the smallest operand against the others when the next
+// smallest is at least this many times larger
+#ifndef W_QUERY_PLANNER_PROBE_RATIO
+#define W_QUERY_PLANNER_PROBE_RATIO 64
+#endif /* ifndef W_QUERY_PLANNER_PROBE_RATIO */
+
+// any_group of terms outside of an any() group
+#define W_QUERY_ANY_GROUP_NONE UINT32_MAX
+
+// order_term of queries iterating in entity ID order
+#define W_QUERY_ORDER_NONE SIZE_MAX
+
+// order arrays grow by this many entries
+#ifndef W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE
+#define W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE 1024
+#endif /* ifndef W_QUERY_REGISTRY_ORDER_REALLOC_BLOCK_SIZE */
+
+// presence_term of required terms, the iterator's data for them is always
+// there
+#define W_QUERY_PRESENCE_TERM_NONE UINT32_MAX
+
+// slice presence states of an optional term, any other value is the offset
+// of the slice's presence bits in presence_masks
+#define W_QUERY_PRESENCE_ALL UINT64_MAX
+#define W_QUERY_PRESENCE_NONE (UINT64_MAX - 1)
+
+// presence arrays grow by this many entries
+#ifndef W_QUERY_REGISTRY_PRESENCE_REALLOC_BLOCK_SIZE
+#define W_QUERY_REGISTRY_PRESENCE_REALLOC_BLOCK_SIZE 64
+#endif /* ifndef W_QUERY_REGISTRY_PRESENCE_REALLOC_BLOCK_SIZE */
+
+// query index of a call site slot that hasn't resolved a query yet
+#define W_QUERY_ID_NONE UINT64_MAX
+
 // each query term has a specific access
 enum W_QUERY_ACCESS
 {
@@ -42,6 +120,30 @@ enum W_QUERY_ACCESS
 	W_QUERY_ACCESS_READ,
 	W_QUERY_ACCESS_WRITE,
 	W_QUERY_ACCESS_OPTIONAL,
+
+	// filters without data access: has X must be present, not/without X
+	// must be absent
+	W_QUERY_ACCESS_HAS,
+	W_QUERY_ACCESS_NOT,
+
+	// order_by X must be present and iteration follows its value
+	W_QUERY_ACCESS_ORDER_BY,
+};
+
+// how the planner evaluates a query's bitsets
+enum W_QUERY_PLAN_KERNEL
+{
+	W_QUERY_PLAN_KERNEL_NONE,
+	// a single bitset, its set bits are the result
+	W_QUERY_PLAN_KERNEL_SCAN,
+	// 2-way page intersect
+	W_QUERY_PLAN_KERNEL_PAIR,
+	// n-way page intersect
+	W_QUERY_PLAN_KERNEL_NWAY,
+	// page-wise expression, for any() groups and exclusions
+	W_QUERY_PLAN_KERNEL_EXPR,
+	// walk the smallest operand probing the others
+	W_QUERY_PLAN_KERNEL_PROBE,
 };
 
 // query parse state
@@ -65,6 +167,10 @@ struct w_query_archetype_slice
 // "read component_a"
 // "write component_a"
 // "optional component_a"
+// "has component_a"
+// "not component_a" (or "without component_a")
+// "order_by component_a" (has component_a, iterated by its value)
+// "any(read component_a | has component_b)" (one term per alternative)
 // etc...
 
 struct w_query_term 
@@ -74,6 +180,22 @@ struct w_query_term
 	w_string_table_id component_name;
 	struct w_component_entry *component_entry;
 	enum W_QUERY_ACCESS access_type;
+
+	// any() group the term is an alternative of, and its position in it
+	uint32_t any_group;
+	uint32_t any_alternative;
+
+	// index into the query's presence terms for optional terms and any()
+	// alternatives, W_QUERY_PRESENCE_TERM_NONE for the rest
+	uint32_t presence_term;
+};
+
+// an ordered entity and the key it's sorted by, the leading scalar of the
+// order term's component value
+struct w_query_order_entry
+{
+	double key;
+	w_entity_id entity_id;
 };
 
 // valid query examples, each one is a term:
@@ -81,12 +203,18 @@ struct w_query_term
 // "read component_a, read component_b"
 // "write component_a, write component_b"
 // "write component_a,write component_b" note: missing white space
+// "read component_a, any(read component_b | read component_c)" note: a and (b or c)
+// "read component_a, order_by component_b" note: iterated by ascending b, NaN keys last
 // INVALID: "write component_a write component_b" note: missing comma
+// INVALID: "order_by component_a" note: when a is not a built-in component type
 // etc...
 
 // main query struct
 struct w_query 
 {
+	// index in the registry's queries
+	uint64_t id;
+
 	// raw query string
 	w_string_table_id raw_query;
 	enum W_QUERY_PARSE_STATE query_parse_state;
@@ -94,13 +222,130 @@ struct w_query
 	// parts making up the full query
 	w_array_declare(struct w_query_term, terms);
 
+	// indexes of the terms with data access (read/write/optional) in query
+	// order, these are the terms w_itor_get steps through
+	w_array_declare(size_t, data_terms);
+
+	// number of any() groups in the query
+	uint32_t any_groups_length;
+
+	// planned operand order, a term index for required terms and
+	// terms_length + group for any() groups, smallest estimate first
+	w_array_declare(size_t, plan_units);
+	// scratch expression ops the plan is laid out into
+	w_array_declare(struct w_sparse_bitset_expr_op, plan_ops);
+	enum W_QUERY_PLAN_KERNEL plan_kernel;
+
 	// cache of entity IDs passing the bitset intersect + array of bitsets
+	// required (read/write/has) bitsets are intersected along with the union
+	// of each any() group, then not/without bitsets are subtracted, ordered
+	// by the planner independent of the written term order
 	struct w_sparse_bitset_intersect_cache bitset_cache;
+	// bitset cache generation the archetype slices were built from
 	uint64_t bitset_cache_generation;
+	// number of times the cache and slices were rebuilt
+	uint64_t rebuilds;
 
 	// query archetype slice cache
 	w_array_declare(struct w_query_archetype_slice, archetype_slices_dense);
 	w_array_declare(struct w_query_archetype_slice, archetype_slices_sparse);
+	// entity IDs of the sparse slices packed in slice order, iterators walk
+	// them in batches so the next batch's rows can be fetched ahead
+	w_array_declare(w_entity_id, sparse_ids);
+	// set when the sparse slices changed since sparse_ids was packed
+	bool sparse_ids_stale;
+
+	// canonical signature of the terms that filter entities, queries with
+	// the same signature share the first one's bitset cache and slices
+	w_string_table_id signature;
+	// query owning the cache, NULL for owners
+	struct w_query *cache_owner;
+
+	// order_by term, W_QUERY_ORDER_NONE when iterating in entity ID order
+	size_t order_term;
+	// matched entities sorted by key then entity ID, synced on rebuild by
+	// merging in the entries that joined or whose key changed
+	w_array_declare(struct w_query_order_entry, order);
+	// bit per entity ID, set while the entity is in the order
+	w_array_declare(uint64_t, order_members);
+	// scratch for the entries being re-placed
+	w_array_declare(struct w_query_order_entry, order_changed);
+	// owner rebuild count the order's members were last synced at
+	uint64_t order_generation;
+
+	// optional and any() data terms, the ones that may be absent per entity
+	w_array_declare(size_t, presence_terms);
+	// per owner slice (dense then sparse) and presence term, whether the
+	// slice's entities have the term's component: W_QUERY_PRESENCE_ALL,
+	// W_QUERY_PRESENCE_NONE or the offset of its bits in presence_masks
+	w_array_declare(uint64_t, presence);
+	// a bit per entity of each mixed slice, from the slice's first entity
+	w_array_declare(uint64_t, presence_masks);
+	// presence terms' component bitset generations the presence was built at
+	w_array_declare(uint64_t, presence_generations);
+	// owner rebuild count the presence was built at plus one, 0 until built
+	uint64_t presence_rebuilds;
+
+	// nanoseconds spent rebuilding the query's own slices, order or presence
+	// (an alias' time leaves out its owner's rebuilds), and the number of
+	// times the query was iterated (iterators and chunk iterators begun)
+	uint64_t rebuild_time;
+	_Atomic uint64_t iterations;
+};
+
+// statistics of a query, cache figures are the owner's for aliases while
+// rebuild_time and iterations are the query's own
+struct w_query_stats
+{
+	// index of the query owning the cache, the query's own index if it isn't
+	// an alias
+	uint64_t cache_owner;
+
+	uint64_t rebuilds;
+	uint64_t rebuild_time;
+	uint64_t iterations;
+
+	// matched entities, split by the slices they fall in
+	uint64_t matches;
+	uint64_t dense_slices;
+	uint64_t sparse_slices;
+	uint64_t dense_entities;
+	uint64_t sparse_entities;
+
+	// bytes allocated by the query's own arrays and bitset cache
+	uint64_t bytes;
+};
+
+// query holding the bitset cache and slices the query iterates
+static inline struct w_query *w_query_cache_owner(struct w_query *query)
+{
+	return query->cache_owner ? query->cache_owner : query;
+}
+
+// whether the entity offset into a slice has an optional term's component,
+// from the term's presence in the slice
+static inline bool w_query_presence_test(const struct w_query *query, uint64_t presence, size_t offset)
+{
+	if (presence == W_QUERY_PRESENCE_ALL) return true;
+	if (presence == W_QUERY_PRESENCE_NONE) return false;
+	return (query->presence_masks[presence + offset / 64] >> (offset % 64)) & 1;
+}
+
+// free list of released slice buffers of one capacity, linked through the
+// first slice of each buffer
+struct w_query_slice_pool_list
+{
+	struct w_query_archetype_slice *head;
+	size_t length;
+};
+
+// slice buffer pool shared by a registry's queries, buffers move between
+// queries as their match counts grow and shrink
+// (note: buffers come from the arena and stay owned by it)
+struct w_query_slice_pool
+{
+	struct w_arena *arena;
+	struct w_query_slice_pool_list lists[W_QUERY_REGISTRY_SLICE_POOL_CLASSES];
 };
 
 // declare a hashmap for the string query to ID map
@@ -114,11 +359,27 @@ struct w_query_registry
 	// component registry to get component IDs
 	struct w_component_registry *component_registry;	
 
-	// array of queries
-	w_array_declare(struct w_query, queries);
+	// queries by index, they live in blocks that never move so query
+	// pointers stay valid as the registry grows
+	w_array_declare(struct w_query *, queries);
+	w_array_declare(struct w_query *, query_blocks);
 
 	// query string hashmap to local query index
 	struct w_query_map query_map;
+
+	// canonical query signature to the index of the query owning the cache
+	struct w_query_map signature_map;
+
+	// backing storage for the queries' slice arrays
+	struct w_query_slice_pool slice_pool;
+
+	// call site slot to query index + 1, 0 while the site hasn't resolved a
+	// query in this registry
+	w_array_declare(uint64_t, site_queries);
+
+	// threads full rebuilds intersect on, incremental ones stay on the
+	// calling thread
+	uint32_t intersect_threads;
 };
 
 
@@ -131,8 +392,77 @@ void w_query_registry_free(struct w_query_registry *registry);
 // pass in a query string, get a parsed query struct back
 struct w_query *w_query_registry_get_query(struct w_query_registry *registry, char *query_string);
 
+// add a query from resolved component IDs and access types, skipping the
+// string parse, returns the query's index in the queries array
+// (note: these queries are not in the query map, callers keep the index)
+uint64_t w_query_registry_add_query(struct w_query_registry *registry, const w_entity_id *component_ids, const enum W_QUERY_ACCESS *access_types, size_t terms_length);
+
+// get a slice buffer holding at least capacity slices, capacity is updated
+// to the buffer's full capacity
+struct w_query_archetype_slice *w_query_slice_pool_acquire(struct w_query_slice_pool *pool, size_t *capacity);
+// return a slice buffer of the given capacity to the pool
+void w_query_slice_pool_release(struct w_query_slice_pool *pool, struct w_query_archetype_slice *slices, size_t capacity);
+
+// hand out a call site slot, slots are shared by every registry in the
+// process and start at 1
+uint32_t w_query_registry_next_site(void);
+
+// query index a call site slot resolved to, W_QUERY_ID_NONE if unresolved
+static inline uint64_t w_query_registry_site_query_id(struct w_query_registry *registry, uint32_t site)
+{
+	return (site < registry->site_queries_length) ? registry->site_queries[site] - 1 : W_QUERY_ID_NONE;
+}
+
+// record the query index a call site slot resolved to
+void w_query_registry_set_site_query_id(struct w_query_registry *registry, uint32_t site, uint64_t query_id);
+
+// get a query by call site slot, falling back to the query string lookup the
+// first time the site runs against this registry
+struct w_query *w_query_registry_get_site_query(struct w_query_registry *registry, uint32_t site, char *query_string);
+
 // rebuild the query cache, returns true if built false if no change
+// (note: aliases rebuild their owner's cache, iterators read the owner's
+// slices and the alias' own terms. Ordered queries also re-read their keys
+// and return true when the order changed, queries with optional terms
+// rebuild their slice presence)
 bool w_query_rebuild_cache(struct w_query_registry *registry, struct w_query *query);
 
+// true when the query's slice presence matches its owner's slices and the
+// optional components, iterators fall back to bitset lookups otherwise
+bool w_query_presence_current(struct w_query *query);
+
+// number of entities matching the query, answered by a current cache or
+// counted without building indexes or slices
+uint64_t w_query_count(struct w_query_registry *registry, struct w_query *query);
+
+// true when at least one entity matches the query, stops at the first match
+bool w_query_any(struct w_query_registry *registry, struct w_query *query);
+
+// get the stats of a query by index, false if it doesn't exist
+bool w_query_registry_get_query_stats(struct w_query_registry *registry, uint64_t query_id, struct w_query_stats *stats);
+
+// write one line of stats per query as key=value pairs followed by the
+// query string, typed queries show their component IDs instead
+void w_query_registry_dump_stats(struct w_query_registry *registry, FILE *out);
+
+// mask of the alternatives of the query's any() group the entity has, bit k
+// is set when it has the k'th alternative's component
+uint64_t w_query_any_mask(struct w_query *query, uint32_t any_group, w_entity_id entity_id);
+
+// w_query_any_mask from a slice's presence, offset is the entity's from the
+// slice's first entity
+static inline uint64_t w_query_any_mask_presence(const struct w_query *query, uint32_t any_group, const uint64_t *slice_presence, size_t offset)
+{
+	uint64_t mask = 0;
+	for (size_t i = 0; i < query->terms_length; ++i)
+	{
+		const struct w_query_term *term = &query->terms[i];
+		if (term->any_group != any_group || !term->component_entry) continue;
+
+		mask |= (uint64_t)w_query_presence_test(query, slice_presence[term->presence_term], offset) << term->any_alternative;
+	}
+	return mask;
+}
+
 #endif /* WHISKER_QUERY_REGISTRY_H */
 
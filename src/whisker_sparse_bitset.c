@@ -8,29 +8,206 @@
 
 #include "whisker_sparse_bitset.h"
 
+#include <pthread.h>
+
 #if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
 #include <immintrin.h>
 #endif
 
+// container size limits for a page of s words
+#define W_SPARSE_BITSET_PAGE_BITS_(s) ((s) * 64)
+#define W_SPARSE_BITSET_ARRAY_MAX_(s) ((s) * W_SPARSE_BITSET_ARRAY_MAX_PER_WORD)
+#define W_SPARSE_BITSET_ARRAY_MIN_(s) ((s) * W_SPARSE_BITSET_ARRAY_MAX_PER_WORD / 2)
+#define W_SPARSE_BITSET_RUN_MAX_(s) ((s) * W_SPARSE_BITSET_RUN_MAX_PER_WORD)
+
 void w_sparse_bitset_init(struct w_sparse_bitset *bitset, struct w_arena *arena, uint64_t page_size_)
+{
+	w_sparse_bitset_init_ex(bitset, arena, page_size_, 0);
+}
+
+void w_sparse_bitset_init_ex(struct w_sparse_bitset *bitset, struct w_arena *arena, uint64_t page_size_, uint32_t flags)
 {
 	bitset->page_size_ = page_size_;
 	bitset->arena = arena;
+	bitset->generation = 0;
+	bitset->cardinality = 0;
+	bitset->pool = NULL;
+
+	bitset->changes = NULL;
+	bitset->changes_head = 0;
+	bitset->changes_length = 0;
+	bitset->changes_floor = 0;
+
+	// 16-bit container offsets can't address bits in larger pages, and slab
+	// pages are always bitmaps
+	if (page_size_ > W_SPARSE_BITSET_ADAPTIVE_MAX_PAGE_SIZE_WORDS || (flags & W_SPARSE_BITSET_FLAG_SLAB)) flags &= ~W_SPARSE_BITSET_FLAG_ADAPTIVE;
+	bitset->flags = flags;
+
+	bitset->slab = NULL;
+	bitset->page_slots = NULL;
+	bitset->free_slots = NULL;
+	bitset->slab_size = 0;
+	bitset->page_slots_size = 0;
+	bitset->free_slots_size = 0;
+	bitset->slab_length = 0;
+	bitset->page_slots_length = 0;
+	bitset->free_slots_length = 0;
+	bitset->slab_slots = 0;
 
 	w_array_init_t(bitset->pages, 0);
 	bitset->pages_length = 0;
 
 	w_array_init_t(bitset->lookup_pages, 0);
 	bitset->lookup_pages_length = 0;
+
+	w_array_init_t(bitset->summary, 0);
+	bitset->summary_length = 0;
 }
 
 void w_sparse_bitset_free(struct w_sparse_bitset *bitset)
 {
+	for (uint64_t i = 0; i < bitset->pages_length; i++)
+	{
+		free_null(bitset->pages[i].values);
+		if (bitset->pool && !bitset->slab && bitset->pages[i].bits) w_sparse_bitset_page_pool_release(bitset->pool, bitset->page_size_, bitset->pages[i].bits);
+	}
 	free_null(bitset->pages);
+	free_null(bitset->slab);
+	free_null(bitset->page_slots);
+	free_null(bitset->free_slots);
+	bitset->slab_slots = 0;
+	bitset->free_slots_length = 0;
 	free_null(bitset->lookup_pages);
+	free_null(bitset->summary);
+	bitset->summary_length = 0;
+	free_null(bitset->changes);
+	bitset->changes_head = 0;
+	bitset->changes_length = 0;
 	bitset->arena = NULL;
 	bitset->pages_length = 0;
 	bitset->lookup_pages_length = 0;
+	bitset->cardinality = 0;
+}
+
+/*
+ * page pool
+ */
+
+void w_sparse_bitset_page_pool_init(struct w_sparse_bitset_page_pool *pool, struct w_arena *arena)
+{
+	pool->arena = arena;
+	w_array_init_t(pool->lists, 0);
+	pool->lists_length = 0;
+}
+
+void w_sparse_bitset_page_pool_free(struct w_sparse_bitset_page_pool *pool)
+{
+	free_null(pool->lists);
+	pool->lists_length = 0;
+	pool->arena = NULL;
+}
+
+// find the free list for a page size, optionally creating it
+static struct w_sparse_bitset_page_pool_list *w_sparse_bitset_page_pool_list_(struct w_sparse_bitset_page_pool *pool, uint64_t page_size, bool create)
+{
+	for (uint64_t i = 0; i < pool->lists_length; i++)
+	{
+		if (pool->lists[i].page_size == page_size) return &pool->lists[i];
+	}
+	if (!create) return NULL;
+
+	w_array_ensure_alloc_block_size(pool->lists, pool->lists_length + 1, 4);
+	struct w_sparse_bitset_page_pool_list *list = &pool->lists[pool->lists_length++];
+	*list = (struct w_sparse_bitset_page_pool_list){ .page_size = page_size };
+	return list;
+}
+
+uint64_t *w_sparse_bitset_page_pool_acquire(struct w_sparse_bitset_page_pool *pool, uint64_t page_size)
+{
+	struct w_sparse_bitset_page_pool_list *list = w_sparse_bitset_page_pool_list_(pool, page_size, false);
+	if (!list || !list->head) return w_arena_calloc(pool->arena, page_size * sizeof(uint64_t));
+
+	uint64_t *bits = list->head;
+	list->head = (uint64_t *)(uintptr_t)bits[0];
+	list->length--;
+	memset(bits, 0, page_size * sizeof(*bits));
+	return bits;
+}
+
+void w_sparse_bitset_page_pool_release(struct w_sparse_bitset_page_pool *pool, uint64_t page_size, uint64_t *bits)
+{
+	struct w_sparse_bitset_page_pool_list *list = w_sparse_bitset_page_pool_list_(pool, page_size, true);
+	bits[0] = (uint64_t)(uintptr_t)list->head;
+	list->head = bits;
+	list->length++;
+}
+
+/*
+ * page slab
+ *
+ * slab bitsets keep all page words in one buffer of page sized slots. page
+ * bits pointers point into the slab and are rebased whenever it moves.
+ */
+
+static uint64_t *w_sparse_bitset_slab_alloc_(struct w_sparse_bitset *bitset, uint64_t page_index)
+{
+	uint64_t page_size = bitset->page_size_;
+	uint32_t slot;
+
+	if (bitset->free_slots_length)
+	{
+		slot = bitset->free_slots[--bitset->free_slots_length];
+		memset(&bitset->slab[(uint64_t)slot * page_size], 0, page_size * sizeof(*bitset->slab));
+	}
+	else
+	{
+		// grow the slab, new slots come zeroed
+		uint64_t *prev = bitset->slab;
+		slot = bitset->slab_slots++;
+		w_array_ensure_alloc_block_size(bitset->slab, (uint64_t)bitset->slab_slots * page_size, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE * page_size);
+
+		if (prev && prev != bitset->slab)
+		{
+			for (uint64_t i = 0; i < bitset->pages_length; i++)
+			{
+				uint32_t s = bitset->page_slots[i];
+				if (s) bitset->pages[i].bits = &bitset->slab[(uint64_t)(s - 1) * page_size];
+			}
+		}
+	}
+
+	bitset->page_slots[page_index] = slot + 1;
+	return &bitset->slab[(uint64_t)slot * page_size];
+}
+
+static inline uint64_t *w_sparse_bitset_alloc_words_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	if (bitset->flags & W_SPARSE_BITSET_FLAG_SLAB) return w_sparse_bitset_slab_alloc_(bitset, (uint64_t)(page - bitset->pages));
+	if (bitset->pool) return w_sparse_bitset_page_pool_acquire(bitset->pool, bitset->page_size_);
+	return w_arena_calloc(bitset->arena, bitset->page_size_ * sizeof(uint64_t));
+}
+
+// hand the words of an emptied page back to the slab or pool
+static inline void w_sparse_bitset_page_recycle_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	if (!page->bits) return;
+
+	if (bitset->flags & W_SPARSE_BITSET_FLAG_SLAB)
+	{
+		uint64_t page_index = (uint64_t)(page - bitset->pages);
+		w_array_ensure_alloc_block_size(bitset->free_slots, bitset->free_slots_length + 1, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+		bitset->free_slots[bitset->free_slots_length++] = bitset->page_slots[page_index] - 1;
+		bitset->page_slots[page_index] = 0;
+	}
+	else if (bitset->pool)
+	{
+		w_sparse_bitset_page_pool_release(bitset->pool, bitset->page_size_, page->bits);
+	}
+	else
+	{
+		return;
+	}
+	page->bits = NULL;
 }
 
 static inline void w_sparse_bitset_ensure_capacity_(struct w_sparse_bitset *bitset, uint64_t index)
@@ -39,7 +216,7 @@ static inline void w_sparse_bitset_ensure_capacity_(struct w_sparse_bitset *bits
 	uint64_t word_index = w_sparse_bitset_word_index(index);
 	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
 	uint64_t page_lookup_index = w_sparse_bitset_page_index(page_index, W_SPARSE_BITSET_WORD_BITS);
-	
+
 	// ensure pages and lookup pages capacity
 	w_array_ensure_alloc_block_size(
 			bitset->pages,
@@ -50,12 +227,17 @@ static inline void w_sparse_bitset_ensure_capacity_(struct w_sparse_bitset *bits
 	{
 		for (uint64_t i = bitset->pages_length; i <= page_index; i++)
 		{
-			bitset->pages[i].bits = NULL;
-			bitset->pages[i].first_set = UINT32_MAX;
-			bitset->pages[i].last_set = 0;
+			bitset->pages[i] = (struct w_sparse_bitset_page){
+				.first_set = UINT32_MAX,
+				.container = W_SPARSE_BITSET_CONTAINER_BITMAP,
+			};
 		}
 		bitset->pages_length = page_index + 1;
 	}
+	if (bitset->flags & W_SPARSE_BITSET_FLAG_SLAB)
+	{
+		w_array_ensure_alloc_block_size(bitset->page_slots, page_index + 1, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+	}
 
 	w_array_ensure_alloc_block_size(
 			bitset->lookup_pages,
@@ -70,483 +252,2840 @@ static inline void w_sparse_bitset_ensure_capacity_(struct w_sparse_bitset *bits
 		}
 		bitset->lookup_pages_length = page_lookup_index + 1;
 	}
+
+	uint64_t summary_index = w_sparse_bitset_page_index(page_lookup_index, W_SPARSE_BITSET_WORD_BITS);
+	w_array_ensure_alloc_block_size(bitset->summary, summary_index + 1, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+	if (summary_index + 1 > bitset->summary_length)
+	{
+		for (uint64_t i = bitset->summary_length; i <= summary_index; i++)
+		{
+			bitset->summary[i] = 0;
+		}
+		bitset->summary_length = summary_index + 1;
+	}
 }
 
-void w_sparse_bitset_set(struct w_sparse_bitset *bitset, uint64_t index)
+// mark a page as holding bits in the lookup pages and summary
+static inline void w_sparse_bitset_lookup_set_(struct w_sparse_bitset *bitset, uint64_t page_index)
 {
-	// get indexes
-	uint64_t word_index = w_sparse_bitset_word_index(index);
-	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
 	uint64_t page_lookup_index = w_sparse_bitset_page_index(page_index, W_SPARSE_BITSET_WORD_BITS);
+	bitset->lookup_pages[page_lookup_index] |= w_sparse_bitset_bit_mask(page_index);
+	bitset->summary[page_lookup_index >> 6] |= w_sparse_bitset_bit_mask(page_lookup_index);
+}
 
-	w_sparse_bitset_ensure_capacity_(bitset, index);
+// mark a page as empty, dropping the summary bit with the last page of its lookup word
+static inline void w_sparse_bitset_lookup_clear_(struct w_sparse_bitset *bitset, uint64_t page_index)
+{
+	uint64_t page_lookup_index = w_sparse_bitset_page_index(page_index, W_SPARSE_BITSET_WORD_BITS);
+	bitset->lookup_pages[page_lookup_index] &= w_sparse_bitset_bit_clear_mask(page_index);
+	if (!bitset->lookup_pages[page_lookup_index])
+	{
+		bitset->summary[page_lookup_index >> 6] &= w_sparse_bitset_bit_clear_mask(page_lookup_index);
+	}
+}
 
-	// proceed to set bits
-	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
-	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+// next lookup word index >= li holding any pages, UINT64_MAX when none
+static inline uint64_t w_sparse_bitset_next_lookup_(struct w_sparse_bitset *bitset, uint64_t li)
+{
+	for (uint64_t si = li >> 6; si < bitset->summary_length; si++)
+	{
+		uint64_t sword = bitset->summary[si];
+		if (si == (li >> 6)) sword &= ~0ULL << (li & 63);
+		if (sword) return si * 64 + (uint64_t)__builtin_ctzll(sword);
+	}
+	return UINT64_MAX;
+}
 
-	// allocate page if page is fresh
-	if (!page->bits)
+// previous lookup word index <= li holding any pages, UINT64_MAX when none
+static inline uint64_t w_sparse_bitset_prev_lookup_(struct w_sparse_bitset *bitset, uint64_t li)
+{
+	if (bitset->summary_length == 0) return UINT64_MAX;
+	if ((li >> 6) >= bitset->summary_length) li = bitset->summary_length * 64 - 1;
+
+	for (uint64_t si = (li >> 6) + 1; si-- > 0; )
 	{
-		page->bits = w_arena_calloc(bitset->arena, bitset->page_size_ * sizeof(*page->bits));
+		uint64_t sword = bitset->summary[si];
+		if (si == (li >> 6)) sword &= ~0ULL >> (63 - (li & 63));
+		if (sword) return si * 64 + 63 - (uint64_t)__builtin_clzll(sword);
 	}
+	return UINT64_MAX;
+}
+
+// bump the generation and record the changed range in the change log
+static inline void w_sparse_bitset_log_change_(struct w_sparse_bitset *bitset, uint64_t lo, uint64_t hi)
+{
+	uint64_t generation = ++bitset->generation;
+	if (!bitset->changes) return;
 
-	// set actual bits
-	page->bits[local_word] |= w_sparse_bitset_bit_mask(index);
+	// extend the newest entry when the change touches or overlaps it
+	if (bitset->changes_length)
+	{
+		uint32_t newest = (bitset->changes_head + W_SPARSE_BITSET_CHANGE_LOG_SIZE - 1) % W_SPARSE_BITSET_CHANGE_LOG_SIZE;
+		struct w_sparse_bitset_change *change = &bitset->changes[newest];
+		if (hi + 1 >= change->lo && lo <= change->hi + 1)
+		{
+			if (lo < change->lo) change->lo = lo;
+			if (hi > change->hi) change->hi = hi;
+			change->generation = generation;
+			return;
+		}
+	}
 
-	// update page metadata
-	if (local_word < page->first_set) page->first_set = local_word;
-	if (local_word > page->last_set) page->last_set = local_word;
+	// once the ring is full, changes up to the overwritten entry are lost
+	struct w_sparse_bitset_change *change = &bitset->changes[bitset->changes_head];
+	if (bitset->changes_length == W_SPARSE_BITSET_CHANGE_LOG_SIZE) bitset->changes_floor = change->generation;
+	else bitset->changes_length++;
 
-	// set lookup bit
-	bitset->lookup_pages[page_lookup_index] |= w_sparse_bitset_bit_mask(page_index);
+	*change = (struct w_sparse_bitset_change){ .generation = generation, .lo = lo, .hi = hi };
+	bitset->changes_head = (bitset->changes_head + 1) % W_SPARSE_BITSET_CHANGE_LOG_SIZE;
 }
 
-void w_sparse_bitset_clear(struct w_sparse_bitset *bitset, uint64_t index)
+// start recording changes, everything before the current generation is
+// considered outside of the log
+static void w_sparse_bitset_track_changes_(struct w_sparse_bitset *bitset)
 {
-	uint64_t word_index = w_sparse_bitset_word_index(index);
-	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
+	if (bitset->changes) return;
 
-	// early out
-	if (page_index >= bitset->pages_length) return;
+	bitset->changes = w_mem_xcalloc_t(W_SPARSE_BITSET_CHANGE_LOG_SIZE, *bitset->changes);
+	bitset->changes_head = 0;
+	bitset->changes_length = 0;
+	bitset->changes_floor = bitset->generation;
+}
 
-	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+/*
+ * page containers
+ *
+ * adaptive pages start as sorted offset arrays, convert to bitmaps once they
+ * hold more than W_SPARSE_BITSET_ARRAY_MAX_PER_WORD offsets per page word, and
+ * back to arrays once they drop to half of that. a page with every bit set
+ * becomes a single run. bitmap words released by a conversion stay attached
+ * to the page and are reused when it converts back.
+ */
 
-	if (!page->bits) return;
+static inline void w_sparse_bitset_page_reserve_values_(struct w_sparse_bitset_page *page, uint32_t length)
+{
+	if (length <= page->values_capacity) return;
 
-	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
-	page->bits[local_word] &= w_sparse_bitset_bit_clear_mask(index);
+	uint32_t capacity = page->values_capacity ? page->values_capacity * 2 : 8;
+	while (capacity < length) capacity *= 2;
 
-	// clear lookup bit if page is empty
-	bool page_empty = true;
-	for (uint32_t i = page->first_set; i <= page->last_set; i++)
-	{
-		if (page->bits[i]) { page_empty = false; break; }
-	}
-	if (page_empty)
+	page->values = w_mem_xrealloc(page->values, capacity * sizeof(*page->values));
+	page->values_capacity = capacity;
+}
+
+static inline void w_sparse_bitset_page_release_values_(struct w_sparse_bitset_page *page)
+{
+	free_null(page->values);
+	page->values_length = 0;
+	page->values_capacity = 0;
+}
+
+static inline void w_sparse_bitset_page_values_bounds_(struct w_sparse_bitset_page *page)
+{
+	if (page->values_length == 0)
 	{
-		uint64_t page_lookup_index = w_sparse_bitset_page_index(page_index, W_SPARSE_BITSET_WORD_BITS);
-		bitset->lookup_pages[page_lookup_index] &= w_sparse_bitset_bit_clear_mask(page_index);
 		page->first_set = UINT32_MAX;
 		page->last_set = 0;
+		return;
 	}
+	page->first_set = page->values[0] >> 6;
+	page->last_set = page->values[page->values_length - 1] >> 6;
 }
 
-bool w_sparse_bitset_get(struct w_sparse_bitset *bitset, uint64_t index)
+static inline bool w_sparse_bitset_page_contains_(const struct w_sparse_bitset_page *page, uint32_t off)
 {
-	uint64_t word_index = w_sparse_bitset_word_index(index);
-	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+			return page->bits && (page->bits[off >> 6] & w_sparse_bitset_bit_mask(off));
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+		{
+			uint32_t i = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+			return i < page->values_length && page->values[i] == off;
+		}
+		default:
+		{
+			uint32_t runs = page->values_length >> 1;
+			uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+			return r < runs && page->values[r * 2] <= off;
+		}
+	}
+}
 
-	// early out
-	if (page_index >= bitset->pages_length) return false;
+static inline bool w_sparse_bitset_page_full_(const struct w_sparse_bitset_page *page, uint64_t page_size)
+{
+	return page->cardinality == W_SPARSE_BITSET_PAGE_BITS_(page_size);
+}
 
-	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+static bool w_sparse_bitset_array_insert_(struct w_sparse_bitset_page *page, uint32_t off)
+{
+	uint32_t pos = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+	if (pos < page->values_length && page->values[pos] == off) return false;
 
-	if (!page->bits) return false;
+	w_sparse_bitset_page_reserve_values_(page, page->values_length + 1);
+	memmove(&page->values[pos + 1], &page->values[pos], (page->values_length - pos) * sizeof(*page->values));
+	page->values[pos] = (uint16_t)off;
+	page->values_length++;
+	return true;
+}
 
-	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
+static bool w_sparse_bitset_array_remove_(struct w_sparse_bitset_page *page, uint32_t off)
+{
+	uint32_t pos = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+	if (pos >= page->values_length || page->values[pos] != off) return false;
 
-	return (page->bits[local_word] & w_sparse_bitset_bit_mask(index)) != 0;
+	memmove(&page->values[pos], &page->values[pos + 1], (page->values_length - pos - 1) * sizeof(*page->values));
+	page->values_length--;
+	return true;
 }
 
-#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
-#pragma GCC push_options
-#pragma GCC target("avx2")
-#endif
+static void w_sparse_bitset_run_insert_at_(struct w_sparse_bitset_page *page, uint32_t r, uint32_t start, uint32_t last)
+{
+	w_sparse_bitset_page_reserve_values_(page, page->values_length + 2);
+	memmove(&page->values[r * 2 + 2], &page->values[r * 2], (page->values_length - r * 2) * sizeof(*page->values));
+	page->values[r * 2] = (uint16_t)start;
+	page->values[r * 2 + 1] = (uint16_t)last;
+	page->values_length += 2;
+}
 
-// batch allocation block size - check capacity every N elements
-#define INTERSECT_ALLOC_BLOCK 1024
+static void w_sparse_bitset_run_remove_at_(struct w_sparse_bitset_page *page, uint32_t r)
+{
+	memmove(&page->values[r * 2], &page->values[r * 2 + 2], (page->values_length - r * 2 - 2) * sizeof(*page->values));
+	page->values_length -= 2;
+}
 
-uint64_t w_sparse_bitset_intersect_cache_stale(struct w_sparse_bitset_intersect_cache *intersect_cache)
+static bool w_sparse_bitset_run_insert_(struct w_sparse_bitset_page *page, uint32_t off)
 {
-	// compute cached generation from bitsets
-	uint64_t bitsets_generation = 0;
-	for (uint64_t i = 0; i < intersect_cache->bitsets_length; i++)
+	uint32_t runs = page->values_length >> 1;
+	uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+	if (r < runs && page->values[r * 2] <= off) return false;
+
+	bool join_prev = r > 0 && (uint32_t)page->values[(r - 1) * 2 + 1] + 1 == off;
+	bool join_next = r < runs && (uint32_t)page->values[r * 2] == off + 1;
+
+	if (join_prev && join_next)
 	{
-		bitsets_generation += intersect_cache->bitsets[i]->generation;
+		page->values[(r - 1) * 2 + 1] = page->values[r * 2 + 1];
+		w_sparse_bitset_run_remove_at_(page, r);
 	}
+	else if (join_prev) page->values[(r - 1) * 2 + 1] = (uint16_t)off;
+	else if (join_next) page->values[r * 2] = (uint16_t)off;
+	else w_sparse_bitset_run_insert_at_(page, r, off, off);
 
-	// if generation didn't change, cache already exists
-	if (bitsets_generation == intersect_cache->cache_generation) return UINT64_MAX;
-
-	return bitsets_generation;
+	return true;
 }
 
-uint64_t w_sparse_bitset_intersect(struct w_sparse_bitset_intersect_cache *intersect_cache)
+static bool w_sparse_bitset_run_remove_(struct w_sparse_bitset_page *page, uint32_t off)
 {
-	// init cache if we need to
-	if (!intersect_cache->indexes) {
-		w_array_init_t(intersect_cache->indexes, 0);
-		intersect_cache->indexes_length = 0;
-		intersect_cache->cache_generation = UINT64_MAX;
-	}
+	uint32_t runs = page->values_length >> 1;
+	uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+	if (r >= runs || page->values[r * 2] > off) return false;
 
-	// if bitsets is invalid or 0 then early out
-	if (!intersect_cache->bitsets || intersect_cache->bitsets_length == 0) return 0;
+	uint32_t start = page->values[r * 2];
+	uint32_t last = page->values[r * 2 + 1];
 
-	// compute cached generation from bitsets
-	uint64_t bitsets_generation = w_sparse_bitset_intersect_cache_stale(intersect_cache);
-	if (bitsets_generation == UINT64_MAX) return intersect_cache->indexes_length;
+	if (start == last) w_sparse_bitset_run_remove_at_(page, r);
+	else if (off == start) page->values[r * 2]++;
+	else if (off == last) page->values[r * 2 + 1]--;
+	else
+	{
+		// split the run around the cleared offset
+		page->values[r * 2 + 1] = (uint16_t)(off - 1);
+		w_sparse_bitset_run_insert_at_(page, r + 1, off + 1, last);
+	}
 
-	// pre-allocate initial capacity
-	w_array_ensure_alloc_block_size(intersect_cache->indexes, INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
+	return true;
+}
 
-	// local count for hot path - no per-element capacity check
-	uint64_t count = 0;
-	uint64_t capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-	uint64_t *indexes = intersect_cache->indexes;
+// get zeroed page words, reusing words left by a previous conversion
+static uint64_t *w_sparse_bitset_page_words_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	if (!page->bits)
+	{
+		page->bits = w_sparse_bitset_alloc_words_(bitset, page);
+	}
+	else
+	{
+		memset(page->bits, 0, bitset->page_size_ * sizeof(*page->bits));
+	}
+	return page->bits;
+}
 
-	// single bitset: return all set bits
-	if (intersect_cache->bitsets_length == 1)
+// OR the contents of an array/run page into zeroed page words
+static void w_sparse_bitset_page_fill_words_(const struct w_sparse_bitset_page *page, uint64_t *bits)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_ARRAY)
 	{
-		struct w_sparse_bitset *bs = intersect_cache->bitsets[0];
-		for (uint64_t li = 0; li < bs->lookup_pages_length; li++)
+		for (uint32_t i = 0; i < page->values_length; i++)
 		{
-			uint64_t lword = bs->lookup_pages[li];
-			while (lword)
-			{
-				int lbit = __builtin_ctzll(lword);
-				lword &= lword - 1;
-				uint64_t page_index = li * 64 + (uint64_t)lbit;
-				if (page_index >= bs->pages_length) continue;
-				struct w_sparse_bitset_page *page = &bs->pages[page_index];
-				if (!page->bits) continue;
-				for (uint32_t w = page->first_set; w <= page->last_set; w++)
-				{
-					uint64_t word = page->bits[w];
-					while (word)
-					{
-						int bit = __builtin_ctzll(word);
-						word &= word - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * bs->page_size_ + w) * 64 + (uint64_t)bit;
-					}
-				}
-			}
+			bits[page->values[i] >> 6] |= w_sparse_bitset_bit_mask(page->values[i]);
 		}
-		intersect_cache->indexes_length = count;
-		intersect_cache->cache_generation = bitsets_generation;
-		return count;
+		return;
 	}
 
-	// find minimum lookup_pages_length across all bitsets
-	uint64_t max_li = intersect_cache->bitsets[0]->lookup_pages_length;
-	for (uint64_t i = 1; i < intersect_cache->bitsets_length; i++)
+	for (uint32_t r = 0; r < page->values_length; r += 2)
 	{
-		if (intersect_cache->bitsets[i]->lookup_pages_length < max_li)
-			max_li = intersect_cache->bitsets[i]->lookup_pages_length;
+		uint32_t start = page->values[r];
+		uint32_t last = page->values[r + 1];
+		for (uint32_t w = start >> 6; w <= (last >> 6); w++)
+		{
+			uint32_t lo = w << 6;
+			uint32_t s = start > lo ? start - lo : 0;
+			uint32_t l = last < lo + 63 ? last - lo : 63;
+			bits[w] |= w_sparse_bitset_range_mask_(s, l);
+		}
 	}
+}
 
-	// fast path for 2-way intersection (most common case)
-	if (intersect_cache->bitsets_length == 2)
-	{
-		struct w_sparse_bitset *a = intersect_cache->bitsets[0];
-		struct w_sparse_bitset *b = intersect_cache->bitsets[1];
-		uint64_t page_size = a->page_size_;
+static void w_sparse_bitset_page_to_bitmap_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) return;
 
-		for (uint64_t li = 0; li < max_li; li++)
-		{
-			uint64_t lword = a->lookup_pages[li] & b->lookup_pages[li];
-			while (lword)
-			{
-				int lbit = __builtin_ctzll(lword);
-				lword &= lword - 1;
-				uint64_t page_index = li * 64 + (uint64_t)lbit;
-				if (page_index >= a->pages_length || page_index >= b->pages_length) continue;
-				struct w_sparse_bitset_page *pa = &a->pages[page_index];
-				struct w_sparse_bitset_page *pb = &b->pages[page_index];
-				if (!pa->bits || !pb->bits) continue;
-
-				uint32_t first = pa->first_set > pb->first_set ? pa->first_set : pb->first_set;
-				uint32_t last = pa->last_set < pb->last_set ? pa->last_set : pb->last_set;
-				if (first > last || first == UINT32_MAX) continue;
-
-	#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
-				uint32_t simd_first = (first + 3) & ~3u;
-				uint32_t simd_last = (last + 1) & ~3u;
-
-				// prefix scalar
-				for (uint32_t w = first; w < simd_first && w <= last; w++)
-				{
-					uint64_t word = pa->bits[w] & pb->bits[w];
-					while (word)
-					{
-						int bit = __builtin_ctzll(word);
-						word &= word - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + w) * 64 + (uint64_t)bit;
-					}
-				}
+	w_sparse_bitset_page_fill_words_(page, w_sparse_bitset_page_words_(bitset, page));
 
-				// SIMD loop
-				for (uint32_t w = simd_first; w < simd_last; w += 4)
-				{
-					__m256i va = _mm256_loadu_si256((__m256i*)&pa->bits[w]);
-					__m256i vb = _mm256_loadu_si256((__m256i*)&pb->bits[w]);
-					__m256i vr = _mm256_and_si256(va, vb);
-
-					uint64_t r0 = _mm256_extract_epi64(vr, 0);
-					uint64_t r1 = _mm256_extract_epi64(vr, 1);
-					uint64_t r2 = _mm256_extract_epi64(vr, 2);
-					uint64_t r3 = _mm256_extract_epi64(vr, 3);
-
-					if (r0) {
-						uint32_t ww = w;
-						while (r0) {
-							int bit = __builtin_ctzll(r0);
-							r0 &= r0 - 1;
-							if (count >= capacity) {
-								w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-								indexes = intersect_cache->indexes;
-								capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-							}
-							indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-						}
-					}
-					if (r1) {
-						uint32_t ww = w + 1;
-						while (r1) {
-							int bit = __builtin_ctzll(r1);
-							r1 &= r1 - 1;
-							if (count >= capacity) {
-								w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-								indexes = intersect_cache->indexes;
-								capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-							}
-							indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-						}
-					}
-					if (r2) {
-						uint32_t ww = w + 2;
-						while (r2) {
-							int bit = __builtin_ctzll(r2);
-							r2 &= r2 - 1;
-							if (count >= capacity) {
-								w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-								indexes = intersect_cache->indexes;
-								capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-							}
-							indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-						}
-					}
-					if (r3) {
-						uint32_t ww = w + 3;
-						while (r3) {
-							int bit = __builtin_ctzll(r3);
-							r3 &= r3 - 1;
-							if (count >= capacity) {
-								w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-								indexes = intersect_cache->indexes;
-								capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-							}
-							indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-						}
-					}
-				}
+	// bounds are exact for array/run pages so they carry over as-is
+	w_sparse_bitset_page_release_values_(page);
+	page->container = W_SPARSE_BITSET_CONTAINER_BITMAP;
+}
 
-				// suffix scalar (start at max of simd_last, simd_first to avoid prefix overlap)
-				uint32_t suffix_start = simd_last >= simd_first ? simd_last : simd_first;
-				for (uint32_t w = suffix_start; w <= last; w++)
-#else
-				// scalar fallback for non-AVX2 platforms
-				for (uint32_t w = first; w <= last; w++)
-#endif
-				{
-					uint64_t word = pa->bits[w] & pb->bits[w];
-					while (word)
-					{
-						int bit = __builtin_ctzll(word);
-						word &= word - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + w) * 64 + (uint64_t)bit;
-					}
-				}
-			}
-		}
+static void w_sparse_bitset_page_to_array_(struct w_sparse_bitset_page *page)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_ARRAY) return;
 
-		intersect_cache->indexes_length = count;
-		intersect_cache->cache_generation = bitsets_generation;
-		return count;
-	}
+	uint16_t *values = w_mem_xmalloc((page->cardinality ? page->cardinality : 1) * sizeof(*values));
+	uint32_t length = 0;
 
-	// n-way intersection (3+ bitsets)
-	for (uint64_t li = 0; li < max_li; li++)
+	for (uint32_t w = page->first_set; w <= page->last_set; w = w_sparse_bitset_page_next_word_(page, w))
 	{
-		// AND all lookup pages together
-		uint64_t lword = intersect_cache->bitsets[0]->lookup_pages[li];
-		for (uint64_t i = 1; i < intersect_cache->bitsets_length && lword; i++)
+		uint64_t word = w_sparse_bitset_page_word_(page, w);
+		while (word)
 		{
-			lword &= intersect_cache->bitsets[i]->lookup_pages[li];
+			values[length++] = (uint16_t)((w << 6) + (uint32_t)__builtin_ctzll(word));
+			word &= word - 1;
 		}
+	}
 
-		while (lword)
-		{
-			int lbit = __builtin_ctzll(lword);
-			lword &= lword - 1;
-			uint64_t page_index = li * 64 + (uint64_t)lbit;
+	free_null(page->values);
+	page->values = values;
+	page->values_length = length;
+	page->values_capacity = page->cardinality ? page->cardinality : 1;
+	page->container = W_SPARSE_BITSET_CONTAINER_ARRAY;
+	w_sparse_bitset_page_values_bounds_(page);
+}
 
-			// check all bitsets have this page
-			bool valid = true;
-			for (uint64_t i = 0; i < intersect_cache->bitsets_length; i++)
-			{
-				if (page_index >= intersect_cache->bitsets[i]->pages_length ||
-				    !intersect_cache->bitsets[i]->pages[page_index].bits)
-				{
-					valid = false;
-					break;
-				}
-			}
-			if (!valid) continue;
+// count the runs of set bits in a page
+static uint32_t w_sparse_bitset_page_count_runs_(const struct w_sparse_bitset_page *page)
+{
+	uint32_t runs = 0;
+	uint64_t carry = 0;
+	uint32_t prev_w = UINT32_MAX;
 
-			// find tightest bounds: max of first_set, min of last_set
-			uint32_t first = intersect_cache->bitsets[0]->pages[page_index].first_set;
-			uint32_t last = intersect_cache->bitsets[0]->pages[page_index].last_set;
-			for (uint64_t i = 1; i < intersect_cache->bitsets_length; i++)
-			{
-				struct w_sparse_bitset_page *p = &intersect_cache->bitsets[i]->pages[page_index];
-				if (p->first_set > first) first = p->first_set;
-				if (p->last_set < last) last = p->last_set;
-			}
-			if (first > last || first == UINT32_MAX) continue;
+	for (uint32_t w = page->first_set; w <= page->last_set; w = w_sparse_bitset_page_next_word_(page, w))
+	{
+		uint64_t word = w_sparse_bitset_page_word_(page, w);
+		if (prev_w == UINT32_MAX || w != prev_w + 1) carry = 0;
 
-			uint64_t page_size = intersect_cache->bitsets[0]->page_size_;
-#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
-			uint32_t simd_first = (first + 3) & ~3u;
-			uint32_t simd_last = (last + 1) & ~3u;
+		// a run starts at each set bit whose lower neighbour is clear
+		runs += (uint32_t)__builtin_popcountll(word & ~((word << 1) | carry));
+		carry = word >> 63;
+		prev_w = w;
+	}
 
-			// prefix scalar
-			for (uint32_t w = first; w < simd_first && w <= last; w++)
-			{
-				uint64_t word = intersect_cache->bitsets[0]->pages[page_index].bits[w];
-				for (uint64_t i = 1; i < intersect_cache->bitsets_length; i++)
-				{
-					word &= intersect_cache->bitsets[i]->pages[page_index].bits[w];
-				}
-				while (word)
-				{
-					int bit = __builtin_ctzll(word);
-					word &= word - 1;
-					if (count >= capacity) {
-						w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-						indexes = intersect_cache->indexes;
-						capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-					}
-					indexes[count++] = (page_index * page_size + w) * 64 + (uint64_t)bit;
-				}
-			}
+	return runs;
+}
 
-			// SIMD loop
-			for (uint32_t w = simd_first; w < simd_last; w += 4)
-			{
-				__m256i vr = _mm256_loadu_si256((__m256i*)&intersect_cache->bitsets[0]->pages[page_index].bits[w]);
-				for (uint64_t i = 1; i < intersect_cache->bitsets_length; i++)
-				{
-					__m256i vi = _mm256_loadu_si256((__m256i*)&intersect_cache->bitsets[i]->pages[page_index].bits[w]);
-					vr = _mm256_and_si256(vr, vi);
-				}
+static void w_sparse_bitset_page_to_run_(struct w_sparse_bitset_page *page)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_RUN) return;
 
-				uint64_t r0 = _mm256_extract_epi64(vr, 0);
-				uint64_t r1 = _mm256_extract_epi64(vr, 1);
-				uint64_t r2 = _mm256_extract_epi64(vr, 2);
-				uint64_t r3 = _mm256_extract_epi64(vr, 3);
-
-				if (r0) {
-					uint32_t ww = w;
-					while (r0) {
-						int bit = __builtin_ctzll(r0);
-						r0 &= r0 - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-					}
-				}
-				if (r1) {
-					uint32_t ww = w + 1;
-					while (r1) {
-						int bit = __builtin_ctzll(r1);
-						r1 &= r1 - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-					}
-				}
-				if (r2) {
-					uint32_t ww = w + 2;
-					while (r2) {
-						int bit = __builtin_ctzll(r2);
-						r2 &= r2 - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-					}
-				}
-				if (r3) {
-					uint32_t ww = w + 3;
-					while (r3) {
-						int bit = __builtin_ctzll(r3);
-						r3 &= r3 - 1;
-						if (count >= capacity) {
-							w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-							indexes = intersect_cache->indexes;
-							capacity = intersect_cache->indexes_size / sizeof(uint64_t);
-						}
-						indexes[count++] = (page_index * page_size + ww) * 64 + (uint64_t)bit;
-					}
-				}
-			}
+	uint32_t runs = w_sparse_bitset_page_count_runs_(page);
+	uint16_t *values = w_mem_xmalloc((runs ? runs : 1) * 2 * sizeof(*values));
+	uint32_t length = 0;
 
-			// suffix scalar
-			uint32_t suffix_start = simd_last >= simd_first ? simd_last : simd_first;
-			for (uint32_t w = suffix_start; w <= last; w++)
-#else
-			// scalar fallback for non-AVX2 platforms
-			for (uint32_t w = first; w <= last; w++)
-#endif
+	for (uint32_t w = page->first_set; w <= page->last_set; w = w_sparse_bitset_page_next_word_(page, w))
+	{
+		uint64_t word = w_sparse_bitset_page_word_(page, w);
+		while (word)
+		{
+			uint32_t s = (uint32_t)__builtin_ctzll(word);
+			uint64_t shifted = ~(word >> s);
+			uint32_t len = shifted ? (uint32_t)__builtin_ctzll(shifted) : 64 - s;
+			uint32_t start = (w << 6) + s;
+			uint32_t last = start + len - 1;
+
+			// extend the previous run when it ends on the bit before this one
+			if (length && (uint32_t)values[length - 1] + 1 == start) values[length - 1] = (uint16_t)last;
+			else
 			{
-				uint64_t word = intersect_cache->bitsets[0]->pages[page_index].bits[w];
-				for (uint64_t i = 1; i < intersect_cache->bitsets_length; i++)
+				values[length++] = (uint16_t)start;
+				values[length++] = (uint16_t)last;
+			}
+
+			word &= ~w_sparse_bitset_range_mask_(s, s + len - 1);
+		}
+	}
+
+	free_null(page->values);
+	page->values = values;
+	page->values_length = length;
+	page->values_capacity = (runs ? runs : 1) * 2;
+	page->container = W_SPARSE_BITSET_CONTAINER_RUN;
+	w_sparse_bitset_page_values_bounds_(page);
+}
+
+static void w_sparse_bitset_page_to_full_run_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	w_sparse_bitset_page_reserve_values_(page, 2);
+	page->values[0] = 0;
+	page->values[1] = (uint16_t)(W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_) - 1);
+	page->values_length = 2;
+	page->container = W_SPARSE_BITSET_CONTAINER_RUN;
+	w_sparse_bitset_page_values_bounds_(page);
+}
+
+void w_sparse_bitset_set(struct w_sparse_bitset *bitset, uint64_t index)
+{
+	// get indexes
+	uint64_t word_index = w_sparse_bitset_word_index(index);
+	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
+
+	w_sparse_bitset_ensure_capacity_(bitset, index);
+
+	// proceed to set bits
+	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
+	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+
+	if (!(bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE))
+	{
+		// allocate page if page is fresh
+		if (!page->bits)
+		{
+			page->bits = w_sparse_bitset_alloc_words_(bitset, page);
+		}
+
+		// set actual bits
+		if (page->bits[local_word] & w_sparse_bitset_bit_mask(index)) return;
+		page->bits[local_word] |= w_sparse_bitset_bit_mask(index);
+
+		// update page metadata
+		if (local_word < page->first_set) page->first_set = local_word;
+		if (local_word > page->last_set) page->last_set = local_word;
+	}
+	else
+	{
+		uint32_t off = (local_word << 6) | (uint32_t)w_sparse_bitset_bit_index(index);
+
+		// empty pages start over as arrays
+		if (page->cardinality == 0) page->container = W_SPARSE_BITSET_CONTAINER_ARRAY;
+
+		switch (page->container)
+		{
+			case W_SPARSE_BITSET_CONTAINER_BITMAP:
+				if (page->bits[local_word] & w_sparse_bitset_bit_mask(index)) return;
+				page->bits[local_word] |= w_sparse_bitset_bit_mask(index);
+				if (local_word < page->first_set) page->first_set = local_word;
+				if (local_word > page->last_set) page->last_set = local_word;
+				break;
+
+			case W_SPARSE_BITSET_CONTAINER_ARRAY:
+				if (!w_sparse_bitset_array_insert_(page, off)) return;
+				w_sparse_bitset_page_values_bounds_(page);
+				if (page->values_length > W_SPARSE_BITSET_ARRAY_MAX_(bitset->page_size_))
+				{
+					w_sparse_bitset_page_to_bitmap_(bitset, page);
+				}
+				break;
+
+			case W_SPARSE_BITSET_CONTAINER_RUN:
+				if (!w_sparse_bitset_run_insert_(page, off)) return;
+				w_sparse_bitset_page_values_bounds_(page);
+				if ((page->values_length >> 1) > W_SPARSE_BITSET_RUN_MAX_(bitset->page_size_))
+				{
+					w_sparse_bitset_page_to_bitmap_(bitset, page);
+				}
+				break;
+		}
+
+		// full pages collapse to a single run
+		if (page->cardinality + 1 == W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_) && page->container != W_SPARSE_BITSET_CONTAINER_RUN)
+		{
+			w_sparse_bitset_page_to_full_run_(bitset, page);
+		}
+	}
+
+	page->cardinality++;
+	bitset->cardinality++;
+	w_sparse_bitset_log_change_(bitset, index, index);
+
+	// set lookup bit
+	w_sparse_bitset_lookup_set_(bitset, page_index);
+}
+
+void w_sparse_bitset_clear(struct w_sparse_bitset *bitset, uint64_t index)
+{
+	uint64_t word_index = w_sparse_bitset_word_index(index);
+	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
+
+	// early out
+	if (page_index >= bitset->pages_length) return;
+
+	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+
+	if (page->cardinality == 0) return;
+
+	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
+	uint32_t off = (local_word << 6) | (uint32_t)w_sparse_bitset_bit_index(index);
+
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+			if (!(page->bits[local_word] & w_sparse_bitset_bit_mask(index))) return;
+			page->bits[local_word] &= w_sparse_bitset_bit_clear_mask(index);
+			break;
+
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+			if (!w_sparse_bitset_array_remove_(page, off)) return;
+			w_sparse_bitset_page_values_bounds_(page);
+			break;
+
+		case W_SPARSE_BITSET_CONTAINER_RUN:
+			if (!w_sparse_bitset_run_remove_(page, off)) return;
+			w_sparse_bitset_page_values_bounds_(page);
+			break;
+	}
+
+	page->cardinality--;
+	bitset->cardinality--;
+	w_sparse_bitset_log_change_(bitset, index, index);
+
+	// clear lookup bit if page is empty
+	if (page->cardinality == 0)
+	{
+		w_sparse_bitset_lookup_clear_(bitset, page_index);
+		page->first_set = UINT32_MAX;
+		page->last_set = 0;
+		if (bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE) w_sparse_bitset_page_release_values_(page);
+		w_sparse_bitset_page_recycle_(bitset, page);
+		return;
+	}
+
+	if (!(bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE)) return;
+
+	// shrink sparse bitmaps back to arrays, and split-heavy runs to bitmaps
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP && page->cardinality <= W_SPARSE_BITSET_ARRAY_MIN_(bitset->page_size_))
+	{
+		w_sparse_bitset_page_to_array_(page);
+	}
+	else if (page->container == W_SPARSE_BITSET_CONTAINER_RUN && (page->values_length >> 1) > W_SPARSE_BITSET_RUN_MAX_(bitset->page_size_))
+	{
+		if (page->cardinality <= W_SPARSE_BITSET_ARRAY_MAX_(bitset->page_size_)) w_sparse_bitset_page_to_array_(page);
+		else w_sparse_bitset_page_to_bitmap_(bitset, page);
+	}
+}
+
+bool w_sparse_bitset_get(struct w_sparse_bitset *bitset, uint64_t index)
+{
+	if (bitset->flags & W_SPARSE_BITSET_FLAG_SLAB) return w_sparse_bitset_slab_get_(bitset, index);
+
+	uint64_t word_index = w_sparse_bitset_word_index(index);
+	uint64_t page_index = w_sparse_bitset_page_index(word_index, bitset->page_size_);
+
+	// early out
+	if (page_index >= bitset->pages_length) return false;
+
+	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+
+	uint32_t local_word = w_sparse_bitset_local_word(word_index, bitset->page_size_);
+
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP)
+	{
+		return page->bits && (page->bits[local_word] & w_sparse_bitset_bit_mask(index)) != 0;
+	}
+
+	return w_sparse_bitset_page_contains_(page, (local_word << 6) | (uint32_t)w_sparse_bitset_bit_index(index));
+}
+
+void w_sparse_bitset_optimize(struct w_sparse_bitset *bitset)
+{
+	if (!(bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE)) return;
+
+	for (uint64_t i = 0; i < bitset->pages_length; i++)
+	{
+		struct w_sparse_bitset_page *page = &bitset->pages[i];
+		if (page->cardinality == 0) continue;
+
+		// pick the container with the smallest footprint
+		uint64_t runs = w_sparse_bitset_page_count_runs_(page);
+		uint64_t bitmap_bytes = bitset->page_size_ * sizeof(uint64_t);
+		uint64_t array_bytes = page->cardinality * sizeof(uint16_t);
+		uint64_t run_bytes = runs * 2 * sizeof(uint16_t);
+
+		if (run_bytes < array_bytes && run_bytes < bitmap_bytes && runs <= W_SPARSE_BITSET_RUN_MAX_(bitset->page_size_))
+		{
+			w_sparse_bitset_page_to_run_(page);
+		}
+		else if (array_bytes < bitmap_bytes && page->cardinality <= W_SPARSE_BITSET_ARRAY_MAX_(bitset->page_size_))
+		{
+			w_sparse_bitset_page_to_array_(page);
+		}
+		else
+		{
+			w_sparse_bitset_page_to_bitmap_(bitset, page);
+		}
+	}
+}
+
+// pick the natural container for an adaptive page after a bulk update
+static void w_sparse_bitset_page_adapt_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page)
+{
+	if (!(bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE) || page->cardinality == 0) return;
+
+	if (w_sparse_bitset_page_full_(page, bitset->page_size_))
+	{
+		if (page->container != W_SPARSE_BITSET_CONTAINER_RUN) w_sparse_bitset_page_to_full_run_(bitset, page);
+		return;
+	}
+
+	// few long runs beat both arrays and bitmaps
+	uint32_t runs = w_sparse_bitset_page_count_runs_(page);
+	if (runs <= W_SPARSE_BITSET_RUN_MAX_(bitset->page_size_) && runs * 2 < page->cardinality)
+	{
+		w_sparse_bitset_page_to_run_(page);
+	}
+	else if (page->cardinality <= W_SPARSE_BITSET_ARRAY_MAX_(bitset->page_size_))
+	{
+		w_sparse_bitset_page_to_array_(page);
+	}
+}
+
+// clear every bit of a page
+static void w_sparse_bitset_page_reset_(struct w_sparse_bitset *bitset, uint64_t page_index)
+{
+	struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+	if (page->cardinality == 0) return;
+
+	uint64_t base = page_index * W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	w_sparse_bitset_log_change_(bitset, base + (uint64_t)page->first_set * 64, base + (uint64_t)page->last_set * 64 + 63);
+
+	if (bitset->pool || (bitset->flags & W_SPARSE_BITSET_FLAG_SLAB))
+	{
+		w_sparse_bitset_page_recycle_(bitset, page);
+	}
+	else if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP)
+	{
+		memset(&page->bits[page->first_set], 0, (page->last_set - page->first_set + 1) * sizeof(*page->bits));
+	}
+	w_sparse_bitset_page_release_values_(page);
+
+	bitset->cardinality -= page->cardinality;
+	page->cardinality = 0;
+	page->first_set = UINT32_MAX;
+	page->last_set = 0;
+	w_sparse_bitset_lookup_clear_(bitset, page_index);
+}
+
+void w_sparse_bitset_clear_all(struct w_sparse_bitset *bitset)
+{
+	for (uint64_t i = 0; i < bitset->pages_length; i++)
+	{
+		w_sparse_bitset_page_reset_(bitset, i);
+	}
+}
+
+void w_sparse_bitset_compact(struct w_sparse_bitset *bitset)
+{
+	for (uint64_t i = 0; i < bitset->pages_length; i++)
+	{
+		struct w_sparse_bitset_page *page = &bitset->pages[i];
+
+		// words are only needed by non-empty bitmap pages
+		if (page->cardinality == 0 || page->container != W_SPARSE_BITSET_CONTAINER_BITMAP)
+		{
+			w_sparse_bitset_page_recycle_(bitset, page);
+		}
+
+		if (page->cardinality == 0)
+		{
+			w_sparse_bitset_page_release_values_(page);
+		}
+		else if (page->values && page->values_capacity > page->values_length)
+		{
+			page->values = w_mem_xrealloc(page->values, page->values_length * sizeof(*page->values));
+			page->values_capacity = page->values_length;
+		}
+	}
+
+	// drop trailing pages holding nothing
+	uint64_t pages_length = bitset->pages_length;
+	while (pages_length && bitset->pages[pages_length - 1].cardinality == 0 && !bitset->pages[pages_length - 1].bits)
+	{
+		pages_length--;
+	}
+	bitset->pages_length = pages_length;
+	bitset->lookup_pages_length = (pages_length + 63) / 64;
+	bitset->summary_length = (bitset->lookup_pages_length + 63) / 64;
+}
+
+// set or clear page offsets lo..hi as bitmap words, returns the cardinality delta
+static int64_t w_sparse_bitset_page_fill_range_(struct w_sparse_bitset *bitset, struct w_sparse_bitset_page *page, uint32_t lo, uint32_t hi, bool set)
+{
+	if (page->cardinality == 0)
+	{
+		if (!set) return 0;
+		page->container = W_SPARSE_BITSET_CONTAINER_BITMAP;
+		w_sparse_bitset_page_words_(bitset, page);
+	}
+	else
+	{
+		w_sparse_bitset_page_to_bitmap_(bitset, page);
+	}
+
+	int64_t delta = 0;
+	for (uint32_t w = lo >> 6; w <= (hi >> 6); w++)
+	{
+		uint32_t s = (w == (lo >> 6)) ? (lo & 63) : 0;
+		uint32_t l = (w == (hi >> 6)) ? (hi & 63) : 63;
+		uint64_t mask = w_sparse_bitset_range_mask_(s, l);
+		uint64_t before = page->bits[w];
+
+		page->bits[w] = set ? (before | mask) : (before & ~mask);
+		delta += __builtin_popcountll(page->bits[w]) - __builtin_popcountll(before);
+	}
+
+	if (set)
+	{
+		if ((lo >> 6) < page->first_set) page->first_set = lo >> 6;
+		if ((hi >> 6) > page->last_set) page->last_set = hi >> 6;
+	}
+
+	return delta;
+}
+
+static void w_sparse_bitset_fill_range_(struct w_sparse_bitset *bitset, uint64_t first, uint64_t last, bool set)
+{
+	if (first > last) return;
+
+	uint64_t page_bits = W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	uint64_t first_page = first / page_bits;
+	uint64_t last_page = last / page_bits;
+	bool adaptive = (bitset->flags & W_SPARSE_BITSET_FLAG_ADAPTIVE) != 0;
+
+	if (set)
+	{
+		w_sparse_bitset_ensure_capacity_(bitset, last);
+	}
+	else
+	{
+		if (first_page >= bitset->pages_length) return;
+		if (last_page >= bitset->pages_length) last_page = bitset->pages_length - 1;
+	}
+
+	bool changed = false;
+	for (uint64_t page_index = first_page; page_index <= last_page; page_index++)
+	{
+		struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+		if (set ? w_sparse_bitset_page_full_(page, bitset->page_size_) : page->cardinality == 0) continue;
+
+		uint64_t base = page_index * page_bits;
+		uint32_t lo = (first > base) ? (uint32_t)(first - base) : 0;
+		uint32_t hi = (last < base + page_bits - 1) ? (uint32_t)(last - base) : (uint32_t)(page_bits - 1);
+		bool whole = lo == 0 && hi == page_bits - 1;
+
+		// whole pages are cleared or collapsed to a single run outright
+		if (!set && whole)
+		{
+			w_sparse_bitset_page_reset_(bitset, page_index);
+			continue;
+		}
+
+		int64_t delta;
+		if (set && whole && adaptive)
+		{
+			delta = (int64_t)page_bits - page->cardinality;
+			w_sparse_bitset_page_to_full_run_(bitset, page);
+		}
+		else
+		{
+			delta = w_sparse_bitset_page_fill_range_(bitset, page, lo, hi, set);
+		}
+
+		page->cardinality = (uint32_t)((int64_t)page->cardinality + delta);
+		bitset->cardinality = (uint64_t)((int64_t)bitset->cardinality + delta);
+		if (delta) changed = true;
+
+		if (page->cardinality == 0)
+		{
+			w_sparse_bitset_lookup_clear_(bitset, page_index);
+			page->first_set = UINT32_MAX;
+			page->last_set = 0;
+			if (adaptive) w_sparse_bitset_page_release_values_(page);
+			w_sparse_bitset_page_recycle_(bitset, page);
+			continue;
+		}
+
+		w_sparse_bitset_lookup_set_(bitset, page_index);
+		w_sparse_bitset_page_adapt_(bitset, page);
+	}
+
+	if (changed) w_sparse_bitset_log_change_(bitset, first, last);
+}
+
+void w_sparse_bitset_set_range(struct w_sparse_bitset *bitset, uint64_t first, uint64_t last)
+{
+	w_sparse_bitset_fill_range_(bitset, first, last, true);
+}
+
+void w_sparse_bitset_clear_range(struct w_sparse_bitset *bitset, uint64_t first, uint64_t last)
+{
+	w_sparse_bitset_fill_range_(bitset, first, last, false);
+}
+
+// first set offset >= off in a page, UINT32_MAX if none
+static uint32_t w_sparse_bitset_page_next_set_(const struct w_sparse_bitset_page *page, uint32_t off)
+{
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+		{
+			if (page->first_set == UINT32_MAX) return UINT32_MAX;
+			if ((off >> 6) < page->first_set) off = page->first_set << 6;
+
+			for (uint32_t w = off >> 6; w <= page->last_set; w++)
+			{
+				uint64_t word = page->bits[w];
+				if (w == (off >> 6)) word &= ~0ULL << (off & 63);
+				if (word) return (w << 6) + (uint32_t)__builtin_ctzll(word);
+			}
+			return UINT32_MAX;
+		}
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+		{
+			uint32_t i = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+			return (i < page->values_length) ? page->values[i] : UINT32_MAX;
+		}
+		default:
+		{
+			uint32_t runs = page->values_length >> 1;
+			uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+			if (r >= runs) return UINT32_MAX;
+			return (page->values[r * 2] > off) ? page->values[r * 2] : off;
+		}
+	}
+}
+
+// last set offset <= off in a page, UINT32_MAX if none
+static uint32_t w_sparse_bitset_page_prev_set_(const struct w_sparse_bitset_page *page, uint32_t off)
+{
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+		{
+			if (page->first_set == UINT32_MAX || (off >> 6) < page->first_set) return UINT32_MAX;
+			if ((off >> 6) > page->last_set) off = (page->last_set << 6) | 63;
+
+			for (uint32_t w = off >> 6; ; w--)
+			{
+				uint64_t word = page->bits[w];
+				if (w == (off >> 6)) word &= w_sparse_bitset_range_mask_(0, off & 63);
+				if (word) return (w << 6) + 63 - (uint32_t)__builtin_clzll(word);
+				if (w == page->first_set) return UINT32_MAX;
+			}
+		}
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+		{
+			uint32_t i = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off + 1);
+			return i ? page->values[i - 1] : UINT32_MAX;
+		}
+		default:
+		{
+			uint32_t runs = page->values_length >> 1;
+			uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+			if (r < runs && page->values[r * 2] <= off) return off;
+			return r ? page->values[(r - 1) * 2 + 1] : UINT32_MAX;
+		}
+	}
+}
+
+uint64_t w_sparse_bitset_next_set(struct w_sparse_bitset *bitset, uint64_t from)
+{
+	uint64_t page_bits = W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	uint64_t page_index = from / page_bits;
+	if (page_index >= bitset->pages_length) return W_SPARSE_BITSET_INDEX_NONE;
+
+	// rest of the starting page
+	if (bitset->pages[page_index].cardinality)
+	{
+		uint32_t off = w_sparse_bitset_page_next_set_(&bitset->pages[page_index], (uint32_t)(from - page_index * page_bits));
+		if (off != UINT32_MAX) return page_index * page_bits + off;
+	}
+
+	// skip to the next page with bits using the summary and lookup pages
+	uint64_t next = page_index + 1;
+	for (uint64_t li = w_sparse_bitset_next_lookup_(bitset, next / 64); li != UINT64_MAX; li = w_sparse_bitset_next_lookup_(bitset, li + 1))
+	{
+		uint64_t lword = bitset->lookup_pages[li];
+		if (li == next / 64) lword &= ~0ULL << (next & 63);
+		if (!lword) continue;
+
+		uint64_t p = li * 64 + (uint64_t)__builtin_ctzll(lword);
+		return p * page_bits + w_sparse_bitset_page_next_set_(&bitset->pages[p], 0);
+	}
+
+	return W_SPARSE_BITSET_INDEX_NONE;
+}
+
+uint64_t w_sparse_bitset_prev_set(struct w_sparse_bitset *bitset, uint64_t from)
+{
+	if (bitset->pages_length == 0) return W_SPARSE_BITSET_INDEX_NONE;
+
+	uint64_t page_bits = W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	uint64_t page_index = from / page_bits;
+	if (page_index >= bitset->pages_length)
+	{
+		page_index = bitset->pages_length - 1;
+		from = (page_index + 1) * page_bits - 1;
+	}
+
+	// start of the starting page
+	if (bitset->pages[page_index].cardinality)
+	{
+		uint32_t off = w_sparse_bitset_page_prev_set_(&bitset->pages[page_index], (uint32_t)(from - page_index * page_bits));
+		if (off != UINT32_MAX) return page_index * page_bits + off;
+	}
+	if (page_index == 0) return W_SPARSE_BITSET_INDEX_NONE;
+
+	// skip back to the previous page with bits
+	uint64_t prev = page_index - 1;
+	for (uint64_t li = w_sparse_bitset_prev_lookup_(bitset, prev / 64); li != UINT64_MAX; li = li ? w_sparse_bitset_prev_lookup_(bitset, li - 1) : UINT64_MAX)
+	{
+		uint64_t lword = bitset->lookup_pages[li];
+		if (li == prev / 64) lword &= w_sparse_bitset_range_mask_(0, (uint32_t)(prev & 63));
+		if (!lword) continue;
+
+		uint64_t p = li * 64 + 63 - (uint64_t)__builtin_clzll(lword);
+		return p * page_bits + w_sparse_bitset_page_prev_set_(&bitset->pages[p], (uint32_t)(page_bits - 1));
+	}
+
+	return W_SPARSE_BITSET_INDEX_NONE;
+}
+
+/*
+ * rank/select
+ *
+ * the index keeps cumulative set bit counts per page and per lookup word, so
+ * rank is a table lookup plus a scan of one page, and select is a binary
+ * search down to a page plus a scan of that page.
+ */
+
+void w_sparse_bitset_rank_index_init(struct w_sparse_bitset_rank_index *rank_index, struct w_sparse_bitset *bitset)
+{
+	*rank_index = (struct w_sparse_bitset_rank_index){ .bitset = bitset };
+	w_array_init_t(rank_index->page_ranks, 0);
+	w_array_init_t(rank_index->lookup_ranks, 0);
+}
+
+void w_sparse_bitset_rank_index_free(struct w_sparse_bitset_rank_index *rank_index)
+{
+	free_null(rank_index->page_ranks);
+	free_null(rank_index->lookup_ranks);
+	rank_index->page_ranks_length = 0;
+	rank_index->lookup_ranks_length = 0;
+	rank_index->built = false;
+}
+
+static void w_sparse_bitset_rank_index_update_(struct w_sparse_bitset_rank_index *rank_index)
+{
+	struct w_sparse_bitset *bitset = rank_index->bitset;
+	if (rank_index->built && rank_index->generation == bitset->generation && rank_index->page_ranks_length == bitset->pages_length) return;
+
+	w_array_ensure_alloc_block_size(rank_index->page_ranks, bitset->pages_length + 1, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+	w_array_ensure_alloc_block_size(rank_index->lookup_ranks, bitset->lookup_pages_length + 1, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+	uint64_t *page_ranks = rank_index->page_ranks;
+	uint64_t *lookup_ranks = rank_index->lookup_ranks;
+
+	uint64_t total = 0;
+	for (uint64_t p = 0; p < bitset->pages_length; p++)
+	{
+		if ((p & 63) == 0) lookup_ranks[p >> 6] = total;
+		page_ranks[p] = total;
+		total += bitset->pages[p].cardinality;
+	}
+	page_ranks[bitset->pages_length] = total;
+	lookup_ranks[bitset->lookup_pages_length] = total;
+
+	rank_index->page_ranks_length = bitset->pages_length;
+	rank_index->lookup_ranks_length = bitset->lookup_pages_length;
+	rank_index->generation = bitset->generation;
+	rank_index->built = true;
+}
+
+// count set page offsets below off
+static uint64_t w_sparse_bitset_page_rank_(const struct w_sparse_bitset_page *page, uint32_t off)
+{
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+		{
+			uint64_t count = 0;
+			uint32_t last = (off >> 6) < page->last_set ? (off >> 6) : page->last_set;
+			for (uint32_t w = page->first_set; w <= last; w++)
+			{
+				uint64_t word = page->bits[w];
+				if (w == (off >> 6)) word &= (off & 63) ? w_sparse_bitset_range_mask_(0, (off & 63) - 1) : 0;
+				count += (uint64_t)__builtin_popcountll(word);
+			}
+			return count;
+		}
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+			return w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+		default:
+		{
+			uint64_t count = 0;
+			for (uint32_t r = 0; r < page->values_length && page->values[r] < off; r += 2)
+			{
+				uint32_t last = (page->values[r + 1] < off) ? page->values[r + 1] : off - 1;
+				count += last - page->values[r] + 1;
+			}
+			return count;
+		}
+	}
+}
+
+// get the page offset of the k-th set bit, k must be below the page cardinality
+static uint32_t w_sparse_bitset_page_select_(const struct w_sparse_bitset_page *page, uint64_t k)
+{
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+			for (uint32_t w = page->first_set; ; w++)
+			{
+				uint64_t word = page->bits[w];
+				uint64_t count = (uint64_t)__builtin_popcountll(word);
+				if (k >= count) { k -= count; continue; }
+
+				while (k--) word &= word - 1;
+				return (w << 6) + (uint32_t)__builtin_ctzll(word);
+			}
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+			return page->values[k];
+		default:
+			for (uint32_t r = 0; ; r += 2)
+			{
+				uint64_t length = (uint64_t)page->values[r + 1] - page->values[r] + 1;
+				if (k < length) return page->values[r] + (uint32_t)k;
+				k -= length;
+			}
+	}
+}
+
+uint64_t w_sparse_bitset_rank(struct w_sparse_bitset_rank_index *rank_index, uint64_t index)
+{
+	w_sparse_bitset_rank_index_update_(rank_index);
+	struct w_sparse_bitset *bitset = rank_index->bitset;
+
+	uint64_t page_bits = W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	uint64_t page_index = index / page_bits;
+	if (page_index >= rank_index->page_ranks_length) return bitset->cardinality;
+
+	const struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+	uint64_t rank = rank_index->page_ranks[page_index];
+	if (page->cardinality == 0) return rank;
+
+	return rank + w_sparse_bitset_page_rank_(page, (uint32_t)(index - page_index * page_bits));
+}
+
+uint64_t w_sparse_bitset_select(struct w_sparse_bitset_rank_index *rank_index, uint64_t k)
+{
+	w_sparse_bitset_rank_index_update_(rank_index);
+	struct w_sparse_bitset *bitset = rank_index->bitset;
+	if (k >= bitset->cardinality) return W_SPARSE_BITSET_INDEX_NONE;
+
+	// last lookup word starting at or before k
+	uint64_t lo = 0;
+	uint64_t hi = rank_index->lookup_ranks_length;
+	while (hi - lo > 1)
+	{
+		uint64_t mid = (lo + hi) >> 1;
+		if (rank_index->lookup_ranks[mid] <= k) lo = mid;
+		else hi = mid;
+	}
+
+	// then the last page within it starting at or before k
+	uint64_t page_lo = lo * 64;
+	uint64_t page_hi = (lo + 1) * 64 < rank_index->page_ranks_length ? (lo + 1) * 64 : rank_index->page_ranks_length;
+	while (page_hi - page_lo > 1)
+	{
+		uint64_t mid = (page_lo + page_hi) >> 1;
+		if (rank_index->page_ranks[mid] <= k) page_lo = mid;
+		else page_hi = mid;
+	}
+
+	uint64_t page_bits = W_SPARSE_BITSET_PAGE_BITS_(bitset->page_size_);
+	return page_lo * page_bits + w_sparse_bitset_page_select_(&bitset->pages[page_lo], k - rank_index->page_ranks[page_lo]);
+}
+
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+
+// batch allocation block size - check capacity every N elements
+#define INTERSECT_ALLOC_BLOCK 1024
+
+// intersect output buffer, kept out of the cache's atomic array fields while writing
+struct w_sparse_bitset_out_
+{
+	uint64_t *indexes;
+	uint64_t count;
+	uint64_t capacity;
+};
+
+static void w_sparse_bitset_out_grow_(struct w_sparse_bitset_out_ *out, uint64_t n)
+{
+	uint64_t capacity = ((out->count + n) / INTERSECT_ALLOC_BLOCK + 1) * INTERSECT_ALLOC_BLOCK;
+	out->indexes = w_mem_xrealloc(out->indexes, capacity * sizeof(*out->indexes));
+	out->capacity = capacity;
+}
+
+#define INTERSECT_RESERVE(out, n) do { \
+	if ((out)->count + (n) > (out)->capacity) w_sparse_bitset_out_grow_((out), (n)); \
+} while (0)
+
+// emit every set bit of a word
+#define INTERSECT_EMIT_WORD(out, base, word) do { \
+	uint64_t _w_ = (word); \
+	if (_w_) { \
+		INTERSECT_RESERVE((out), 64); \
+		while (_w_) { \
+			(out)->indexes[(out)->count++] = (base) + (uint64_t)__builtin_ctzll(_w_); \
+			_w_ &= _w_ - 1; \
+		} \
+	} \
+} while (0)
+
+static inline void w_sparse_bitset_emit_range_(struct w_sparse_bitset_out_ *out, uint64_t start, uint64_t last)
+{
+	INTERSECT_RESERVE(out, last - start + 1);
+	for (uint64_t i = start; i <= last; i++)
+	{
+		out->indexes[out->count++] = i;
+	}
+}
+
+// emit all set bits of a page
+static void w_sparse_bitset_emit_page_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *page, uint64_t base)
+{
+	switch (page->container)
+	{
+		case W_SPARSE_BITSET_CONTAINER_BITMAP:
+			for (uint32_t w = page->first_set; w <= page->last_set; w++)
+			{
+				INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, page->bits[w]);
+			}
+			break;
+
+		case W_SPARSE_BITSET_CONTAINER_ARRAY:
+			INTERSECT_RESERVE(out, page->values_length);
+			for (uint32_t i = 0; i < page->values_length; i++)
+			{
+				out->indexes[out->count++] = base + page->values[i];
+			}
+			break;
+
+		case W_SPARSE_BITSET_CONTAINER_RUN:
+			for (uint32_t r = 0; r < page->values_length; r += 2)
+			{
+				w_sparse_bitset_emit_range_(out, base + page->values[r], base + page->values[r + 1]);
+			}
+			break;
+	}
+}
+
+// bitmap AND bitmap over a word range
+static void w_sparse_bitset_intersect_bitmap_2_(struct w_sparse_bitset_out_ *out, const uint64_t *a, const uint64_t *b, uint32_t first, uint32_t last, uint64_t base)
+{
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+	uint32_t simd_first = (first + 3) & ~3u;
+	uint32_t simd_last = (last + 1) & ~3u;
+
+	// prefix scalar
+	for (uint32_t w = first; w < simd_first && w <= last; w++)
+	{
+		INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, a[w] & b[w]);
+	}
+
+	// SIMD loop, skipping all-zero blocks
+	for (uint32_t w = simd_first; w < simd_last; w += 4)
+	{
+		__m256i vr = _mm256_and_si256(_mm256_loadu_si256((__m256i*)&a[w]), _mm256_loadu_si256((__m256i*)&b[w]));
+		if (_mm256_testz_si256(vr, vr)) continue;
+
+		uint64_t r[4];
+		_mm256_storeu_si256((__m256i*)r, vr);
+		for (uint32_t k = 0; k < 4; k++)
+		{
+			INTERSECT_EMIT_WORD(out, base + (uint64_t)(w + k) * 64, r[k]);
+		}
+	}
+
+	// suffix scalar (start at max of simd_last, simd_first to avoid prefix overlap)
+	uint32_t suffix_start = simd_last >= simd_first ? simd_last : simd_first;
+	for (uint32_t w = suffix_start; w <= last; w++)
+#else
+	// scalar fallback for non-AVX2 platforms
+	for (uint32_t w = first; w <= last; w++)
+#endif
+	{
+		INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, a[w] & b[w]);
+	}
+}
+
+// bitmap AND array: probe the bitmap with each offset
+static void w_sparse_bitset_intersect_bitmap_array_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *bitmap, const struct w_sparse_bitset_page *array, uint64_t base)
+{
+	INTERSECT_RESERVE(out, array->values_length);
+	for (uint32_t i = 0; i < array->values_length; i++)
+	{
+		uint16_t v = array->values[i];
+		if (bitmap->bits[v >> 6] & w_sparse_bitset_bit_mask(v)) out->indexes[out->count++] = base + v;
+	}
+}
+
+// bitmap AND run: mask bitmap words with each run
+static void w_sparse_bitset_intersect_bitmap_run_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *bitmap, const struct w_sparse_bitset_page *run, uint64_t base)
+{
+	for (uint32_t r = 0; r < run->values_length; r += 2)
+	{
+		uint32_t start = run->values[r];
+		uint32_t last = run->values[r + 1];
+		uint32_t w_first = start >> 6;
+		uint32_t w_last = last >> 6;
+		if (w_first < bitmap->first_set) w_first = bitmap->first_set;
+		if (w_last > bitmap->last_set) w_last = bitmap->last_set;
+
+		for (uint32_t w = w_first; w <= w_last; w++)
+		{
+			uint32_t lo = w << 6;
+			uint32_t s = start > lo ? start - lo : 0;
+			uint32_t l = last < lo + 63 ? last - lo : 63;
+			INTERSECT_EMIT_WORD(out, base + lo, bitmap->bits[w] & w_sparse_bitset_range_mask_(s, l));
+		}
+	}
+}
+
+// array AND array: sorted merge
+static void w_sparse_bitset_intersect_array_array_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *a, const struct w_sparse_bitset_page *b, uint64_t base)
+{
+	INTERSECT_RESERVE(out, a->values_length < b->values_length ? a->values_length : b->values_length);
+	uint32_t i = 0;
+	uint32_t j = 0;
+	while (i < a->values_length && j < b->values_length)
+	{
+		uint16_t va = a->values[i];
+		uint16_t vb = b->values[j];
+		if (va < vb) i++;
+		else if (vb < va) j++;
+		else
+		{
+			out->indexes[out->count++] = base + va;
+			i++;
+			j++;
+		}
+	}
+}
+
+// array AND run: walk offsets against runs
+static void w_sparse_bitset_intersect_array_run_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *array, const struct w_sparse_bitset_page *run, uint64_t base)
+{
+	INTERSECT_RESERVE(out, array->values_length);
+	uint32_t i = 0;
+	uint32_t r = 0;
+	while (i < array->values_length && r < run->values_length)
+	{
+		uint16_t v = array->values[i];
+		if (v < run->values[r]) i++;
+		else if (v > run->values[r + 1]) r += 2;
+		else
+		{
+			out->indexes[out->count++] = base + v;
+			i++;
+		}
+	}
+}
+
+// run AND run: emit overlapping ranges
+static void w_sparse_bitset_intersect_run_run_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *a, const struct w_sparse_bitset_page *b, uint64_t base)
+{
+	uint32_t i = 0;
+	uint32_t j = 0;
+	while (i < a->values_length && j < b->values_length)
+	{
+		uint32_t start = a->values[i] > b->values[j] ? a->values[i] : b->values[j];
+		uint32_t last = a->values[i + 1] < b->values[j + 1] ? a->values[i + 1] : b->values[j + 1];
+		if (start <= last) w_sparse_bitset_emit_range_(out, base + start, base + last);
+
+		if (a->values[i + 1] < b->values[j + 1]) i += 2;
+		else j += 2;
+	}
+}
+
+// intersect a pair of pages using the kernel for their container types
+static void w_sparse_bitset_intersect_page_2_(struct w_sparse_bitset_out_ *out, const struct w_sparse_bitset_page *pa, const struct w_sparse_bitset_page *pb, uint64_t page_size, uint64_t base)
+{
+	uint32_t first = pa->first_set > pb->first_set ? pa->first_set : pb->first_set;
+	uint32_t last = pa->last_set < pb->last_set ? pa->last_set : pb->last_set;
+	if (first > last || first == UINT32_MAX) return;
+
+	if (pa->container == W_SPARSE_BITSET_CONTAINER_BITMAP && pb->container == W_SPARSE_BITSET_CONTAINER_BITMAP)
+	{
+		w_sparse_bitset_intersect_bitmap_2_(out, pa->bits, pb->bits, first, last, base);
+		return;
+	}
+
+	// full pages intersect to the other page as-is
+	if (w_sparse_bitset_page_full_(pa, page_size)) { w_sparse_bitset_emit_page_(out, pb, base); return; }
+	if (w_sparse_bitset_page_full_(pb, page_size)) { w_sparse_bitset_emit_page_(out, pa, base); return; }
+
+	// order the pair as bitmap < array < run
+	if (pa->container > pb->container)
+	{
+		const struct w_sparse_bitset_page *t = pa;
+		pa = pb;
+		pb = t;
+	}
+
+	if (pa->container == W_SPARSE_BITSET_CONTAINER_BITMAP)
+	{
+		if (pb->container == W_SPARSE_BITSET_CONTAINER_ARRAY) w_sparse_bitset_intersect_bitmap_array_(out, pa, pb, base);
+		else w_sparse_bitset_intersect_bitmap_run_(out, pa, pb, base);
+	}
+	else if (pa->container == W_SPARSE_BITSET_CONTAINER_ARRAY)
+	{
+		if (pb->container == W_SPARSE_BITSET_CONTAINER_ARRAY) w_sparse_bitset_intersect_array_array_(out, pa, pb, base);
+		else w_sparse_bitset_intersect_array_run_(out, pa, pb, base);
+	}
+	else
+	{
+		w_sparse_bitset_intersect_run_run_(out, pa, pb, base);
+	}
+}
+
+// intersect the same page across 3+ bitsets
+// pages is scratch space for bitsets_length page pointers
+static void w_sparse_bitset_intersect_page_n_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset **bitsets, uint64_t bitsets_length, const struct w_sparse_bitset_page **pages, uint64_t page_index)
+{
+	uint64_t page_size = bitsets[0]->page_size_;
+	uint64_t base = page_index * page_size * 64;
+
+	// find tightest bounds: max of first_set, min of last_set
+	// full pages are skipped since they don't constrain the result
+	uint32_t first = 0;
+	uint32_t last = UINT32_MAX;
+	uint64_t count = 0;
+	bool all_bitmap = true;
+	const struct w_sparse_bitset_page *driver = NULL;
+
+	for (uint64_t i = 0; i < bitsets_length; i++)
+	{
+		const struct w_sparse_bitset_page *p = &bitsets[i]->pages[page_index];
+		if (p->cardinality == 0) return;
+		if (p->first_set > first) first = p->first_set;
+		if (p->last_set < last) last = p->last_set;
+
+		if (p->container != W_SPARSE_BITSET_CONTAINER_BITMAP && w_sparse_bitset_page_full_(p, page_size)) continue;
+		if (p->container != W_SPARSE_BITSET_CONTAINER_BITMAP) all_bitmap = false;
+		if (p->container == W_SPARSE_BITSET_CONTAINER_ARRAY && (!driver || p->values_length < driver->values_length)) driver = p;
+		pages[count++] = p;
+	}
+	if (first > last) return;
+
+	if (count == 0)
+	{
+		w_sparse_bitset_emit_range_(out, base, base + W_SPARSE_BITSET_PAGE_BITS_(page_size) - 1);
+		return;
+	}
+	if (count == 1) { w_sparse_bitset_emit_page_(out, pages[0], base); return; }
+	if (count == 2) { w_sparse_bitset_intersect_page_2_(out, pages[0], pages[1], page_size, base); return; }
+
+	// array driven: probe remaining pages with each offset of the smallest array
+	if (driver)
+	{
+		INTERSECT_RESERVE(out, driver->values_length);
+		for (uint32_t i = 0; i < driver->values_length; i++)
+		{
+			uint16_t v = driver->values[i];
+			bool found = true;
+			for (uint64_t k = 0; k < count && found; k++)
+			{
+				if (pages[k] != driver) found = w_sparse_bitset_page_contains_(pages[k], v);
+			}
+			if (found) out->indexes[out->count++] = base + v;
+		}
+		return;
+	}
+
+	// bitmaps mixed with runs: AND page words
+	if (!all_bitmap)
+	{
+		for (uint32_t w = first; w <= last; w++)
+		{
+			uint64_t word = w_sparse_bitset_page_word_(pages[0], w);
+			for (uint64_t k = 1; k < count && word; k++)
+			{
+				word &= w_sparse_bitset_page_word_(pages[k], w);
+			}
+			INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, word);
+		}
+		return;
+	}
+
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+	uint32_t simd_first = (first + 3) & ~3u;
+	uint32_t simd_last = (last + 1) & ~3u;
+
+	// prefix scalar
+	for (uint32_t w = first; w < simd_first && w <= last; w++)
+	{
+		uint64_t word = pages[0]->bits[w];
+		for (uint64_t k = 1; k < count; k++)
+		{
+			word &= pages[k]->bits[w];
+		}
+		INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, word);
+	}
+
+	// SIMD loop
+	for (uint32_t w = simd_first; w < simd_last; w += 4)
+	{
+		__m256i vr = _mm256_loadu_si256((__m256i*)&pages[0]->bits[w]);
+		for (uint64_t k = 1; k < count; k++)
+		{
+			__m256i vi = _mm256_loadu_si256((__m256i*)&pages[k]->bits[w]);
+			vr = _mm256_and_si256(vr, vi);
+		}
+		if (_mm256_testz_si256(vr, vr)) continue;
+
+		uint64_t r[4];
+		_mm256_storeu_si256((__m256i*)r, vr);
+		for (uint32_t k = 0; k < 4; k++)
+		{
+			INTERSECT_EMIT_WORD(out, base + (uint64_t)(w + k) * 64, r[k]);
+		}
+	}
+
+	// suffix scalar
+	uint32_t suffix_start = simd_last >= simd_first ? simd_last : simd_first;
+	for (uint32_t w = suffix_start; w <= last; w++)
+#else
+	// scalar fallback for non-AVX2 platforms
+	for (uint32_t w = first; w <= last; w++)
+#endif
+	{
+		uint64_t word = pages[0]->bits[w];
+		for (uint64_t k = 1; k < count; k++)
+		{
+			word &= pages[k]->bits[w];
+		}
+		INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, word);
+	}
+}
+
+// evaluation state shared by intersects and expressions
+struct w_sparse_bitset_eval_
+{
+	struct w_sparse_bitset **bitsets;
+	uint64_t bitsets_length;
+	const struct w_sparse_bitset_expr_op *expr;
+	uint64_t page_size;
+
+	// operands with differing page sizes that all divide the largest one,
+	// walked in units of the largest page (page_size) instead of pages
+	bool units;
+
+	// scratch space
+	const struct w_sparse_bitset_page **pages;
+	const uint64_t **words;
+	uint64_t *materialised;
+	uint64_t *zero;
+	uint64_t *result;
+};
+
+static void w_sparse_bitset_eval_init_(struct w_sparse_bitset_eval_ *ev, struct w_sparse_bitset **bitsets, uint64_t bitsets_length, const struct w_sparse_bitset_expr_op *expr)
+{
+	*ev = (struct w_sparse_bitset_eval_){
+		.bitsets = bitsets,
+		.bitsets_length = bitsets_length,
+		.expr = expr,
+		.page_size = bitsets[0]->page_size_,
+	};
+
+	bool matched = true;
+	bool aligned = true;
+	for (uint64_t k = 1; k < bitsets_length; k++)
+	{
+		if (bitsets[k]->page_size_ > ev->page_size) ev->page_size = bitsets[k]->page_size_;
+	}
+	for (uint64_t k = 0; k < bitsets_length; k++)
+	{
+		if (bitsets[k]->page_size_ != ev->page_size) matched = false;
+		if (ev->page_size % bitsets[k]->page_size_ != 0) aligned = false;
+	}
+	ev->units = !matched && aligned;
+
+	if (bitsets_length > 2) ev->pages = w_mem_xcalloc_t(bitsets_length, *ev->pages);
+	if (expr || ev->units)
+	{
+		ev->words = w_mem_xcalloc_t(bitsets_length, *ev->words);
+		ev->materialised = w_mem_xcalloc(bitsets_length * ev->page_size, sizeof(*ev->materialised));
+		ev->zero = w_mem_xcalloc(ev->page_size, sizeof(*ev->zero));
+		ev->result = w_mem_xcalloc(ev->page_size, sizeof(*ev->result));
+	}
+}
+
+static void w_sparse_bitset_eval_free_(struct w_sparse_bitset_eval_ *ev)
+{
+	free_null(ev->pages);
+	free_null(ev->words);
+	free_null(ev->materialised);
+	free_null(ev->zero);
+	free_null(ev->result);
+}
+
+// get page words, expanding array/run pages into the provided buffer
+static const uint64_t *w_sparse_bitset_page_materialise_(const struct w_sparse_bitset_page *page, uint64_t *buffer, uint64_t page_size)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) return page->bits;
+
+	memset(buffer, 0, page_size * sizeof(*buffer));
+	w_sparse_bitset_page_fill_words_(page, buffer);
+	return buffer;
+}
+
+static inline uint64_t w_sparse_bitset_expr_apply_(uint64_t acc, uint64_t v, uint8_t op)
+{
+	switch (op)
+	{
+		case W_SPARSE_BITSET_OP_OR: return acc | v;
+		case W_SPARSE_BITSET_OP_ANDNOT: return acc & ~v;
+		case W_SPARSE_BITSET_OP_XOR: return acc ^ v;
+		default: return acc & v;
+	}
+}
+
+// fold the expression for a single page word
+static inline uint64_t w_sparse_bitset_expr_word_(const struct w_sparse_bitset_eval_ *ev, uint32_t w)
+{
+	uint64_t acc = 0;
+	uint64_t group = ev->words[0][w];
+	uint8_t group_op = ev->expr[0].op;
+	bool seeded = false;
+
+	for (uint64_t k = 1; k < ev->bitsets_length; k++)
+	{
+		uint64_t v = ev->words[k][w];
+		if (ev->expr[k].group == ev->expr[k - 1].group) { group |= v; continue; }
+
+		acc = seeded ? w_sparse_bitset_expr_apply_(acc, group, group_op) : group;
+		seeded = true;
+		group = v;
+		group_op = ev->expr[k].op;
+	}
+
+	return seeded ? w_sparse_bitset_expr_apply_(acc, group, group_op) : group;
+}
+
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+static inline __m256i w_sparse_bitset_expr_apply_vec_(__m256i acc, __m256i v, uint8_t op)
+{
+	switch (op)
+	{
+		case W_SPARSE_BITSET_OP_OR: return _mm256_or_si256(acc, v);
+		case W_SPARSE_BITSET_OP_ANDNOT: return _mm256_andnot_si256(v, acc);
+		case W_SPARSE_BITSET_OP_XOR: return _mm256_xor_si256(acc, v);
+		default: return _mm256_and_si256(acc, v);
+	}
+}
+
+// fold the expression for 4 page words
+static inline __m256i w_sparse_bitset_expr_vec_(const struct w_sparse_bitset_eval_ *ev, uint32_t w)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m256i group = _mm256_loadu_si256((__m256i*)&ev->words[0][w]);
+	uint8_t group_op = ev->expr[0].op;
+	bool seeded = false;
+
+	for (uint64_t k = 1; k < ev->bitsets_length; k++)
+	{
+		__m256i v = _mm256_loadu_si256((__m256i*)&ev->words[k][w]);
+		if (ev->expr[k].group == ev->expr[k - 1].group) { group = _mm256_or_si256(group, v); continue; }
+
+		acc = seeded ? w_sparse_bitset_expr_apply_vec_(acc, group, group_op) : group;
+		seeded = true;
+		group = v;
+		group_op = ev->expr[k].op;
+	}
+
+	return seeded ? w_sparse_bitset_expr_apply_vec_(acc, group, group_op) : group;
+}
+#endif
+
+// OR of the summary words of all bitsets, covering every lookup word in use
+static uint64_t w_sparse_bitset_summary_any_(struct w_sparse_bitset **bitsets, uint64_t length, uint64_t si)
+{
+	uint64_t sword = 0;
+	for (uint64_t i = 0; i < length; i++)
+	{
+		if (si < bitsets[i]->summary_length) sword |= bitsets[i]->summary[si];
+	}
+	return sword;
+}
+
+// fold lookup words conservatively: a page can only be dropped by AND
+static uint64_t w_sparse_bitset_expr_lookup_(const struct w_sparse_bitset_eval_ *ev, uint64_t li)
+{
+	uint64_t acc = 0;
+	uint64_t group = 0;
+	uint8_t group_op = 0;
+	bool seeded = false;
+
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		struct w_sparse_bitset *bs = ev->bitsets[k];
+		uint64_t v = li < bs->lookup_pages_length ? bs->lookup_pages[li] : 0;
+		if (k > 0 && ev->expr[k].group == ev->expr[k - 1].group) { group |= v; continue; }
+
+		if (k > 0)
+		{
+			if (!seeded) acc = group;
+			else if (group_op == W_SPARSE_BITSET_OP_AND) acc &= group;
+			else if (group_op != W_SPARSE_BITSET_OP_ANDNOT) acc |= group;
+			seeded = true;
+		}
+		group = v;
+		group_op = ev->expr[k].op;
+	}
+
+	if (!seeded) return group;
+	if (group_op == W_SPARSE_BITSET_OP_AND) return acc & group;
+	if (group_op == W_SPARSE_BITSET_OP_ANDNOT) return acc;
+	return acc | group;
+}
+
+// evaluate the expression for one page into ev->result
+// returns false if no operand has bits in the page, otherwise the word range
+static bool w_sparse_bitset_expr_page_(struct w_sparse_bitset_eval_ *ev, uint64_t page_index, uint32_t *first_out, uint32_t *last_out)
+{
+	uint32_t first = UINT32_MAX;
+	uint32_t last = 0;
+
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		struct w_sparse_bitset *bs = ev->bitsets[k];
+		if (page_index >= bs->pages_length || bs->pages[page_index].cardinality == 0)
+		{
+			ev->words[k] = ev->zero;
+			continue;
+		}
+
+		const struct w_sparse_bitset_page *page = &bs->pages[page_index];
+		ev->words[k] = w_sparse_bitset_page_materialise_(page, &ev->materialised[k * ev->page_size], ev->page_size);
+		if (page->first_set < first) first = page->first_set;
+		if (page->last_set > last) last = page->last_set;
+	}
+	if (first > last) return false;
+
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+	uint32_t simd_first = (first + 3) & ~3u;
+	uint32_t simd_last = (last + 1) & ~3u;
+
+	// prefix scalar
+	for (uint32_t w = first; w < simd_first && w <= last; w++)
+	{
+		ev->result[w] = w_sparse_bitset_expr_word_(ev, w);
+	}
+
+	// SIMD loop
+	for (uint32_t w = simd_first; w < simd_last; w += 4)
+	{
+		_mm256_storeu_si256((__m256i*)&ev->result[w], w_sparse_bitset_expr_vec_(ev, w));
+	}
+
+	// suffix scalar
+	uint32_t suffix_start = simd_last >= simd_first ? simd_last : simd_first;
+	for (uint32_t w = suffix_start; w <= last; w++)
+#else
+	// scalar fallback for non-AVX2 platforms
+	for (uint32_t w = first; w <= last; w++)
+#endif
+	{
+		ev->result[w] = w_sparse_bitset_expr_word_(ev, w);
+	}
+
+	*first_out = first;
+	*last_out = last;
+	return true;
+}
+
+// true when the bitset has bits in the given unit
+static bool w_sparse_bitset_unit_any_(const struct w_sparse_bitset *bs, uint64_t unit, uint64_t unit_size)
+{
+	uint64_t ratio = unit_size / bs->page_size_;
+	uint64_t end = (unit + 1) * ratio;
+	if (end > bs->pages_length) end = bs->pages_length;
+
+	for (uint64_t p = unit * ratio; p < end; p++)
+	{
+		if (bs->pages[p].cardinality) return true;
+	}
+	return false;
+}
+
+// get an operand's words for a unit, a smaller page size lays its run of
+// pages in the unit out back to back in the operand's scratch buffer
+static const uint64_t *w_sparse_bitset_unit_words_(struct w_sparse_bitset_eval_ *ev, uint64_t k, uint64_t unit)
+{
+	struct w_sparse_bitset *bs = ev->bitsets[k];
+	uint64_t size = bs->page_size_;
+	uint64_t ratio = ev->page_size / size;
+	uint64_t *buffer = &ev->materialised[k * ev->page_size];
+
+	if (ratio == 1)
+	{
+		if (unit >= bs->pages_length || bs->pages[unit].cardinality == 0) return ev->zero;
+		return w_sparse_bitset_page_materialise_(&bs->pages[unit], buffer, size);
+	}
+
+	memset(buffer, 0, ev->page_size * sizeof(*buffer));
+	for (uint64_t p = 0; p < ratio && unit * ratio + p < bs->pages_length; p++)
+	{
+		const struct w_sparse_bitset_page *page = &bs->pages[unit * ratio + p];
+		if (page->cardinality == 0) continue;
+
+		if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) memcpy(&buffer[p * size], page->bits, size * sizeof(*buffer));
+		else w_sparse_bitset_page_fill_words_(page, &buffer[p * size]);
+	}
+	return buffer;
+}
+
+// fold a unit word by word into ev->result, false when it comes out empty
+static bool w_sparse_bitset_unit_fold_(struct w_sparse_bitset_eval_ *ev, uint64_t unit)
+{
+	// intersections need bits in every operand, expressions in any
+	bool any = false;
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		bool has = w_sparse_bitset_unit_any_(ev->bitsets[k], unit, ev->page_size);
+		if (!has && !ev->expr) return false;
+		any |= has;
+	}
+	if (!any) return false;
+
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		ev->words[k] = w_sparse_bitset_unit_words_(ev, k, unit);
+	}
+
+	uint64_t found = 0;
+	for (uint32_t w = 0; w < ev->page_size; w++)
+	{
+		uint64_t word;
+		if (ev->expr)
+		{
+			word = w_sparse_bitset_expr_word_(ev, w);
+		}
+		else
+		{
+			word = ev->words[0][w];
+			for (uint64_t k = 1; k < ev->bitsets_length; k++)
+			{
+				word &= ev->words[k][w];
+			}
+		}
+		ev->result[w] = word;
+		found |= word;
+	}
+	return found != 0;
+}
+
+// number of units an intersect or expression has to visit
+static uint64_t w_sparse_bitset_units_length_(struct w_sparse_bitset_eval_ *ev)
+{
+	// intersections stop at the shortest bitset, expressions at the longest
+	uint64_t length = 0;
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		uint64_t ratio = ev->page_size / ev->bitsets[k]->page_size_;
+		uint64_t l = (ev->bitsets[k]->pages_length + ratio - 1) / ratio;
+		if (k == 0 || (ev->expr ? l > length : l < length)) length = l;
+	}
+	return length;
+}
+
+static void w_sparse_bitset_intersect_unit_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev, uint64_t unit)
+{
+	if (!w_sparse_bitset_unit_fold_(ev, unit)) return;
+
+	uint64_t base = unit * ev->page_size * 64;
+	for (uint32_t w = 0; w < ev->page_size; w++)
+	{
+		INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, ev->result[w]);
+	}
+}
+
+static void w_sparse_bitset_intersect_units_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev)
+{
+	uint64_t units_length = w_sparse_bitset_units_length_(ev);
+	for (uint64_t unit = 0; unit < units_length; unit++)
+	{
+		w_sparse_bitset_intersect_unit_(out, ev, unit);
+	}
+}
+
+// intersect (or evaluate) a single page across all bitsets, a unit when
+// their page sizes differ
+static void w_sparse_bitset_intersect_page_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev, uint64_t page_index)
+{
+	if (ev->units)
+	{
+		w_sparse_bitset_intersect_unit_(out, ev, page_index);
+		return;
+	}
+
+	struct w_sparse_bitset **bitsets = ev->bitsets;
+	uint64_t base = page_index * ev->page_size * 64;
+
+	if (ev->expr)
+	{
+		uint32_t first;
+		uint32_t last;
+		if (!w_sparse_bitset_expr_page_(ev, page_index, &first, &last)) return;
+		for (uint32_t w = first; w <= last; w++)
+		{
+			INTERSECT_EMIT_WORD(out, base + (uint64_t)w * 64, ev->result[w]);
+		}
+		return;
+	}
+
+	// check all bitsets have this page
+	for (uint64_t i = 0; i < ev->bitsets_length; i++)
+	{
+		if (page_index >= bitsets[i]->pages_length || bitsets[i]->pages[page_index].cardinality == 0) return;
+	}
+
+	// single bitset: return all set bits
+	if (ev->bitsets_length == 1)
+	{
+		w_sparse_bitset_emit_page_(out, &bitsets[0]->pages[page_index], base);
+	}
+	// fast path for 2-way intersection (most common case)
+	else if (ev->bitsets_length == 2)
+	{
+		w_sparse_bitset_intersect_page_2_(out, &bitsets[0]->pages[page_index], &bitsets[1]->pages[page_index], ev->page_size, base);
+	}
+	else
+	{
+		w_sparse_bitset_intersect_page_n_(out, bitsets, ev->bitsets_length, ev->pages, page_index);
+	}
+}
+
+// number of lookup words an intersect or expression has to visit
+static uint64_t w_sparse_bitset_intersect_lookup_length_(struct w_sparse_bitset_eval_ *ev)
+{
+	// intersections stop at the shortest bitset, expressions at the longest
+	uint64_t length = ev->bitsets[0]->lookup_pages_length;
+	for (uint64_t i = 1; i < ev->bitsets_length; i++)
+	{
+		uint64_t l = ev->bitsets[i]->lookup_pages_length;
+		if (ev->expr ? l > length : l < length) length = l;
+	}
+	return length;
+}
+
+// intersect (or evaluate) the pages of lookup words li_begin..li_end - 1
+static void w_sparse_bitset_intersect_range_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev, uint64_t li_begin, uint64_t li_end)
+{
+	struct w_sparse_bitset **bitsets = ev->bitsets;
+	if (li_begin >= li_end) return;
+
+	for (uint64_t si = li_begin / 64; si <= (li_end - 1) / 64; si++)
+	{
+		// AND the summaries for intersections, expressions may keep any
+		// lookup word present in one of their operands
+		uint64_t sword = ev->expr ? w_sparse_bitset_summary_any_(bitsets, ev->bitsets_length, si) : bitsets[0]->summary[si];
+		for (uint64_t i = 1; i < ev->bitsets_length && sword && !ev->expr; i++)
+		{
+			sword &= bitsets[i]->summary[si];
+		}
+		if (si == li_begin / 64) sword &= ~0ULL << (li_begin & 63);
+		if (si == (li_end - 1) / 64) sword &= ~0ULL >> (63 - ((li_end - 1) & 63));
+
+		for (; sword; sword &= sword - 1)
+		{
+			uint64_t li = si * 64 + (uint64_t)__builtin_ctzll(sword);
+			uint64_t lword;
+			if (ev->expr)
+			{
+				lword = w_sparse_bitset_expr_lookup_(ev, li);
+			}
+			else
+			{
+				// AND all lookup pages together
+				lword = bitsets[0]->lookup_pages[li];
+				for (uint64_t i = 1; i < ev->bitsets_length && lword; i++)
+				{
+					lword &= bitsets[i]->lookup_pages[li];
+				}
+			}
+
+			while (lword)
+			{
+				uint64_t page_index = li * 64 + (uint64_t)__builtin_ctzll(lword);
+				lword &= lword - 1;
+				w_sparse_bitset_intersect_page_(out, ev, page_index);
+			}
+		}
+	}
+}
+
+static void w_sparse_bitset_intersect_full_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev)
+{
+	w_sparse_bitset_intersect_range_(out, ev, 0, w_sparse_bitset_intersect_lookup_length_(ev));
+}
+
+// a worker's share of a parallel intersect
+struct w_sparse_bitset_worker_
+{
+	pthread_t thread;
+	bool started;
+	struct w_sparse_bitset_eval_ ev;
+	struct w_sparse_bitset_out_ out;
+	uint64_t li_begin;
+	uint64_t li_end;
+};
+
+static void *w_sparse_bitset_intersect_worker_(void *worker_)
+{
+	struct w_sparse_bitset_worker_ *worker = worker_;
+	w_sparse_bitset_intersect_range_(&worker->out, &worker->ev, worker->li_begin, worker->li_end);
+	return NULL;
+}
+
+// split the lookup words into ranges holding about the same number of pages,
+// intersect the ranges on worker threads and append them to out in order
+// (note: the calling thread takes the first range and writes to out directly)
+static void w_sparse_bitset_intersect_parallel_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev, uint32_t threads)
+{
+	struct w_sparse_bitset **bitsets = ev->bitsets;
+	uint64_t li_length = w_sparse_bitset_intersect_lookup_length_(ev);
+
+	// pages of the first bitset bound the work of intersections, every page
+	// in use counts for expressions
+	uint64_t pages = 0;
+	for (uint64_t li = 0; li < li_length; li++)
+	{
+		uint64_t lword = (li < bitsets[0]->lookup_pages_length) ? bitsets[0]->lookup_pages[li] : 0;
+		for (uint64_t i = 1; i < ev->bitsets_length && ev->expr; i++)
+		{
+			if (li < bitsets[i]->lookup_pages_length) lword |= bitsets[i]->lookup_pages[li];
+		}
+		pages += (uint64_t)__builtin_popcountll(lword);
+	}
+
+	if (pages / W_SPARSE_BITSET_PARALLEL_MIN_PAGES < threads) threads = (uint32_t)(pages / W_SPARSE_BITSET_PARALLEL_MIN_PAGES);
+	if (threads <= 1)
+	{
+		w_sparse_bitset_intersect_range_(out, ev, 0, li_length);
+		return;
+	}
+
+	struct w_sparse_bitset_worker_ *workers = w_mem_xcalloc_t(threads, *workers);
+	uint64_t per_worker = pages / threads;
+	uint64_t li = 0;
+	for (uint32_t t = 0; t < threads; t++)
+	{
+		workers[t].li_begin = li;
+		uint64_t counted = 0;
+		while (li < li_length && (t == threads - 1 || counted < per_worker))
+		{
+			uint64_t lword = (li < bitsets[0]->lookup_pages_length) ? bitsets[0]->lookup_pages[li] : 0;
+			for (uint64_t i = 1; i < ev->bitsets_length && ev->expr; i++)
+			{
+				if (li < bitsets[i]->lookup_pages_length) lword |= bitsets[i]->lookup_pages[li];
+			}
+			counted += (uint64_t)__builtin_popcountll(lword);
+			li++;
+		}
+		workers[t].li_end = li;
+	}
+
+	for (uint32_t t = 1; t < threads; t++)
+	{
+		w_sparse_bitset_eval_init_(&workers[t].ev, bitsets, ev->bitsets_length, ev->expr);
+		workers[t].started = pthread_create(&workers[t].thread, NULL, w_sparse_bitset_intersect_worker_, &workers[t]) == 0;
+
+		// run it here when a thread can't be started
+		if (!workers[t].started) w_sparse_bitset_intersect_worker_(&workers[t]);
+	}
+
+	w_sparse_bitset_intersect_range_(out, ev, workers[0].li_begin, workers[0].li_end);
+
+	for (uint32_t t = 1; t < threads; t++)
+	{
+		if (workers[t].started) pthread_join(workers[t].thread, NULL);
+
+		INTERSECT_RESERVE(out, workers[t].out.count);
+		if (workers[t].out.count) memcpy(&out->indexes[out->count], workers[t].out.indexes, workers[t].out.count * sizeof(*out->indexes));
+		out->count += workers[t].out.count;
+
+		free_null(workers[t].out.indexes);
+		w_sparse_bitset_eval_free_(&workers[t].ev);
+	}
+
+	free_null(workers);
+}
+
+// true when every bitset uses the given page size
+static bool w_sparse_bitset_page_sizes_match_(struct w_sparse_bitset **bitsets, uint64_t bitsets_length, uint64_t page_size)
+{
+	for (uint64_t i = 0; i < bitsets_length; i++)
+	{
+		if (bitsets[i]->page_size_ != page_size) return false;
+	}
+	return true;
+}
+
+// fold the expression (or intersection) for a single bit
+static bool w_sparse_bitset_expr_bit_(const struct w_sparse_bitset_eval_ *ev, uint64_t index)
+{
+	if (!ev->expr)
+	{
+		for (uint64_t k = 0; k < ev->bitsets_length; k++)
+		{
+			if (!w_sparse_bitset_get(ev->bitsets[k], index)) return false;
+		}
+		return true;
+	}
+
+	uint64_t acc = 0;
+	uint64_t group = w_sparse_bitset_get(ev->bitsets[0], index);
+	uint8_t group_op = ev->expr[0].op;
+	bool seeded = false;
+
+	for (uint64_t k = 1; k < ev->bitsets_length; k++)
+	{
+		uint64_t v = w_sparse_bitset_get(ev->bitsets[k], index);
+		if (ev->expr[k].group == ev->expr[k - 1].group) { group |= v; continue; }
+
+		acc = seeded ? w_sparse_bitset_expr_apply_(acc, group, group_op) : group;
+		seeded = true;
+		group = v;
+		group_op = ev->expr[k].op;
+	}
+
+	return (seeded ? w_sparse_bitset_expr_apply_(acc, group, group_op) : group) != 0;
+}
+
+// walk bitsets with differing page sizes (or probing ones that don't), page
+// indexes don't line up so candidate bits are merged from the operands that
+// can contribute them and folded one at a time. heads hold each operand's
+// next candidate
+static uint64_t *w_sparse_bitset_mixed_begin_(struct w_sparse_bitset_eval_ *ev)
+{
+	struct w_sparse_bitset **bitsets = ev->bitsets;
+	uint64_t *heads = w_mem_xcalloc_t(ev->bitsets_length, *heads);
+
+	for (uint64_t k = 0; k < ev->bitsets_length; k++)
+	{
+		heads[k] = W_SPARSE_BITSET_INDEX_NONE;
+	}
+
+	if (!ev->expr)
+	{
+		// intersections are driven by the smallest bitset
+		uint64_t driver = 0;
+		for (uint64_t k = 1; k < ev->bitsets_length; k++)
+		{
+			if (bitsets[k]->cardinality < bitsets[driver]->cardinality) driver = k;
+		}
+		heads[driver] = w_sparse_bitset_next_set(bitsets[driver], 0);
+	}
+	else
+	{
+		// results come from the seed group and OR/XOR groups only
+		for (uint64_t k = 0; k < ev->bitsets_length; k++)
+		{
+			uint32_t group = ev->expr[k].group;
+			uint64_t first = k;
+			while (first > 0 && ev->expr[first - 1].group == group) first--;
+
+			uint8_t op = ev->expr[first].op;
+			if (first == 0 || op == W_SPARSE_BITSET_OP_OR || op == W_SPARSE_BITSET_OP_XOR)
+			{
+				heads[k] = w_sparse_bitset_next_set(bitsets[k], 0);
+			}
+		}
+	}
+
+	return heads;
+}
+
+// next index passing the evaluation, W_SPARSE_BITSET_INDEX_NONE once done
+static uint64_t w_sparse_bitset_mixed_next_(struct w_sparse_bitset_eval_ *ev, uint64_t *heads)
+{
+	for (;;)
+	{
+		uint64_t index = W_SPARSE_BITSET_INDEX_NONE;
+		for (uint64_t k = 0; k < ev->bitsets_length; k++)
+		{
+			if (heads[k] < index) index = heads[k];
+		}
+		if (index == W_SPARSE_BITSET_INDEX_NONE) return index;
+
+		bool hit = w_sparse_bitset_expr_bit_(ev, index);
+		for (uint64_t k = 0; k < ev->bitsets_length; k++)
+		{
+			if (heads[k] == index) heads[k] = w_sparse_bitset_next_set(ev->bitsets[k], index + 1);
+		}
+		if (hit) return index;
+	}
+}
+
+static void w_sparse_bitset_intersect_mixed_(struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev)
+{
+	uint64_t *heads = w_sparse_bitset_mixed_begin_(ev);
+
+	for (uint64_t index = w_sparse_bitset_mixed_next_(ev, heads); index != W_SPARSE_BITSET_INDEX_NONE; index = w_sparse_bitset_mixed_next_(ev, heads))
+	{
+		INTERSECT_RESERVE(out, 1);
+		out->indexes[out->count++] = index;
+	}
+
+	free_null(heads);
+}
+
+static int w_sparse_bitset_compare_u64_(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// collect pages (in dirty_page_size) changed since the cache was built into
+// the sorted dirty page list, returns false when the change logs can't cover it
+static bool w_sparse_bitset_intersect_collect_dirty_(struct w_sparse_bitset_intersect_cache *intersect_cache)
+{
+	struct w_sparse_bitset **bitsets = intersect_cache->bitsets;
+	uint64_t page_bits = intersect_cache->dirty_page_size * 64;
+
+	// past this many dirty pages a full rebuild is cheaper
+	uint64_t pages_length = 0;
+	for (uint64_t i = 0; i < intersect_cache->bitsets_length; i++)
+	{
+		uint64_t ratio = intersect_cache->dirty_page_size / bitsets[i]->page_size_;
+		uint64_t length = (bitsets[i]->pages_length + ratio - 1) / ratio;
+		if (length > pages_length) pages_length = length;
+	}
+	uint64_t dirty_max = pages_length / W_SPARSE_BITSET_INTERSECT_DIRTY_PAGES_RATIO + 1;
+
+	intersect_cache->dirty_pages_length = 0;
+
+	for (uint64_t i = 0; i < intersect_cache->bitsets_length; i++)
+	{
+		struct w_sparse_bitset *bs = bitsets[i];
+		uint64_t seen = intersect_cache->generations[i];
+		if (bs->generation == seen) continue;
+
+		// changes must be fully covered by the log, and the newest entry must
+		// match the generation (bumped by hand otherwise)
+		if (!bs->changes || seen < bs->changes_floor || bs->changes_length == 0) return false;
+		uint32_t newest = (bs->changes_head + W_SPARSE_BITSET_CHANGE_LOG_SIZE - 1) % W_SPARSE_BITSET_CHANGE_LOG_SIZE;
+		if (bs->changes[newest].generation != bs->generation) return false;
+
+		for (uint32_t c = 0; c < bs->changes_length; c++)
+		{
+			struct w_sparse_bitset_change *change = &bs->changes[(newest + W_SPARSE_BITSET_CHANGE_LOG_SIZE - c) % W_SPARSE_BITSET_CHANGE_LOG_SIZE];
+			if (change->generation <= seen) break;
+
+			uint64_t first = change->lo / page_bits;
+			uint64_t last = change->hi / page_bits;
+
+			// repeated changes to the same page only count once
+			uint64_t length = intersect_cache->dirty_pages_length;
+			if (length && first == last && intersect_cache->dirty_pages[length - 1] == first) continue;
+			if (length + (last - first + 1) > dirty_max * 2) return false;
+
+			w_array_ensure_alloc_block_size(intersect_cache->dirty_pages, length + (last - first + 1), INTERSECT_ALLOC_BLOCK);
+			for (uint64_t p = first; p <= last; p++)
+			{
+				intersect_cache->dirty_pages[intersect_cache->dirty_pages_length++] = p;
+			}
+		}
+	}
+
+	// sort and drop duplicates
+	uint64_t *dirty = intersect_cache->dirty_pages;
+	uint64_t length = intersect_cache->dirty_pages_length;
+	if (length > 1) qsort(dirty, length, sizeof(*dirty), w_sparse_bitset_compare_u64_);
+
+	uint64_t unique = 0;
+	for (uint64_t i = 0; i < length; i++)
+	{
+		if (unique == 0 || dirty[unique - 1] != dirty[i]) dirty[unique++] = dirty[i];
+	}
+	intersect_cache->dirty_pages_length = unique;
+
+	return unique <= dirty_max;
+}
+
+// first position in the sorted indexes holding a value >= value
+static uint64_t w_sparse_bitset_indexes_lower_bound_(const uint64_t *indexes, uint64_t length, uint64_t value)
+{
+	uint64_t lo = 0;
+	uint64_t hi = length;
+	while (lo < hi)
+	{
+		uint64_t mid = (lo + hi) >> 1;
+		if (indexes[mid] < value) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// recompute dirty pages and splice them into the cached indexes
+static void w_sparse_bitset_intersect_splice_(struct w_sparse_bitset_intersect_cache *intersect_cache, struct w_sparse_bitset_out_ *out, struct w_sparse_bitset_eval_ *ev)
+{
+	uint64_t page_bits = ev->page_size * 64;
+	struct w_sparse_bitset_out_ page_out = {0};
+
+	for (uint64_t d = 0; d < intersect_cache->dirty_pages_length; d++)
+	{
+		uint64_t page_index = intersect_cache->dirty_pages[d];
+
+		page_out.count = 0;
+		w_sparse_bitset_intersect_page_(&page_out, ev, page_index);
+
+		// replace the page's old range with the new results
+		uint64_t start = w_sparse_bitset_indexes_lower_bound_(out->indexes, out->count, page_index * page_bits);
+		uint64_t end = w_sparse_bitset_indexes_lower_bound_(out->indexes, out->count, (page_index + 1) * page_bits);
+		uint64_t old_count = end - start;
+
+		if (page_out.count > old_count) INTERSECT_RESERVE(out, page_out.count - old_count);
+		if (page_out.count != old_count)
+		{
+			memmove(&out->indexes[start + page_out.count], &out->indexes[end], (out->count - end) * sizeof(*out->indexes));
+			out->count = out->count - old_count + page_out.count;
+		}
+		if (page_out.count) memcpy(&out->indexes[start], page_out.indexes, page_out.count * sizeof(*out->indexes));
+	}
+
+	free_null(page_out.indexes);
+}
+
+bool w_sparse_bitset_intersect_cache_stale(struct w_sparse_bitset_intersect_cache *intersect_cache)
+{
+	// never built or bitsets changed since
+	if (intersect_cache->cache_generation == 0 || intersect_cache->generations_length != intersect_cache->bitsets_length) return true;
+
+	for (uint64_t i = 0; i < intersect_cache->bitsets_length; i++)
+	{
+		if (intersect_cache->bitsets[i]->generation != intersect_cache->generations[i]) return true;
+	}
+
+	return false;
+}
+
+static uint64_t w_sparse_bitset_intersect_ex_(struct w_sparse_bitset_intersect_cache *intersect_cache, uint32_t threads)
+{
+	// init cache if we need to
+	if (!intersect_cache->indexes) {
+		w_array_init_t(intersect_cache->indexes, 0);
+		intersect_cache->indexes_length = 0;
+		intersect_cache->cache_generation = 0;
+	}
+
+	// if bitsets is invalid or 0 then early out
+	if (!intersect_cache->bitsets || intersect_cache->bitsets_length == 0) return 0;
+
+	if (!w_sparse_bitset_intersect_cache_stale(intersect_cache)) return intersect_cache->indexes_length;
+
+	struct w_sparse_bitset **bitsets = intersect_cache->bitsets;
+	uint64_t bitsets_length = intersect_cache->bitsets_length;
+
+	// write into a local buffer for the hot path
+	struct w_sparse_bitset_out_ out = {
+		.indexes = intersect_cache->indexes,
+		.count = intersect_cache->indexes_length,
+		.capacity = intersect_cache->indexes_size / sizeof(uint64_t),
+	};
+	struct w_sparse_bitset_eval_ ev;
+	w_sparse_bitset_eval_init_(&ev, bitsets, bitsets_length, intersect_cache->expr);
+
+	// pages only line up when all bitsets share a page size, or as units of
+	// the largest page when the others divide it, the rest go bit by bit
+	bool mixed = !w_sparse_bitset_page_sizes_match_(bitsets, bitsets_length, ev.page_size) && !ev.units;
+	intersect_cache->dirty_page_size = ev.page_size;
+
+	// recompute only the dirty pages when the change logs cover them
+	bool incremental = !mixed && intersect_cache->cache_generation != 0 &&
+		intersect_cache->generations_length == bitsets_length &&
+		w_sparse_bitset_intersect_collect_dirty_(intersect_cache);
+
+	if (incremental)
+	{
+		w_sparse_bitset_intersect_splice_(intersect_cache, &out, &ev);
+	}
+	else
+	{
+		// pre-allocate initial capacity
+		out.count = 0;
+		INTERSECT_RESERVE(&out, INTERSECT_ALLOC_BLOCK);
+		if (mixed || intersect_cache->probe)
+		{
+			w_sparse_bitset_intersect_mixed_(&out, &ev);
+		}
+		else if (ev.units)
+		{
+			w_sparse_bitset_intersect_units_(&out, &ev);
+		}
+		else if (threads > 1)
+		{
+			w_sparse_bitset_intersect_parallel_(&out, &ev, threads);
+		}
+		else
+		{
+			w_sparse_bitset_intersect_full_(&out, &ev);
+		}
+
+		for (uint64_t i = 0; i < bitsets_length; i++)
+		{
+			w_sparse_bitset_track_changes_(bitsets[i]);
+		}
+	}
+
+	w_sparse_bitset_eval_free_(&ev);
+
+	// record the generations the indexes now reflect
+	w_array_ensure_alloc_block_size(intersect_cache->generations, bitsets_length, W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE);
+	for (uint64_t i = 0; i < bitsets_length; i++)
+	{
+		intersect_cache->generations[i] = bitsets[i]->generation;
+	}
+	intersect_cache->generations_length = bitsets_length;
+
+	intersect_cache->indexes = out.indexes;
+	intersect_cache->indexes_size = out.capacity * sizeof(uint64_t);
+	intersect_cache->indexes_length = out.count;
+	intersect_cache->incremental = incremental;
+	intersect_cache->cache_generation++;
+	return out.count;
+}
+
+uint64_t w_sparse_bitset_intersect(struct w_sparse_bitset_intersect_cache *intersect_cache)
+{
+	return w_sparse_bitset_intersect_ex_(intersect_cache, 1);
+}
+
+uint64_t w_sparse_bitset_intersect_parallel(struct w_sparse_bitset_intersect_cache *intersect_cache, uint32_t threads)
+{
+	return w_sparse_bitset_intersect_ex_(intersect_cache, threads);
+}
+
+// count the bits an expression produces page by page, the page words are
+// folded into scratch and popcounted, stopping once limit is reached
+static uint64_t w_sparse_bitset_count_pages_(struct w_sparse_bitset_eval_ *ev, uint64_t limit)
+{
+	uint64_t count = 0;
+	uint64_t li_end = w_sparse_bitset_intersect_lookup_length_(ev);
+
+	for (uint64_t si = 0; si * 64 < li_end; si++)
+	{
+		uint64_t sword = w_sparse_bitset_summary_any_(ev->bitsets, ev->bitsets_length, si);
+		for (; sword; sword &= sword - 1)
+		{
+			uint64_t li = si * 64 + (uint64_t)__builtin_ctzll(sword);
+			if (li >= li_end) break;
+
+			uint64_t lword = w_sparse_bitset_expr_lookup_(ev, li);
+			while (lword)
+			{
+				uint64_t page_index = li * 64 + (uint64_t)__builtin_ctzll(lword);
+				lword &= lword - 1;
+
+				uint32_t first;
+				uint32_t last;
+				if (!w_sparse_bitset_expr_page_(ev, page_index, &first, &last)) continue;
+				for (uint32_t w = first; w <= last; w++)
+				{
+					count += (uint64_t)__builtin_popcountll(ev->result[w]);
+				}
+				if (limit && count >= limit) return limit;
+			}
+		}
+	}
+
+	return count;
+}
+
+// count_pages_ for bitsets walked in units
+static uint64_t w_sparse_bitset_count_units_(struct w_sparse_bitset_eval_ *ev, uint64_t limit)
+{
+	uint64_t count = 0;
+	uint64_t units_length = w_sparse_bitset_units_length_(ev);
+
+	for (uint64_t unit = 0; unit < units_length; unit++)
+	{
+		if (!w_sparse_bitset_unit_fold_(ev, unit)) continue;
+		for (uint32_t w = 0; w < ev->page_size; w++)
+		{
+			count += (uint64_t)__builtin_popcountll(ev->result[w]);
+		}
+		if (limit && count >= limit) return limit;
+	}
+
+	return count;
+}
+
+uint64_t w_sparse_bitset_intersect_count(struct w_sparse_bitset_intersect_cache *intersect_cache, uint64_t limit)
+{
+	if (!intersect_cache->bitsets || intersect_cache->bitsets_length == 0) return 0;
+
+	// a current cache already holds the answer
+	uint64_t count = intersect_cache->indexes_length;
+	if (intersect_cache->indexes && !w_sparse_bitset_intersect_cache_stale(intersect_cache))
+	{
+		return (limit && count > limit) ? limit : count;
+	}
+
+	struct w_sparse_bitset **bitsets = intersect_cache->bitsets;
+	uint64_t bitsets_length = intersect_cache->bitsets_length;
+	if (bitsets_length == 1)
+	{
+		count = bitsets[0]->cardinality;
+		return (limit && count > limit) ? limit : count;
+	}
+
+	struct w_sparse_bitset_eval_ ev;
+	if (intersect_cache->probe || !w_sparse_bitset_page_sizes_match_(bitsets, bitsets_length, bitsets[0]->page_size_))
+	{
+		w_sparse_bitset_eval_init_(&ev, bitsets, bitsets_length, intersect_cache->expr);
+		if (ev.units && !intersect_cache->probe)
+		{
+			count = w_sparse_bitset_count_units_(&ev, limit);
+			w_sparse_bitset_eval_free_(&ev);
+			return count;
+		}
+
+		uint64_t *heads = w_sparse_bitset_mixed_begin_(&ev);
+
+		count = 0;
+		while ((!limit || count < limit) && w_sparse_bitset_mixed_next_(&ev, heads) != W_SPARSE_BITSET_INDEX_NONE)
+		{
+			count++;
+		}
+		free_null(heads);
+		w_sparse_bitset_eval_free_(&ev);
+		return count;
+	}
+
+	// plain intersects fold as one AND group per bitset
+	struct w_sparse_bitset_expr_op *and_expr = NULL;
+	const struct w_sparse_bitset_expr_op *expr = intersect_cache->expr;
+	if (!expr)
+	{
+		and_expr = w_mem_xcalloc_t(bitsets_length, *and_expr);
+		for (uint64_t k = 0; k < bitsets_length; k++)
+		{
+			and_expr[k] = (struct w_sparse_bitset_expr_op){ .op = W_SPARSE_BITSET_OP_AND, .group = (uint32_t)k };
+		}
+		expr = and_expr;
+	}
+
+	w_sparse_bitset_eval_init_(&ev, bitsets, bitsets_length, expr);
+	count = w_sparse_bitset_count_pages_(&ev, limit);
+	w_sparse_bitset_eval_free_(&ev);
+	free_null(and_expr);
+
+	return count;
+}
+
+/*
+ * set algebra
+ */
+
+// store evaluated page words into an empty page of dst
+static void w_sparse_bitset_store_page_(struct w_sparse_bitset *dst, uint64_t page_index, const uint64_t *words, uint32_t first, uint32_t last)
+{
+	// trim empty words off both ends
+	while (first <= last && words[first] == 0) first++;
+	while (last > first && words[last] == 0) last--;
+	if (first > last || words[first] == 0) return;
+
+	uint64_t cardinality = 0;
+	for (uint32_t w = first; w <= last; w++)
+	{
+		cardinality += (uint64_t)__builtin_popcountll(words[w]);
+	}
+
+	uint64_t base = page_index * W_SPARSE_BITSET_PAGE_BITS_(dst->page_size_);
+	w_sparse_bitset_ensure_capacity_(dst, base);
+
+	struct w_sparse_bitset_page *page = &dst->pages[page_index];
+	page->container = W_SPARSE_BITSET_CONTAINER_BITMAP;
+	uint64_t *bits = w_sparse_bitset_page_words_(dst, page);
+	memcpy(&bits[first], &words[first], (last - first + 1) * sizeof(*bits));
+
+	page->first_set = first;
+	page->last_set = last;
+	page->cardinality = (uint32_t)cardinality;
+	dst->cardinality += cardinality;
+	w_sparse_bitset_lookup_set_(dst, page_index);
+	w_sparse_bitset_log_change_(dst, base + (uint64_t)first * 64, base + (uint64_t)last * 64 + 63);
+
+	w_sparse_bitset_page_adapt_(dst, page);
+}
+
+void w_sparse_bitset_evaluate(struct w_sparse_bitset *dst, struct w_sparse_bitset **bitsets, const struct w_sparse_bitset_expr_op *expr, uint64_t length)
+{
+	w_sparse_bitset_clear_all(dst);
+	if (length == 0) return;
+
+	struct w_sparse_bitset_eval_ ev;
+	w_sparse_bitset_eval_init_(&ev, bitsets, length, expr);
+
+	// pages only line up when dst and all operands share a page size
+	if (!w_sparse_bitset_page_sizes_match_(bitsets, length, dst->page_size_))
+	{
+		struct w_sparse_bitset_out_ out = {0};
+		w_sparse_bitset_intersect_mixed_(&out, &ev);
+		for (uint64_t i = 0; i < out.count; i++)
+		{
+			w_sparse_bitset_set(dst, out.indexes[i]);
+		}
+		free_null(out.indexes);
+		w_sparse_bitset_eval_free_(&ev);
+		return;
+	}
+
+	uint64_t max_si = 0;
+	for (uint64_t i = 0; i < length; i++)
+	{
+		if (bitsets[i]->summary_length > max_si) max_si = bitsets[i]->summary_length;
+	}
+
+	for (uint64_t si = 0; si < max_si; si++)
+	{
+		for (uint64_t sword = w_sparse_bitset_summary_any_(bitsets, length, si); sword; sword &= sword - 1)
+		{
+			uint64_t li = si * 64 + (uint64_t)__builtin_ctzll(sword);
+			for (uint64_t lword = w_sparse_bitset_expr_lookup_(&ev, li); lword; lword &= lword - 1)
+			{
+				uint64_t page_index = li * 64 + (uint64_t)__builtin_ctzll(lword);
+				uint32_t first;
+				uint32_t last;
+				if (w_sparse_bitset_expr_page_(&ev, page_index, &first, &last))
 				{
-					word &= intersect_cache->bitsets[i]->pages[page_index].bits[w];
+					w_sparse_bitset_store_page_(dst, page_index, ev.result, first, last);
 				}
-				while (word)
+			}
+		}
+	}
+
+	w_sparse_bitset_eval_free_(&ev);
+}
+
+static void w_sparse_bitset_evaluate_2_(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b, uint8_t op)
+{
+	struct w_sparse_bitset *bitsets[2] = { a, b };
+	struct w_sparse_bitset_expr_op expr[2] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = op, .group = 1 },
+	};
+	w_sparse_bitset_evaluate(dst, bitsets, expr, 2);
+}
+
+void w_sparse_bitset_union(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b)
+{
+	w_sparse_bitset_evaluate_2_(dst, a, b, W_SPARSE_BITSET_OP_OR);
+}
+
+void w_sparse_bitset_difference(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b)
+{
+	w_sparse_bitset_evaluate_2_(dst, a, b, W_SPARSE_BITSET_OP_ANDNOT);
+}
+
+void w_sparse_bitset_xor(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b)
+{
+	w_sparse_bitset_evaluate_2_(dst, a, b, W_SPARSE_BITSET_OP_XOR);
+}
+
+/*
+ * page size migration
+ */
+
+void w_sparse_bitset_rebuild(struct w_sparse_bitset *bitset, uint64_t page_size)
+{
+	if (page_size == bitset->page_size_) return;
+
+	struct w_sparse_bitset rebuilt;
+	w_sparse_bitset_init_ex(&rebuilt, bitset->arena, page_size, bitset->flags);
+	rebuilt.pool = bitset->pool;
+
+	// old pages are visited in order, so each new page fills up in one go
+	uint64_t *words = w_mem_xcalloc(page_size, sizeof(*words));
+	uint64_t *scratch = w_mem_xcalloc(bitset->page_size_, sizeof(*scratch));
+	uint64_t current = UINT64_MAX;
+	uint32_t first = UINT32_MAX;
+	uint32_t last = 0;
+
+	for (uint64_t li = w_sparse_bitset_next_lookup_(bitset, 0); li != UINT64_MAX; li = w_sparse_bitset_next_lookup_(bitset, li + 1))
+	{
+		for (uint64_t lword = bitset->lookup_pages[li]; lword; lword &= lword - 1)
+		{
+			uint64_t page_index = li * 64 + (uint64_t)__builtin_ctzll(lword);
+			const struct w_sparse_bitset_page *page = &bitset->pages[page_index];
+			const uint64_t *src = w_sparse_bitset_page_materialise_(page, scratch, bitset->page_size_);
+
+			for (uint32_t w = page->first_set; w <= page->last_set; w++)
+			{
+				if (!src[w]) continue;
+
+				uint64_t word_index = page_index * bitset->page_size_ + w;
+				uint64_t target = word_index / page_size;
+				if (target != current)
 				{
-					int bit = __builtin_ctzll(word);
-					word &= word - 1;
-					if (count >= capacity) {
-						w_array_ensure_alloc_block_size(intersect_cache->indexes, count + INTERSECT_ALLOC_BLOCK, INTERSECT_ALLOC_BLOCK);
-						indexes = intersect_cache->indexes;
-						capacity = intersect_cache->indexes_size / sizeof(uint64_t);
+					if (current != UINT64_MAX)
+					{
+						w_sparse_bitset_store_page_(&rebuilt, current, words, first, last);
+						memset(&words[first], 0, (last - first + 1) * sizeof(*words));
 					}
-					indexes[count++] = (page_index * page_size + w) * 64 + (uint64_t)bit;
+					current = target;
+					first = UINT32_MAX;
+					last = 0;
 				}
+
+				uint32_t local_word = (uint32_t)(word_index % page_size);
+				words[local_word] = src[w];
+				if (local_word < first) first = local_word;
+				if (local_word > last) last = local_word;
 			}
 		}
 	}
+	if (current != UINT64_MAX) w_sparse_bitset_store_page_(&rebuilt, current, words, first, last);
 
-	intersect_cache->indexes_length = count;
-	intersect_cache->cache_generation = bitsets_generation;
-	return count;
+	free_null(words);
+	free_null(scratch);
+
+	// caches compare generations, so carry on from the old one
+	uint64_t generation = bitset->generation;
+	w_sparse_bitset_free(bitset);
+	*bitset = rebuilt;
+	bitset->generation = generation + 1;
+}
+
+// apply op to dst words in [first, last], returns the cardinality delta and
+// the range of words that changed
+static int64_t w_sparse_bitset_apply_words_(uint64_t *dst, const uint64_t *src, uint32_t first, uint32_t last, uint8_t op, uint32_t *changed_first, uint32_t *changed_last)
+{
+	int64_t delta = 0;
+	uint32_t w = first;
+
+#if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
+	for (; w + 3 <= last; w += 4)
+	{
+		__m256i d = _mm256_loadu_si256((__m256i*)&dst[w]);
+		__m256i n = w_sparse_bitset_expr_apply_vec_(d, _mm256_loadu_si256((__m256i*)&src[w]), op);
+		__m256i x = _mm256_xor_si256(d, n);
+		if (_mm256_testz_si256(x, x)) continue;
+
+		uint64_t before[4];
+		_mm256_storeu_si256((__m256i*)before, d);
+		_mm256_storeu_si256((__m256i*)&dst[w], n);
+		for (uint32_t lane = 0; lane < 4; lane++)
+		{
+			if (before[lane] == dst[w + lane]) continue;
+			delta += __builtin_popcountll(dst[w + lane]) - __builtin_popcountll(before[lane]);
+			if (w + lane < *changed_first) *changed_first = w + lane;
+			*changed_last = w + lane;
+		}
+	}
+#endif
+
+	for (; w <= last; w++)
+	{
+		uint64_t n = w_sparse_bitset_expr_apply_(dst[w], src[w], op);
+		if (n == dst[w]) continue;
+
+		delta += __builtin_popcountll(n) - __builtin_popcountll(dst[w]);
+		dst[w] = n;
+		if (w < *changed_first) *changed_first = w;
+		*changed_last = w;
+	}
+
+	return delta;
+}
+
+// apply op to a single page of dst from the matching src page
+static void w_sparse_bitset_apply_page_(struct w_sparse_bitset *dst, const struct w_sparse_bitset_page *src_page, uint64_t page_index, uint8_t op, uint64_t *scratch)
+{
+	const uint64_t *src_bits = w_sparse_bitset_page_materialise_(src_page, scratch, dst->page_size_);
+
+	uint64_t base = page_index * W_SPARSE_BITSET_PAGE_BITS_(dst->page_size_);
+	w_sparse_bitset_ensure_capacity_(dst, base);
+	struct w_sparse_bitset_page *page = &dst->pages[page_index];
+
+	// work on page words
+	if (page->cardinality == 0)
+	{
+		page->container = W_SPARSE_BITSET_CONTAINER_BITMAP;
+		w_sparse_bitset_page_words_(dst, page);
+	}
+	else
+	{
+		w_sparse_bitset_page_to_bitmap_(dst, page);
+	}
+
+	uint32_t first = page->first_set;
+	uint32_t last = page->last_set;
+	if (op == W_SPARSE_BITSET_OP_OR || op == W_SPARSE_BITSET_OP_XOR)
+	{
+		first = src_page->first_set;
+		last = src_page->last_set;
+	}
+	else if (op == W_SPARSE_BITSET_OP_ANDNOT)
+	{
+		if (src_page->first_set > first) first = src_page->first_set;
+		if (src_page->last_set < last) last = src_page->last_set;
+	}
+
+	uint32_t changed_first = UINT32_MAX;
+	uint32_t changed_last = 0;
+	int64_t delta = (first <= last) ? w_sparse_bitset_apply_words_(page->bits, src_bits, first, last, op, &changed_first, &changed_last) : 0;
+
+	if (changed_first != UINT32_MAX)
+	{
+		if (changed_first < page->first_set) page->first_set = changed_first;
+		if (changed_last > page->last_set) page->last_set = changed_last;
+
+		page->cardinality = (uint32_t)((int64_t)page->cardinality + delta);
+		dst->cardinality = (uint64_t)((int64_t)dst->cardinality + delta);
+		w_sparse_bitset_log_change_(dst, base + (uint64_t)changed_first * 64, base + (uint64_t)changed_last * 64 + 63);
+	}
+
+	if (page->cardinality == 0)
+	{
+		w_sparse_bitset_lookup_clear_(dst, page_index);
+		page->first_set = UINT32_MAX;
+		page->last_set = 0;
+		w_sparse_bitset_page_recycle_(dst, page);
+		return;
+	}
+
+	w_sparse_bitset_lookup_set_(dst, page_index);
+	w_sparse_bitset_page_adapt_(dst, page);
+}
+
+// apply op bit by bit, used when page sizes differ
+static void w_sparse_bitset_apply_bits_(struct w_sparse_bitset *dst, struct w_sparse_bitset *src, uint8_t op)
+{
+	if (op != W_SPARSE_BITSET_OP_AND)
+	{
+		w_sparse_bitset_for_each(src)
+		{
+			if (op == W_SPARSE_BITSET_OP_OR) w_sparse_bitset_set(dst, i);
+			else if (op == W_SPARSE_BITSET_OP_ANDNOT) w_sparse_bitset_clear(dst, i);
+			else if (w_sparse_bitset_get(dst, i)) w_sparse_bitset_clear(dst, i);
+			else w_sparse_bitset_set(dst, i);
+		}
+		return;
+	}
+
+	// collect first, clearing while iterating would move pages under the loop
+	struct w_sparse_bitset_out_ cleared = {0};
+
+	w_sparse_bitset_for_each(dst)
+	{
+		if (w_sparse_bitset_get(src, i)) continue;
+		INTERSECT_RESERVE(&cleared, 1);
+		cleared.indexes[cleared.count++] = i;
+	}
+	for (uint64_t c = 0; c < cleared.count; c++)
+	{
+		w_sparse_bitset_clear(dst, cleared.indexes[c]);
+	}
+
+	free_null(cleared.indexes);
+}
+
+static void w_sparse_bitset_apply_(struct w_sparse_bitset *dst, struct w_sparse_bitset *src, uint8_t op)
+{
+	// self ops are either a no-op or clear everything
+	if (dst == src)
+	{
+		if (op == W_SPARSE_BITSET_OP_ANDNOT || op == W_SPARSE_BITSET_OP_XOR) w_sparse_bitset_clear_all(dst);
+		return;
+	}
+
+	if (dst->page_size_ != src->page_size_)
+	{
+		w_sparse_bitset_apply_bits_(dst, src, op);
+		return;
+	}
+
+	uint64_t *scratch = w_mem_xcalloc(src->page_size_, sizeof(*scratch));
+
+	if (op == W_SPARSE_BITSET_OP_AND)
+	{
+		// pages missing from src are cleared outright
+		for (uint64_t page_index = 0; page_index < dst->pages_length; page_index++)
+		{
+			if (dst->pages[page_index].cardinality == 0) continue;
+
+			if (page_index >= src->pages_length || src->pages[page_index].cardinality == 0)
+			{
+				w_sparse_bitset_page_reset_(dst, page_index);
+			}
+			else
+			{
+				w_sparse_bitset_apply_page_(dst, &src->pages[page_index], page_index, op, scratch);
+			}
+		}
+	}
+	else
+	{
+		// only pages present in src can change dst
+		for (uint64_t li = w_sparse_bitset_next_lookup_(src, 0); li != UINT64_MAX; li = w_sparse_bitset_next_lookup_(src, li + 1))
+		{
+			for (uint64_t lword = src->lookup_pages[li]; lword; lword &= lword - 1)
+			{
+				uint64_t page_index = li * 64 + (uint64_t)__builtin_ctzll(lword);
+				if (op == W_SPARSE_BITSET_OP_ANDNOT && (page_index >= dst->pages_length || dst->pages[page_index].cardinality == 0)) continue;
+
+				w_sparse_bitset_apply_page_(dst, &src->pages[page_index], page_index, op, scratch);
+			}
+		}
+	}
+
+	free_null(scratch);
+}
+
+void w_sparse_bitset_union_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src)
+{
+	w_sparse_bitset_apply_(dst, src, W_SPARSE_BITSET_OP_OR);
+}
+
+void w_sparse_bitset_difference_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src)
+{
+	w_sparse_bitset_apply_(dst, src, W_SPARSE_BITSET_OP_ANDNOT);
+}
+
+void w_sparse_bitset_xor_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src)
+{
+	w_sparse_bitset_apply_(dst, src, W_SPARSE_BITSET_OP_XOR);
+}
+
+void w_sparse_bitset_intersect_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src)
+{
+	w_sparse_bitset_apply_(dst, src, W_SPARSE_BITSET_OP_AND);
 }
 
 #if defined(__AVX2__) && !defined(__EMSCRIPTEN__)
@@ -557,5 +3096,11 @@ void w_sparse_bitset_intersect_free_cache(struct w_sparse_bitset_intersect_cache
 {
 	free_null(intersect_cache->bitsets);
 	free_null(intersect_cache->indexes);
+	free_null(intersect_cache->generations);
+	free_null(intersect_cache->dirty_pages);
+	free_null(intersect_cache->expr);
+	intersect_cache->indexes_length = 0;
+	intersect_cache->generations_length = 0;
+	intersect_cache->dirty_pages_length = 0;
 	intersect_cache->cache_generation = 0;
 }
@@ -17,24 +17,150 @@
 #define W_SPARSE_BITSET_PAGE_SIZE_WORDS 256
 #define W_SPARSE_BITSET_PAGE_REALLOC_BLOCK_SIZE 16
 
+// adaptive containers address bits inside a page with 16-bit offsets, so
+// bitsets with larger pages always use bitmap containers
+#define W_SPARSE_BITSET_ADAPTIVE_MAX_PAGE_SIZE_WORDS 1024
+
+// array containers hold at most this many offsets per page word before
+// converting to a bitmap (4 per word is where both take the same memory)
+#ifndef W_SPARSE_BITSET_ARRAY_MAX_PER_WORD
+#define W_SPARSE_BITSET_ARRAY_MAX_PER_WORD 4
+#endif /* ifndef W_SPARSE_BITSET_ARRAY_MAX_PER_WORD */
+
+// parallel intersects give each thread at least this many pages
+#ifndef W_SPARSE_BITSET_PARALLEL_MIN_PAGES
+#define W_SPARSE_BITSET_PARALLEL_MIN_PAGES 64
+#endif /* ifndef W_SPARSE_BITSET_PARALLEL_MIN_PAGES */
+
+// run containers hold at most this many runs per page word before
+// converting to a bitmap
+#ifndef W_SPARSE_BITSET_RUN_MAX_PER_WORD
+#define W_SPARSE_BITSET_RUN_MAX_PER_WORD 1
+#endif /* ifndef W_SPARSE_BITSET_RUN_MAX_PER_WORD */
+
+// number of change log entries kept per bitset for incremental intersects
+#ifndef W_SPARSE_BITSET_CHANGE_LOG_SIZE
+#define W_SPARSE_BITSET_CHANGE_LOG_SIZE 256
+#endif /* ifndef W_SPARSE_BITSET_CHANGE_LOG_SIZE */
+
+// incremental intersects fall back to a full rebuild once more than
+// 1/N of the pages are dirty
+#ifndef W_SPARSE_BITSET_INTERSECT_DIRTY_PAGES_RATIO
+#define W_SPARSE_BITSET_INTERSECT_DIRTY_PAGES_RATIO 4
+#endif /* ifndef W_SPARSE_BITSET_INTERSECT_DIRTY_PAGES_RATIO */
+
+// bitset behaviour flags
+#define W_SPARSE_BITSET_FLAG_ADAPTIVE (1U << 0)
+
+// store page words in one contiguous slab addressed through a dense page slot
+// table, trading adaptive containers for cheaper random access
+#define W_SPARSE_BITSET_FLAG_SLAB (1U << 1)
+
+// returned by seek operations when no bit is found
+#define W_SPARSE_BITSET_INDEX_NONE UINT64_MAX
+
+// page container types
+// bitmap pages store page_size_ words, array pages store sorted bit offsets
+// and run pages store sorted inclusive (start, last) offset pairs
+enum W_SPARSE_BITSET_CONTAINER
+{
+	W_SPARSE_BITSET_CONTAINER_BITMAP = 0,
+	W_SPARSE_BITSET_CONTAINER_ARRAY = 1,
+	W_SPARSE_BITSET_CONTAINER_RUN = 2,
+};
+
 // each page points to an array of X pages
 // page size decided by the bitset's page_size_ value
-struct w_sparse_bitset_page 
+struct w_sparse_bitset_page
 {
 	// first/last set allow specifying the first/last non-zero WORD
 	uint32_t first_set;
 	uint32_t last_set;
 	uint64_t *bits;
+
+	// array/run container storage, only used by adaptive bitsets
+	uint16_t *values;
+	uint32_t values_length;
+	uint32_t values_capacity;
+
+	// count of set bits in the page
+	uint32_t cardinality;
+	uint8_t container;
+};
+
+// set operations used by bitset expressions
+enum W_SPARSE_BITSET_OP
+{
+	W_SPARSE_BITSET_OP_AND = 0,
+	W_SPARSE_BITSET_OP_OR = 1,
+	W_SPARSE_BITSET_OP_ANDNOT = 2,
+	W_SPARSE_BITSET_OP_XOR = 3,
+};
+
+// expression operand op, applied left to right to the running result
+// consecutive operands sharing a group are ORed together first and the
+// group is then applied using the op of its first operand
+// (note: the op of the first group is ignored, it seeds the result)
+struct w_sparse_bitset_expr_op
+{
+	uint8_t op;
+	uint32_t group;
+};
+
+// change log entry, a range of bit indexes changed up to a generation
+struct w_sparse_bitset_change
+{
+	uint64_t generation;
+	uint64_t lo;
+	uint64_t hi;
+};
+
+// free list of released page words for one page size, linked through the
+// first word of each page
+struct w_sparse_bitset_page_pool_list
+{
+	uint64_t page_size;
+	uint64_t *head;
+	uint64_t length;
+};
+
+// page word pool, hands out zeroed page words and recycles released ones
+// (note: words come from the arena and stay owned by it)
+struct w_sparse_bitset_page_pool
+{
+	struct w_arena *arena;
+	w_array_declare(struct w_sparse_bitset_page_pool_list, lists);
 };
 
 // main bitset
-struct w_sparse_bitset 
+struct w_sparse_bitset
 {
 	uint64_t page_size_;
-	w_array_declare(struct w_sparse_bitset_page, pages); 
+	w_array_declare(struct w_sparse_bitset_page, pages);
 	w_array_declare(uint64_t, lookup_pages);
+	// second summary level, one bit per non-zero lookup_pages word
+	w_array_declare(uint64_t, summary);
 	struct w_arena *arena;
 	uint64_t generation;
+	uint64_t cardinality;
+	uint32_t flags;
+
+	// optional page pool, page words are allocated from the arena when NULL
+	struct w_sparse_bitset_page_pool *pool;
+
+	// W_SPARSE_BITSET_FLAG_SLAB page words, page_slots holds the slab slot + 1
+	// of each page (0 for none) and free_slots the slots of emptied pages
+	w_array_declare(uint64_t, slab);
+	w_array_declare(uint32_t, page_slots);
+	w_array_declare(uint32_t, free_slots);
+	uint32_t slab_slots;
+
+	// ring of recent changes, allocated once an intersect cache tracks the bitset
+	// changes before changes_floor are no longer in the ring
+	struct w_sparse_bitset_change *changes;
+	uint32_t changes_head;
+	uint32_t changes_length;
+	uint64_t changes_floor;
 };
 
 // intersect cache, holds a list of indexes set across bitsets
@@ -42,18 +168,148 @@ struct w_sparse_bitset_intersect_cache
 {
 	w_array_declare(struct w_sparse_bitset *, bitsets);
 	w_array_declare(uint64_t, indexes);
+
+	// bumped on every rebuild, 0 when the cache is empty
 	uint64_t cache_generation;
+
+	// bitset generations the indexes were built against
+	w_array_declare(uint64_t, generations);
+
+	// scratch list of pages to recompute
+	w_array_declare(uint64_t, dirty_pages);
+
+	// optional expression ops, one per bitset, NULL intersects all bitsets
+	w_array_declare(struct w_sparse_bitset_expr_op, expr);
+
+	// full rebuilds walk the set bits of the smallest operand (or the seed
+	// group) and probe the others bit by bit instead of going page by page,
+	// cheaper when one operand is far smaller than the rest
+	bool probe;
+
+	// set when the last rebuild only recomputed the dirty_pages, which then
+	// list the pages (in dirty_page_size words) whose indexes may have changed
+	bool incremental;
+
+	// page size the dirty_pages are counted in, the largest operand page size
+	uint64_t dirty_page_size;
 };
 
+// rank/select index over a bitset, rebuilt on use once the bitset changes
+struct w_sparse_bitset_rank_index
+{
+	struct w_sparse_bitset *bitset;
+	uint64_t generation;
+	bool built;
+
+	// set bits before each page and before each lookup word
+	w_array_declare(uint64_t, page_ranks);
+	w_array_declare(uint64_t, lookup_ranks);
+};
+
+// first position in a sorted array container holding an offset >= off
+static inline uint32_t w_sparse_bitset_array_lower_bound_(const uint16_t *values, uint32_t length, uint32_t off)
+{
+	uint32_t lo = 0;
+	uint32_t hi = length;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) >> 1;
+		if (values[mid] < off) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// first run in a run container whose last offset is >= off
+static inline uint32_t w_sparse_bitset_run_lower_bound_(const uint16_t *values, uint32_t runs, uint32_t off)
+{
+	uint32_t lo = 0;
+	uint32_t hi = runs;
+	while (lo < hi)
+	{
+		uint32_t mid = (lo + hi) >> 1;
+		if (values[mid * 2 + 1] < off) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// mask with bits start..last (inclusive) set
+static inline uint64_t w_sparse_bitset_range_mask_(uint32_t start, uint32_t last)
+{
+	uint64_t hi = (last >= 63) ? ~0ULL : ((1ULL << (last + 1)) - 1);
+	return hi & ~((1ULL << start) - 1);
+}
+
+// get a page word regardless of the page container type
+static inline uint64_t w_sparse_bitset_page_word_(const struct w_sparse_bitset_page *page, uint32_t w)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) return page->bits ? page->bits[w] : 0;
+
+	uint32_t lo = w << 6;
+	uint32_t hi = lo + 63;
+	uint64_t word = 0;
+
+	if (page->container == W_SPARSE_BITSET_CONTAINER_ARRAY)
+	{
+		for (uint32_t i = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, lo); i < page->values_length && page->values[i] <= hi; i++)
+		{
+			word |= 1ULL << (page->values[i] & 63);
+		}
+		return word;
+	}
+
+	uint32_t runs = page->values_length >> 1;
+	for (uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, lo); r < runs && page->values[r * 2] <= hi; r++)
+	{
+		uint32_t start = page->values[r * 2] > lo ? page->values[r * 2] : lo;
+		uint32_t last = page->values[r * 2 + 1] < hi ? page->values[r * 2 + 1] : hi;
+		word |= w_sparse_bitset_range_mask_(start - lo, last - lo);
+	}
+	return word;
+}
+
+// check a bit of a W_SPARSE_BITSET_FLAG_SLAB bitset through the slot table
+static inline bool w_sparse_bitset_slab_get_(const struct w_sparse_bitset *bitset, uint64_t index)
+{
+	uint64_t word_index = index >> 6;
+	uint64_t page_index = word_index / bitset->page_size_;
+	if (page_index >= bitset->pages_length) return false;
+
+	uint32_t slot = bitset->page_slots[page_index];
+	return slot && (bitset->slab[(uint64_t)(slot - 1) * bitset->page_size_ + word_index % bitset->page_size_] & (1ULL << (index & 63)));
+}
+
+// get the next page word after w that can hold set bits, UINT32_MAX if none
+static inline uint32_t w_sparse_bitset_page_next_word_(const struct w_sparse_bitset_page *page, uint32_t w)
+{
+	if (page->container == W_SPARSE_BITSET_CONTAINER_BITMAP) return w + 1;
+
+	uint32_t off = (w + 1) << 6;
+	if (page->container == W_SPARSE_BITSET_CONTAINER_ARRAY)
+	{
+		uint32_t i = w_sparse_bitset_array_lower_bound_(page->values, page->values_length, off);
+		return (i < page->values_length) ? (uint32_t)(page->values[i] >> 6) : UINT32_MAX;
+	}
+
+	uint32_t runs = page->values_length >> 1;
+	uint32_t r = w_sparse_bitset_run_lower_bound_(page->values, runs, off);
+	if (r >= runs) return UINT32_MAX;
+	return ((page->values[r * 2] > off) ? page->values[r * 2] : off) >> 6;
+}
+
 // iterate all set bits in a sparse bitset; provides uint64_t i as the current bit index
 #define w_sparse_bitset_for_each(bs) \
-    for (uint64_t _sb_li = 0; _sb_li < (bs)->lookup_pages_length; _sb_li++) \
+    for (uint64_t _sb_si = 0; _sb_si < (bs)->summary_length; _sb_si++) \
+    for (uint64_t _sb_sw = (bs)->summary[_sb_si]; _sb_sw; _sb_sw &= _sb_sw - 1) \
+    for (uint64_t _sb_li = _sb_si * 64ULL + (uint64_t)__builtin_ctzll(_sb_sw), _sb_l = 1; _sb_l; _sb_l = 0) \
     for (uint64_t _sb_lw = (bs)->lookup_pages[_sb_li]; _sb_lw; _sb_lw &= _sb_lw - 1) \
     for (uint64_t _sb_pi = _sb_li * 64ULL + (uint64_t)__builtin_ctzll(_sb_lw), \
-             _sb_pg = (_sb_pi < (bs)->pages_length && (bs)->pages[_sb_pi].bits) ? 1ULL : 0ULL; \
+             _sb_pg = (_sb_pi < (bs)->pages_length && (bs)->pages[_sb_pi].first_set != UINT32_MAX) ? 1ULL : 0ULL; \
          _sb_pg; _sb_pg = 0) \
-    for (uint32_t _sb_w = (bs)->pages[_sb_pi].first_set; _sb_w <= (bs)->pages[_sb_pi].last_set; _sb_w++) \
-    for (uint64_t _sb_wd = (bs)->pages[_sb_pi].bits[_sb_w]; _sb_wd; _sb_wd &= _sb_wd - 1) \
+    for (uint32_t _sb_w = (bs)->pages[_sb_pi].first_set; _sb_w <= (bs)->pages[_sb_pi].last_set; \
+         _sb_w = w_sparse_bitset_page_next_word_(&(bs)->pages[_sb_pi], _sb_w)) \
+    for (uint64_t _sb_wd = w_sparse_bitset_page_word_(&(bs)->pages[_sb_pi], _sb_w); _sb_wd; _sb_wd &= _sb_wd - 1) \
     for (uint64_t i = (_sb_pi * (bs)->page_size_ + (uint64_t)_sb_w) * 64ULL + (uint64_t)__builtin_ctzll(_sb_wd), \
              _sb_d = 0; !_sb_d; _sb_d = 1)
 
@@ -68,6 +324,11 @@ struct w_sparse_bitset_intersect_cache
 // init sparse bitset with custom page size
 void w_sparse_bitset_init(struct w_sparse_bitset *bitset, struct w_arena *arena, uint64_t page_size_);
 
+// init sparse bitset with custom page size and W_SPARSE_BITSET_FLAG_* flags
+// (note: W_SPARSE_BITSET_FLAG_ADAPTIVE is dropped for page sizes above
+// W_SPARSE_BITSET_ADAPTIVE_MAX_PAGE_SIZE_WORDS and for slab bitsets)
+void w_sparse_bitset_init_ex(struct w_sparse_bitset *bitset, struct w_arena *arena, uint64_t page_size_, uint32_t flags);
+
 // free bitset page lists
 void w_sparse_bitset_free(struct w_sparse_bitset *bitset);
 
@@ -80,16 +341,97 @@ void w_sparse_bitset_clear(struct w_sparse_bitset *bitset, uint64_t index);
 // check if bit index is set
 bool w_sparse_bitset_get(struct w_sparse_bitset *bitset, uint64_t index);
 
+// clear all bits, keeping allocated pages
+void w_sparse_bitset_clear_all(struct w_sparse_bitset *bitset);
+
+// set or clear every bit from first to last (inclusive), a word or page at a time
+void w_sparse_bitset_set_range(struct w_sparse_bitset *bitset, uint64_t first, uint64_t last);
+void w_sparse_bitset_clear_range(struct w_sparse_bitset *bitset, uint64_t first, uint64_t last);
+
+// get the first set bit index >= from, W_SPARSE_BITSET_INDEX_NONE if none
+uint64_t w_sparse_bitset_next_set(struct w_sparse_bitset *bitset, uint64_t from);
+
+// get the last set bit index <= from, W_SPARSE_BITSET_INDEX_NONE if none
+uint64_t w_sparse_bitset_prev_set(struct w_sparse_bitset *bitset, uint64_t from);
+
+// release page words of empty pages and spare words left by container
+// conversions back to the page pool, and drop trailing empty pages
+void w_sparse_bitset_compact(struct w_sparse_bitset *bitset);
+
+// move the bitset to a new page size, keeping its bits, flags and pool
+// (note: page pointers are invalidated and intersect caches rebuild in full)
+void w_sparse_bitset_rebuild(struct w_sparse_bitset *bitset, uint64_t page_size);
+
+// convert each page of an adaptive bitset to its smallest container type
+// (note: run containers are only chosen automatically for full pages, this
+// also picks them for nearly full pages with few gaps)
+void w_sparse_bitset_optimize(struct w_sparse_bitset *bitset);
+
 // write intersecting IDs to a result struct from multiple intersecting bitsets
 // writes into a cache struct, will init if not already setup
+// when the cache has expr ops set, the expression is evaluated instead
+// only pages changed since the last call are recomputed when possible
+// (note: bitsets with differing page sizes are evaluated bit by bit)
 // returns total count of intersections found, 0 for none or failed
 uint64_t w_sparse_bitset_intersect(struct w_sparse_bitset_intersect_cache *intersect_cache);
 
+// like w_sparse_bitset_intersect, but full rebuilds split the lookup pages
+// into ranges intersected on up to threads threads
+// (note: incremental updates and mixed page sizes stay on the calling thread)
+uint64_t w_sparse_bitset_intersect_parallel(struct w_sparse_bitset_intersect_cache *intersect_cache, uint32_t threads);
+
+// count the bits an intersect (or expression) would produce without writing
+// indexes, a current cache answers from its indexes. Stops once limit bits
+// are found, 0 for no limit
+uint64_t w_sparse_bitset_intersect_count(struct w_sparse_bitset_intersect_cache *intersect_cache, uint64_t limit);
+
+// dst = a | b, dst = a & ~b, dst = a ^ b
+// (note: dst is cleared first so it can't be one of the operands)
+void w_sparse_bitset_union(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b);
+void w_sparse_bitset_difference(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b);
+void w_sparse_bitset_xor(struct w_sparse_bitset *dst, struct w_sparse_bitset *a, struct w_sparse_bitset *b);
+
+// in-place variants: dst |= src, dst &= ~src, dst ^= src, dst &= src
+void w_sparse_bitset_union_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src);
+void w_sparse_bitset_difference_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src);
+void w_sparse_bitset_xor_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src);
+void w_sparse_bitset_intersect_with(struct w_sparse_bitset *dst, struct w_sparse_bitset *src);
+
+// evaluate an expression over bitsets in a single pass, writing the result to dst
+// expr holds one op per bitset, see struct w_sparse_bitset_expr_op
+// (note: dst is cleared first so it can't be one of the operands)
+void w_sparse_bitset_evaluate(struct w_sparse_bitset *dst, struct w_sparse_bitset **bitsets, const struct w_sparse_bitset_expr_op *expr, uint64_t length);
+
+// init a page pool allocating from an arena
+void w_sparse_bitset_page_pool_init(struct w_sparse_bitset_page_pool *pool, struct w_arena *arena);
+
+// free the pool free lists
+void w_sparse_bitset_page_pool_free(struct w_sparse_bitset_page_pool *pool);
+
+// get zeroed page words for a page size, reusing released words when possible
+uint64_t *w_sparse_bitset_page_pool_acquire(struct w_sparse_bitset_page_pool *pool, uint64_t page_size);
+
+// release page words back to the pool
+void w_sparse_bitset_page_pool_release(struct w_sparse_bitset_page_pool *pool, uint64_t page_size, uint64_t *bits);
+
+// setup a rank/select index for a bitset, built lazily on first use
+void w_sparse_bitset_rank_index_init(struct w_sparse_bitset_rank_index *rank_index, struct w_sparse_bitset *bitset);
+
+// free rank/select index arrays
+void w_sparse_bitset_rank_index_free(struct w_sparse_bitset_rank_index *rank_index);
+
+// get the number of set bits before index
+uint64_t w_sparse_bitset_rank(struct w_sparse_bitset_rank_index *rank_index, uint64_t index);
+
+// get the index of the k-th set bit (0 based), W_SPARSE_BITSET_INDEX_NONE if
+// the bitset has k or fewer bits set
+uint64_t w_sparse_bitset_select(struct w_sparse_bitset_rank_index *rank_index, uint64_t k);
+
 // free indexes and reset counts
 void w_sparse_bitset_intersect_free_cache(struct w_sparse_bitset_intersect_cache *intersect_cache);
 
 // check if bitset intersect cache is stale
-uint64_t w_sparse_bitset_intersect_cache_stale(struct w_sparse_bitset_intersect_cache *intersect_cache);
+bool w_sparse_bitset_intersect_cache_stale(struct w_sparse_bitset_intersect_cache *intersect_cache);
 
 #endif /* WHISKER_SPARSE_BITSET_H */
 
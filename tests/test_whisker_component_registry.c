@@ -729,6 +729,132 @@ START_TEST(test_many_entities_data_integrity)
 }
 END_TEST
 
+static uint64_t pool_free_count_(struct w_sparse_bitset_page_pool *pool, uint64_t page_size)
+{
+	for (uint64_t i = 0; i < pool->lists_length; i++)
+	{
+		if (pool->lists[i].page_size == page_size) return pool->lists[i].length;
+	}
+	return 0;
+}
+
+START_TEST(test_removed_components_recycle_pages)
+{
+	w_entity_id type_a = new_type_id();
+	w_entity_id type_b = new_type_id();
+	w_entity_id ids[1100];
+	int val = 1;
+
+	// enough entities in one page to need bitmap words
+	for (int i = 0; i < 1100; i++) {
+		ids[i] = new_entity_id();
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, type_a, ids[i], &val, sizeof(int));
+	}
+	ck_assert_uint_eq(pool_free_count_(&g_registry.page_pool, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE), 0);
+
+	for (int i = 0; i < 1100; i++) {
+		w_component_remove_(&g_registry, type_a, ids[i]);
+	}
+	ck_assert_uint_eq(pool_free_count_(&g_registry.page_pool, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE), 1);
+
+	// another component picks the page back up
+	for (int i = 0; i < 1100; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, type_b, ids[i], &val, sizeof(int));
+	}
+	ck_assert_uint_eq(pool_free_count_(&g_registry.page_pool, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE), 0);
+	ck_assert(w_component_has_(&g_registry, type_b, ids[1099]));
+	ck_assert(!w_component_has_(&g_registry, type_a, ids[1099]));
+}
+END_TEST
+
+
+/*****************************
+*  page_size_tuning          *
+*****************************/
+
+// sparse ids spread just wide enough to fall under the sparse fill threshold
+#define SPARSE_STRIDE_ 128
+
+START_TEST(test_tune_moves_page_sizes_by_density)
+{
+	w_entity_id dense = new_type_id();
+	w_entity_id sparse = new_type_id();
+	w_entity_id idle = new_type_id();
+
+	for (int i = 0; i < 20000; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, dense, i, &i, sizeof(int));
+	}
+	for (int i = 0; i < 5000; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, sparse, i * SPARSE_STRIDE_, &i, sizeof(int));
+	}
+	for (int i = 0; i < 100; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, idle, i * SPARSE_STRIDE_, &i, sizeof(int));
+	}
+
+	w_component_registry_tune(&g_registry);
+
+	struct w_component_entry_stats stats;
+	ck_assert(w_component_registry_get_entry_stats(&g_registry, dense, &stats));
+	ck_assert_uint_eq(stats.page_size, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_DENSE);
+	ck_assert_uint_eq(stats.cardinality, 20000);
+	ck_assert_uint_eq(stats.migrations, 1);
+
+	ck_assert(w_component_registry_get_entry_stats(&g_registry, sparse, &stats));
+	ck_assert_uint_eq(stats.page_size, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE_SPARSE);
+	ck_assert(stats.fill < W_COMPONENT_REGISTRY_DATA_BITSET_FILL_SPARSE);
+
+	// too few changes to be sampled yet
+	ck_assert(w_component_registry_get_entry_stats(&g_registry, idle, &stats));
+	ck_assert_uint_eq(stats.page_size, W_COMPONENT_REGISTRY_DATA_BITSET_PAGE_SIZE);
+	ck_assert_uint_eq(stats.migrations, 0);
+	ck_assert(!w_component_registry_get_entry_stats(&g_registry, new_type_id(), &stats));
+
+	// components keep their data and bits
+	for (int i = 0; i < 5000; i++) {
+		ck_assert(w_component_has_(&g_registry, sparse, i * SPARSE_STRIDE_));
+		ck_assert(!w_component_has_(&g_registry, sparse, i * SPARSE_STRIDE_ + 1));
+		ck_assert_int_eq(*(int *)w_component_get_(&g_registry, sparse, i * SPARSE_STRIDE_), i);
+	}
+	ck_assert(w_component_has_entry(&g_registry.entries[dense], 19999));
+
+	// sampling again without changes leaves the sizes alone
+	w_component_registry_tune(&g_registry);
+	ck_assert(w_component_registry_get_entry_stats(&g_registry, dense, &stats));
+	ck_assert_uint_eq(stats.migrations, 1);
+}
+END_TEST
+
+START_TEST(test_tuned_components_intersect)
+{
+	w_entity_id dense = new_type_id();
+	w_entity_id sparse = new_type_id();
+	int val = 1;
+
+	for (int i = 0; i < 20000; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, dense, i, &val, sizeof(int));
+	}
+	for (int i = 0; i < 5000; i++) {
+		w_component_set_(&g_registry, W_COMPONENT_TYPE_int, sparse, i * SPARSE_STRIDE_, &val, sizeof(int));
+	}
+	w_component_registry_tune(&g_registry);
+	ck_assert_uint_ne(g_registry.entries[dense].data_bitset.page_size_, g_registry.entries[sparse].data_bitset.page_size_);
+
+	struct w_sparse_bitset_intersect_cache cache = {0};
+	cache.bitsets = w_mem_xcalloc_t(2, *cache.bitsets);
+	cache.bitsets[0] = &g_registry.entries[dense].data_bitset;
+	cache.bitsets[1] = &g_registry.entries[sparse].data_bitset;
+	cache.bitsets_length = 2;
+
+	uint64_t expected = (20000 + SPARSE_STRIDE_ - 1) / SPARSE_STRIDE_;
+	ck_assert_uint_eq(w_sparse_bitset_intersect(&cache), expected);
+	for (uint64_t i = 0; i < expected; i++) {
+		ck_assert_uint_eq(cache.indexes[i], i * SPARSE_STRIDE_);
+	}
+
+	free_null(cache.bitsets);
+	w_sparse_bitset_intersect_free_cache(&cache);
+}
+END_TEST
 
 /*****************************
 *  registry_free             *
@@ -897,8 +1023,16 @@ Suite *whisker_component_registry_suite(void)
 	tcase_set_timeout(tc_realloc, 10);
 	tcase_add_test(tc_realloc, test_high_entity_id_triggers_realloc);
 	tcase_add_test(tc_realloc, test_many_entities_data_integrity);
+	tcase_add_test(tc_realloc, test_removed_components_recycle_pages);
 	suite_add_tcase(s, tc_realloc);
 
+	TCase *tc_tuning = tcase_create("page_size_tuning");
+	tcase_add_checked_fixture(tc_tuning, component_registry_setup, component_registry_teardown);
+	tcase_set_timeout(tc_tuning, 10);
+	tcase_add_test(tc_tuning, test_tune_moves_page_sizes_by_density);
+	tcase_add_test(tc_tuning, test_tuned_components_intersect);
+	suite_add_tcase(s, tc_tuning);
+
 	TCase *tc_free = tcase_create("registry_free");
 	tcase_set_timeout(tc_free, 10);
 	tcase_add_test(tc_free, test_free_empty_registry);
@@ -939,6 +939,37 @@ START_TEST(test_unbuffered_set_component)
 }
 END_TEST
 
+START_TEST(test_get_components_many)
+{
+	g_test_component_type_id = w_ecs_get_component_by_name(&g_world, "test_component_many");
+
+	// every third entity has the component, looked up out of order
+	w_entity_id entities[40];
+	for (int i = 0; i < 40; i++)
+	{
+		entities[39 - i] = w_ecs_request_entity(&g_world);
+		if (i % 3 == 0)
+		{
+			struct test_component comp = {.value = i, .data = 0};
+			w_ecs_set_component_(&g_world, 0, g_test_component_type_id, entities[39 - i], &comp, sizeof(comp));
+		}
+	}
+
+	void *components[40];
+	ck_assert_uint_eq(w_ecs_get_components_many(&g_world, g_test_component_type_id, entities, 40, components), 14);
+	for (int k = 0; k < 40; k++)
+	{
+		ck_assert_ptr_eq(components[k], w_ecs_get_component_(&g_world, g_test_component_type_id, entities[k]));
+		if (components[k]) ck_assert_int_eq(((struct test_component *)components[k])->value, 39 - k);
+	}
+
+	// unknown components resolve nothing
+	w_entity_id missing = w_ecs_request_entity(&g_world);
+	ck_assert_uint_eq(w_ecs_get_components_many(&g_world, missing, entities, 40, components), 0);
+	for (int k = 0; k < 40; k++) ck_assert_ptr_null(components[k]);
+}
+END_TEST
+
 START_TEST(test_buffered_set_component)
 {
 	w_entity_id entity = w_ecs_request_entity(&g_world);
@@ -1558,6 +1589,7 @@ Suite *whisker_ecs_world_suite(void)
 	tcase_add_test(tc_buffered, test_unbuffered_clear_entity_name);
 	tcase_add_test(tc_buffered, test_buffered_clear_entity_name);
 	tcase_add_test(tc_buffered, test_unbuffered_set_component);
+	tcase_add_test(tc_buffered, test_get_components_many);
 	tcase_add_test(tc_buffered, test_buffered_set_component);
 	tcase_add_test(tc_buffered, test_unbuffered_remove_component);
 	tcase_add_test(tc_buffered, test_buffered_remove_component);
@@ -395,6 +395,98 @@ START_TEST(test_optional_can_write_when_present)
 }
 END_TEST
 
+// three runs split by entities without position: velocity on all of the
+// first, none of the second and every other entity of the third
+static w_entity_id presence_runs_(void)
+{
+	w_ecs_get_component_by_name(&g_world, "position");
+	w_ecs_get_component_by_name(&g_world, "velocity");
+
+	w_entity_id first = W_ENTITY_INVALID;
+	for (int run = 0; run < 3; run++)
+	{
+		for (int i = 0; i < 100; i++)
+		{
+			w_entity_id e = w_ecs_request_entity(&g_world);
+			if (first == W_ENTITY_INVALID) first = e;
+			set_position(e, (float)e, 0);
+			if (run == 0 || (run == 2 && e % 2 == 0)) set_velocity(e, (float)e, 0);
+		}
+		w_ecs_request_entity(&g_world);
+	}
+	return first;
+}
+
+// entities the optional get disagrees with the velocity bitset on
+static int presence_mismatches_(int *present)
+{
+	struct w_component_entry *velocity = w_ecs_get_component_entry(&g_world, w_ecs_get_component_by_name(&g_world, "velocity"));
+	int mismatches = 0;
+	*present = 0;
+	w_query_for_each(&g_world, "read position, optional velocity", {
+		w_itor_get(Position);
+		Velocity *vel = w_itor_get_optional(Velocity);
+		mismatches += (vel != NULL) != w_sparse_bitset_get(&velocity->data_bitset, itor.entity_id);
+		*present += vel != NULL;
+	});
+	return mismatches;
+}
+
+START_TEST(test_optional_presence_per_slice)
+{
+	w_entity_id first = presence_runs_();
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, optional velocity");
+	w_query_rebuild_cache(&g_world.queries, q);
+	ck_assert_uint_eq(q->presence_terms_length, 1);
+	ck_assert_uint_eq(q->archetype_slices_dense_length, 3);
+	ck_assert(w_query_presence_current(q));
+
+	// whole slices answer without bits, the mixed one keeps a mask
+	ck_assert_uint_eq(q->presence[0], W_QUERY_PRESENCE_ALL);
+	ck_assert_uint_eq(q->presence[1], W_QUERY_PRESENCE_NONE);
+	ck_assert_uint_eq(q->presence[2], 0);
+	ck_assert_uint_eq(q->presence_masks_length, 2);
+	ck_assert(w_query_presence_test(q, q->presence[2], 0) == ((first + 202) % 2 == 0));
+
+	int present;
+	ck_assert_int_eq(presence_mismatches_(&present), 0);
+	ck_assert_int_eq(present, 150);
+}
+END_TEST
+
+START_TEST(test_optional_presence_follows_changes)
+{
+	w_entity_id first = presence_runs_();
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, optional velocity");
+	w_query_rebuild_cache(&g_world.queries, q);
+
+	// optional changes don't touch the slices, iteration falls back to the
+	// bitset until the next rebuild
+	set_velocity(first + 150, 1, 0);
+	ck_assert(!w_query_presence_current(q));
+	int present;
+	ck_assert_int_eq(presence_mismatches_(&present), 0);
+	ck_assert_int_eq(present, 151);
+
+	w_query_rebuild_cache(&g_world.queries, q);
+	ck_assert(w_query_presence_current(q));
+	ck_assert_uint_lt(q->presence[1], W_QUERY_PRESENCE_NONE);
+	ck_assert_int_eq(presence_mismatches_(&present), 0);
+	ck_assert_int_eq(present, 151);
+
+	// typed queries test the same masks
+	int typed_present = 0;
+	int typed_mismatches = 0;
+	w_query_for_each_typed(&g_world, W_QUERY((read, position, Position, pos), (optional, velocity, Velocity, vel)), {
+		typed_present += vel != NULL;
+		typed_mismatches += vel && vel->vx != pos->x && itor.entity_id != first + 150;
+	});
+	ck_assert_int_eq(typed_present, 151);
+	ck_assert_int_eq(typed_mismatches, 0);
+}
+END_TEST
+
 
 /*****************************
 *  'has' terms skipping      *
@@ -411,7 +503,7 @@ START_TEST(test_has_term_skipped_by_iterator)
 		set_health(e, 100, 100);
 	}
 
-	// rebuild cache - 'has' parses to W_QUERY_ACCESS_NONE
+	// rebuild cache - 'has' parses to W_QUERY_ACCESS_HAS
 	struct w_query *q = w_ecs_get_query(&g_world, "read position, has health");
 	w_query_rebuild_cache(&g_world.queries, q);
 
@@ -449,8 +541,7 @@ START_TEST(test_has_term_in_middle_skipped)
 	w_query_for_each(&g_world, "read position, has health, read velocity", {
 		Position *pos = w_itor_get(Position);
 		(void)pos;
-		// 'has health' is skipped by w_itor_get_optional logic
-		// but w_itor_get doesn't skip, so we need to use optional for mid-has
+		// 'has health' carries no data, the next get is velocity
 		Velocity *vel = w_itor_get_optional(Velocity);
 		if (vel)
 			sum_vx += vel->vx;
@@ -462,6 +553,1033 @@ START_TEST(test_has_term_in_middle_skipped)
 }
 END_TEST
 
+START_TEST(test_has_term_filters_entities)
+{
+	// only entities with health pass, without its data being fetched
+	for (int i = 0; i < 6; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		set_velocity(e, (float)(i * 10), 0);
+		if (i % 2 == 0) set_health(e, 10, 100);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, has health, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+
+	int count = 0;
+	float sum_vx = 0;
+	w_query_for_each(&g_world, "read position, has health, read velocity", {
+		Position *pos = w_itor_get(Position);
+		Velocity *vel = w_itor_get(Velocity);
+		ck_assert_float_eq(vel->vx, pos->x * 10);
+		sum_vx += vel->vx;
+		count++;
+	});
+
+	ck_assert_int_eq(count, 3);
+	ck_assert_float_eq(sum_vx, 0 + 20 + 40);
+}
+END_TEST
+
+START_TEST(test_not_term_excludes_entities)
+{
+	w_entity_id entities[6];
+	for (int i = 0; i < 6; i++)
+	{
+		w_entity_id e = entities[i] = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i < 2) set_health(e, 10, 100);
+		if (i == 5) set_scale(e, 2.0f);
+	}
+
+	// not and without are the same, several exclusions are ORed
+	struct w_query *q = w_ecs_get_query(&g_world, "not health, read position, without scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->bitset_cache.bitsets_length, 3);
+
+	int count = 0;
+	float sum_x = 0;
+	w_query_for_each(&g_world, "not health, read position, without scale", {
+		Position *pos = w_itor_get(Position);
+		sum_x += pos->x;
+		count++;
+	});
+
+	ck_assert_int_eq(count, 3);
+	ck_assert_float_eq(sum_x, 2 + 3 + 4);
+
+	// removing the excluded component lets the entity back in
+	w_ecs_remove_component_(&g_world, w_ecs_get_component_by_name(&g_world, "health"), entities[0]);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, 4);
+}
+END_TEST
+
+
+/*****************************
+*  any() groups              *
+*****************************/
+
+START_TEST(test_any_group_matches_union)
+{
+	// position and (velocity or scale)
+	for (int i = 0; i < 8; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i % 4 == 1 || i % 4 == 3) set_velocity(e, (float)i, 0);
+		if (i % 4 == 2 || i % 4 == 3) set_scale(e, (float)i);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, any(read velocity | read scale)");
+	ck_assert_uint_eq(q->terms_length, 3);
+	ck_assert_uint_eq(q->any_groups_length, 1);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+
+	int count = 0;
+	int mismatches = 0;
+	w_query_for_each(&g_world, "read position, any(read velocity | read scale)", {
+		Position *pos = w_itor_get(Position);
+		Velocity *vel = w_itor_get_optional(Velocity);
+		Scale *scale = w_itor_get_optional(Scale);
+		int i = (int)pos->x;
+
+		// the mask agrees with the optional gets
+		uint64_t mask = w_itor_any_mask(0);
+		mismatches += mask != ((uint64_t)(vel != NULL) | ((uint64_t)(scale != NULL) << 1));
+		mismatches += mask != (uint64_t)(i % 4);
+		mismatches += vel && vel->vx != (float)i;
+		mismatches += scale && scale->scale != (float)i;
+		count++;
+	});
+
+	ck_assert_int_eq(count, 6);
+	ck_assert_int_eq(mismatches, 0);
+}
+END_TEST
+
+START_TEST(test_any_group_mask_from_presence)
+{
+	// a dense run of entities with a mix of alternatives, then sparse ones
+	for (int i = 0; i < 300; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		if (i >= 200 && i % 3 != 0) continue;
+		set_position(e, (float)e, 0);
+		if (i % 2 == 0) set_velocity(e, 1, 0);
+		if (i % 5 == 0 || i >= 100) set_scale(e, 1);
+	}
+
+	const char *query_string = "read position, any(has velocity | has scale)";
+	struct w_query *q = w_ecs_get_query(&g_world, (char *)query_string);
+	ck_assert_uint_eq(q->presence_terms_length, 2);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert(w_query_presence_current(q));
+
+	// the presence mask agrees with the per entity bitset lookups
+	int count = 0;
+	int mismatches = 0;
+	int from_presence = 0;
+	w_query_for_each(&g_world, (char *)query_string, {
+		w_itor_get(Position);
+		from_presence += itor.slice_presence != NULL;
+		uint64_t mask = w_itor_any_mask(0);
+		mismatches += mask == 0 || mask != w_query_any_mask(itor.query, 0, itor.entity_id);
+		count++;
+	});
+
+	ck_assert_int_gt(count, 0);
+	ck_assert_int_eq(from_presence, count);
+	ck_assert_int_eq(mismatches, 0);
+}
+END_TEST
+
+START_TEST(test_any_group_with_filters)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i < 3) set_velocity(e, 1, 0);
+		else set_health(e, 10, 100);
+		if (i == 0 || i == 4) set_scale(e, 1);
+	}
+
+	// has alternatives filter without data, exclusions still apply
+	struct w_query *q = w_ecs_get_query(&g_world, "any(has velocity | has health), read position, without scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->data_terms_length, 1);
+
+	float sum_x = 0;
+	int count = 0;
+	w_query_for_each(&g_world, "any(has velocity | has health), read position, without scale", {
+		Position *pos = w_itor_get(Position);
+		sum_x += pos->x;
+		count++;
+	});
+
+	ck_assert_int_eq(count, 4);
+	ck_assert_float_eq(sum_x, 1 + 2 + 3 + 5);
+}
+END_TEST
+
+
+/*****************************
+*  query planner             *
+*****************************/
+
+START_TEST(test_planner_orders_by_cardinality)
+{
+	for (int i = 0; i < 40; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i % 4 == 0) set_velocity(e, (float)i, 0);
+	}
+
+	// velocity is the smaller bitset whichever order the terms are written in
+	struct w_query *a = w_ecs_get_query(&g_world, "read position, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, a));
+
+	struct w_component_entry *velocity = w_ecs_get_component_entry(&g_world, w_ecs_get_component_by_name(&g_world, "velocity"));
+	ck_assert_ptr_eq(a->bitset_cache.bitsets[0], &velocity->data_bitset);
+	ck_assert_int_eq(a->plan_kernel, W_QUERY_PLAN_KERNEL_PAIR);
+	ck_assert_uint_eq(a->bitset_cache.indexes_length, 10);
+
+	// the reversed query aliases the first and reuses its built cache
+	struct w_query *b = w_ecs_get_query(&g_world, "read velocity, read position");
+	a = g_world.queries.queries[0];
+	ck_assert_ptr_eq(w_query_cache_owner(b), a);
+	ck_assert(!w_query_rebuild_cache(&g_world.queries, b));
+
+	// iteration keeps the written term order
+	int mismatches = 0;
+	w_query_for_each(&g_world, "read velocity, read position", {
+		Velocity *vel = w_itor_get(Velocity);
+		Position *pos = w_itor_get(Position);
+		mismatches += vel->vx != pos->x;
+	});
+	ck_assert_int_eq(mismatches, 0);
+}
+END_TEST
+
+START_TEST(test_planner_reorders_after_drift)
+{
+	w_entity_id entities[40];
+	for (int i = 0; i < 40; i++)
+	{
+		entities[i] = w_ecs_request_entity(&g_world);
+		set_position(entities[i], (float)i, 0);
+		if (i % 4 == 0) set_velocity(entities[i], 0, 0);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	struct w_sparse_bitset *first = q->bitset_cache.bitsets[0];
+
+	// small drifts keep the plan, the leading operand stays the same
+	for (int i = 0; i < 40; i += 2) set_velocity(entities[i], 0, 0);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_ptr_eq(q->bitset_cache.bitsets[0], first);
+
+	// velocity past twice the size of position flips the order
+	for (int i = 40; i < 120; i++) set_velocity(w_ecs_request_entity(&g_world), 0, 0);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_ptr_ne(q->bitset_cache.bitsets[0], first);
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, 20);
+}
+END_TEST
+
+START_TEST(test_planner_probes_tiny_operand)
+{
+	w_entity_id entities[2000];
+	for (int i = 0; i < 2000; i++)
+	{
+		entities[i] = w_ecs_request_entity(&g_world);
+		set_position(entities[i], (float)i, 0);
+		set_velocity(entities[i], 0, 0);
+	}
+	set_health(entities[7], 1, 1);
+	set_health(entities[1500], 1, 1);
+	set_health(entities[1501], 1, 1);
+	set_scale(entities[1500], 1);
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity, has health, without scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_int_eq(q->plan_kernel, W_QUERY_PLAN_KERNEL_PROBE);
+	ck_assert(q->bitset_cache.probe);
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, 2);
+	ck_assert_uint_eq(q->bitset_cache.indexes[0], entities[7]);
+	ck_assert_uint_eq(q->bitset_cache.indexes[1], entities[1501]);
+
+	// without the tiny operand the page kernels are used
+	struct w_query *n = w_ecs_get_query(&g_world, "read position, read velocity, without scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, n));
+	ck_assert_int_eq(n->plan_kernel, W_QUERY_PLAN_KERNEL_EXPR);
+	ck_assert_uint_eq(n->bitset_cache.indexes_length, 1999);
+}
+END_TEST
+
+/*****************************
+*  incremental slices        *
+*****************************/
+
+// slices are sorted, classified by length and cover exactly the indexes
+static void assert_slices_match_indexes_(struct w_query *q)
+{
+	size_t d = 0;
+	size_t sp = 0;
+	size_t k = 0;
+	uint64_t last_end = 0;
+	while (d < q->archetype_slices_dense_length || sp < q->archetype_slices_sparse_length)
+	{
+		bool take_dense = sp >= q->archetype_slices_sparse_length ||
+			(d < q->archetype_slices_dense_length && q->archetype_slices_dense[d].start_id < q->archetype_slices_sparse[sp].start_id);
+		struct w_query_archetype_slice slice = take_dense ? q->archetype_slices_dense[d++] : q->archetype_slices_sparse[sp++];
+
+		ck_assert_uint_gt(slice.slice_length, 0);
+		ck_assert_uint_le(slice.slice_length, W_QUERY_REGISTRY_ARCHETYPE_SLICES_MAX_SLICE);
+		ck_assert(take_dense == (slice.slice_length >= W_QUERY_REGISTRY_ARCHETYPE_SLICES_MIN_SLICE));
+		ck_assert(k == 0 || slice.start_id >= last_end);
+
+		for (size_t s = 0; s < slice.slice_length; s++)
+		{
+			ck_assert_uint_lt(k, q->bitset_cache.indexes_length);
+			ck_assert_uint_eq(q->bitset_cache.indexes[k++], slice.start_id + s);
+		}
+		last_end = slice.start_id + slice.slice_length;
+	}
+	ck_assert_uint_eq(k, q->bitset_cache.indexes_length);
+}
+
+START_TEST(test_slices_patched_on_churn)
+{
+	enum { ENTITY_COUNT = 20000 };
+	static w_entity_id entities[ENTITY_COUNT];
+	for (int i = 0; i < ENTITY_COUNT; i++)
+	{
+		entities[i] = w_ecs_request_entity(&g_world);
+		set_position(entities[i], (float)i, 0);
+		if ((i / 700) % 3 != 2) set_velocity(entities[i], 0, 0);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	assert_slices_match_indexes_(q);
+
+	// small churn each tick patches the slices in place, kept to the first
+	// entities so the changes stay within one bitset page
+	uint32_t seed = 12345;
+	int patched = 0;
+	for (int tick = 0; tick < 50; tick++)
+	{
+		for (int c = 0; c < 6; c++)
+		{
+			seed = seed * 1103515245 + 12345;
+			w_entity_id e = entities[(seed >> 8) % 4000];
+			if (c % 2) set_velocity(e, 0, 0);
+			else w_ecs_remove_component_(&g_world, w_ecs_get_component_by_name(&g_world, "velocity"), e);
+		}
+
+		ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+		patched += q->bitset_cache.incremental;
+		assert_slices_match_indexes_(q);
+	}
+	ck_assert_int_eq(patched, 50);
+
+	// a large change falls back to a full rebuild
+	for (int i = 0; i < ENTITY_COUNT; i += 2) set_velocity(entities[i], 0, 0);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert(!q->bitset_cache.incremental);
+	assert_slices_match_indexes_(q);
+}
+END_TEST
+
+START_TEST(test_full_rebuild_on_intersect_threads)
+{
+	enum { ENTITY_COUNT = 60000 };
+	static w_entity_id entities[ENTITY_COUNT];
+	ck_assert_uint_eq(g_world.queries.intersect_threads, W_QUERY_REGISTRY_INTERSECT_THREADS);
+	g_world.queries.intersect_threads = 4;
+
+	int expected = 0;
+	for (int i = 0; i < ENTITY_COUNT; i++)
+	{
+		entities[i] = w_ecs_request_entity(&g_world);
+		set_position(entities[i], (float)i, 0);
+		if ((i / 900) % 4 != 3 && i % 7 != 0)
+		{
+			set_velocity(entities[i], 0, 0);
+			expected++;
+		}
+	}
+
+	// the full rebuild is split across threads, the matches don't change
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert(!q->bitset_cache.incremental);
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, expected);
+	assert_slices_match_indexes_(q);
+
+	// small churn still patches incrementally on the calling thread
+	w_ecs_remove_component_(&g_world, w_ecs_get_component_by_name(&g_world, "velocity"), entities[1]);
+	set_velocity(entities[7], 0, 0);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert(q->bitset_cache.incremental);
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, expected);
+	assert_slices_match_indexes_(q);
+}
+END_TEST
+
+/*****************************
+*  ordered queries           *
+*****************************/
+
+// walk an ordered query, counting order violations against health and the
+// entities that shouldn't match
+static int check_health_order_(const char *query_string, int *count)
+{
+	int violations = 0;
+	int prev_health = INT32_MIN;
+	w_entity_id prev_id = 0;
+	*count = 0;
+	w_query_for_each(&g_world, (char *)query_string, {
+		Position *pos = w_itor_get(Position);
+		Health *health = w_ecs_get_component_(&g_world, w_ecs_get_component_by_name(&g_world, "health"), itor.entity_id);
+		violations += !health || pos->x != (float)itor.entity_id;
+		if (health)
+		{
+			violations += health->health < prev_health || (health->health == prev_health && itor.entity_id < prev_id);
+			prev_health = health->health;
+		}
+		prev_id = itor.entity_id;
+		(*count)++;
+	});
+	return violations;
+}
+
+START_TEST(test_order_by_iterates_sorted)
+{
+	int expected = 0;
+	for (int i = 0; i < 300; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)e, 0);
+		if (i % 4 != 0)
+		{
+			set_health(e, (i * 37) % 101, 100);
+			expected++;
+		}
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, order_by health");
+	ck_assert_uint_eq(q->order_term, 1);
+	ck_assert_uint_eq(q->data_terms_length, 1);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->order_length, expected);
+
+	int count;
+	ck_assert_int_eq(check_health_order_("read position, order_by health", &count), 0);
+	ck_assert_int_eq(count, expected);
+
+	// nothing changed, nothing to re-sort
+	ck_assert(!w_query_rebuild_cache(&g_world.queries, q));
+}
+END_TEST
+
+START_TEST(test_order_by_resorts_changed_entries)
+{
+	w_entity_id entities[400];
+	for (int i = 0; i < 400; i++)
+	{
+		entities[i] = w_ecs_request_entity(&g_world);
+		set_position(entities[i], (float)entities[i], 0);
+		if (i < 300) set_health(entities[i], i % 50, 100);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "order_by health, read position");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+
+	uint32_t seed = 99;
+	for (int tick = 0; tick < 20; tick++)
+	{
+		// key writes in place, entities leaving and joining
+		for (int c = 0; c < 8; c++)
+		{
+			seed = seed * 1103515245 + 12345;
+			w_entity_id e = entities[(seed >> 8) % 400];
+			Health *health = w_ecs_get_component_(&g_world, w_ecs_get_component_by_name(&g_world, "health"), e);
+			if (c % 4 == 0) w_ecs_remove_component_(&g_world, w_ecs_get_component_by_name(&g_world, "health"), e);
+			else if (health) health->health = (int)((seed >> 4) % 60) - 5;
+			else set_health(e, (int)(seed % 60), 100);
+		}
+
+		ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+
+		int count;
+		ck_assert_int_eq(check_health_order_("order_by health, read position", &count), 0);
+		ck_assert_uint_eq(count, w_ecs_get_component_entry(&g_world, w_ecs_get_component_by_name(&g_world, "health"))->data_bitset.cardinality);
+	}
+}
+END_TEST
+
+START_TEST(test_order_by_shares_filter_cache)
+{
+	for (int i = 0; i < 100; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)e, 0);
+		set_health(e, 100 - i, 100);
+	}
+
+	// ordering doesn't change the matches, only the alias' own order
+	struct w_query *plain = w_ecs_get_query(&g_world, "read position, has health");
+	struct w_query *ordered = w_ecs_get_query(&g_world, "read position, order_by health");
+	plain = g_world.queries.queries[0];
+	ck_assert_ptr_eq(w_query_cache_owner(ordered), plain);
+	ck_assert_uint_eq(plain->order_term, W_QUERY_ORDER_NONE);
+
+	ck_assert(w_query_rebuild_cache(&g_world.queries, ordered));
+	ck_assert_uint_eq(ordered->order_length, 100);
+	ck_assert_uint_eq(ordered->order[0].entity_id, plain->bitset_cache.indexes[99]);
+
+	int count;
+	ck_assert_int_eq(check_health_order_("read position, order_by health", &count), 0);
+	ck_assert_int_eq(count, 100);
+
+	// the plain query still iterates its slices
+	w_entity_id first = W_ENTITY_INVALID;
+	count = 0;
+	w_query_for_each(&g_world, "read position, has health", {
+		if (first == W_ENTITY_INVALID) first = itor.entity_id;
+		count++;
+	});
+	ck_assert_int_eq(count, 100);
+	ck_assert_uint_ne(first, ordered->order[0].entity_id);
+}
+END_TEST
+
+START_TEST(test_order_by_sorts_nan_keys_last)
+{
+	for (int i = 0; i < 200; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)e, 0);
+		set_scale(e, (i % 3 == 0) ? NAN : (float)((i * 53) % 29));
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, order_by scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->order_length, 200);
+
+	// the finite keys ascending, then the NaN keys by entity ID
+	for (size_t i = 1; i < q->order_length; i++)
+	{
+		struct w_query_order_entry a = q->order[i - 1];
+		struct w_query_order_entry b = q->order[i];
+		if (isnan(a.key)) ck_assert(isnan(b.key) && a.entity_id < b.entity_id);
+		else ck_assert(isnan(b.key) || a.key < b.key || (a.key == b.key && a.entity_id < b.entity_id));
+	}
+	ck_assert(isnan(q->order[q->order_length - 1].key));
+
+	// NaN keys that stay NaN aren't re-sorted every tick
+	ck_assert(!w_query_rebuild_cache(&g_world.queries, q));
+}
+END_TEST
+
+START_TEST(test_order_by_rejects_unknown_key_type)
+{
+	w_entity_id e = w_ecs_request_entity(&g_world);
+	set_position(e, 1, 0);
+	Scale s = {1};
+	w_ecs_set_component_(&g_world, W_COMPONENT_TYPE_COUNT + 1,
+		w_ecs_get_component_by_name(&g_world, "blob"), e, &s, sizeof(Scale));
+
+	// no known layout to key on, the query never finishes parsing
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, order_by blob");
+	ck_assert_int_ne(q->query_parse_state, W_QUERY_PARSE_STATE_COMPONENTS_PARSED);
+	ck_assert(!w_query_rebuild_cache(&g_world.queries, q));
+
+	int count = 0;
+	w_query_for_each(&g_world, "read position, order_by blob", { count++; });
+	ck_assert_int_eq(count, 0);
+}
+END_TEST
+
+/*****************************
+*  count queries             *
+*****************************/
+
+START_TEST(test_count_matches_iteration)
+{
+	for (int i = 0; i < 300; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i % 3 == 0) set_velocity(e, 1, 0);
+		if (i % 5 == 0) set_health(e, i, 100);
+	}
+
+	// counting builds neither indexes nor slices
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity, not health");
+	uint64_t count = w_query_count(&g_world.queries, q);
+	ck_assert(w_query_any(&g_world.queries, q));
+	ck_assert_uint_eq(q->rebuilds, 0);
+	ck_assert_uint_eq(q->bitset_cache.indexes_length, 0);
+	ck_assert_uint_eq(q->archetype_slices_dense_length + q->archetype_slices_sparse_length, 0);
+
+	w_query_rebuild_cache(&g_world.queries, q);
+	uint64_t iterated = 0;
+	w_query_for_each(&g_world, "read position, read velocity, not health", {
+		iterated++;
+	});
+	ck_assert_uint_eq(count, iterated);
+	ck_assert_uint_eq(count, 80);
+
+	// a built cache answers directly
+	ck_assert_uint_eq(w_query_count(&g_world.queries, q), iterated);
+}
+END_TEST
+
+START_TEST(test_any_stops_without_matches)
+{
+	for (int i = 0; i < 50; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+	}
+	w_ecs_get_component_by_name(&g_world, "velocity");
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, read velocity");
+	ck_assert(!w_query_any(&g_world.queries, q));
+	ck_assert_uint_eq(w_query_count(&g_world.queries, q), 0);
+
+	// counts follow component changes
+	w_entity_id e = w_ecs_request_entity(&g_world);
+	set_position(e, 1, 1);
+	set_velocity(e, 1, 1);
+	ck_assert(w_query_any(&g_world.queries, q));
+	ck_assert_uint_eq(w_query_count(&g_world.queries, q), 1);
+	ck_assert_uint_eq(w_query_count(&g_world.queries, w_ecs_get_query(&g_world, "read position")), 51);
+}
+END_TEST
+
+/*****************************
+*  query stats               *
+*****************************/
+
+START_TEST(test_query_stats_track_cache_and_iteration)
+{
+	// a dense run of 40, then 10 single entities
+	w_ecs_get_component_by_name(&g_world, "position");
+	for (int i = 0; i < 40; i++) set_position(w_ecs_request_entity(&g_world), 1, 0);
+	for (int i = 0; i < 10; i++)
+	{
+		w_ecs_request_entity(&g_world);
+		set_position(w_ecs_request_entity(&g_world), 1, 0);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position");
+	uint64_t id = q->id;
+	w_query_rebuild_cache(&g_world.queries, q);
+	for (int run = 0; run < 3; run++)
+	{
+		w_query_for_each(&g_world, "read position", {
+			w_itor_get(Position);
+		});
+	}
+
+	struct w_query_stats stats;
+	ck_assert(w_query_registry_get_query_stats(&g_world.queries, id, &stats));
+	ck_assert_uint_eq(stats.cache_owner, id);
+	ck_assert_uint_eq(stats.rebuilds, 1);
+	ck_assert_uint_gt(stats.rebuild_time, 0);
+	ck_assert_uint_eq(stats.iterations, 3);
+	ck_assert_uint_eq(stats.matches, 50);
+	ck_assert_uint_eq(stats.dense_slices, 1);
+	ck_assert_uint_eq(stats.sparse_slices, 10);
+	ck_assert_uint_eq(stats.dense_entities, 40);
+	ck_assert_uint_eq(stats.sparse_entities, 10);
+	ck_assert_uint_ge(stats.bytes, 50 * sizeof(uint64_t));
+
+	// ticks with nothing to rebuild aren't timed
+	uint64_t rebuild_time = q->rebuild_time;
+	ck_assert(!w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_eq(q->rebuild_time, rebuild_time);
+
+	// aliases report their owner's cache with their own counters
+	struct w_query *alias = w_ecs_get_query(&g_world, "write position");
+	uint64_t alias_id = alias->id;
+	set_position(w_ecs_request_entity(&g_world), 1, 0);
+	ck_assert(w_query_rebuild_cache(&g_world.queries, alias));
+	ck_assert(w_query_registry_get_query_stats(&g_world.queries, alias_id, &stats));
+	ck_assert_uint_eq(stats.cache_owner, id);
+	ck_assert_uint_eq(stats.matches, 51);
+	ck_assert_uint_eq(stats.iterations, 0);
+
+	// the owner's rebuild is timed on the owner only
+	ck_assert_uint_eq(stats.rebuild_time, 0);
+	ck_assert_uint_gt(q->rebuild_time, rebuild_time);
+
+	ck_assert(!w_query_registry_get_query_stats(&g_world.queries, g_world.queries.queries_length, &stats));
+}
+END_TEST
+
+START_TEST(test_query_stats_dump)
+{
+	for (int i = 0; i < 5; i++) set_position(w_ecs_request_entity(&g_world), 1, 0);
+	w_query_rebuild_cache(&g_world.queries, w_ecs_get_query(&g_world, "read position"));
+	w_query_for_each_typed(&g_world, W_QUERY((read, position, Position, pos)), {
+		(void)pos;
+	});
+
+	FILE *out = tmpfile();
+	ck_assert_ptr_nonnull(out);
+	w_query_registry_dump_stats(&g_world.queries, out);
+	rewind(out);
+
+	char line[512];
+	int lines = 0;
+	bool found_string = false;
+	bool found_typed = false;
+	while (fgets(line, sizeof(line), out))
+	{
+		lines++;
+		if (strstr(line, "matches=5 ") && strstr(line, "\"read position\"")) found_string = true;
+		if (strstr(line, "iterations=1 ") && strstr(line, "\"read ")) found_typed = true;
+	}
+	fclose(out);
+
+	ck_assert_int_eq(lines, (int)g_world.queries.queries_length);
+	ck_assert(found_string);
+	ck_assert(found_typed);
+}
+END_TEST
+
+/*****************************
+*  chunked iteration         *
+*****************************/
+
+START_TEST(test_chunk_iteration_covers_slices)
+{
+	// a dense run, then sparse entities
+	int expected = 0;
+	float expected_sum = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 1);
+		if (i < 100 || i % 7 == 0)
+		{
+			set_velocity(e, (float)i, 0);
+			expected++;
+			expected_sum += (float)i;
+		}
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "write position, has velocity, read velocity");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_uint_gt(q->archetype_slices_dense_length, 0);
+	ck_assert_uint_gt(q->archetype_slices_sparse_length, 0);
+
+	int count = 0;
+	int chunks = 0;
+	int mismatches = 0;
+	float sum = 0;
+	w_query_for_each_chunk(&g_world, "write position, has velocity, read velocity", {
+		Position *pos = w_chunk_get(Position);
+		Velocity *vel = w_chunk_get(Velocity);
+		for (size_t k = 0; k < chunk.length; k++)
+		{
+			mismatches += vel[k].vx != pos[k].x;
+			pos[k].y += vel[k].vx;
+			sum += vel[k].vx;
+		}
+		count += (int)chunk.length;
+		chunks++;
+	});
+
+	ck_assert_int_eq(mismatches, 0);
+	ck_assert_int_eq(count, expected);
+	ck_assert_float_eq(sum, expected_sum);
+	ck_assert_int_eq(chunks, (int)(q->archetype_slices_dense_length + q->archetype_slices_sparse_length));
+
+	// writes through the columns land on the entities
+	float total = 0;
+	w_query_for_each(&g_world, "write position, has velocity, read velocity", {
+		Position *pos = w_itor_get(Position);
+		total += pos->y - 1;
+	});
+	ck_assert_float_eq(total, expected_sum);
+}
+END_TEST
+
+START_TEST(test_chunk_optional_terms)
+{
+	// scale is known but no entity has it yet
+	w_ecs_get_component_by_name(&g_world, "scale");
+	w_entity_id ids[250];
+	for (int i = 0; i < 250; i++)
+	{
+		ids[i] = w_ecs_request_entity(&g_world);
+		if (i < 100 || (i >= 110 && i < 200) || i >= 210) set_position(ids[i], (float)i, 0);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, optional scale");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	ck_assert_ptr_null(q->terms[1].component_entry);
+
+	int count = 0;
+	int mismatches = 0;
+	w_query_for_each_chunk(&g_world, "read position, optional scale", {
+		w_chunk_get(Position);
+		Scale *scale = w_chunk_get_optional(Scale);
+		mismatches += scale != NULL;
+		for (size_t k = 0; k < chunk.length; k++) mismatches += w_chunk_has(1, k);
+		count += (int)chunk.length;
+	});
+	ck_assert_int_eq(count, 230);
+	ck_assert_int_eq(mismatches, 0);
+
+	// a run with some, one without any and one with all of them
+	for (int i = 0; i < 250; i++)
+	{
+		if ((i < 100 && i % 2 == 0) || i >= 210) set_scale(ids[i], (float)i);
+	}
+
+	w_query_rebuild_cache(&g_world.queries, q);
+	ck_assert(w_query_presence_current(q));
+
+	count = 0;
+	int with_scale = 0;
+	int none = 0;
+	int all = 0;
+	w_query_for_each_chunk(&g_world, "read position, optional scale", {
+		Position *pos = w_chunk_get(Position);
+		Scale *scale = w_chunk_get_optional(Scale);
+		ck_assert_ptr_nonnull(chunk.slice_presence);
+		uint64_t presence = chunk.slice_presence[0];
+		none += presence == W_QUERY_PRESENCE_NONE;
+		all += presence == W_QUERY_PRESENCE_ALL;
+		mismatches += (scale == NULL) != (presence == W_QUERY_PRESENCE_NONE);
+		for (size_t k = 0; k < chunk.length; k++)
+		{
+			bool has = w_chunk_has(1, k);
+			mismatches += has != w_sparse_bitset_get(&q->terms[1].component_entry->data_bitset, chunk.start_id + k);
+			mismatches += has && scale[k].scale != pos[k].x;
+			with_scale += has;
+		}
+		count += (int)chunk.length;
+	});
+	ck_assert_int_eq(count, 230);
+	ck_assert_int_eq(with_scale, 90);
+	ck_assert_int_gt(none, 0);
+	ck_assert_int_gt(all, 0);
+	ck_assert_int_eq(mismatches, 0);
+}
+END_TEST
+
+/*****************************
+*  typed queries             *
+*****************************/
+
+START_TEST(test_typed_query_matches_string_query)
+{
+	for (int i = 0; i < 300; i++)
+	{
+		w_entity_id e = w_ecs_request_entity(&g_world);
+		set_position(e, (float)i, 0);
+		if (i % 3 != 0) set_velocity(e, (float)i, 1);
+		if (i % 5 == 0) set_scale(e, 2.0f);
+		if (i % 11 == 0) set_health(e, 1, 1);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "write position, read velocity, optional scale, without health");
+	ck_assert(w_query_rebuild_cache(&g_world.queries, q));
+	int expected = 0;
+	float expected_sum = 0;
+	w_query_for_each(&g_world, "write position, read velocity, optional scale, without health", {
+		w_itor_get(Position);
+		Velocity *vel = w_itor_get(Velocity);
+		Scale *scale = w_itor_get_optional(Scale);
+		expected_sum += vel->vx * (scale ? scale->scale : 1);
+		expected++;
+	});
+
+	// the typed form is registered without parsing and iterates the same
+	size_t queries_length = g_world.queries.queries_length;
+	int count = 0;
+	int mismatches = 0;
+	float sum = 0;
+	for (int run = 0; run < 2; run++)
+	{
+		w_query_for_each_typed(&g_world, W_QUERY(
+			(write, position, Position, pos),
+			(read, velocity, Velocity, vel),
+			(optional, scale, Scale, scale),
+			(without, health, Health, health)), {
+			mismatches += pos->x != vel->vx;
+			mismatches += (scale != NULL) != ((int)pos->x % 5 == 0);
+			if (run == 0) sum += vel->vx * (scale ? scale->scale : 1);
+			if (run == 0) count++;
+			pos->y += 1;
+		});
+	}
+	ck_assert_uint_eq(g_world.queries.queries_length, queries_length + 1);
+
+	struct w_query *typed = g_world.queries.queries[queries_length];
+	ck_assert_int_eq(typed->query_parse_state, W_QUERY_PARSE_STATE_COMPONENTS_PARSED);
+	ck_assert_uint_eq(typed->data_terms_length, 3);
+
+	ck_assert_int_eq(mismatches, 0);
+	ck_assert_int_eq(count, expected);
+	ck_assert_float_eq(sum, expected_sum);
+
+	// writes land in the component data
+	float y = 0;
+	w_query_for_each(&g_world, "write position, read velocity, optional scale, without health", {
+		Position *pos = w_itor_get(Position);
+		y += pos->y;
+	});
+	ck_assert_float_eq(y, 2.0f * expected);
+}
+END_TEST
+
+/*****************************
+*  call site slots           *
+*****************************/
+
+// one call site shared by every world passed in
+static float sum_positions_(struct w_ecs_world *world)
+{
+	w_query_rebuild_cache(&world->queries, w_ecs_get_query(world, "read position"));
+
+	float sum = 0;
+	w_query_for_each(world, "read position", {
+		Position *pos = w_itor_get(Position);
+		sum += pos->x;
+	});
+	return sum;
+}
+
+static float sum_positions_typed_(struct w_ecs_world *world)
+{
+	float sum = 0;
+	w_query_for_each_typed(world, W_QUERY((read, position, Position, pos)), {
+		sum += pos->x;
+	});
+	return sum;
+}
+
+static void add_positions_(struct w_ecs_world *world, int count, float x)
+{
+	for (int i = 0; i < count; i++)
+	{
+		Position p = {x, 0};
+		w_ecs_set_component_(world, W_COMPONENT_TYPE_float,
+			w_ecs_get_component_by_name(world, "position"), w_ecs_request_entity(world), &p, sizeof(Position));
+	}
+}
+
+START_TEST(test_call_site_shared_across_worlds)
+{
+	struct w_ecs_world world2;
+	w_ecs_world_init(&world2, &g_string_table, &g_arena);
+
+	// the second world registers an extra query first so the same query
+	// lands on a different index in each world
+	w_ecs_get_query(&world2, "read velocity");
+	add_positions_(&g_world, 10, 1.0f);
+	add_positions_(&world2, 20, 2.0f);
+
+	for (int run = 0; run < 2; run++)
+	{
+		ck_assert_float_eq(sum_positions_(&g_world), 10.0f);
+		ck_assert_float_eq(sum_positions_(&world2), 40.0f);
+		ck_assert_float_eq(sum_positions_typed_(&g_world), 10.0f);
+		ck_assert_float_eq(sum_positions_typed_(&world2), 40.0f);
+	}
+
+	// each world resolved the call site once
+	ck_assert_uint_eq(g_world.queries.queries_length, 2);
+	ck_assert_uint_eq(world2.queries.queries_length, 3);
+
+	w_ecs_world_free(&world2);
+}
+END_TEST
+
+START_TEST(test_call_site_survives_registry_growth)
+{
+	add_positions_(&g_world, 10, 1.0f);
+	ck_assert_float_eq(sum_positions_(&g_world), 10.0f);
+	ck_assert_float_eq(sum_positions_typed_(&g_world), 10.0f);
+
+	// grow the queries array past its block so it moves, the queries
+	// themselves stay put
+	struct w_query **queries = g_world.queries.queries;
+	struct w_query *q = w_ecs_get_query(&g_world, "read position");
+	w_entity_id ids[] = {w_ecs_get_component_by_name(&g_world, "position")};
+	enum W_QUERY_ACCESS access[] = {W_QUERY_ACCESS_READ};
+	for (int i = 0; i < W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE * 2; i++)
+	{
+		w_query_registry_add_query(&g_world.queries, ids, access, 1);
+	}
+	ck_assert_ptr_ne(g_world.queries.queries, queries);
+	ck_assert_ptr_eq(w_ecs_get_query(&g_world, "read position"), q);
+
+	add_positions_(&g_world, 5, 3.0f);
+	ck_assert_float_eq(sum_positions_(&g_world), 25.0f);
+	ck_assert_float_eq(sum_positions_typed_(&g_world), 25.0f);
+}
+END_TEST
+
+// resolve enough new queries to move the queries array
+static void grow_queries_(int *grown)
+{
+	for (int k = 0; k < W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE / 8; k++)
+	{
+		char query_string[64];
+		snprintf(query_string, sizeof(query_string), "read position, has grow_%d", (*grown)++);
+		w_ecs_get_query(&g_world, query_string);
+	}
+}
+
+START_TEST(test_nested_loops_survive_registry_growth)
+{
+	add_positions_(&g_world, 20, 1.0f);
+	w_query_rebuild_cache(&g_world.queries, w_ecs_get_query(&g_world, "read position"));
+
+	// each outer entity resolves new queries from inside the block while the
+	// outer loop keeps using its query
+	int grown = 0;
+	float sum = 0;
+	w_query_for_each(&g_world, "read position", {
+		grow_queries_(&grown);
+		w_query_for_each(&g_world, "read position, has velocity", { w_itor_get(Position); });
+		Position *pos = w_itor_get(Position);
+		sum += pos->x * (float)itor.query->data_terms_length;
+	});
+	ck_assert_float_eq(sum, 20.0f);
+
+	size_t rows = 0;
+	w_query_for_each_chunk(&g_world, "read position", {
+		grow_queries_(&grown);
+		Position *pos = w_chunk_get(Position);
+		for (size_t k = 0; k < chunk.length; k++) rows += pos[k].x == 1.0f;
+	});
+	ck_assert_uint_eq(rows, 20);
+
+	sum = 0;
+	w_query_for_each_typed(&g_world, W_QUERY((read, position, Position, pos)), {
+		grow_queries_(&grown);
+		sum += pos->x * (float)itor.query->data_terms_length;
+	});
+	ck_assert_float_eq(sum, 20.0f);
+
+	ck_assert_uint_gt(g_world.queries.queries_length, W_QUERY_REGISTRY_QUERIES_REALLOC_BLOCK_SIZE * 2);
+}
+END_TEST
 
 /*****************************
 *  dense slices              *
@@ -599,6 +1717,68 @@ START_TEST(test_sparse_single_entities)
 }
 END_TEST
 
+START_TEST(test_sparse_batches_cover_fragmented_ids)
+{
+	// runs of 1-3 entities between gaps, more than a few batches worth
+	w_ecs_get_component_by_name(&g_world, "position");
+	w_ecs_get_component_by_name(&g_world, "velocity");
+	int expected = 0;
+	for (int i = 0; i < 200; i++)
+	{
+		for (int k = 0; k <= i % 3; k++)
+		{
+			w_entity_id e = w_ecs_request_entity(&g_world);
+			set_position(e, (float)e, 0);
+			if (e % 3 == 0) set_velocity(e, (float)e, 0);
+			expected++;
+		}
+		w_ecs_request_entity(&g_world);
+	}
+
+	struct w_query *q = w_ecs_get_query(&g_world, "read position, optional velocity");
+	w_query_rebuild_cache(&g_world.queries, q);
+	ck_assert_uint_eq(q->archetype_slices_dense_length, 0);
+	ck_assert_uint_eq(q->sparse_ids_length, (size_t)expected);
+	for (size_t k = 0; k < q->sparse_ids_length; k++)
+	{
+		ck_assert_uint_eq(q->sparse_ids[k], q->bitset_cache.indexes[k]);
+	}
+
+	// every entity once, in ID order, with its own row and presence
+	int count = 0;
+	int mismatches = 0;
+	w_entity_id last = 0;
+	w_query_for_each(&g_world, "read position, optional velocity", {
+		Position *pos = w_itor_get(Position);
+		Velocity *vel = w_itor_get_optional(Velocity);
+		mismatches += (w_entity_id)pos->x != itor.entity_id;
+		mismatches += (vel != NULL) != (itor.entity_id % 3 == 0);
+		mismatches += count > 0 && itor.entity_id <= last;
+		last = itor.entity_id;
+		count++;
+	});
+	ck_assert_int_eq(count, expected);
+	ck_assert_int_eq(mismatches, 0);
+
+	// typed queries walk the same entities
+	count = 0;
+	w_query_for_each_typed(&g_world, W_QUERY((read, position, Position, pos), (optional, velocity, Velocity, vel)), {
+		mismatches += (w_entity_id)pos->x != itor.entity_id;
+		mismatches += (vel != NULL) != (itor.entity_id % 3 == 0);
+		count++;
+	});
+	ck_assert_int_eq(count, expected);
+	ck_assert_int_eq(mismatches, 0);
+
+	// patched slices repack the IDs
+	w_entity_id e = w_ecs_request_entity(&g_world);
+	set_position(e, (float)e, 0);
+	w_query_rebuild_cache(&g_world.queries, q);
+	ck_assert_uint_eq(q->sparse_ids_length, (size_t)expected + 1);
+	ck_assert_uint_eq(q->sparse_ids[expected], e);
+}
+END_TEST
+
 
 /*****************************
 *  mixed dense/sparse        *
@@ -945,6 +2125,8 @@ Suite *whisker_query_iterator_suite(void)
 	tcase_set_timeout(tc_opt_present, 10);
 	tcase_add_test(tc_opt_present, test_optional_returns_data_when_present);
 	tcase_add_test(tc_opt_present, test_optional_can_write_when_present);
+	tcase_add_test(tc_opt_present, test_optional_presence_per_slice);
+	tcase_add_test(tc_opt_present, test_optional_presence_follows_changes);
 	suite_add_tcase(s, tc_opt_present);
 
 	TCase *tc_has = tcase_create("has_terms");
@@ -952,8 +2134,76 @@ Suite *whisker_query_iterator_suite(void)
 	tcase_set_timeout(tc_has, 10);
 	tcase_add_test(tc_has, test_has_term_skipped_by_iterator);
 	tcase_add_test(tc_has, test_has_term_in_middle_skipped);
+	tcase_add_test(tc_has, test_has_term_filters_entities);
+	tcase_add_test(tc_has, test_not_term_excludes_entities);
 	suite_add_tcase(s, tc_has);
 
+	TCase *tc_any = tcase_create("any_groups");
+	tcase_add_checked_fixture(tc_any, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_any, 10);
+	tcase_add_test(tc_any, test_any_group_matches_union);
+	tcase_add_test(tc_any, test_any_group_mask_from_presence);
+	tcase_add_test(tc_any, test_any_group_with_filters);
+	suite_add_tcase(s, tc_any);
+
+	TCase *tc_planner = tcase_create("planner");
+	tcase_add_checked_fixture(tc_planner, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_planner, 10);
+	tcase_add_test(tc_planner, test_planner_orders_by_cardinality);
+	tcase_add_test(tc_planner, test_planner_reorders_after_drift);
+	tcase_add_test(tc_planner, test_planner_probes_tiny_operand);
+	suite_add_tcase(s, tc_planner);
+
+	TCase *tc_patch = tcase_create("incremental_slices");
+	tcase_add_checked_fixture(tc_patch, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_patch, 30);
+	tcase_add_test(tc_patch, test_slices_patched_on_churn);
+	tcase_add_test(tc_patch, test_full_rebuild_on_intersect_threads);
+	suite_add_tcase(s, tc_patch);
+
+	TCase *tc_order = tcase_create("ordered_queries");
+	tcase_add_checked_fixture(tc_order, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_order, 10);
+	tcase_add_test(tc_order, test_order_by_iterates_sorted);
+	tcase_add_test(tc_order, test_order_by_resorts_changed_entries);
+	tcase_add_test(tc_order, test_order_by_shares_filter_cache);
+	tcase_add_test(tc_order, test_order_by_sorts_nan_keys_last);
+	tcase_add_test(tc_order, test_order_by_rejects_unknown_key_type);
+	suite_add_tcase(s, tc_order);
+
+	TCase *tc_count = tcase_create("count_queries");
+	tcase_add_checked_fixture(tc_count, query_iterator_setup, query_iterator_teardown);
+	tcase_add_test(tc_count, test_count_matches_iteration);
+	tcase_add_test(tc_count, test_any_stops_without_matches);
+	suite_add_tcase(s, tc_count);
+
+	TCase *tc_stats = tcase_create("query_stats");
+	tcase_add_checked_fixture(tc_stats, query_iterator_setup, query_iterator_teardown);
+	tcase_add_test(tc_stats, test_query_stats_track_cache_and_iteration);
+	tcase_add_test(tc_stats, test_query_stats_dump);
+	suite_add_tcase(s, tc_stats);
+
+	TCase *tc_chunk = tcase_create("chunked_iteration");
+	tcase_add_checked_fixture(tc_chunk, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_chunk, 10);
+	tcase_add_test(tc_chunk, test_chunk_iteration_covers_slices);
+	tcase_add_test(tc_chunk, test_chunk_optional_terms);
+	suite_add_tcase(s, tc_chunk);
+
+	TCase *tc_typed = tcase_create("typed_queries");
+	tcase_add_checked_fixture(tc_typed, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_typed, 10);
+	tcase_add_test(tc_typed, test_typed_query_matches_string_query);
+	suite_add_tcase(s, tc_typed);
+
+	TCase *tc_sites = tcase_create("call_site_slots");
+	tcase_add_checked_fixture(tc_sites, query_iterator_setup, query_iterator_teardown);
+	tcase_set_timeout(tc_sites, 10);
+	tcase_add_test(tc_sites, test_call_site_shared_across_worlds);
+	tcase_add_test(tc_sites, test_call_site_survives_registry_growth);
+	tcase_add_test(tc_sites, test_nested_loops_survive_registry_growth);
+	suite_add_tcase(s, tc_sites);
+
 	TCase *tc_dense = tcase_create("dense_slices");
 	tcase_add_checked_fixture(tc_dense, query_iterator_setup, query_iterator_teardown);
 	tcase_set_timeout(tc_dense, 10);
@@ -966,6 +2216,7 @@ Suite *whisker_query_iterator_suite(void)
 	tcase_set_timeout(tc_sparse, 10);
 	tcase_add_test(tc_sparse, test_sparse_slice_iteration);
 	tcase_add_test(tc_sparse, test_sparse_single_entities);
+	tcase_add_test(tc_sparse, test_sparse_batches_cover_fragmented_ids);
 	suite_add_tcase(s, tc_sparse);
 
 	TCase *tc_mixed = tcase_create("mixed_slices");
@@ -199,6 +199,65 @@ START_TEST(test_stage2_optional_access)
 }
 END_TEST
 
+START_TEST(test_stage2_filter_access)
+{
+	struct w_query *q = w_query_registry_get_query(&g_registry, "has a, not b, without c, read d");
+	ck_assert_ptr_nonnull(q);
+	ck_assert_int_eq(q->terms_length, 4);
+	ck_assert_int_eq(q->terms[0].access_type, W_QUERY_ACCESS_HAS);
+	ck_assert_int_eq(q->terms[1].access_type, W_QUERY_ACCESS_NOT);
+	ck_assert_int_eq(q->terms[2].access_type, W_QUERY_ACCESS_NOT);
+	ck_assert_int_eq(q->terms[3].access_type, W_QUERY_ACCESS_READ);
+
+	// only data terms are stepped through by the iterator
+	ck_assert_uint_eq(q->data_terms_length, 1);
+	ck_assert_uint_eq(q->data_terms[0], 3);
+}
+END_TEST
+
+START_TEST(test_stage1_any_group_split)
+{
+	struct w_query *q = w_query_registry_get_query(&g_registry, "read a, any(read b |write c|  has d ), any(read e)");
+	ck_assert_ptr_nonnull(q);
+	ck_assert_int_eq(q->terms_length, 5);
+	ck_assert_uint_eq(q->any_groups_length, 2);
+
+	const char *expected[] = {"read a", "read b", "write c", "has d", "read e"};
+	uint32_t groups[] = {W_QUERY_ANY_GROUP_NONE, 0, 0, 0, 1};
+	uint32_t alternatives[] = {0, 0, 1, 2, 0};
+	for (int i = 0; i < 5; i++)
+	{
+		ck_assert_str_eq(w_string_table_lookup(&g_string_table, q->terms[i].raw_term), expected[i]);
+		ck_assert_uint_eq(q->terms[i].any_group, groups[i]);
+		ck_assert_uint_eq(q->terms[i].any_alternative, alternatives[i]);
+	}
+	ck_assert_int_eq(q->terms[3].access_type, W_QUERY_ACCESS_HAS);
+	ck_assert_uint_eq(q->data_terms_length, 4);
+
+	// every alternative keeps slice presence, has terms included
+	ck_assert_uint_eq(q->presence_terms_length, 4);
+	ck_assert_uint_eq(q->terms[3].presence_term, 2);
+}
+END_TEST
+
+START_TEST(test_stage1_any_group_too_many_alternatives)
+{
+	char query_string[W_QUERY_ANY_MAX_ALTERNATIVES * 12 + 16] = "any(";
+	for (int i = 0; i <= W_QUERY_ANY_MAX_ALTERNATIVES; i++)
+	{
+		char alt[16];
+		snprintf(alt, sizeof(alt), "%shas c%d", i ? " | " : "", i);
+		strcat(query_string, alt);
+	}
+	strcat(query_string, ")");
+
+	// alternatives past the mask width fail the parse instead of being dropped
+	struct w_query *q = w_query_registry_get_query(&g_registry, query_string);
+	ck_assert_ptr_nonnull(q);
+	ck_assert_int_eq(q->query_parse_state, W_QUERY_PARSE_STATE_UNPARSED);
+}
+END_TEST
+
 START_TEST(test_stage2_unknown_access)
 {
 	// invalid access type should become NONE
@@ -675,6 +734,41 @@ START_TEST(test_cache_dense_max_splits)
 }
 END_TEST
 
+START_TEST(test_cache_rebuild_tracks_component_changes)
+{
+	// rebuilding after entities gain/lose components updates the slices
+	w_entity_id comp_a = register_component("cache_changes_a");
+	w_entity_id comp_b = register_component("cache_changes_b");
+
+	for (w_entity_id e = 0; e < 20; e++)
+	{
+		set_component_on_entity(comp_a, e);
+		set_component_on_entity(comp_b, e);
+	}
+
+	struct w_query *q = w_query_registry_get_query(&g_registry,
+		"read cache_changes_a, read cache_changes_b");
+	ck_assert(w_query_rebuild_cache(&g_registry, q));
+	ck_assert_int_eq(q->archetype_slices_dense_length, 1);
+	ck_assert_int_eq(q->archetype_slices_sparse_length, 0);
+
+	// add a far entity and remove one from the middle of the run
+	set_component_on_entity(comp_a, 5000);
+	set_component_on_entity(comp_b, 5000);
+	w_component_remove(&g_components, comp_b, 10);
+
+	ck_assert(w_query_rebuild_cache(&g_registry, q));
+	ck_assert_int_eq(q->bitset_cache.indexes_length, 20);
+	ck_assert_int_eq(q->archetype_slices_dense_length, 0);
+	ck_assert_int_eq(q->archetype_slices_sparse_length, 3);
+	ck_assert_int_eq(q->archetype_slices_sparse[0].start_id, 0);
+	ck_assert_int_eq(q->archetype_slices_sparse[0].slice_length, 10);
+	ck_assert_int_eq(q->archetype_slices_sparse[1].start_id, 11);
+	ck_assert_int_eq(q->archetype_slices_sparse[1].slice_length, 9);
+	ck_assert_int_eq(q->archetype_slices_sparse[2].start_id, 5000);
+}
+END_TEST
+
 START_TEST(test_cache_rebuild_returns_false_on_unparsed)
 {
 	// query with unresolved component should fail rebuild
@@ -688,6 +782,174 @@ START_TEST(test_cache_rebuild_returns_false_on_unparsed)
 END_TEST
 
 
+/*****************************
+*  query aliases             *
+*****************************/
+
+START_TEST(test_alias_equivalent_queries_share_cache)
+{
+	w_entity_id comp_a = register_component("alias_a");
+	w_entity_id comp_b = register_component("alias_b");
+	register_component("alias_c");
+	for (w_entity_id e = 0; e < 20; e++)
+	{
+		set_component_on_entity(comp_a, e);
+		if (e % 2 == 0) set_component_on_entity(comp_b, e);
+	}
+
+	struct w_query *q = w_query_registry_get_query(&g_registry, "read alias_a, read alias_b");
+	ck_assert_ptr_null(q->cache_owner);
+
+	// order, whitespace, access and optional terms don't change the matches
+	const char *aliases[] = {
+		"read alias_b, read alias_a",
+		"read alias_a,read alias_b",
+		"write alias_b, has alias_a, optional alias_c",
+	};
+	for (size_t i = 0; i < sizeof(aliases) / sizeof(*aliases); i++)
+	{
+		struct w_query *alias = w_query_registry_get_query(&g_registry, (char *)aliases[i]);
+		q = g_registry.queries[0];
+		ck_assert_ptr_eq(w_query_cache_owner(alias), q);
+		ck_assert_uint_eq(alias->signature, q->signature);
+	}
+	ck_assert_uint_eq(g_registry.queries_length, 4);
+
+	// rebuilding through an alias builds the owner's cache once
+	ck_assert(w_query_rebuild_cache(&g_registry, g_registry.queries[1]));
+	ck_assert(!w_query_rebuild_cache(&g_registry, g_registry.queries[0]));
+	ck_assert(!w_query_rebuild_cache(&g_registry, g_registry.queries[3]));
+	ck_assert_int_eq(q->bitset_cache.indexes_length, 10);
+	ck_assert_int_eq(g_registry.queries[1]->bitset_cache.indexes_length, 0);
+	ck_assert_int_eq(g_registry.queries[1]->archetype_slices_sparse_length, 0);
+
+	// aliases keep their own term order for access
+	ck_assert_uint_eq(g_registry.queries[1]->terms[0].component_id, comp_b);
+	ck_assert_uint_eq(g_registry.queries[3]->data_terms_length, 2);
+}
+END_TEST
+
+START_TEST(test_alias_distinct_filters_keep_own_cache)
+{
+	register_component("alias_a");
+	register_component("alias_b");
+	register_component("alias_c");
+
+	const char *queries[] = {
+		"read alias_a, read alias_b",
+		"read alias_a, not alias_b",
+		"read alias_a, has alias_b, has alias_c",
+		"read alias_a, any(read alias_b | read alias_c)",
+		"read alias_a, any(read alias_b), any(read alias_c)",
+	};
+	for (size_t i = 0; i < sizeof(queries) / sizeof(*queries); i++)
+	{
+		struct w_query *q = w_query_registry_get_query(&g_registry, (char *)queries[i]);
+		ck_assert_int_eq(q->query_parse_state, W_QUERY_PARSE_STATE_COMPONENTS_PARSED);
+		ck_assert_ptr_null(q->cache_owner);
+	}
+
+	// any() groups alias regardless of alternative and group order
+	struct w_query *q = w_query_registry_get_query(&g_registry, "any(read alias_c | read alias_b), read alias_a");
+	ck_assert_ptr_eq(w_query_cache_owner(q), g_registry.queries[3]);
+	q = w_query_registry_get_query(&g_registry, "any(read alias_c), read alias_a, any(read alias_b)");
+	ck_assert_ptr_eq(w_query_cache_owner(q), g_registry.queries[4]);
+}
+END_TEST
+
+START_TEST(test_alias_resolved_late_joins_owner)
+{
+	w_entity_id comp_a = register_component("alias_a");
+	struct w_query *q = w_query_registry_get_query(&g_registry, "read alias_b, read alias_a");
+	ck_assert_int_ne(q->query_parse_state, W_QUERY_PARSE_STATE_COMPONENTS_PARSED);
+
+	w_entity_id comp_b = register_component("alias_b");
+	w_query_registry_get_query(&g_registry, "read alias_a, read alias_b");
+
+	// the first query resolves after the second and becomes its alias
+	q = w_query_registry_get_query(&g_registry, "read alias_b, read alias_a");
+	ck_assert_int_eq(q->query_parse_state, W_QUERY_PARSE_STATE_COMPONENTS_PARSED);
+	ck_assert_ptr_eq(w_query_cache_owner(q), g_registry.queries[1]);
+
+	// typed queries alias string queries too
+	w_entity_id ids[] = {comp_b, comp_a};
+	enum W_QUERY_ACCESS access[] = {W_QUERY_ACCESS_WRITE, W_QUERY_ACCESS_READ};
+	uint64_t id = w_query_registry_add_query(&g_registry, ids, access, 2);
+	ck_assert_ptr_eq(w_query_cache_owner(g_registry.queries[id]), g_registry.queries[1]);
+}
+END_TEST
+
+
+/*****************************
+*  slice pool                *
+*****************************/
+
+START_TEST(test_slice_pool_rounds_and_recycles)
+{
+	struct w_query_slice_pool *pool = &g_registry.slice_pool;
+
+	size_t capacity = 1;
+	struct w_query_archetype_slice *a = w_query_slice_pool_acquire(pool, &capacity);
+	ck_assert_uint_eq(capacity, W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY);
+
+	capacity = W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY * 2 + 1;
+	struct w_query_archetype_slice *b = w_query_slice_pool_acquire(pool, &capacity);
+	ck_assert_uint_eq(capacity, W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY * 4);
+
+	// released buffers come back for the same capacity class only
+	w_query_slice_pool_release(pool, a, W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY);
+	w_query_slice_pool_release(pool, b, W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY * 4);
+	ck_assert_uint_eq(pool->lists[0].length, 1);
+	ck_assert_uint_eq(pool->lists[2].length, 1);
+
+	capacity = W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY * 3;
+	ck_assert_ptr_eq(w_query_slice_pool_acquire(pool, &capacity), b);
+	capacity = 0;
+	ck_assert_ptr_eq(w_query_slice_pool_acquire(pool, &capacity), a);
+	ck_assert_uint_eq(pool->lists[0].length, 0);
+	ck_assert_uint_eq(pool->lists[2].length, 0);
+}
+END_TEST
+
+START_TEST(test_slice_storage_sized_lazily)
+{
+	w_entity_id comp_a = register_component("lazy_a");
+	w_entity_id comp_b = register_component("lazy_b");
+
+	struct w_query *q = w_query_registry_get_query(&g_registry, "read lazy_a, read lazy_b");
+	ck_assert_uint_le(q->terms_size, W_QUERY_REGISTRY_QUERY_TERMS_REALLOC_BLOCK_SIZE * sizeof(struct w_query_term));
+	ck_assert_ptr_null(q->archetype_slices_dense);
+	ck_assert_ptr_null(q->archetype_slices_sparse);
+
+	// 200 isolated matches need 200 sparse slices and no dense ones
+	for (w_entity_id e = 0; e < 400; e += 2)
+	{
+		set_component_on_entity(comp_a, e);
+		set_component_on_entity(comp_b, e);
+	}
+	ck_assert(w_query_rebuild_cache(&g_registry, q));
+	ck_assert_uint_eq(q->archetype_slices_sparse_length, 200);
+	ck_assert_uint_eq(q->archetype_slices_sparse_size, 256 * sizeof(struct w_query_archetype_slice));
+	ck_assert_uint_eq(q->archetype_slices_dense_length, 0);
+	ck_assert_uint_le(q->archetype_slices_dense_size, W_QUERY_REGISTRY_SLICE_POOL_MIN_CAPACITY * sizeof(struct w_query_archetype_slice));
+
+	// dropping most matches hands the big buffer back to the pool
+	struct w_query_archetype_slice *big = q->archetype_slices_sparse;
+	for (w_entity_id e = 20; e < 400; e += 2) w_component_remove(&g_components, comp_b, e);
+	ck_assert(w_query_rebuild_cache(&g_registry, q));
+	ck_assert_uint_eq(q->archetype_slices_sparse_length, 10);
+	ck_assert_uint_lt(q->archetype_slices_sparse_size, 256 * sizeof(struct w_query_archetype_slice));
+	ck_assert_uint_eq(q->archetype_slices_sparse[9].start_id, 18);
+
+	// another query picks it up
+	struct w_query *other = w_query_registry_get_query(&g_registry, "read lazy_a");
+	ck_assert(w_query_rebuild_cache(&g_registry, other));
+	ck_assert_uint_eq(other->archetype_slices_sparse_length, 200);
+	ck_assert_ptr_eq(other->archetype_slices_sparse, big);
+}
+END_TEST
+
+
 /*****************************
 *  registry_free             *
 *****************************/
@@ -787,6 +1049,9 @@ Suite *whisker_query_registry_suite(void)
 	tcase_add_test(tc_stage2, test_stage2_read_access);
 	tcase_add_test(tc_stage2, test_stage2_write_access);
 	tcase_add_test(tc_stage2, test_stage2_optional_access);
+	tcase_add_test(tc_stage2, test_stage2_filter_access);
+	tcase_add_test(tc_stage2, test_stage1_any_group_split);
+	tcase_add_test(tc_stage2, test_stage1_any_group_too_many_alternatives);
 	tcase_add_test(tc_stage2, test_stage2_unknown_access);
 	tcase_add_test(tc_stage2, test_stage2_component_name_interned);
 	tcase_add_test(tc_stage2, test_stage2_multiple_terms_parsed);
@@ -838,9 +1103,25 @@ Suite *whisker_query_registry_suite(void)
 	tcase_add_test(tc_cache_rebuild, test_cache_all_sparse);
 	tcase_add_test(tc_cache_rebuild, test_cache_mixed_dense_sparse);
 	tcase_add_test(tc_cache_rebuild, test_cache_dense_max_splits);
+	tcase_add_test(tc_cache_rebuild, test_cache_rebuild_tracks_component_changes);
 	tcase_add_test(tc_cache_rebuild, test_cache_rebuild_returns_false_on_unparsed);
 	suite_add_tcase(s, tc_cache_rebuild);
 
+	TCase *tc_alias = tcase_create("query_aliases");
+	tcase_add_checked_fixture(tc_alias, query_registry_setup, query_registry_teardown);
+	tcase_set_timeout(tc_alias, 10);
+	tcase_add_test(tc_alias, test_alias_equivalent_queries_share_cache);
+	tcase_add_test(tc_alias, test_alias_distinct_filters_keep_own_cache);
+	tcase_add_test(tc_alias, test_alias_resolved_late_joins_owner);
+	suite_add_tcase(s, tc_alias);
+
+	TCase *tc_pool = tcase_create("slice_pool");
+	tcase_add_checked_fixture(tc_pool, query_registry_setup, query_registry_teardown);
+	tcase_set_timeout(tc_pool, 10);
+	tcase_add_test(tc_pool, test_slice_pool_rounds_and_recycles);
+	tcase_add_test(tc_pool, test_slice_storage_sized_lazily);
+	suite_add_tcase(s, tc_pool);
+
 	TCase *tc_free = tcase_create("registry_free");
 	tcase_set_timeout(tc_free, 10);
 	tcase_add_test(tc_free, test_free_empty_registry);
@@ -802,6 +802,1662 @@ START_TEST(test_for_each_yields_only_set_indices)
 END_TEST
 
 
+/*****************************
+*  adaptive containers tcase *
+*****************************/
+
+#define PAGE_BITS_ (W_SPARSE_BITSET_PAGE_SIZE_WORDS * 64)
+
+enum { FILL_ARRAY_, FILL_BITMAP_, FILL_RUN_FULL_, FILL_RUN_PARTIAL_ };
+
+static void sparse_bitset_adaptive_setup(void)
+{
+	w_arena_init(&g_arena, 64 * 1024);
+	w_sparse_bitset_init_ex(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_init_ex(&g_bitset2, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_init_ex(&g_bitset3, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+}
+
+// fill a page so that it ends up in the given container after optimize
+static void fill_page_(struct w_sparse_bitset *bs, uint64_t page, int kind, uint64_t seed)
+{
+	uint64_t base = page * PAGE_BITS_;
+	switch (kind)
+	{
+		case FILL_ARRAY_:
+			for (uint64_t i = seed % 97; i < PAGE_BITS_; i += 97) w_sparse_bitset_set(bs, base + i);
+			break;
+		case FILL_BITMAP_:
+			for (uint64_t i = seed % 3; i < PAGE_BITS_; i += 3) w_sparse_bitset_set(bs, base + i);
+			break;
+		case FILL_RUN_FULL_:
+			for (uint64_t i = 0; i < PAGE_BITS_; i++) w_sparse_bitset_set(bs, base + i);
+			break;
+		case FILL_RUN_PARTIAL_:
+			for (uint64_t i = seed * 10; i < seed * 10 + 2000; i++) w_sparse_bitset_set(bs, base + i);
+			for (uint64_t i = 9000 + seed; i < 12000; i++) w_sparse_bitset_set(bs, base + i);
+			break;
+	}
+}
+
+// check an intersect result against get() on every bit in range
+static void assert_intersect_matches_(struct w_sparse_bitset **bitsets, uint64_t bitsets_length, uint64_t bits)
+{
+	g_intersect_cache.bitsets = w_mem_xcalloc_t(bitsets_length, *g_intersect_cache.bitsets);
+	for (uint64_t i = 0; i < bitsets_length; i++) g_intersect_cache.bitsets[i] = bitsets[i];
+	g_intersect_cache.bitsets_length = bitsets_length;
+
+	uint64_t count = w_sparse_bitset_intersect(&g_intersect_cache);
+
+	uint64_t expected = 0;
+	for (uint64_t i = 0; i < bits; i++)
+	{
+		bool all = true;
+		for (uint64_t b = 0; b < bitsets_length && all; b++) all = w_sparse_bitset_get(bitsets[b], i);
+		if (!all) continue;
+
+		ck_assert_uint_lt(expected, count);
+		ck_assert_uint_eq(g_intersect_cache.indexes[expected], i);
+		expected++;
+	}
+	ck_assert_uint_eq(count, expected);
+}
+
+START_TEST(test_adaptive_first_set_uses_array)
+{
+	w_sparse_bitset_set(&g_bitset, 5);
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_ARRAY);
+	ck_assert_ptr_null(g_bitset.pages[0].bits);
+	ck_assert_uint_eq(g_bitset.pages[0].cardinality, 1);
+	ck_assert_uint_eq(g_bitset.cardinality, 1);
+	ck_assert(w_sparse_bitset_get(&g_bitset, 5));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 6));
+}
+END_TEST
+
+START_TEST(test_adaptive_set_existing_bit_keeps_cardinality)
+{
+	w_sparse_bitset_set(&g_bitset, 5);
+	w_sparse_bitset_set(&g_bitset, 5);
+	ck_assert_uint_eq(g_bitset.pages[0].cardinality, 1);
+	ck_assert_uint_eq(g_bitset.pages[0].values_length, 1);
+}
+END_TEST
+
+START_TEST(test_adaptive_array_converts_to_bitmap)
+{
+	uint64_t n = W_SPARSE_BITSET_PAGE_SIZE_WORDS * W_SPARSE_BITSET_ARRAY_MAX_PER_WORD + 1;
+	for (uint64_t i = 0; i < n; i++) w_sparse_bitset_set(&g_bitset, i * 3);
+
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_BITMAP);
+	ck_assert_ptr_nonnull(g_bitset.pages[0].bits);
+	ck_assert_ptr_null(g_bitset.pages[0].values);
+	ck_assert_uint_eq(g_bitset.pages[0].cardinality, n);
+	for (uint64_t i = 0; i < n * 3; i++)
+	{
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == (i % 3 == 0));
+	}
+}
+END_TEST
+
+START_TEST(test_adaptive_bitmap_shrinks_to_array)
+{
+	uint64_t n = W_SPARSE_BITSET_PAGE_SIZE_WORDS * W_SPARSE_BITSET_ARRAY_MAX_PER_WORD + 1;
+	for (uint64_t i = 0; i < n; i++) w_sparse_bitset_set(&g_bitset, i * 3);
+
+	// clear down to half the array limit
+	uint64_t keep = W_SPARSE_BITSET_PAGE_SIZE_WORDS * W_SPARSE_BITSET_ARRAY_MAX_PER_WORD / 2;
+	for (uint64_t i = keep; i < n; i++) w_sparse_bitset_clear(&g_bitset, i * 3);
+
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_ARRAY);
+	ck_assert_uint_eq(g_bitset.pages[0].values_length, keep);
+	ck_assert(w_sparse_bitset_get(&g_bitset, (keep - 1) * 3));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, keep * 3));
+	ck_assert_uint_eq(g_bitset.pages[0].last_set, ((keep - 1) * 3) >> 6);
+}
+END_TEST
+
+START_TEST(test_adaptive_full_page_becomes_run)
+{
+	fill_page_(&g_bitset, 1, FILL_RUN_FULL_, 0);
+
+	struct w_sparse_bitset_page *page = &g_bitset.pages[1];
+	ck_assert_int_eq(page->container, W_SPARSE_BITSET_CONTAINER_RUN);
+	ck_assert_uint_eq(page->values_length, 2);
+	ck_assert_uint_eq(page->cardinality, PAGE_BITS_);
+	ck_assert_uint_eq(page->first_set, 0);
+	ck_assert_uint_eq(page->last_set, W_SPARSE_BITSET_PAGE_SIZE_WORDS - 1);
+	ck_assert(w_sparse_bitset_get(&g_bitset, PAGE_BITS_));
+	ck_assert(w_sparse_bitset_get(&g_bitset, PAGE_BITS_ * 2 - 1));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, PAGE_BITS_ * 2));
+}
+END_TEST
+
+START_TEST(test_adaptive_run_clear_splits_run)
+{
+	fill_page_(&g_bitset, 0, FILL_RUN_FULL_, 0);
+	w_sparse_bitset_clear(&g_bitset, 100);
+
+	struct w_sparse_bitset_page *page = &g_bitset.pages[0];
+	ck_assert_int_eq(page->container, W_SPARSE_BITSET_CONTAINER_RUN);
+	ck_assert_uint_eq(page->values_length, 4);
+	ck_assert_uint_eq(page->cardinality, PAGE_BITS_ - 1);
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 100));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 99));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 101));
+
+	// setting it again joins the runs back together
+	w_sparse_bitset_set(&g_bitset, 100);
+	ck_assert_uint_eq(page->values_length, 2);
+	ck_assert_uint_eq(page->cardinality, PAGE_BITS_);
+}
+END_TEST
+
+START_TEST(test_adaptive_clear_empties_page)
+{
+	w_sparse_bitset_set(&g_bitset, 10);
+	w_sparse_bitset_set(&g_bitset, 700);
+	w_sparse_bitset_clear(&g_bitset, 10);
+	w_sparse_bitset_clear(&g_bitset, 700);
+
+	ck_assert_uint_eq(g_bitset.lookup_pages[0], 0);
+	ck_assert_uint_eq(g_bitset.pages[0].first_set, UINT32_MAX);
+	ck_assert_uint_eq(g_bitset.pages[0].cardinality, 0);
+	ck_assert_uint_eq(g_bitset.cardinality, 0);
+	ck_assert_ptr_null(g_bitset.pages[0].values);
+
+	// page can be reused afterwards
+	w_sparse_bitset_set(&g_bitset, 42);
+	ck_assert(w_sparse_bitset_get(&g_bitset, 42));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 10));
+}
+END_TEST
+
+START_TEST(test_adaptive_for_each_across_containers)
+{
+	fill_page_(&g_bitset, 0, FILL_ARRAY_, 1);
+	fill_page_(&g_bitset, 1, FILL_BITMAP_, 1);
+	fill_page_(&g_bitset, 2, FILL_RUN_FULL_, 0);
+	fill_page_(&g_bitset, 3, FILL_RUN_PARTIAL_, 1);
+	w_sparse_bitset_optimize(&g_bitset);
+
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_ARRAY);
+	ck_assert_int_eq(g_bitset.pages[1].container, W_SPARSE_BITSET_CONTAINER_BITMAP);
+	ck_assert_int_eq(g_bitset.pages[2].container, W_SPARSE_BITSET_CONTAINER_RUN);
+	ck_assert_int_eq(g_bitset.pages[3].container, W_SPARSE_BITSET_CONTAINER_RUN);
+
+	uint64_t count = 0;
+	uint64_t prev = 0;
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert(w_sparse_bitset_get(&g_bitset, i));
+		if (count) ck_assert_uint_gt(i, prev);
+		prev = i;
+		count++;
+	}
+	ck_assert_uint_eq(count, g_bitset.cardinality);
+}
+END_TEST
+
+START_TEST(test_adaptive_optimize_preserves_bits)
+{
+	fill_page_(&g_bitset, 0, FILL_RUN_PARTIAL_, 3);
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_BITMAP);
+
+	uint64_t cardinality = g_bitset.cardinality;
+	w_sparse_bitset_optimize(&g_bitset);
+
+	ck_assert_int_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_RUN);
+	ck_assert_uint_eq(g_bitset.pages[0].values_length, 4);
+	ck_assert_uint_eq(g_bitset.cardinality, cardinality);
+	for (uint64_t i = 0; i < PAGE_BITS_; i++)
+	{
+		bool expected = (i >= 30 && i < 2030) || (i >= 9003 && i < 12000);
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == expected);
+	}
+}
+END_TEST
+
+START_TEST(test_adaptive_intersect_container_pairs)
+{
+	// page p holds container (p / 4) in the first bitset and (p % 4) in the second
+	for (uint64_t p = 0; p < 16; p++)
+	{
+		fill_page_(&g_bitset, p, (int)(p / 4), p);
+		fill_page_(&g_bitset2, p, (int)(p % 4), p + 1);
+	}
+	w_sparse_bitset_optimize(&g_bitset);
+	w_sparse_bitset_optimize(&g_bitset2);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	assert_intersect_matches_(bitsets, 2, 16 * PAGE_BITS_);
+}
+END_TEST
+
+START_TEST(test_adaptive_intersect_three_way_mixed)
+{
+	for (uint64_t p = 0; p < 16; p++)
+	{
+		fill_page_(&g_bitset, p, (int)(p / 4), p);
+		fill_page_(&g_bitset2, p, (int)(p % 4), p + 1);
+		fill_page_(&g_bitset3, p, (int)((p + 1) % 4), p + 2);
+	}
+	w_sparse_bitset_optimize(&g_bitset);
+	w_sparse_bitset_optimize(&g_bitset2);
+	w_sparse_bitset_optimize(&g_bitset3);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	assert_intersect_matches_(bitsets, 3, 16 * PAGE_BITS_);
+}
+END_TEST
+
+START_TEST(test_adaptive_intersect_with_bitmap_only_bitset)
+{
+	// adaptive and non-adaptive bitsets intersect together
+	w_sparse_bitset_free(&g_bitset2);
+	w_sparse_bitset_init(&g_bitset2, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS);
+	for (uint64_t p = 0; p < 4; p++)
+	{
+		fill_page_(&g_bitset, p, (int)p, p);
+		fill_page_(&g_bitset2, p, FILL_BITMAP_, p + 1);
+	}
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	assert_intersect_matches_(bitsets, 2, 4 * PAGE_BITS_);
+}
+END_TEST
+
+START_TEST(test_adaptive_disabled_for_large_pages)
+{
+	struct w_sparse_bitset bs;
+	w_sparse_bitset_init_ex(&bs, &g_arena, W_SPARSE_BITSET_ADAPTIVE_MAX_PAGE_SIZE_WORDS * 2, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	ck_assert_uint_eq(bs.flags & W_SPARSE_BITSET_FLAG_ADAPTIVE, 0);
+
+	w_sparse_bitset_set(&bs, 5);
+	ck_assert_int_eq(bs.pages[0].container, W_SPARSE_BITSET_CONTAINER_BITMAP);
+	ck_assert_ptr_nonnull(bs.pages[0].bits);
+	w_sparse_bitset_free(&bs);
+}
+END_TEST
+
+
+/*****************************
+*  incremental tcase         *
+*****************************/
+
+// intersect the given bitsets into a fresh cache for comparison
+static uint64_t full_intersect_(struct w_sparse_bitset **bitsets, uint64_t bitsets_length, struct w_sparse_bitset_intersect_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	w_array_init_t(cache->bitsets, bitsets_length);
+	for (uint64_t i = 0; i < bitsets_length; i++) cache->bitsets[i] = bitsets[i];
+	cache->bitsets_length = bitsets_length;
+	return w_sparse_bitset_intersect(cache);
+}
+
+static void assert_cache_matches_full_(struct w_sparse_bitset **bitsets, uint64_t bitsets_length)
+{
+	struct w_sparse_bitset_intersect_cache full;
+	uint64_t count = full_intersect_(bitsets, bitsets_length, &full);
+
+	ck_assert_uint_eq(g_intersect_cache.indexes_length, count);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		ck_assert_uint_eq(g_intersect_cache.indexes[i], full.indexes[i]);
+	}
+	w_sparse_bitset_intersect_free_cache(&full);
+}
+
+START_TEST(test_generation_bumps_on_change_only)
+{
+	w_sparse_bitset_set(&g_bitset, 5);
+	ck_assert_uint_eq(g_bitset.generation, 1);
+	w_sparse_bitset_set(&g_bitset, 5);
+	ck_assert_uint_eq(g_bitset.generation, 1);
+	w_sparse_bitset_clear(&g_bitset, 6);
+	ck_assert_uint_eq(g_bitset.generation, 1);
+	w_sparse_bitset_clear(&g_bitset, 5);
+	ck_assert_uint_eq(g_bitset.generation, 2);
+}
+END_TEST
+
+START_TEST(test_cache_stale_after_change)
+{
+	w_sparse_bitset_set(&g_bitset, 5);
+	w_sparse_bitset_set(&g_bitset2, 5);
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	ck_assert(!w_sparse_bitset_intersect_cache_stale(&g_intersect_cache));
+	w_sparse_bitset_set(&g_bitset2, 6);
+	ck_assert(w_sparse_bitset_intersect_cache_stale(&g_intersect_cache));
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	ck_assert(!w_sparse_bitset_intersect_cache_stale(&g_intersect_cache));
+}
+END_TEST
+
+START_TEST(test_change_log_enabled_by_intersect)
+{
+	w_sparse_bitset_set(&g_bitset, 5);
+	ck_assert_ptr_null(g_bitset.changes);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset};
+	full_intersect_(bitsets, 1, &g_intersect_cache);
+	ck_assert_ptr_nonnull(g_bitset.changes);
+
+	// adjacent changes extend the newest entry
+	w_sparse_bitset_set(&g_bitset, 100);
+	w_sparse_bitset_set(&g_bitset, 101);
+	w_sparse_bitset_set(&g_bitset, 99);
+	ck_assert_uint_eq(g_bitset.changes_length, 1);
+	ck_assert_uint_eq(g_bitset.changes[0].lo, 99);
+	ck_assert_uint_eq(g_bitset.changes[0].hi, 101);
+	ck_assert_uint_eq(g_bitset.changes[0].generation, g_bitset.generation);
+
+	w_sparse_bitset_set(&g_bitset, 5000);
+	ck_assert_uint_eq(g_bitset.changes_length, 2);
+}
+END_TEST
+
+START_TEST(test_incremental_intersect_matches_full)
+{
+	for (uint64_t i = 0; i < 200000; i += 7) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < 200000; i += 3) w_sparse_bitset_set(&g_bitset2, i);
+	for (uint64_t i = 0; i < 200000; i += 2) w_sparse_bitset_set(&g_bitset3, i);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	full_intersect_(bitsets, 3, &g_intersect_cache);
+	uint64_t gen = g_intersect_cache.cache_generation;
+
+	// a handful of changes on a couple of pages
+	w_sparse_bitset_clear(&g_bitset, 42);
+	w_sparse_bitset_set(&g_bitset, 44);
+	w_sparse_bitset_set(&g_bitset2, 44);
+	w_sparse_bitset_set(&g_bitset2, 150000);
+	w_sparse_bitset_set(&g_bitset, 150000);
+	w_sparse_bitset_clear(&g_bitset3, 84);
+
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	ck_assert_uint_ne(g_intersect_cache.cache_generation, gen);
+	ck_assert_uint_eq(g_intersect_cache.dirty_pages_length, 2);
+	assert_cache_matches_full_(bitsets, 3);
+}
+END_TEST
+
+START_TEST(test_incremental_intersect_new_pages)
+{
+	w_sparse_bitset_set(&g_bitset, 10);
+	w_sparse_bitset_set(&g_bitset2, 10);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	// grow both bitsets past their existing pages
+	for (uint64_t p = 1; p < 12; p++)
+	{
+		w_sparse_bitset_set(&g_bitset, p * 16384 + p);
+		w_sparse_bitset_set(&g_bitset2, p * 16384 + p);
+	}
+	w_sparse_bitset_clear(&g_bitset2, 10);
+
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 2);
+	ck_assert_uint_eq(g_intersect_cache.indexes_length, 11);
+}
+END_TEST
+
+START_TEST(test_incremental_intersect_log_overflow)
+{
+	for (uint64_t i = 0; i < 100000; i += 5) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < 100000; i += 2) w_sparse_bitset_set(&g_bitset2, i);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	// more separate changes than the log holds forces a full rebuild
+	for (uint64_t i = 0; i < W_SPARSE_BITSET_CHANGE_LOG_SIZE * 2; i++)
+	{
+		w_sparse_bitset_clear(&g_bitset, i * 10);
+	}
+	ck_assert_uint_gt(g_bitset.changes_floor, 0);
+
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 2);
+}
+END_TEST
+
+START_TEST(test_incremental_intersect_adaptive_containers)
+{
+	w_sparse_bitset_free(&g_bitset);
+	w_sparse_bitset_free(&g_bitset2);
+	w_sparse_bitset_init_ex(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_init_ex(&g_bitset2, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+
+	for (uint64_t i = 0; i < 16384; i++) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < 40000; i += 97) w_sparse_bitset_set(&g_bitset2, i);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	w_sparse_bitset_clear(&g_bitset, 97);
+	w_sparse_bitset_set(&g_bitset2, 98);
+	w_sparse_bitset_set(&g_bitset, 20000 - 20000 % 97);
+
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 2);
+}
+END_TEST
+
+
+/*****************************
+*  set algebra tcase         *
+*****************************/
+
+static bool apply_op_(uint8_t op, bool a, bool b)
+{
+	switch (op)
+	{
+		case W_SPARSE_BITSET_OP_OR: return a || b;
+		case W_SPARSE_BITSET_OP_ANDNOT: return a && !b;
+		case W_SPARSE_BITSET_OP_XOR: return a != b;
+		default: return a && b;
+	}
+}
+
+// fill a and b with overlapping pages of every container kind
+static void fill_algebra_operands_(struct w_sparse_bitset *a, struct w_sparse_bitset *b)
+{
+	fill_page_(a, 0, FILL_ARRAY_, 1);
+	fill_page_(b, 0, FILL_BITMAP_, 1);
+	fill_page_(a, 1, FILL_BITMAP_, 2);
+	fill_page_(b, 1, FILL_RUN_PARTIAL_, 3);
+	fill_page_(a, 2, FILL_RUN_FULL_, 0);
+	fill_page_(b, 2, FILL_ARRAY_, 5);
+	fill_page_(a, 3, FILL_RUN_PARTIAL_, 1);
+	fill_page_(b, 5, FILL_BITMAP_, 0);
+	w_sparse_bitset_optimize(a);
+	w_sparse_bitset_optimize(b);
+}
+
+static bool *snapshot_(struct w_sparse_bitset *bs, uint64_t bits)
+{
+	bool *out = w_mem_xcalloc(bits, sizeof(*out));
+	for (uint64_t i = 0; i < bits; i++) out[i] = w_sparse_bitset_get(bs, i);
+	return out;
+}
+
+// check dst against a bit by bit reference of a op b
+static void assert_op_matches_(struct w_sparse_bitset *dst, bool *a, bool *b, uint8_t op, uint64_t bits)
+{
+	uint64_t expected = 0;
+	for (uint64_t i = 0; i < bits; i++)
+	{
+		bool want = apply_op_(op, a[i], b[i]);
+		ck_assert_msg(w_sparse_bitset_get(dst, i) == want, "bit %lu", (unsigned long)i);
+		expected += want;
+	}
+	ck_assert_uint_eq(dst->cardinality, expected);
+
+	// page cardinality and lookup bits agree
+	uint64_t cardinality = 0;
+	for (uint64_t p = 0; p < dst->pages_length; p++)
+	{
+		bool lookup = (dst->lookup_pages[p / 64] >> (p % 64)) & 1;
+		ck_assert(lookup == (dst->pages[p].cardinality > 0));
+		cardinality += dst->pages[p].cardinality;
+	}
+	ck_assert_uint_eq(cardinality, expected);
+}
+
+START_TEST(test_algebra_out_of_place_ops)
+{
+	fill_algebra_operands_(&g_bitset, &g_bitset2);
+	uint64_t bits = PAGE_BITS_ * 6;
+	bool *a = snapshot_(&g_bitset, bits);
+	bool *b = snapshot_(&g_bitset2, bits);
+
+	w_sparse_bitset_union(&g_bitset3, &g_bitset, &g_bitset2);
+	assert_op_matches_(&g_bitset3, a, b, W_SPARSE_BITSET_OP_OR, bits);
+
+	// dst is cleared before each op
+	w_sparse_bitset_difference(&g_bitset3, &g_bitset, &g_bitset2);
+	assert_op_matches_(&g_bitset3, a, b, W_SPARSE_BITSET_OP_ANDNOT, bits);
+
+	w_sparse_bitset_xor(&g_bitset3, &g_bitset, &g_bitset2);
+	assert_op_matches_(&g_bitset3, a, b, W_SPARSE_BITSET_OP_XOR, bits);
+
+	free(a);
+	free(b);
+}
+END_TEST
+
+START_TEST(test_algebra_result_containers)
+{
+	fill_page_(&g_bitset, 0, FILL_RUN_PARTIAL_, 0);
+	for (uint64_t i = 0; i < PAGE_BITS_; i++)
+	{
+		if (!w_sparse_bitset_get(&g_bitset, i)) w_sparse_bitset_set(&g_bitset2, i);
+	}
+
+	// full results collapse to a run
+	w_sparse_bitset_union(&g_bitset3, &g_bitset, &g_bitset2);
+	ck_assert_uint_eq(g_bitset3.pages[0].cardinality, PAGE_BITS_);
+	ck_assert_uint_eq(g_bitset3.pages[0].container, W_SPARSE_BITSET_CONTAINER_RUN);
+
+	// sparse results fall back to arrays
+	w_sparse_bitset_difference(&g_bitset3, &g_bitset2, &g_bitset);
+	w_sparse_bitset_free(&g_bitset2);
+	w_sparse_bitset_init_ex(&g_bitset2, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_set(&g_bitset2, 5);
+	w_sparse_bitset_set(&g_bitset2, 2500);
+	w_sparse_bitset_intersect_with(&g_bitset3, &g_bitset2);
+	ck_assert_uint_eq(g_bitset3.cardinality, 1);
+	ck_assert(w_sparse_bitset_get(&g_bitset3, 2500));
+	ck_assert_uint_eq(g_bitset3.pages[0].container, W_SPARSE_BITSET_CONTAINER_ARRAY);
+}
+END_TEST
+
+START_TEST(test_algebra_in_place_ops)
+{
+	uint8_t ops[] = { W_SPARSE_BITSET_OP_AND, W_SPARSE_BITSET_OP_OR, W_SPARSE_BITSET_OP_ANDNOT, W_SPARSE_BITSET_OP_XOR };
+	uint64_t bits = PAGE_BITS_ * 6;
+
+	for (int adaptive = 0; adaptive < 2; adaptive++)
+	{
+		for (size_t o = 0; o < sizeof(ops) / sizeof(ops[0]); o++)
+		{
+			w_sparse_bitset_free(&g_bitset);
+			w_sparse_bitset_free(&g_bitset2);
+			w_sparse_bitset_init_ex(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, adaptive ? W_SPARSE_BITSET_FLAG_ADAPTIVE : 0);
+			w_sparse_bitset_init_ex(&g_bitset2, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+			fill_algebra_operands_(&g_bitset, &g_bitset2);
+
+			bool *a = snapshot_(&g_bitset, bits);
+			bool *b = snapshot_(&g_bitset2, bits);
+
+			switch (ops[o])
+			{
+				case W_SPARSE_BITSET_OP_AND: w_sparse_bitset_intersect_with(&g_bitset, &g_bitset2); break;
+				case W_SPARSE_BITSET_OP_OR: w_sparse_bitset_union_with(&g_bitset, &g_bitset2); break;
+				case W_SPARSE_BITSET_OP_ANDNOT: w_sparse_bitset_difference_with(&g_bitset, &g_bitset2); break;
+				case W_SPARSE_BITSET_OP_XOR: w_sparse_bitset_xor_with(&g_bitset, &g_bitset2); break;
+			}
+			assert_op_matches_(&g_bitset, a, b, ops[o], bits);
+
+			free(a);
+			free(b);
+		}
+	}
+}
+END_TEST
+
+START_TEST(test_algebra_in_place_self)
+{
+	fill_page_(&g_bitset, 0, FILL_BITMAP_, 0);
+	uint64_t cardinality = g_bitset.cardinality;
+
+	w_sparse_bitset_union_with(&g_bitset, &g_bitset);
+	w_sparse_bitset_intersect_with(&g_bitset, &g_bitset);
+	ck_assert_uint_eq(g_bitset.cardinality, cardinality);
+
+	w_sparse_bitset_xor_with(&g_bitset, &g_bitset);
+	ck_assert_uint_eq(g_bitset.cardinality, 0);
+	ck_assert_uint_eq(g_bitset.lookup_pages[0], 0);
+}
+END_TEST
+
+START_TEST(test_algebra_in_place_mismatched_page_sizes)
+{
+	w_sparse_bitset_free(&g_bitset2);
+	w_sparse_bitset_init(&g_bitset2, &g_arena, 4);
+
+	for (uint64_t i = 0; i < 2000; i += 3) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < 2000; i += 5) w_sparse_bitset_set(&g_bitset2, i);
+
+	w_sparse_bitset_intersect_with(&g_bitset, &g_bitset2);
+	for (uint64_t i = 0; i < 2000; i++)
+	{
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == (i % 15 == 0));
+	}
+
+	w_sparse_bitset_union_with(&g_bitset, &g_bitset2);
+	for (uint64_t i = 0; i < 2000; i++)
+	{
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == (i % 5 == 0));
+	}
+}
+END_TEST
+
+START_TEST(test_algebra_evaluate_groups)
+{
+	fill_algebra_operands_(&g_bitset, &g_bitset2);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i += 7) w_sparse_bitset_set(&g_bitset3, i);
+
+	// (a | b) & ~c
+	struct w_sparse_bitset dst;
+	w_sparse_bitset_init_ex(&dst, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	struct w_sparse_bitset *bitsets[] = { &g_bitset, &g_bitset2, &g_bitset3 };
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_OR, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 1 },
+	};
+	w_sparse_bitset_evaluate(&dst, bitsets, expr, 3);
+
+	uint64_t expected = 0;
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i++)
+	{
+		bool want = (w_sparse_bitset_get(&g_bitset, i) || w_sparse_bitset_get(&g_bitset2, i)) && !w_sparse_bitset_get(&g_bitset3, i);
+		ck_assert(w_sparse_bitset_get(&dst, i) == want);
+		expected += want;
+	}
+	ck_assert_uint_eq(dst.cardinality, expected);
+
+	w_sparse_bitset_free(&dst);
+}
+END_TEST
+
+START_TEST(test_algebra_intersect_cache_expr)
+{
+	fill_algebra_operands_(&g_bitset, &g_bitset2);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 2; i += 11) w_sparse_bitset_set(&g_bitset3, i);
+
+	// a & ~b through the cache, kept up to date incrementally
+	struct w_sparse_bitset *bitsets[] = { &g_bitset, &g_bitset2 };
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 1 },
+	};
+	w_array_init_t(g_intersect_cache.bitsets, 2);
+	memcpy(g_intersect_cache.bitsets, bitsets, sizeof(bitsets));
+	g_intersect_cache.bitsets_length = 2;
+	w_array_init_t(g_intersect_cache.expr, 2);
+	memcpy(g_intersect_cache.expr, expr, sizeof(expr));
+
+	struct w_sparse_bitset dst;
+	w_sparse_bitset_init(&dst, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS);
+
+	for (int round = 0; round < 3; round++)
+	{
+		uint64_t count = w_sparse_bitset_intersect(&g_intersect_cache);
+		w_sparse_bitset_difference(&dst, &g_bitset, &g_bitset2);
+		ck_assert_uint_eq(count, dst.cardinality);
+
+		uint64_t n = 0;
+		w_sparse_bitset_for_each(&dst)
+		{
+			ck_assert_uint_eq(g_intersect_cache.indexes[n], i);
+			n++;
+		}
+		ck_assert_uint_eq(n, count);
+
+		// pages only present in the first operand still count
+		w_sparse_bitset_set(&g_bitset, PAGE_BITS_ * 4 + 17 + round);
+		w_sparse_bitset_clear(&g_bitset2, 6 + round * 3);
+		w_sparse_bitset_union_with(&g_bitset2, &g_bitset3);
+	}
+
+	w_sparse_bitset_free(&dst);
+}
+END_TEST
+
+START_TEST(test_algebra_in_place_feeds_incremental_intersect)
+{
+	fill_algebra_operands_(&g_bitset, &g_bitset2);
+	struct w_sparse_bitset *bitsets[] = { &g_bitset, &g_bitset2 };
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+	uint64_t rebuilds = g_intersect_cache.cache_generation;
+
+	// changes are logged per page so the cache can splice them in
+	uint64_t generation = g_bitset.generation;
+	w_sparse_bitset_set(&g_bitset3, PAGE_BITS_ + 1);
+	w_sparse_bitset_set(&g_bitset3, PAGE_BITS_ * 5 + 2);
+	w_sparse_bitset_xor_with(&g_bitset, &g_bitset3);
+	ck_assert_uint_gt(g_bitset.generation, generation);
+
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	ck_assert_uint_eq(g_intersect_cache.cache_generation, rebuilds + 1);
+	assert_cache_matches_full_(bitsets, 2);
+}
+END_TEST
+
+
+/*****************************
+*  ranges + seek tcase       *
+*****************************/
+
+START_TEST(test_set_range_within_page)
+{
+	w_sparse_bitset_set_range(&g_bitset, 70, 200);
+
+	ck_assert_uint_eq(g_bitset.cardinality, 131);
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 69));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 70));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 200));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 201));
+
+	// a single range is best stored as a run
+	ck_assert_uint_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_RUN);
+}
+END_TEST
+
+START_TEST(test_set_range_across_pages)
+{
+	w_sparse_bitset_set(&g_bitset, PAGE_BITS_ + 5);
+	w_sparse_bitset_set_range(&g_bitset, 100, PAGE_BITS_ * 3 + 10);
+
+	ck_assert_uint_eq(g_bitset.cardinality, PAGE_BITS_ * 3 + 10 - 100 + 1);
+	for (uint64_t p = 1; p < 3; p++)
+	{
+		ck_assert_uint_eq(g_bitset.pages[p].cardinality, PAGE_BITS_);
+		ck_assert_uint_eq(g_bitset.pages[p].container, W_SPARSE_BITSET_CONTAINER_RUN);
+	}
+	ck_assert_uint_eq(g_bitset.pages[3].cardinality, 11);
+	ck_assert_uint_eq(g_bitset.lookup_pages[0], 0xf);
+
+	// overlapping ranges only count new bits
+	w_sparse_bitset_set_range(&g_bitset, 0, 200);
+	ck_assert_uint_eq(g_bitset.cardinality, PAGE_BITS_ * 3 + 11);
+}
+END_TEST
+
+START_TEST(test_clear_range_partial_and_whole_pages)
+{
+	w_sparse_bitset_set_range(&g_bitset, 0, PAGE_BITS_ * 4 - 1);
+	w_sparse_bitset_clear_range(&g_bitset, 50, PAGE_BITS_ * 3 - 50);
+
+	ck_assert_uint_eq(g_bitset.cardinality, 50 + 49 + PAGE_BITS_);
+	ck_assert_uint_eq(g_bitset.pages[1].cardinality, 0);
+	ck_assert_uint_eq(g_bitset.pages[1].first_set, UINT32_MAX);
+	ck_assert_uint_eq(g_bitset.lookup_pages[0], 0xd);
+	ck_assert(w_sparse_bitset_get(&g_bitset, 49));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 50));
+	ck_assert(!w_sparse_bitset_get(&g_bitset, PAGE_BITS_ * 3 - 50));
+	ck_assert(w_sparse_bitset_get(&g_bitset, PAGE_BITS_ * 3 - 49));
+
+	// clearing past the allocated pages is a no-op
+	w_sparse_bitset_clear_range(&g_bitset, PAGE_BITS_ * 10, PAGE_BITS_ * 20);
+	ck_assert_uint_eq(g_bitset.pages_length, 4);
+}
+END_TEST
+
+START_TEST(test_range_ops_bitmap_only)
+{
+	w_sparse_bitset_free(&g_bitset);
+	w_sparse_bitset_init(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS);
+
+	w_sparse_bitset_set_range(&g_bitset, 10, PAGE_BITS_ + 10);
+	w_sparse_bitset_clear_range(&g_bitset, 64, 127);
+
+	uint64_t count = 0;
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert(i >= 10 && i <= PAGE_BITS_ + 10 && (i < 64 || i > 127));
+		count++;
+	}
+	ck_assert_uint_eq(count, PAGE_BITS_ + 1 - 64);
+	ck_assert_uint_eq(g_bitset.cardinality, count);
+	ck_assert_uint_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_BITMAP);
+}
+END_TEST
+
+START_TEST(test_range_ops_log_one_change)
+{
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	w_sparse_bitset_set_range(&g_bitset2, 0, PAGE_BITS_ * 8);
+	full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	uint64_t generation = g_bitset.generation;
+	w_sparse_bitset_set_range(&g_bitset, 300, 5000);
+	ck_assert_uint_eq(g_bitset.generation, generation + 1);
+	ck_assert_uint_eq(g_bitset.changes_length, 1);
+
+	// no-op ranges leave the generation alone
+	w_sparse_bitset_set_range(&g_bitset, 400, 500);
+	ck_assert_uint_eq(g_bitset.generation, generation + 1);
+
+	w_sparse_bitset_clear_range(&g_bitset, 1000, 1999);
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 2);
+}
+END_TEST
+
+START_TEST(test_next_prev_set_across_containers)
+{
+	fill_page_(&g_bitset, 0, FILL_ARRAY_, 3);
+	fill_page_(&g_bitset, 2, FILL_BITMAP_, 1);
+	fill_page_(&g_bitset, 3, FILL_RUN_PARTIAL_, 2);
+	w_sparse_bitset_set(&g_bitset, PAGE_BITS_ * 130 + 7);
+	w_sparse_bitset_optimize(&g_bitset);
+
+	// walk forwards and backwards, comparing against get()
+	uint64_t end = PAGE_BITS_ * 131;
+	uint64_t expected = W_SPARSE_BITSET_INDEX_NONE;
+	for (uint64_t i = end; i-- > 0; )
+	{
+		if (w_sparse_bitset_get(&g_bitset, i)) expected = i;
+		if (i % 61 == 0 || expected == i) ck_assert_uint_eq(w_sparse_bitset_next_set(&g_bitset, i), expected);
+	}
+
+	expected = W_SPARSE_BITSET_INDEX_NONE;
+	for (uint64_t i = 0; i < end; i++)
+	{
+		if (w_sparse_bitset_get(&g_bitset, i)) expected = i;
+		if (i % 61 == 0 || expected == i) ck_assert_uint_eq(w_sparse_bitset_prev_set(&g_bitset, i), expected);
+	}
+
+	ck_assert_uint_eq(w_sparse_bitset_next_set(&g_bitset, end), W_SPARSE_BITSET_INDEX_NONE);
+	ck_assert_uint_eq(w_sparse_bitset_prev_set(&g_bitset, UINT64_MAX - 1), PAGE_BITS_ * 130 + 7);
+}
+END_TEST
+
+START_TEST(test_next_set_iterates_all_bits)
+{
+	for (uint64_t i = 0; i < 100000; i += 37) w_sparse_bitset_set(&g_bitset, i);
+	w_sparse_bitset_set_range(&g_bitset, 40000, 45000);
+
+	uint64_t n = w_sparse_bitset_next_set(&g_bitset, 0);
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert_uint_eq(n, i);
+		n = w_sparse_bitset_next_set(&g_bitset, n + 1);
+	}
+	ck_assert_uint_eq(n, W_SPARSE_BITSET_INDEX_NONE);
+
+	w_sparse_bitset_clear_all(&g_bitset);
+	ck_assert_uint_eq(w_sparse_bitset_next_set(&g_bitset, 0), W_SPARSE_BITSET_INDEX_NONE);
+	ck_assert_uint_eq(w_sparse_bitset_prev_set(&g_bitset, 100000), W_SPARSE_BITSET_INDEX_NONE);
+}
+END_TEST
+
+
+/*****************************
+*  rank + select tcase       *
+*****************************/
+
+static struct w_sparse_bitset_rank_index g_rank_index;
+
+static void sparse_bitset_rank_setup(void)
+{
+	sparse_bitset_adaptive_setup();
+	w_sparse_bitset_rank_index_init(&g_rank_index, &g_bitset);
+}
+
+static void sparse_bitset_rank_teardown(void)
+{
+	w_sparse_bitset_rank_index_free(&g_rank_index);
+	sparse_bitset_intersect_teardown();
+}
+
+START_TEST(test_rank_select_empty)
+{
+	ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, 0), 0);
+	ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, 123456), 0);
+	ck_assert_uint_eq(w_sparse_bitset_select(&g_rank_index, 0), W_SPARSE_BITSET_INDEX_NONE);
+}
+END_TEST
+
+START_TEST(test_rank_select_across_containers)
+{
+	fill_page_(&g_bitset, 0, FILL_ARRAY_, 3);
+	fill_page_(&g_bitset, 2, FILL_BITMAP_, 1);
+	fill_page_(&g_bitset, 3, FILL_RUN_PARTIAL_, 2);
+	fill_page_(&g_bitset, 70, FILL_RUN_FULL_, 0);
+	w_sparse_bitset_set(&g_bitset, PAGE_BITS_ * 130 + 7);
+	w_sparse_bitset_optimize(&g_bitset);
+
+	// every set bit selects back to itself and ranks to its position
+	uint64_t k = 0;
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, i), k);
+		ck_assert_uint_eq(w_sparse_bitset_select(&g_rank_index, k), i);
+		k++;
+	}
+	ck_assert_uint_eq(k, g_bitset.cardinality);
+	ck_assert_uint_eq(w_sparse_bitset_select(&g_rank_index, k), W_SPARSE_BITSET_INDEX_NONE);
+	ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, UINT64_MAX - 1), k);
+
+	// ranks of unset bits count everything below them
+	for (uint64_t i = 0; i < PAGE_BITS_ * 4; i += 13)
+	{
+		uint64_t expected = 0;
+		for (uint64_t j = 0; j < i; j++) expected += w_sparse_bitset_get(&g_bitset, j);
+		ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, i), expected);
+	}
+}
+END_TEST
+
+START_TEST(test_rank_index_rebuilds_after_change)
+{
+	w_sparse_bitset_set_range(&g_bitset, 100, 199);
+	ck_assert_uint_eq(w_sparse_bitset_select(&g_rank_index, 50), 150);
+
+	w_sparse_bitset_set_range(&g_bitset, 0, 9);
+	ck_assert_uint_eq(w_sparse_bitset_select(&g_rank_index, 50), 140);
+	ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, 100), 10);
+
+	// unchanged bitsets keep the built index
+	uint64_t generation = g_rank_index.generation;
+	w_sparse_bitset_rank(&g_rank_index, 5);
+	ck_assert_uint_eq(g_rank_index.generation, generation);
+}
+END_TEST
+
+START_TEST(test_select_splits_into_equal_chunks)
+{
+	for (uint64_t i = 0; i < 50000; i += 3) w_sparse_bitset_set(&g_bitset, i);
+	w_sparse_bitset_set_range(&g_bitset, 200000, 260000);
+
+	// cut the set bits into 4 chunks of equal size
+	uint64_t parts = 4;
+	uint64_t per_part = g_bitset.cardinality / parts;
+	for (uint64_t part = 1; part < parts; part++)
+	{
+		uint64_t cut = w_sparse_bitset_select(&g_rank_index, part * per_part);
+		ck_assert(w_sparse_bitset_get(&g_bitset, cut));
+		ck_assert_uint_eq(w_sparse_bitset_rank(&g_rank_index, cut), part * per_part);
+	}
+}
+END_TEST
+
+
+/*****************************
+*  page pool tcase           *
+*****************************/
+
+static struct w_sparse_bitset_page_pool g_pool;
+
+static void sparse_bitset_pool_setup(void)
+{
+	sparse_bitset_adaptive_setup();
+	w_sparse_bitset_page_pool_init(&g_pool, &g_arena);
+	g_bitset.pool = &g_pool;
+}
+
+static void sparse_bitset_pool_teardown(void)
+{
+	sparse_bitset_intersect_teardown();
+	w_sparse_bitset_page_pool_free(&g_pool);
+}
+
+static uint64_t pool_free_count_(uint64_t page_size)
+{
+	for (uint64_t i = 0; i < g_pool.lists_length; i++)
+	{
+		if (g_pool.lists[i].page_size == page_size) return g_pool.lists[i].length;
+	}
+	return 0;
+}
+
+START_TEST(test_page_pool_recycles_zeroed_words)
+{
+	uint64_t *a = w_sparse_bitset_page_pool_acquire(&g_pool, 8);
+	uint64_t *b = w_sparse_bitset_page_pool_acquire(&g_pool, 16);
+	memset(a, 0xff, 8 * sizeof(*a));
+
+	w_sparse_bitset_page_pool_release(&g_pool, 8, a);
+	ck_assert_uint_eq(pool_free_count_(8), 1);
+	ck_assert_uint_eq(pool_free_count_(16), 0);
+
+	// released words are reused for the same page size only, and zeroed
+	ck_assert_ptr_ne(w_sparse_bitset_page_pool_acquire(&g_pool, 16), a);
+	uint64_t *c = w_sparse_bitset_page_pool_acquire(&g_pool, 8);
+	ck_assert_ptr_eq(c, a);
+	for (int i = 0; i < 8; i++) ck_assert_uint_eq(c[i], 0);
+	ck_assert_uint_eq(pool_free_count_(8), 0);
+
+	w_sparse_bitset_page_pool_release(&g_pool, 16, b);
+	ck_assert_uint_eq(pool_free_count_(16), 1);
+}
+END_TEST
+
+START_TEST(test_pool_bitset_recycles_emptied_pages)
+{
+	w_sparse_bitset_free(&g_bitset);
+	w_sparse_bitset_init(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS);
+	g_bitset.pool = &g_pool;
+
+	w_sparse_bitset_set(&g_bitset, 5);
+	w_sparse_bitset_set(&g_bitset, 700);
+	uint64_t *bits = g_bitset.pages[0].bits;
+
+	w_sparse_bitset_clear(&g_bitset, 5);
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 0);
+	w_sparse_bitset_clear(&g_bitset, 700);
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 1);
+	ck_assert_ptr_null(g_bitset.pages[0].bits);
+
+	// a page elsewhere picks the words back up, zeroed
+	w_sparse_bitset_set(&g_bitset, PAGE_BITS_ * 40 + 1);
+	ck_assert_ptr_eq(g_bitset.pages[40].bits, bits);
+	ck_assert_uint_eq(g_bitset.cardinality, 1);
+	ck_assert(!w_sparse_bitset_get(&g_bitset, PAGE_BITS_ * 40 + 700));
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 0);
+
+	// whole page clears go through the pool as well
+	w_sparse_bitset_clear_range(&g_bitset, 0, PAGE_BITS_ * 41);
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 1);
+}
+END_TEST
+
+START_TEST(test_pool_compact_releases_spare_words)
+{
+	// bitmap page shrinks back to an array, leaving its words attached
+	fill_page_(&g_bitset, 0, FILL_BITMAP_, 0);
+	w_sparse_bitset_clear_range(&g_bitset, 64, PAGE_BITS_ - 1);
+	ck_assert_uint_eq(g_bitset.pages[0].container, W_SPARSE_BITSET_CONTAINER_ARRAY);
+	ck_assert_ptr_nonnull(g_bitset.pages[0].bits);
+
+	fill_page_(&g_bitset, 3, FILL_BITMAP_, 0);
+	w_sparse_bitset_clear_range(&g_bitset, PAGE_BITS_ * 3, PAGE_BITS_ * 4 - 1);
+	ck_assert_uint_eq(g_bitset.pages_length, 4);
+
+	w_sparse_bitset_compact(&g_bitset);
+	ck_assert_ptr_null(g_bitset.pages[0].bits);
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 2);
+	ck_assert_uint_eq(g_bitset.pages_length, 1);
+	ck_assert_uint_eq(g_bitset.pages[0].values_capacity, g_bitset.pages[0].values_length);
+
+	// bits survive compaction
+	uint64_t count = 0;
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert_uint_lt(i, 64);
+		ck_assert_uint_eq(i % 3, 0);
+		count++;
+	}
+	ck_assert_uint_eq(count, g_bitset.cardinality);
+}
+END_TEST
+
+START_TEST(test_pool_free_returns_all_pages)
+{
+	for (uint64_t p = 0; p < 5; p++) fill_page_(&g_bitset, p * 3, FILL_BITMAP_, p);
+	w_sparse_bitset_free(&g_bitset);
+	ck_assert_uint_eq(pool_free_count_(W_SPARSE_BITSET_PAGE_SIZE_WORDS), 5);
+
+	w_sparse_bitset_init_ex(&g_bitset, &g_arena, W_SPARSE_BITSET_PAGE_SIZE_WORDS, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+}
+END_TEST
+
+
+/*****************************
+*  slab layout tcase         *
+*****************************/
+
+static void sparse_bitset_slab_setup(void)
+{
+	w_arena_init(&g_arena, 64 * 1024);
+	w_sparse_bitset_init_ex(&g_bitset, &g_arena, 8, W_SPARSE_BITSET_FLAG_SLAB | W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_init_ex(&g_bitset2, &g_arena, 8, W_SPARSE_BITSET_FLAG_SLAB);
+	w_sparse_bitset_init(&g_bitset3, &g_arena, 8);
+	memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+}
+
+START_TEST(test_slab_drops_adaptive_flag)
+{
+	ck_assert(g_bitset.flags & W_SPARSE_BITSET_FLAG_SLAB);
+	ck_assert(!(g_bitset.flags & W_SPARSE_BITSET_FLAG_ADAPTIVE));
+}
+END_TEST
+
+START_TEST(test_slab_set_get_clear_matches_reference)
+{
+	// spread bits over many pages so the slab grows and moves
+	for (uint64_t i = 0; i < 200000; i += 131)
+	{
+		w_sparse_bitset_set(&g_bitset, i);
+		w_sparse_bitset_set(&g_bitset3, i);
+	}
+	for (uint64_t i = 0; i < 200000; i += 262)
+	{
+		w_sparse_bitset_clear(&g_bitset, i);
+		w_sparse_bitset_clear(&g_bitset3, i);
+	}
+
+	ck_assert_uint_eq(g_bitset.cardinality, g_bitset3.cardinality);
+	for (uint64_t i = 0; i < 200000; i++)
+	{
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == w_sparse_bitset_get(&g_bitset3, i));
+	}
+
+	// page bits point into the slab through their slots
+	for (uint64_t p = 0; p < g_bitset.pages_length; p++)
+	{
+		uint32_t slot = g_bitset.page_slots[p];
+		if (!slot) ck_assert_ptr_null(g_bitset.pages[p].bits);
+		else ck_assert_ptr_eq(g_bitset.pages[p].bits, &g_bitset.slab[(uint64_t)(slot - 1) * 8]);
+	}
+}
+END_TEST
+
+START_TEST(test_slab_reuses_emptied_slots)
+{
+	w_sparse_bitset_set(&g_bitset, 10);
+	w_sparse_bitset_set(&g_bitset, 600);
+	ck_assert_uint_eq(g_bitset.slab_slots, 2);
+
+	w_sparse_bitset_clear(&g_bitset, 10);
+	ck_assert_uint_eq(g_bitset.page_slots[0], 0);
+	ck_assert_uint_eq(g_bitset.free_slots_length, 1);
+
+	// new pages take the free slot, zeroed
+	w_sparse_bitset_set(&g_bitset, 5000);
+	ck_assert_uint_eq(g_bitset.slab_slots, 2);
+	ck_assert_uint_eq(g_bitset.free_slots_length, 0);
+	ck_assert(!w_sparse_bitset_get(&g_bitset, 5000 - 5000 % 512 + 10));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 5000));
+	ck_assert(w_sparse_bitset_get(&g_bitset, 600));
+}
+END_TEST
+
+START_TEST(test_slab_bulk_ops_and_intersect)
+{
+	w_sparse_bitset_set_range(&g_bitset, 100, 20000);
+	for (uint64_t i = 0; i < 30000; i += 7) w_sparse_bitset_set(&g_bitset2, i);
+	w_sparse_bitset_clear_range(&g_bitset, 1000, 5000);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	uint64_t count = full_intersect_(bitsets, 2, &g_intersect_cache);
+
+	uint64_t expected = 0;
+	for (uint64_t i = 0; i < 30000; i++)
+	{
+		bool in = i >= 100 && i <= 20000 && (i < 1000 || i > 5000) && i % 7 == 0;
+		ck_assert(w_sparse_bitset_get(&g_bitset, i) == (i >= 100 && i <= 20000 && (i < 1000 || i > 5000)));
+		if (in) ck_assert_uint_eq(g_intersect_cache.indexes[expected++], i);
+	}
+	ck_assert_uint_eq(count, expected);
+
+	w_sparse_bitset_intersect_with(&g_bitset2, &g_bitset);
+	ck_assert_uint_eq(g_bitset2.cardinality, expected);
+}
+END_TEST
+
+
+/*****************************
+*  summary tcase             *
+*****************************/
+
+// bits covered by one summary word with 8 word pages
+#define SUMMARY_WORD_BITS_ (64ULL * 64ULL * 512ULL)
+
+static void sparse_bitset_summary_setup(void)
+{
+	w_arena_init(&g_arena, 64 * 1024);
+	w_sparse_bitset_init(&g_bitset, &g_arena, 8);
+	w_sparse_bitset_init(&g_bitset2, &g_arena, 8);
+	w_sparse_bitset_init(&g_bitset3, &g_arena, 8);
+	memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+}
+
+// every summary bit matches a non-zero lookup word
+static void assert_summary_matches_lookup_(struct w_sparse_bitset *bitset)
+{
+	ck_assert_uint_eq(bitset->summary_length, (bitset->lookup_pages_length + 63) / 64);
+	for (uint64_t li = 0; li < bitset->lookup_pages_length; li++)
+	{
+		bool bit = (bitset->summary[li / 64] >> (li % 64)) & 1;
+		ck_assert(bit == (bitset->lookup_pages[li] != 0));
+	}
+}
+
+START_TEST(test_summary_tracks_lookup_words)
+{
+	w_sparse_bitset_set(&g_bitset, 3);
+	w_sparse_bitset_set(&g_bitset, SUMMARY_WORD_BITS_ * 5 + 77);
+	assert_summary_matches_lookup_(&g_bitset);
+	ck_assert_uint_eq(g_bitset.summary[0], 1);
+	ck_assert_uint_eq(g_bitset.summary[5], 1);
+
+	w_sparse_bitset_clear(&g_bitset, 3);
+	ck_assert_uint_eq(g_bitset.summary[0], 0);
+	assert_summary_matches_lookup_(&g_bitset);
+
+	w_sparse_bitset_set_range(&g_bitset, 1000, SUMMARY_WORD_BITS_ / 2);
+	assert_summary_matches_lookup_(&g_bitset);
+	w_sparse_bitset_clear_range(&g_bitset, 0, SUMMARY_WORD_BITS_);
+	ck_assert_uint_eq(g_bitset.summary[0], 0);
+	assert_summary_matches_lookup_(&g_bitset);
+
+	w_sparse_bitset_clear(&g_bitset, SUMMARY_WORD_BITS_ * 5 + 77);
+	w_sparse_bitset_set(&g_bitset, 42);
+	w_sparse_bitset_compact(&g_bitset);
+	assert_summary_matches_lookup_(&g_bitset);
+
+	w_sparse_bitset_clear_all(&g_bitset);
+	ck_assert_uint_eq(g_bitset.summary[0], 0);
+}
+END_TEST
+
+START_TEST(test_summary_skips_empty_regions)
+{
+	// a few bits far apart, as on a shard owning a high id range
+	uint64_t bits[] = { 5, SUMMARY_WORD_BITS_ * 3 + 1, SUMMARY_WORD_BITS_ * 3 + 900, SUMMARY_WORD_BITS_ * 7 - 1, SUMMARY_WORD_BITS_ * 9 + 12345 };
+	uint64_t n = sizeof(bits) / sizeof(bits[0]);
+	for (uint64_t i = 0; i < n; i++) w_sparse_bitset_set(&g_bitset, bits[i]);
+
+	uint64_t k = 0;
+	w_sparse_bitset_for_each(&g_bitset)
+	{
+		ck_assert_uint_lt(k, n);
+		ck_assert_uint_eq(i, bits[k++]);
+	}
+	ck_assert_uint_eq(k, n);
+
+	for (uint64_t i = 0; i < n; i++)
+	{
+		ck_assert_uint_eq(w_sparse_bitset_next_set(&g_bitset, (i ? bits[i - 1] : 0) + (i ? 1 : 0)), bits[i]);
+		ck_assert_uint_eq(w_sparse_bitset_prev_set(&g_bitset, (i + 1 < n) ? bits[i + 1] - 1 : UINT64_MAX - 1), bits[i]);
+	}
+	ck_assert_uint_eq(w_sparse_bitset_next_set(&g_bitset, bits[n - 1] + 1), W_SPARSE_BITSET_INDEX_NONE);
+	ck_assert_uint_eq(w_sparse_bitset_prev_set(&g_bitset, bits[0] - 1), W_SPARSE_BITSET_INDEX_NONE);
+}
+END_TEST
+
+START_TEST(test_summary_intersect_and_algebra)
+{
+	for (uint64_t r = 0; r < 10; r += 2)
+	{
+		w_sparse_bitset_set_range(&g_bitset, SUMMARY_WORD_BITS_ * r, SUMMARY_WORD_BITS_ * r + 2000);
+		w_sparse_bitset_set_range(&g_bitset2, SUMMARY_WORD_BITS_ * r + 1000, SUMMARY_WORD_BITS_ * r + 5000);
+	}
+	w_sparse_bitset_set(&g_bitset2, SUMMARY_WORD_BITS_ * 11);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	uint64_t count = full_intersect_(bitsets, 2, &g_intersect_cache);
+	ck_assert_uint_eq(count, 5 * 1001);
+	for (uint64_t i = 0; i < count; i++)
+	{
+		uint64_t off = g_intersect_cache.indexes[i] % SUMMARY_WORD_BITS_;
+		ck_assert(off >= 1000 && off <= 2000);
+	}
+
+	w_sparse_bitset_union(&g_bitset3, &g_bitset, &g_bitset2);
+	ck_assert_uint_eq(g_bitset3.cardinality, 5 * 5001 + 1);
+	assert_summary_matches_lookup_(&g_bitset3);
+
+	w_sparse_bitset_difference_with(&g_bitset3, &g_bitset);
+	ck_assert_uint_eq(g_bitset3.cardinality, 5 * 3000 + 1);
+	assert_summary_matches_lookup_(&g_bitset3);
+}
+END_TEST
+
+/*****************************
+*  page size mixing tcase    *
+*****************************/
+
+START_TEST(test_rebuild_keeps_bits)
+{
+	fill_page_(&g_bitset, 0, FILL_ARRAY_, 3);
+	fill_page_(&g_bitset, 2, FILL_BITMAP_, 1);
+	fill_page_(&g_bitset, 3, FILL_RUN_PARTIAL_, 2);
+	fill_page_(&g_bitset, 9, FILL_RUN_FULL_, 0);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 12; i++)
+	{
+		if (w_sparse_bitset_get(&g_bitset, i)) w_sparse_bitset_set(&g_bitset3, i);
+	}
+
+	uint64_t generation = g_bitset.generation;
+	uint64_t sizes[] = { 8, 1024, 3, W_SPARSE_BITSET_PAGE_SIZE_WORDS };
+	for (int s = 0; s < 4; s++)
+	{
+		w_sparse_bitset_rebuild(&g_bitset, sizes[s]);
+		ck_assert_uint_eq(g_bitset.page_size_, sizes[s]);
+		ck_assert_uint_gt(g_bitset.generation, generation);
+		generation = g_bitset.generation;
+
+		ck_assert_uint_eq(g_bitset.cardinality, g_bitset3.cardinality);
+		for (uint64_t i = 0; i < PAGE_BITS_ * 12; i++)
+		{
+			ck_assert(w_sparse_bitset_get(&g_bitset, i) == w_sparse_bitset_get(&g_bitset3, i));
+		}
+	}
+	ck_assert(g_bitset.flags & W_SPARSE_BITSET_FLAG_ADAPTIVE);
+}
+END_TEST
+
+START_TEST(test_intersect_mixed_page_sizes)
+{
+	for (uint64_t i = 0; i < PAGE_BITS_ * 5; i += 3) w_sparse_bitset_set(&g_bitset, i);
+	w_sparse_bitset_set_range(&g_bitset2, 1000, PAGE_BITS_ * 3);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i += 5) w_sparse_bitset_set(&g_bitset3, i);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	struct w_sparse_bitset_intersect_cache same;
+	uint64_t counts[2];
+	counts[0] = full_intersect_(bitsets, 2, &same);
+	w_sparse_bitset_intersect_free_cache(&same);
+	counts[1] = full_intersect_(bitsets, 3, &same);
+
+	// same results with every operand on a different page size
+	w_sparse_bitset_rebuild(&g_bitset2, 8);
+	w_sparse_bitset_rebuild(&g_bitset3, 1024);
+
+	ck_assert_uint_eq(full_intersect_(bitsets, 2, &g_intersect_cache), counts[0]);
+	w_sparse_bitset_intersect_free_cache(&g_intersect_cache);
+	ck_assert_uint_eq(full_intersect_(bitsets, 3, &g_intersect_cache), counts[1]);
+	for (uint64_t i = 0; i < counts[1]; i++)
+	{
+		ck_assert_uint_eq(g_intersect_cache.indexes[i], same.indexes[i]);
+	}
+	w_sparse_bitset_intersect_free_cache(&same);
+
+	// changes after the rebuild are picked up
+	w_sparse_bitset_clear(&g_bitset, 1005);
+	w_sparse_bitset_set(&g_bitset, 1006);
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 3);
+	ck_assert_uint_eq(g_intersect_cache.indexes_length, counts[1] - 1);
+}
+END_TEST
+
+START_TEST(test_intersect_mixed_page_sizes_incremental)
+{
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i += 3) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 5; i += 2) w_sparse_bitset_set(&g_bitset2, i);
+	w_sparse_bitset_set_range(&g_bitset3, 500, PAGE_BITS_ * 4);
+	w_sparse_bitset_rebuild(&g_bitset2, 16);
+	w_sparse_bitset_rebuild(&g_bitset3, 1024);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	full_intersect_(bitsets, 3, &g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 3);
+	ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX), g_intersect_cache.indexes_length);
+
+	// changes patch the largest pages they fall in
+	w_sparse_bitset_set(&g_bitset, 1000);
+	w_sparse_bitset_set(&g_bitset2, 1001);
+	w_sparse_bitset_clear(&g_bitset2, 1002);
+	w_sparse_bitset_set(&g_bitset2, PAGE_BITS_ * 3 + 7);
+	uint64_t count = w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX);
+	ck_assert_uint_eq(w_sparse_bitset_intersect(&g_intersect_cache), count);
+	ck_assert(g_intersect_cache.incremental);
+	ck_assert_uint_eq(g_intersect_cache.dirty_page_size, 1024);
+	ck_assert_uint_eq(g_intersect_cache.dirty_pages_length, 1);
+	ck_assert_uint_eq(g_intersect_cache.dirty_pages[0], 0);
+	assert_cache_matches_full_(bitsets, 3);
+
+	// sizes that don't divide the largest still match, bit by bit
+	w_sparse_bitset_rebuild(&g_bitset2, 3);
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	assert_cache_matches_full_(bitsets, 3);
+	w_sparse_bitset_clear(&g_bitset, 1000);
+	w_sparse_bitset_intersect(&g_intersect_cache);
+	ck_assert(!g_intersect_cache.incremental);
+	assert_cache_matches_full_(bitsets, 3);
+}
+END_TEST
+
+START_TEST(test_evaluate_mixed_page_sizes)
+{
+	fill_algebra_operands_(&g_bitset, &g_bitset2);
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i += 7) w_sparse_bitset_set(&g_bitset3, i);
+	w_sparse_bitset_rebuild(&g_bitset2, 16);
+	w_sparse_bitset_rebuild(&g_bitset3, 4);
+
+	// (a | b) & ~c into a dst of yet another page size
+	struct w_sparse_bitset dst;
+	w_sparse_bitset_init(&dst, &g_arena, 64);
+	struct w_sparse_bitset *bitsets[] = { &g_bitset, &g_bitset2, &g_bitset3 };
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_OR, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 1 },
+	};
+	w_sparse_bitset_evaluate(&dst, bitsets, expr, 3);
+
+	uint64_t expected = 0;
+	for (uint64_t i = 0; i < PAGE_BITS_ * 6; i++)
+	{
+		bool want = (w_sparse_bitset_get(&g_bitset, i) || w_sparse_bitset_get(&g_bitset2, i)) && !w_sparse_bitset_get(&g_bitset3, i);
+		ck_assert(w_sparse_bitset_get(&dst, i) == want);
+		expected += want;
+	}
+	ck_assert_uint_eq(dst.cardinality, expected);
+
+	// the same expression through a cache
+	w_array_init_t(g_intersect_cache.bitsets, 3);
+	memcpy(g_intersect_cache.bitsets, bitsets, sizeof(bitsets));
+	g_intersect_cache.bitsets_length = 3;
+	w_array_init_t(g_intersect_cache.expr, 3);
+	memcpy(g_intersect_cache.expr, expr, sizeof(expr));
+	ck_assert_uint_eq(w_sparse_bitset_intersect(&g_intersect_cache), expected);
+
+	uint64_t n = 0;
+	w_sparse_bitset_for_each(&dst)
+	{
+		ck_assert_uint_eq(g_intersect_cache.indexes[n++], i);
+	}
+
+	w_sparse_bitset_free(&dst);
+}
+END_TEST
+
+/*****************************
+*  parallel intersect tcase  *
+*****************************/
+
+static void sparse_bitset_parallel_setup(void)
+{
+	w_arena_init(&g_arena, 64 * 1024);
+	w_sparse_bitset_init_ex(&g_bitset, &g_arena, 8, W_SPARSE_BITSET_FLAG_ADAPTIVE);
+	w_sparse_bitset_init(&g_bitset2, &g_arena, 8);
+	w_sparse_bitset_init(&g_bitset3, &g_arena, 8);
+	memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+
+	// enough pages for several workers, with gaps between clusters
+	for (uint64_t i = 0; i < 512 * 2000; i += 3) if ((i / 20000) % 3 != 1) w_sparse_bitset_set(&g_bitset, i);
+	for (uint64_t i = 0; i < 512 * 1800; i += 5) w_sparse_bitset_set(&g_bitset2, i);
+	w_sparse_bitset_set_range(&g_bitset3, 100000, 700000);
+}
+
+static void assert_parallel_matches_(struct w_sparse_bitset **bitsets, uint64_t bitsets_length, const struct w_sparse_bitset_expr_op *expr)
+{
+	struct w_sparse_bitset_intersect_cache serial;
+	memset(&serial, 0, sizeof(serial));
+	w_array_init_t(serial.bitsets, bitsets_length);
+	memcpy(serial.bitsets, bitsets, bitsets_length * sizeof(*bitsets));
+	serial.bitsets_length = bitsets_length;
+	if (expr)
+	{
+		w_array_init_t(serial.expr, bitsets_length);
+		memcpy(serial.expr, expr, bitsets_length * sizeof(*expr));
+	}
+	uint64_t count = w_sparse_bitset_intersect(&serial);
+	ck_assert_uint_gt(count, 0);
+
+	uint32_t threads[] = { 2, 3, 8, 64 };
+	for (int t = 0; t < 4; t++)
+	{
+		struct w_sparse_bitset_intersect_cache parallel;
+		memset(&parallel, 0, sizeof(parallel));
+		w_array_init_t(parallel.bitsets, bitsets_length);
+		memcpy(parallel.bitsets, bitsets, bitsets_length * sizeof(*bitsets));
+		parallel.bitsets_length = bitsets_length;
+		if (expr)
+		{
+			w_array_init_t(parallel.expr, bitsets_length);
+			memcpy(parallel.expr, expr, bitsets_length * sizeof(*expr));
+		}
+
+		ck_assert_uint_eq(w_sparse_bitset_intersect_parallel(&parallel, threads[t]), count);
+		ck_assert(memcmp(parallel.indexes, serial.indexes, count * sizeof(uint64_t)) == 0);
+		w_sparse_bitset_intersect_free_cache(&parallel);
+	}
+
+	w_sparse_bitset_intersect_free_cache(&serial);
+}
+
+START_TEST(test_parallel_intersect_matches_serial)
+{
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	assert_parallel_matches_(bitsets, 1, NULL);
+	assert_parallel_matches_(bitsets, 2, NULL);
+	assert_parallel_matches_(bitsets, 3, NULL);
+}
+END_TEST
+
+START_TEST(test_parallel_expr_matches_serial)
+{
+	// (a | b) & ~c
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_OR, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 1 },
+	};
+	assert_parallel_matches_(bitsets, 3, expr);
+}
+END_TEST
+
+START_TEST(test_parallel_intersect_then_incremental)
+{
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	w_array_init_t(g_intersect_cache.bitsets, 2);
+	memcpy(g_intersect_cache.bitsets, bitsets, sizeof(bitsets));
+	g_intersect_cache.bitsets_length = 2;
+	w_sparse_bitset_intersect_parallel(&g_intersect_cache, 4);
+	assert_cache_matches_full_(bitsets, 2);
+
+	// later updates only touch the changed pages
+	w_sparse_bitset_set(&g_bitset2, 1);
+	w_sparse_bitset_set(&g_bitset, 1);
+	w_sparse_bitset_clear(&g_bitset, 300000);
+	w_sparse_bitset_intersect_parallel(&g_intersect_cache, 4);
+	assert_cache_matches_full_(bitsets, 2);
+	ck_assert_uint_eq(g_intersect_cache.indexes[1], 1);
+}
+END_TEST
+
+START_TEST(test_probe_matches_page_intersect)
+{
+	// a handful of bits against the large bitsets
+	w_sparse_bitset_clear_range(&g_bitset3, 100000, 700000);
+	for (uint64_t i = 0; i < 512 * 2000; i += 4099) w_sparse_bitset_set(&g_bitset3, i);
+
+	struct w_sparse_bitset *bitsets[] = {&g_bitset3, &g_bitset, &g_bitset2};
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 1 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 2 },
+	};
+
+	for (int e = 0; e < 2; e++)
+	{
+		struct w_sparse_bitset_intersect_cache pages;
+		memset(&pages, 0, sizeof(pages));
+		w_array_init_t(pages.bitsets, 3);
+		memcpy(pages.bitsets, bitsets, sizeof(bitsets));
+		pages.bitsets_length = 3;
+		if (e)
+		{
+			w_array_init_t(pages.expr, 3);
+			memcpy(pages.expr, expr, sizeof(expr));
+		}
+		uint64_t count = w_sparse_bitset_intersect(&pages);
+		ck_assert_uint_gt(count, 0);
+
+		memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+		w_array_init_t(g_intersect_cache.bitsets, 3);
+		memcpy(g_intersect_cache.bitsets, bitsets, sizeof(bitsets));
+		g_intersect_cache.bitsets_length = 3;
+		if (e)
+		{
+			w_array_init_t(g_intersect_cache.expr, 3);
+			memcpy(g_intersect_cache.expr, expr, sizeof(expr));
+		}
+		g_intersect_cache.probe = true;
+		ck_assert_uint_eq(w_sparse_bitset_intersect(&g_intersect_cache), count);
+		ck_assert(memcmp(g_intersect_cache.indexes, pages.indexes, count * sizeof(uint64_t)) == 0);
+
+		// later updates still go through the changed pages only
+		w_sparse_bitset_set(&g_bitset3, 30);
+		w_sparse_bitset_set(&g_bitset, 30);
+		w_sparse_bitset_clear(&g_bitset2, 30);
+		uint64_t generation = g_intersect_cache.cache_generation;
+		ck_assert_uint_eq(w_sparse_bitset_intersect(&g_intersect_cache), w_sparse_bitset_intersect(&pages));
+		ck_assert_uint_eq(g_intersect_cache.cache_generation, generation + 1);
+		ck_assert(memcmp(g_intersect_cache.indexes, pages.indexes, pages.indexes_length * sizeof(uint64_t)) == 0);
+
+		w_sparse_bitset_clear(&g_bitset3, 30);
+		w_sparse_bitset_intersect_free_cache(&pages);
+		w_sparse_bitset_intersect_free_cache(&g_intersect_cache);
+	}
+}
+END_TEST
+
+START_TEST(test_intersect_count_matches_intersect)
+{
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2, &g_bitset3};
+	struct w_sparse_bitset_expr_op expr[] = {
+		{ .op = W_SPARSE_BITSET_OP_AND, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_OR, .group = 0 },
+		{ .op = W_SPARSE_BITSET_OP_ANDNOT, .group = 1 },
+	};
+
+	// plain, expression and probe paths count without writing indexes
+	for (int mode = 0; mode < 3; mode++)
+	{
+		struct w_sparse_bitset_intersect_cache full;
+		memset(&full, 0, sizeof(full));
+		w_array_init_t(full.bitsets, 3);
+		memcpy(full.bitsets, bitsets, sizeof(bitsets));
+		full.bitsets_length = 3;
+		if (mode == 1)
+		{
+			w_array_init_t(full.expr, 3);
+			memcpy(full.expr, expr, sizeof(expr));
+		}
+		uint64_t count = w_sparse_bitset_intersect(&full);
+		ck_assert_uint_gt(count, 100);
+
+		memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+		w_array_init_t(g_intersect_cache.bitsets, 3);
+		memcpy(g_intersect_cache.bitsets, bitsets, sizeof(bitsets));
+		g_intersect_cache.bitsets_length = 3;
+		if (mode == 1)
+		{
+			w_array_init_t(g_intersect_cache.expr, 3);
+			memcpy(g_intersect_cache.expr, expr, sizeof(expr));
+		}
+		g_intersect_cache.probe = mode == 2;
+
+		ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX), count);
+		ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, 100), 100);
+		ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, 1), 1);
+		ck_assert_uint_eq(g_intersect_cache.indexes_length, 0);
+		ck_assert_uint_eq(g_intersect_cache.cache_generation, 0);
+
+		w_sparse_bitset_intersect_free_cache(&full);
+		w_sparse_bitset_intersect_free_cache(&g_intersect_cache);
+	}
+
+	// single bitsets answer from their cardinality
+	memset(&g_intersect_cache, 0, sizeof(g_intersect_cache));
+	w_array_init_t(g_intersect_cache.bitsets, 1);
+	g_intersect_cache.bitsets[0] = &g_bitset2;
+	g_intersect_cache.bitsets_length = 1;
+	ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX), g_bitset2.cardinality);
+}
+END_TEST
+
+START_TEST(test_intersect_count_reuses_built_cache)
+{
+	struct w_sparse_bitset *bitsets[] = {&g_bitset, &g_bitset2};
+	uint64_t count = full_intersect_(bitsets, 2, &g_intersect_cache);
+	ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX), count);
+	ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, 3), 3);
+
+	// stale caches are recounted from the bitsets, leaving indexes alone
+	w_sparse_bitset_clear_range(&g_bitset2, 0, 512 * 1800);
+	ck_assert_uint_eq(w_sparse_bitset_intersect_count(&g_intersect_cache, UINT64_MAX), 0);
+	ck_assert_uint_eq(g_intersect_cache.indexes_length, count);
+}
+END_TEST
+
 /*****************************
 *  suite + runner            *
 *****************************/
@@ -922,6 +2578,113 @@ Suite* whisker_sparse_bitset_suite(void)
 	tcase_add_test(tc_for_each, test_for_each_yields_only_set_indices);
 	suite_add_tcase(s, tc_for_each);
 
+	TCase *tc_containers = tcase_create("containers");
+	tcase_add_checked_fixture(tc_containers, sparse_bitset_adaptive_setup, sparse_bitset_intersect_teardown);
+	tcase_set_timeout(tc_containers, 30);
+	tcase_add_test(tc_containers, test_adaptive_first_set_uses_array);
+	tcase_add_test(tc_containers, test_adaptive_set_existing_bit_keeps_cardinality);
+	tcase_add_test(tc_containers, test_adaptive_array_converts_to_bitmap);
+	tcase_add_test(tc_containers, test_adaptive_bitmap_shrinks_to_array);
+	tcase_add_test(tc_containers, test_adaptive_full_page_becomes_run);
+	tcase_add_test(tc_containers, test_adaptive_run_clear_splits_run);
+	tcase_add_test(tc_containers, test_adaptive_clear_empties_page);
+	tcase_add_test(tc_containers, test_adaptive_for_each_across_containers);
+	tcase_add_test(tc_containers, test_adaptive_optimize_preserves_bits);
+	tcase_add_test(tc_containers, test_adaptive_intersect_container_pairs);
+	tcase_add_test(tc_containers, test_adaptive_intersect_three_way_mixed);
+	tcase_add_test(tc_containers, test_adaptive_intersect_with_bitmap_only_bitset);
+	tcase_add_test(tc_containers, test_adaptive_disabled_for_large_pages);
+	suite_add_tcase(s, tc_containers);
+
+	TCase *tc_incremental = tcase_create("incremental");
+	tcase_add_checked_fixture(tc_incremental, sparse_bitset_intersect_setup, sparse_bitset_intersect_teardown);
+	tcase_set_timeout(tc_incremental, 30);
+	tcase_add_test(tc_incremental, test_generation_bumps_on_change_only);
+	tcase_add_test(tc_incremental, test_cache_stale_after_change);
+	tcase_add_test(tc_incremental, test_change_log_enabled_by_intersect);
+	tcase_add_test(tc_incremental, test_incremental_intersect_matches_full);
+	tcase_add_test(tc_incremental, test_incremental_intersect_new_pages);
+	tcase_add_test(tc_incremental, test_incremental_intersect_log_overflow);
+	tcase_add_test(tc_incremental, test_incremental_intersect_adaptive_containers);
+	suite_add_tcase(s, tc_incremental);
+
+	TCase *tc_algebra = tcase_create("set_algebra");
+	tcase_add_checked_fixture(tc_algebra, sparse_bitset_adaptive_setup, sparse_bitset_intersect_teardown);
+	tcase_set_timeout(tc_algebra, 30);
+	tcase_add_test(tc_algebra, test_algebra_out_of_place_ops);
+	tcase_add_test(tc_algebra, test_algebra_result_containers);
+	tcase_add_test(tc_algebra, test_algebra_in_place_ops);
+	tcase_add_test(tc_algebra, test_algebra_in_place_self);
+	tcase_add_test(tc_algebra, test_algebra_in_place_mismatched_page_sizes);
+	tcase_add_test(tc_algebra, test_algebra_evaluate_groups);
+	tcase_add_test(tc_algebra, test_algebra_intersect_cache_expr);
+	tcase_add_test(tc_algebra, test_algebra_in_place_feeds_incremental_intersect);
+	suite_add_tcase(s, tc_algebra);
+
+	TCase *tc_ranges = tcase_create("ranges");
+	tcase_add_checked_fixture(tc_ranges, sparse_bitset_adaptive_setup, sparse_bitset_intersect_teardown);
+	tcase_set_timeout(tc_ranges, 30);
+	tcase_add_test(tc_ranges, test_set_range_within_page);
+	tcase_add_test(tc_ranges, test_set_range_across_pages);
+	tcase_add_test(tc_ranges, test_clear_range_partial_and_whole_pages);
+	tcase_add_test(tc_ranges, test_range_ops_bitmap_only);
+	tcase_add_test(tc_ranges, test_range_ops_log_one_change);
+	tcase_add_test(tc_ranges, test_next_prev_set_across_containers);
+	tcase_add_test(tc_ranges, test_next_set_iterates_all_bits);
+	suite_add_tcase(s, tc_ranges);
+
+	TCase *tc_rank = tcase_create("rank_select");
+	tcase_add_checked_fixture(tc_rank, sparse_bitset_rank_setup, sparse_bitset_rank_teardown);
+	tcase_set_timeout(tc_rank, 30);
+	tcase_add_test(tc_rank, test_rank_select_empty);
+	tcase_add_test(tc_rank, test_rank_select_across_containers);
+	tcase_add_test(tc_rank, test_rank_index_rebuilds_after_change);
+	tcase_add_test(tc_rank, test_select_splits_into_equal_chunks);
+	suite_add_tcase(s, tc_rank);
+
+	TCase *tc_pool = tcase_create("page_pool");
+	tcase_add_checked_fixture(tc_pool, sparse_bitset_pool_setup, sparse_bitset_pool_teardown);
+	tcase_set_timeout(tc_pool, 30);
+	tcase_add_test(tc_pool, test_page_pool_recycles_zeroed_words);
+	tcase_add_test(tc_pool, test_pool_bitset_recycles_emptied_pages);
+	tcase_add_test(tc_pool, test_pool_compact_releases_spare_words);
+	tcase_add_test(tc_pool, test_pool_free_returns_all_pages);
+	suite_add_tcase(s, tc_pool);
+
+	TCase *tc_slab = tcase_create("slab");
+	tcase_add_checked_fixture(tc_slab, sparse_bitset_slab_setup, sparse_bitset_intersect_teardown);
+	tcase_set_timeout(tc_slab, 30);
+	tcase_add_test(tc_slab, test_slab_drops_adaptive_flag);
+	tcase_add_test(tc_slab, test_slab_set_get_clear_matches_reference);
+	tcase_add_test(tc_slab, test_slab_reuses_emptied_slots);
+	tcase_add_test(tc_slab, test_slab_bulk_ops_and_intersect);
+	suite_add_tcase(s, tc_slab);
+
+	TCase *tc_summary = tcase_create("summary");
+	tcase_add_checked_fixture(tc_summary, sparse_bitset_summary_setup, sparse_bitset_intersect_teardown);
+	tcase_add_test(tc_summary, test_summary_tracks_lookup_words);
+	tcase_add_test(tc_summary, test_summary_skips_empty_regions);
+	tcase_add_test(tc_summary, test_summary_intersect_and_algebra);
+	suite_add_tcase(s, tc_summary);
+
+	TCase *tc_mixed = tcase_create("page_size_mixing");
+	tcase_add_checked_fixture(tc_mixed, sparse_bitset_adaptive_setup, sparse_bitset_intersect_teardown);
+	tcase_add_test(tc_mixed, test_rebuild_keeps_bits);
+	tcase_add_test(tc_mixed, test_intersect_mixed_page_sizes);
+	tcase_add_test(tc_mixed, test_intersect_mixed_page_sizes_incremental);
+	tcase_add_test(tc_mixed, test_evaluate_mixed_page_sizes);
+	suite_add_tcase(s, tc_mixed);
+
+	TCase *tc_parallel = tcase_create("parallel_intersect");
+	tcase_add_checked_fixture(tc_parallel, sparse_bitset_parallel_setup, sparse_bitset_intersect_teardown);
+	tcase_add_test(tc_parallel, test_parallel_intersect_matches_serial);
+	tcase_add_test(tc_parallel, test_parallel_expr_matches_serial);
+	tcase_add_test(tc_parallel, test_parallel_intersect_then_incremental);
+	tcase_add_test(tc_parallel, test_probe_matches_page_intersect);
+	tcase_add_test(tc_parallel, test_intersect_count_matches_intersect);
+	tcase_add_test(tc_parallel, test_intersect_count_reuses_built_cache);
+	suite_add_tcase(s, tc_parallel);
+
 	return s;
 }
 